@@ -5,7 +5,10 @@ TOPDIR = ..
 LIBP11_OBJECTS = libpkcs11.obj p11_attr.obj p11_cert.obj \
 	p11_err.obj p11_ckr.obj p11_key.obj p11_load.obj p11_misc.obj \
 	p11_rsa.obj p11_ec.obj p11_pkey.obj p11_slot.obj p11_front.obj \
-	p11_atfork.obj
+	p11_atfork.obj p11_op.obj p11_share.obj p11_mech.obj \
+	p11_keypool.obj p11_mem.obj p11_quota.obj p11_limit.obj \
+	p11_sigcache.obj p11_fpindex.obj p11_lock.obj \
+	p11_rate.obj
 LIBP11_LIB = libp11.lib
 LIBP11_TARGET = libp11.dll
 
@@ -28,8 +28,13 @@
 
 #include "engine.h"
 #include "p11_pthread.h"
+#include "p11_lock.h"
+#include "p11_place.h"
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #if defined(_WIN32) || defined(_WIN64)
 #define strncasecmp _strnicmp
@@ -38,10 +43,19 @@
 /* The maximum length of an internally-allocated PIN */
 #define MAX_PIN_LENGTH   32
 
+/* The PIN of the tokens matching a PKCS#11 URI */
+typedef struct st_engine_pin {
+	PKCS11_TOKEN *match_tok;
+	char *pin;
+	size_t pin_length;
+	int forced_pin;
+	struct st_engine_pin *next;
+} ENGINE_PIN;
+
 struct st_engine_ctx {
 	/* Engine configuration */
 	/*
-	 * The PIN used for login. Cache for the ctx_get_pin function.
+	 * The PIN used for login to the tokens without their own PIN.
 	 * The memory for this PIN is always owned internally,
 	 * and may be freed as necessary. Before freeing, the PIN
 	 * must be whitened, to prevent security holes.
@@ -49,21 +63,55 @@ struct st_engine_ctx {
 	char *pin;
 	size_t pin_length;
 	int forced_pin;
+	/* The PINs of the tokens, set or cached by ctx_get_pin() */
+	ENGINE_PIN *pins;
+	pthread_mutex_t pin_lock;
 	int verbose;
 	char *module;
 	char *init_args;
 	UI_METHOD *ui_method;
 	void *callback_data;
 	int force_login;
+	unsigned long slow_op_threshold;
+	unsigned int session_affinity;
+	unsigned int session_quota;
+	char *session_quota_name;
+	unsigned int limit_min, limit_max;
+	unsigned long limit_wait;
+	unsigned int signature_cache;
+	unsigned long rate, rate_burst, rate_wait;
+	unsigned long key_rate, key_rate_burst;
+	int key_placement;
+	int share_certs;
+	long keep_alive;
+	time_t idle_since; /* kept by ctx_finish() with keep_alive */
+	int expired;
+	int lock_profiling;
 	pthread_mutex_t lock;
+	PKCS11_LOCK_PROFILE lock_prof;
+	pthread_cond_t idle;
+	unsigned int loading; /* objects being loaded without ctx->lock */
+	int enumerating;
 
 	/* Current operations */
 	PKCS11_CTX *pkcs11_ctx;
 	PKCS11_SLOT *slot_list;
 	unsigned int slot_count;
+	/* serialize the logins and enumerations of each slot of slot_list */
+	pthread_mutex_t *slot_locks;
+	unsigned int slot_lock_count;
 };
 
+/* Acquire and release ctx->lock, profiled with LOCK_PROFILING */
+#define CTX_LOCK(ctx) \
+	PKCS11_LOCK(&(ctx)->lock, &(ctx)->lock_prof, (ctx)->lock_profiling)
+#define CTX_UNLOCK(ctx) \
+	PKCS11_UNLOCK(&(ctx)->lock, &(ctx)->lock_prof)
+#define CTX_WAIT_IDLE(ctx) \
+	PKCS11_COND_WAIT(&(ctx)->idle, &(ctx)->lock, &(ctx)->lock_prof)
+
 static int ctx_ctrl_set_pin(ENGINE_CTX *ctx, const char *pin);
+static void free_match_tok(PKCS11_TOKEN *match_tok);
 
 /******************************************************************************/
 /* Utility functions                                                          */
@@ -126,7 +174,8 @@ static void dump_expiry(ENGINE_CTX *ctx, int level,
 /* PIN handling                                                               */
 /******************************************************************************/
 
-/* Free PIN storage in secure way. */
+/* Free PIN storage in secure way.
+ * Called with ctx->pin_lock held */
 static void ctx_destroy_pin(ENGINE_CTX *ctx)
 {
 	if (ctx->pin) {
@@ -138,11 +187,157 @@ static void ctx_destroy_pin(ENGINE_CTX *ctx)
 	}
 }
 
+static void pin_destroy(ENGINE_PIN *entry)
+{
+	if (entry->pin) {
+		OPENSSL_cleanse(entry->pin, entry->pin_length);
+		OPENSSL_free(entry->pin);
+		entry->pin = NULL;
+		entry->pin_length = 0;
+		entry->forced_pin = 0;
+	}
+}
+
+static void ctx_free_pins(ENGINE_CTX *ctx)
+{
+	ENGINE_PIN *entry;
+
+	while (ctx->pins) {
+		entry = ctx->pins;
+		ctx->pins = entry->next;
+		pin_destroy(entry);
+		free_match_tok(entry->match_tok);
+		OPENSSL_free(entry);
+	}
+}
+
+static int str_matches(const char *match, const char *value)
+{
+	return !match || !strcmp(match, value);
+}
+
+static int str_equal(const char *a, const char *b)
+{
+	return a == b || (a && b && !strcmp(a, b));
+}
+
+/* Return 1 if the token matches the token attributes of a PKCS#11 URI */
+static int token_matches(const PKCS11_TOKEN *match_tok, const PKCS11_TOKEN *tok)
+{
+	return str_matches(match_tok->label, tok->label) &&
+		str_matches(match_tok->manufacturer, tok->manufacturer) &&
+		str_matches(match_tok->serialnr, tok->serialnr) &&
+		str_matches(match_tok->model, tok->model);
+}
+
+/* Return 1 if a PKCS#11 URI has any token attribute */
+static int token_selected(const PKCS11_TOKEN *match_tok)
+{
+	return match_tok && (match_tok->label || match_tok->manufacturer ||
+		match_tok->serialnr || match_tok->model);
+}
+
+static int token_dup_attr(char **dst, const char *src)
+{
+	*dst = src ? OPENSSL_strdup(src) : NULL;
+	return !src || *dst;
+}
+
+/* Allocate a PIN entry for the tokens matching the given attributes
+ * Called with ctx->pin_lock held */
+static ENGINE_PIN *ctx_new_pin_unlocked(ENGINE_CTX *ctx,
+		const char *label, const char *manufacturer,
+		const char *serialnr, const char *model)
+{
+	ENGINE_PIN *entry;
+	PKCS11_TOKEN *match_tok;
+
+	entry = OPENSSL_malloc(sizeof(ENGINE_PIN));
+	match_tok = OPENSSL_malloc(sizeof(PKCS11_TOKEN));
+	if (!entry || !match_tok) {
+		OPENSSL_free(entry);
+		OPENSSL_free(match_tok);
+		return NULL;
+	}
+	memset(entry, 0, sizeof(ENGINE_PIN));
+	memset(match_tok, 0, sizeof(PKCS11_TOKEN));
+	if (!token_dup_attr(&match_tok->label, label) ||
+			!token_dup_attr(&match_tok->manufacturer, manufacturer) ||
+			!token_dup_attr(&match_tok->serialnr, serialnr) ||
+			!token_dup_attr(&match_tok->model, model)) {
+		free_match_tok(match_tok);
+		OPENSSL_free(entry);
+		return NULL;
+	}
+	entry->match_tok = match_tok;
+
+	/* The latest entries take precedence */
+	entry->next = ctx->pins;
+	ctx->pins = entry;
+	return entry;
+}
+
+/* Find the PIN entry of a token, or allocate one for the token
+ * Called with ctx->pin_lock held */
+static ENGINE_PIN *ctx_find_pin_unlocked(ENGINE_CTX *ctx, PKCS11_TOKEN *tok)
+{
+	ENGINE_PIN *entry;
+
+	for (entry = ctx->pins; entry; entry = entry->next)
+		if (token_matches(entry->match_tok, tok))
+			return entry;
+	return ctx_new_pin_unlocked(ctx, tok->label, NULL, tok->serialnr, NULL);
+}
+
+/* Set the PIN of the tokens matching the token attributes of a PKCS#11 URI,
+ * or the PIN of all the tokens if the URI selects none */
+static int ctx_set_token_pin(ENGINE_CTX *ctx, PKCS11_TOKEN *match_tok,
+		const char *pin)
+{
+	ENGINE_PIN *entry;
+	char *copy;
+
+	if (!token_selected(match_tok))
+		return ctx_ctrl_set_pin(ctx, pin);
+
+	copy = OPENSSL_strdup(pin);
+	if (!copy) {
+		ENGerr(ENG_F_CTX_CTRL_SET_PIN, ERR_R_MALLOC_FAILURE);
+		errno = ENOMEM;
+		return 0;
+	}
+	pthread_mutex_lock(&ctx->pin_lock);
+	for (entry = ctx->pins; entry; entry = entry->next)
+		if (str_equal(entry->match_tok->label, match_tok->label) &&
+				str_equal(entry->match_tok->manufacturer, match_tok->manufacturer) &&
+				str_equal(entry->match_tok->serialnr, match_tok->serialnr) &&
+				str_equal(entry->match_tok->model, match_tok->model))
+			break;
+	if (!entry)
+		entry = ctx_new_pin_unlocked(ctx, match_tok->label,
+			match_tok->manufacturer, match_tok->serialnr, match_tok->model);
+	if (!entry) {
+		pthread_mutex_unlock(&ctx->pin_lock);
+		OPENSSL_cleanse(copy, strlen(copy));
+		OPENSSL_free(copy);
+		ENGerr(ENG_F_CTX_CTRL_SET_PIN, ERR_R_MALLOC_FAILURE);
+		errno = ENOMEM;
+		return 0;
+	}
+	pin_destroy(entry);
+	entry->pin = copy;
+	entry->pin_length = strlen(copy);
+	entry->forced_pin = 1;
+	pthread_mutex_unlock(&ctx->pin_lock);
+	return 1;
+}
+
 /* Get the PIN via asking user interface. The supplied call-back data are
  * passed to the user interface implemented by an application. Only the
  * application knows how to interpret the call-back data.
- * A (strdup'ed) copy of the PIN code will be stored in the pin variable. */
-static int ctx_get_pin(ENGINE_CTX *ctx, const char* token_label, UI_METHOD *ui_method, void *callback_data)
+ * The PIN code will be stored in the pin buffer of MAX_PIN_LENGTH+1 bytes. */
+static int ctx_get_pin(ENGINE_CTX *ctx, const char* token_label, UI_METHOD *ui_method, void *callback_data,
+		char *pin)
 {
 	UI *ui;
 	char* prompt;
@@ -156,18 +351,13 @@ static int ctx_get_pin(ENGINE_CTX *ctx, const char* token_label, UI_METHOD *ui_m
 	if (callback_data)
 		UI_add_user_data(ui, callback_data);
 
-	ctx_destroy_pin(ctx);
-	ctx->pin = OPENSSL_malloc(MAX_PIN_LENGTH+1);
-	if (!ctx->pin)
-		return 0;
-	memset(ctx->pin, 0, MAX_PIN_LENGTH+1);
-	ctx->pin_length = MAX_PIN_LENGTH;
+	memset(pin, 0, MAX_PIN_LENGTH+1);
 	prompt = UI_construct_prompt(ui, "PKCS#11 token PIN", token_label);
 	if (!prompt) {
 		return 0;
 	}
 	if (UI_dup_input_string(ui, prompt,
-			UI_INPUT_FLAG_DEFAULT_PWD, ctx->pin, 4, MAX_PIN_LENGTH) <= 0) {
+			UI_INPUT_FLAG_DEFAULT_PWD, pin, 4, MAX_PIN_LENGTH) <= 0) {
 		ctx_log(ctx, 0, "UI_dup_input_string failed\n");
 		UI_free(ui);
 		OPENSSL_free(prompt);
@@ -196,8 +386,28 @@ static int slot_logged_in(ENGINE_CTX *ctx, PKCS11_SLOT *slot) {
 	return logged_in;
 }
 
+/*
+ * Serialize the logins and the object enumerations of a slot.
+ * libp11 reallocates the object arrays of a token while enumerating,
+ * so the arrays returned to a thread are only valid under this lock.
+ * Several PIN entries may match the same token, so the lock belongs to
+ * the slot rather than to the PIN entry.
+ *
+ * @slot is a PKCS11 slot of ctx->slot_list
+ */
+static void ctx_lock_slot(ENGINE_CTX *ctx, PKCS11_SLOT *slot)
+{
+	pthread_mutex_lock(&ctx->slot_locks[slot - ctx->slot_list]);
+}
+
+static void ctx_unlock_slot(ENGINE_CTX *ctx, PKCS11_SLOT *slot)
+{
+	pthread_mutex_unlock(&ctx->slot_locks[slot - ctx->slot_list]);
+}
+
 /*
  * Log-into the token if necessary.
+ * Called with the slot locked by ctx_lock_slot().
  *
  * @slot is PKCS11 slot to log in
  * @tok is PKCS11 token to log in (??? could be derived as @slot->token)
@@ -208,38 +418,86 @@ static int slot_logged_in(ENGINE_CTX *ctx, PKCS11_SLOT *slot) {
 static int ctx_login(ENGINE_CTX *ctx, PKCS11_SLOT *slot, PKCS11_TOKEN *tok,
 		UI_METHOD *ui_method, void *callback_data)
 {
-	if (!(ctx->force_login || tok->loginRequired) || slot_logged_in(ctx, slot))
+	ENGINE_PIN *entry;
+	char *pin = NULL, prompted[MAX_PIN_LENGTH+1];
+	int global = 0, rv = 0;
+
+	if (!(ctx->force_login || tok->loginRequired))
 		return 1;
 
-	/* If the token has a secure login (i.e., an external keypad),
+	if (slot_logged_in(ctx, slot))
+		return 1;
+
+	pthread_mutex_lock(&ctx->pin_lock);
+	entry = ctx_find_pin_unlocked(ctx, tok);
+	pthread_mutex_unlock(&ctx->pin_lock);
+	if (!entry) {
+		ctx_log(ctx, 0, "Could not allocate memory for PIN\n");
+		return 0;
+	}
+
+	/* Use the PIN set for the token, or else the PIN set for all tokens,
+	 * or else the PIN entered for the token.
+	 * If the token has a secure login (i.e., an external keypad),
 	 * then use a NULL PIN. Otherwise, obtain a new PIN if needed. */
-	if (tok->secureLogin && !ctx->forced_pin) {
+	pthread_mutex_lock(&ctx->pin_lock);
+	if (entry->pin && entry->forced_pin) {
+		pin = OPENSSL_strdup(entry->pin);
+	} else if (ctx->pin && (ctx->forced_pin || !tok->secureLogin)) {
+		pin = OPENSSL_strdup(ctx->pin);
+		global = 1;
+	} else if (entry->pin && !tok->secureLogin) {
+		pin = OPENSSL_strdup(entry->pin);
+	} else if (tok->secureLogin) {
 		/* Free the PIN if it has already been
 		 * assigned (i.e, cached by ctx_get_pin) */
-		ctx_destroy_pin(ctx);
-	} else if (!ctx->pin) {
-		ctx->pin = OPENSSL_malloc(MAX_PIN_LENGTH+1);
-		ctx->pin_length = MAX_PIN_LENGTH;
-		if (ctx->pin == NULL) {
-			ctx_log(ctx, 0, "Could not allocate memory for PIN\n");
-			return 0;
-		}
-		memset(ctx->pin, 0, MAX_PIN_LENGTH+1);
-		if (!ctx_get_pin(ctx, tok->label, ui_method, callback_data)) {
-			ctx_destroy_pin(ctx);
+		pin_destroy(entry);
+	}
+	pthread_mutex_unlock(&ctx->pin_lock);
+
+	if (!pin && !tok->secureLogin) {
+		if (!ctx_get_pin(ctx, tok->label, ui_method, callback_data,
+				prompted)) {
+			OPENSSL_cleanse(prompted, sizeof(prompted));
 			ctx_log(ctx, 0, "No PIN code was entered\n");
-			return 0;
+			goto end;
+		}
+		pin = OPENSSL_strdup(prompted);
+		OPENSSL_cleanse(prompted, sizeof(prompted));
+		if (pin) {
+			/* Cache the PIN of this token */
+			pthread_mutex_lock(&ctx->pin_lock);
+			pin_destroy(entry);
+			entry->pin = OPENSSL_strdup(pin);
+			entry->pin_length = entry->pin ? strlen(entry->pin) : 0;
+			pthread_mutex_unlock(&ctx->pin_lock);
 		}
 	}
+	if (!pin && !tok->secureLogin) {
+		ctx_log(ctx, 0, "Could not allocate memory for PIN\n");
+		goto end;
+	}
 
 	/* Now login in with the (possibly NULL) PIN */
-	if (PKCS11_login(slot, 0, ctx->pin)) {
+	if (PKCS11_login(slot, 0, pin)) {
 		/* Login failed, so free the PIN if present */
-		ctx_destroy_pin(ctx);
+		pthread_mutex_lock(&ctx->pin_lock);
+		if (global)
+			ctx_destroy_pin(ctx);
+		else
+			pin_destroy(entry);
+		pthread_mutex_unlock(&ctx->pin_lock);
 		ctx_log(ctx, 0, "Login failed\n");
-		return 0;
+		goto end;
 	}
-	return 1;
+	rv = 1;
+
+end:
+	if (pin) {
+		OPENSSL_cleanse(pin, strlen(pin));
+		OPENSSL_free(pin);
+	}
+	return rv;
 }
 
 /******************************************************************************/
@@ -256,6 +514,10 @@ ENGINE_CTX *ctx_new()
 		return NULL;
 	memset(ctx, 0, sizeof(ENGINE_CTX));
 	pthread_mutex_init(&ctx->lock, 0);
+	pkcs11_lock_profile_init(&ctx->lock_prof, "engine ctx->lock",
+		(unsigned long)-1);
+	pthread_cond_init(&ctx->idle, 0);
+	pthread_mutex_init(&ctx->pin_lock, 0);
 
 	mod = getenv("PKCS11_MODULE_PATH");
 	if (mod) {
@@ -271,13 +533,69 @@ ENGINE_CTX *ctx_new()
 	return ctx;
 }
 
+/* Destroy the locks of the slots, called while no object is loaded */
+static void ctx_free_slot_locks(ENGINE_CTX *ctx)
+{
+	unsigned int n;
+
+	for (n = 0; n < ctx->slot_lock_count; n++)
+		pthread_mutex_destroy(&ctx->slot_locks[n]);
+	OPENSSL_free(ctx->slot_locks);
+	ctx->slot_locks = NULL;
+	ctx->slot_lock_count = 0;
+}
+
+/* Allocate a lock for each slot of ctx->slot_list, called while no object
+ * is loaded.  Returns 1 on success, 0 on error */
+static int ctx_alloc_slot_locks(ENGINE_CTX *ctx)
+{
+	unsigned int n;
+
+	if (ctx->slot_lock_count == ctx->slot_count)
+		return 1;
+	ctx_free_slot_locks(ctx);
+	if (ctx->slot_count == 0)
+		return 1;
+	ctx->slot_locks = OPENSSL_malloc(ctx->slot_count * sizeof(pthread_mutex_t));
+	if (!ctx->slot_locks)
+		return 0;
+	for (n = 0; n < ctx->slot_count; n++)
+		pthread_mutex_init(&ctx->slot_locks[n], 0);
+	ctx->slot_lock_count = ctx->slot_count;
+	return 1;
+}
+
+/* Release libp11 data: ctx->pkcs11_ctx and ctx->slot_list */
+static void ctx_release_libp11_unlocked(ENGINE_CTX *ctx)
+{
+	ctx_free_slot_locks(ctx);
+	if (ctx->slot_list) {
+		PKCS11_release_all_slots(ctx->pkcs11_ctx,
+			ctx->slot_list, ctx->slot_count);
+		ctx->slot_list = NULL;
+		ctx->slot_count = 0;
+	}
+	if (ctx->pkcs11_ctx) {
+		PKCS11_CTX_unload(ctx->pkcs11_ctx);
+		PKCS11_CTX_free(ctx->pkcs11_ctx);
+		ctx->pkcs11_ctx = NULL;
+	}
+	ctx->expired = 0;
+}
+
 /* Destroy the context allocated with ctx_new() */
 int ctx_destroy(ENGINE_CTX *ctx)
 {
 	if (ctx) {
+		/* Release the state kept with KEEP_ALIVE */
+		ctx_release_libp11_unlocked(ctx);
 		ctx_destroy_pin(ctx);
+		ctx_free_pins(ctx);
 		OPENSSL_free(ctx->module);
 		OPENSSL_free(ctx->init_args);
+		OPENSSL_free(ctx->session_quota_name);
+		pthread_mutex_destroy(&ctx->pin_lock);
+		pthread_cond_destroy(&ctx->idle);
 		pthread_mutex_destroy(&ctx->lock);
 		OPENSSL_free(ctx);
 	}
@@ -291,18 +609,35 @@ static int ctx_enumerate_slots_unlocked(ENGINE_CTX *ctx, PKCS11_CTX *pkcs11_ctx)
 		ctx_log(ctx, 0, "Failed to enumerate slots\n");
 		return 0;
 	}
+	if (!ctx_alloc_slot_locks(ctx)) {
+		ctx_log(ctx, 0, "Could not allocate memory for the slot locks\n");
+		return 0;
+	}
 	ctx_log(ctx, 1, "Found %u slot%s\n", ctx->slot_count,
 		ctx->slot_count <= 1 ? "" : "s");
 	return 1;
 }
 
+/* Wait until no object is being loaded from ctx->slot_list
+ * Called with ctx->lock held */
+static void ctx_wait_loading_unlocked(ENGINE_CTX *ctx)
+{
+	ctx->enumerating++;
+	while (ctx->loading)
+		CTX_WAIT_IDLE(ctx);
+	ctx->enumerating--;
+}
+
 static int ctx_enumerate_slots(ENGINE_CTX *ctx, PKCS11_CTX *pkcs11_ctx)
 {
 	int rv;
 
-	pthread_mutex_lock(&ctx->lock);
+	CTX_LOCK(ctx);
+	/* PKCS11_update_slots() may move ctx->slot_list */
+	ctx_wait_loading_unlocked(ctx);
 	rv = ctx_enumerate_slots_unlocked(ctx, pkcs11_ctx);
-	pthread_mutex_unlock(&ctx->lock);
+	pthread_cond_broadcast(&ctx->idle);
+	CTX_UNLOCK(ctx);
 	return rv;
 }
 
@@ -311,6 +646,12 @@ static int ctx_init_libp11_unlocked(ENGINE_CTX *ctx)
 {
 	PKCS11_CTX *pkcs11_ctx;
 
+	/* Drop the state kept idle for longer than KEEP_ALIVE */
+	if (ctx->expired) {
+		ctx_log(ctx, 1, "PKCS#11: Releasing the idle module\n");
+		ctx_wait_loading_unlocked(ctx);
+		ctx_release_libp11_unlocked(ctx);
+	}
 	if (ctx->pkcs11_ctx && ctx->slot_list)
 		return 0;
 
@@ -319,6 +660,23 @@ static int ctx_init_libp11_unlocked(ENGINE_CTX *ctx)
 	pkcs11_ctx = PKCS11_CTX_new();
 	PKCS11_CTX_init_args(pkcs11_ctx, ctx->init_args);
 	PKCS11_set_ui_method(pkcs11_ctx, ctx->ui_method, ctx->callback_data);
+	if (ctx->slow_op_threshold)
+		PKCS11_set_slow_op_threshold(pkcs11_ctx, 0, ctx->slow_op_threshold);
+	if (ctx->session_affinity)
+		PKCS11_set_session_affinity(pkcs11_ctx, ctx->session_affinity);
+	if (ctx->session_quota &&
+			PKCS11_set_session_quota(pkcs11_ctx, ctx->session_quota_name,
+				ctx->session_quota) < 0)
+		ctx_log(ctx, 0, "Unable to attach the session quota %s\n",
+			ctx->session_quota_name);
+	if (ctx->limit_max)
+		PKCS11_set_concurrency_limit(pkcs11_ctx, ctx->limit_min,
+			ctx->limit_max, ctx->limit_wait);
+	if (ctx->rate)
+		PKCS11_set_rate_limit(pkcs11_ctx, ctx->rate, ctx->rate_burst,
+			ctx->rate_wait);
+	if (ctx->lock_profiling)
+		PKCS11_set_lock_profiling(pkcs11_ctx, 1);
 	if (PKCS11_CTX_load(pkcs11_ctx, ctx->module) < 0) {
 		ctx_log(ctx, 0, "Unable to load module %s\n", ctx->module);
 		PKCS11_CTX_free(pkcs11_ctx);
@@ -340,24 +698,58 @@ int ctx_init(ENGINE_CTX *ctx)
 	 * Double-locking a non-recursive rwlock causes the application to
 	 * crash or hang, depending on the locking library implementation. */
 
-	(void)ctx; /* squash the unused parameter warning */
+	/* For the same reason, the state kept by ctx_finish() is released
+	 * on its next use rather than here */
+	if (ctx->idle_since) {
+		if (time(NULL) - ctx->idle_since >= ctx->keep_alive)
+			ctx->expired = 1;
+		ctx->idle_since = 0;
+	}
 	return 1;
 }
 
+/* Initialize libp11 and register an object being loaded.  The objects are
+ * loaded without ctx->lock, so that different tokens are used concurrently.
+ * Returns 0 on success, -1 on error */
+static int ctx_begin_load(ENGINE_CTX *ctx)
+{
+	int rv;
+
+	CTX_LOCK(ctx);
+	while (ctx->enumerating)
+		CTX_WAIT_IDLE(ctx);
+
+	/* Delayed libp11 initialization */
+	rv = ctx_init_libp11_unlocked(ctx);
+	if (!rv)
+		ctx->loading++;
+	CTX_UNLOCK(ctx);
+	return rv;
+}
+
+static void ctx_end_load(ENGINE_CTX *ctx)
+{
+	CTX_LOCK(ctx);
+	if (--ctx->loading == 0)
+		pthread_cond_broadcast(&ctx->idle);
+	CTX_UNLOCK(ctx);
+}
+
 /* Finish engine operations initialized with ctx_init() */
 int ctx_finish(ENGINE_CTX *ctx)
 {
 	if (ctx) {
-		if (ctx->slot_list) {
-			PKCS11_release_all_slots(ctx->pkcs11_ctx,
-				ctx->slot_list, ctx->slot_count);
-			ctx->slot_list = NULL;
-			ctx->slot_count = 0;
-		}
-		if (ctx->pkcs11_ctx) {
-			PKCS11_CTX_unload(ctx->pkcs11_ctx);
-			PKCS11_CTX_free(ctx->pkcs11_ctx);
-			ctx->pkcs11_ctx = NULL;
+		/* Keep the module, the slots, the sessions, the login state
+		 * and the enumerated objects for the next ctx_init().  Nothing
+		 * runs while the engine is idle: the state is released by the
+		 * first ctx_init() after the timeout, or by ctx_destroy() */
+		if (ctx->keep_alive > 0 && ctx->pkcs11_ctx) {
+			ctx->idle_since = time(NULL);
+			ctx_log(ctx, 1, "PKCS#11: Keeping the module for %ld seconds\n",
+				ctx->keep_alive);
+		} else {
+			ctx_release_libp11_unlocked(ctx);
+			ctx->idle_since = 0;
 		}
 	}
 	return 1;
@@ -367,6 +759,53 @@ int ctx_finish(ENGINE_CTX *ctx)
 /* Utilities common to public, private key and certificate handling           */
 /******************************************************************************/
 
+/* Check if the slot is selected by a legacy slot number or a token template */
+static int slot_matches(PKCS11_SLOT *slot, PKCS11_TOKEN *match_tok, int slot_nr)
+{
+	if (slot_nr != -1 &&
+			slot_nr == (int)PKCS11_get_slotid_from_slot(slot))
+		return 1;
+	return match_tok && slot->token && token_matches(match_tok, slot->token);
+}
+
+static void free_match_tok(PKCS11_TOKEN *match_tok)
+{
+	if (match_tok) {
+		OPENSSL_free(match_tok->model);
+		OPENSSL_free(match_tok->manufacturer);
+		OPENSSL_free(match_tok->serialnr);
+		OPENSSL_free(match_tok->label);
+		OPENSSL_free(match_tok);
+	}
+}
+
+/* Select the token holding an object by its id among the matching tokens,
+ * or all the tokens if none matched.  The keys are placed by their id, so
+ * objects selected by their label only are searched on all the tokens. */
+static PKCS11_SLOT *ctx_place_object(ENGINE_CTX *ctx,
+		PKCS11_SLOT **matched_slots, size_t matched_count,
+		const char *obj_id, size_t obj_id_len)
+{
+	PKCS11_SLOT **slots, *placed;
+	unsigned int n;
+
+	if (obj_id_len == 0)
+		return NULL;
+	if (matched_count != 0)
+		return pkcs11_place_key(matched_slots, (unsigned int)matched_count,
+			(const unsigned char *)obj_id, obj_id_len);
+
+	slots = OPENSSL_malloc(ctx->slot_count * sizeof(PKCS11_SLOT *));
+	if (!slots)
+		return NULL;
+	for (n = 0; n < ctx->slot_count; n++)
+		slots[n] = ctx->slot_list + n;
+	placed = pkcs11_place_key(slots, ctx->slot_count,
+		(const unsigned char *)obj_id, obj_id_len);
+	OPENSSL_free(slots);
+	return placed;
+}
+
 static void *ctx_try_load_object(ENGINE_CTX *ctx,
 		const char *object_typestr,
 		void *(*match_func)(ENGINE_CTX *, PKCS11_TOKEN *,
@@ -404,7 +843,9 @@ static void *ctx_try_load_object(ENGINE_CTX *ctx,
 			}
 			if (tmp_pin_len > 0 && tmp_pin[0] != 0) {
 				tmp_pin[tmp_pin_len] = 0;
-				if (!ctx_ctrl_set_pin(ctx, tmp_pin)) {
+				n = ctx_set_token_pin(ctx, match_tok, tmp_pin);
+				OPENSSL_cleanse(tmp_pin, sizeof(tmp_pin));
+				if (!n) {
 					goto error;
 				}
 			}
@@ -463,22 +904,8 @@ static void *ctx_try_load_object(ENGINE_CTX *ctx,
 			flags[m - 2] = '\0';
 		}
 
-		if (slot_nr != -1 &&
-			slot_nr == (int)PKCS11_get_slotid_from_slot(slot)) {
-			found_slot = slot;
-		}
-
-		if (match_tok && slot->token &&
-				(!match_tok->label ||
-					!strcmp(match_tok->label, slot->token->label)) &&
-				(!match_tok->manufacturer ||
-					!strcmp(match_tok->manufacturer, slot->token->manufacturer)) &&
-				(!match_tok->serialnr ||
-					!strcmp(match_tok->serialnr, slot->token->serialnr)) &&
-				(!match_tok->model ||
-					!strcmp(match_tok->model, slot->token->model))) {
+		if (slot_matches(slot, match_tok, slot_nr))
 			found_slot = slot;
-		}
 		ctx_log(ctx, 1, "- [%lu] %-25.25s  %-36s",
 			PKCS11_get_slotid_from_slot(slot),
 			slot->description, flags);
@@ -497,6 +924,20 @@ static void *ctx_try_load_object(ENGINE_CTX *ctx,
 		found_slot = NULL;
 	}
 
+	/* Search only the token selected by the key placement */
+	if (ctx->key_placement && slot_nr == -1 &&
+			(matched_count > 1 || (matched_count == 0 && !match_tok))) {
+		found_slot = ctx_place_object(ctx, matched_slots, matched_count,
+			obj_id, obj_id_len);
+		if (found_slot) {
+			ctx_log(ctx, 1, "Key placement selected token: %s\n",
+				found_slot->token->label);
+			matched_slots[0] = found_slot;
+			matched_count = 1;
+			found_slot = NULL;
+		}
+	}
+
 	if (matched_count == 0) {
 		if (match_tok) {
 			ctx_log(ctx, 0, "No matching initialized token was found for %s\n",
@@ -534,6 +975,8 @@ static void *ctx_try_load_object(ENGINE_CTX *ctx,
 		ctx_log(ctx, 1, "Found slot:  %s\n", slot->description);
 		ctx_log(ctx, 1, "Found token: %s\n", slot->token->label);
 
+		ctx_lock_slot(ctx, slot);
+
 		/* In several tokens certificates are marked as private */
 		if (login) {
 			/* Only try to login if login is required */
@@ -543,10 +986,12 @@ static void *ctx_try_load_object(ENGINE_CTX *ctx,
 				if (matched_count == 1) {
 					if (!ctx_login(ctx, slot, tok,
 							ui_method, callback_data)) {
+						ctx_unlock_slot(ctx, slot);
 						ctx_log(ctx, 0, "Login to token failed, returning NULL...\n");
 						goto error;
 					}
 				} else {
+					ctx_unlock_slot(ctx, slot);
 					ctx_log(ctx, 0, "Multiple matching slots (%lu); will not try to"
 						" login\n", matched_count);
 					for (m = 0; m < matched_count; m++){
@@ -563,19 +1008,14 @@ static void *ctx_try_load_object(ENGINE_CTX *ctx,
 		}
 
 		object = match_func(ctx, tok, obj_id, obj_id_len, obj_label);
+		ctx_unlock_slot(ctx, slot);
 		if (object)
 			break;
 	}
 
 error:
 	/* Free the searched token data */
-	if (match_tok) {
-		OPENSSL_free(match_tok->model);
-		OPENSSL_free(match_tok->manufacturer);
-		OPENSSL_free(match_tok->serialnr);
-		OPENSSL_free(match_tok->label);
-		OPENSSL_free(match_tok);
-	}
+	free_match_tok(match_tok);
 
 	if (obj_label)
 		OPENSSL_free(obj_label);
@@ -594,12 +1034,8 @@ static void *ctx_load_object(ENGINE_CTX *ctx,
 {
 	void *obj = NULL;
 
-	pthread_mutex_lock(&ctx->lock);
-
-	/* Delayed libp11 initialization */
-	if (ctx_init_libp11_unlocked(ctx)) {
+	if (ctx_begin_load(ctx)) {
 		ENGerr(ENG_F_CTX_LOAD_OBJECT, ENG_R_INVALID_PARAMETER);
-		pthread_mutex_unlock(&ctx->lock);
 		return NULL;
 	}
 
@@ -620,7 +1056,7 @@ static void *ctx_load_object(ENGINE_CTX *ctx,
 		}
 	}
 
-	pthread_mutex_unlock(&ctx->lock);
+	ctx_end_load(ctx);
 	return obj;
 }
 
@@ -758,13 +1194,30 @@ cleanup:
 	return selected_cert;
 }
 
+/* Return the X509 of the matching certificate while the token is locked */
+static void *match_cert_x509(ENGINE_CTX *ctx, PKCS11_TOKEN *tok,
+		const char *obj_id, size_t obj_id_len, const char *obj_label)
+{
+	PKCS11_CERT *cert;
+
+	cert = match_cert(ctx, tok, obj_id, obj_id_len, obj_label);
+	if (!cert || !cert->x509)
+		return NULL;
+	if (!ctx->share_certs)
+		return X509_dup(cert->x509);
+	/* The certificate is shared with every slot and context holding it */
+	if (!X509_up_ref(cert->x509))
+		return NULL;
+	return cert->x509;
+}
+
 static int ctx_ctrl_load_cert(ENGINE_CTX *ctx, void *p)
 {
 	struct {
 		const char *s_slot_cert_id;
 		X509 *cert;
 	} *parms = p;
-	PKCS11_CERT *cert;
+	X509 *cert;
 
 	if (!parms) {
 		ENGerr(ENG_F_CTX_CTRL_LOAD_CERT, ERR_R_PASSED_NULL_PARAMETER);
@@ -775,14 +1228,14 @@ static int ctx_ctrl_load_cert(ENGINE_CTX *ctx, void *p)
 		return 0;
 	}
 
-	cert = ctx_load_object(ctx, "certificate", match_cert, parms->s_slot_cert_id,
-		ctx->ui_method, ctx->callback_data);
+	cert = ctx_load_object(ctx, "certificate", match_cert_x509,
+		parms->s_slot_cert_id, ctx->ui_method, ctx->callback_data);
 	if (!cert) {
 		if (!ERR_peek_last_error())
 			ENGerr(ENG_F_CTX_CTRL_LOAD_CERT, ENG_R_OBJECT_NOT_FOUND);
 		return 0;
 	}
-	parms->cert = X509_dup(cert->x509);
+	parms->cert = cert;
 	return 1;
 }
 
@@ -889,58 +1342,326 @@ cleanup:
 	return ret;
 }
 
+/* The EVP_PKEY objects are created while the token is locked */
 static void *match_public_key(ENGINE_CTX *ctx, PKCS11_TOKEN *tok,
 		const char *obj_id, size_t obj_id_len, const char *obj_label)
 {
-	return match_key_int(ctx, tok, 0, obj_id, obj_id_len, obj_label);
+	PKCS11_KEY *key;
+
+	key = match_key_int(ctx, tok, 0, obj_id, obj_id_len, obj_label);
+	if (!key)
+		return NULL;
+	return PKCS11_get_public_key(key);
 }
 
 static void *match_private_key(ENGINE_CTX *ctx, PKCS11_TOKEN *tok,
 		const char *obj_id, size_t obj_id_len, const char *obj_label)
 {
-	return match_key_int(ctx, tok, 1, obj_id, obj_id_len, obj_label);
+	PKCS11_KEY *key;
+
+	key = match_key_int(ctx, tok, 1, obj_id, obj_id_len, obj_label);
+	if (!key)
+		return NULL;
+	if (ctx->signature_cache)
+		PKCS11_set_signature_cache(key, ctx->signature_cache);
+	if (ctx->key_rate)
+		PKCS11_set_key_rate_limit(key, ctx->key_rate, ctx->key_rate_burst);
+	return PKCS11_get_private_key(key);
 }
 
 EVP_PKEY *ctx_load_pubkey(ENGINE_CTX *ctx, const char *s_key_id,
 		UI_METHOD *ui_method, void *callback_data)
 {
-	PKCS11_KEY *key;
+	EVP_PKEY *pkey;
 
-	key = ctx_load_object(ctx, "public key", match_public_key, s_key_id,
+	pkey = ctx_load_object(ctx, "public key", match_public_key, s_key_id,
 		ui_method, callback_data);
-	if (!key) {
+	if (!pkey) {
 		ctx_log(ctx, 0, "PKCS11_load_public_key returned NULL\n");
 		if (!ERR_peek_last_error())
 			ENGerr(ENG_F_CTX_LOAD_PUBKEY, ENG_R_OBJECT_NOT_FOUND);
 		return NULL;
 	}
-	return PKCS11_get_public_key(key);
+	return pkey;
 }
 
 EVP_PKEY *ctx_load_privkey(ENGINE_CTX *ctx, const char *s_key_id,
 		UI_METHOD *ui_method, void *callback_data)
 {
-	PKCS11_KEY *key;
+	EVP_PKEY *pkey;
 
-	key = ctx_load_object(ctx, "private key", match_private_key, s_key_id,
+	pkey = ctx_load_object(ctx, "private key", match_private_key, s_key_id,
 		ui_method, callback_data);
-	if (!key) {
+	if (!pkey) {
 		ctx_log(ctx, 0, "PKCS11_get_private_key returned NULL\n");
 		if (!ERR_peek_last_error())
 			ENGerr(ENG_F_CTX_LOAD_PRIVKEY, ENG_R_OBJECT_NOT_FOUND);
 		return NULL;
 	}
-	return PKCS11_get_private_key(key);
+	return pkey;
+}
+
+/******************************************************************************/
+/* Batch private key loading                                                  */
+/******************************************************************************/
+
+typedef struct {
+	char *id;
+	size_t id_len;
+	char *label;
+	PKCS11_SLOT *slot; /* the single token holding the key */
+	int fallback; /* several tokens match: use ctx_load_privkey() */
+} BATCH_KEY;
+
+static int batch_id_cmp(const PKCS11_KEY *k, const char *id, size_t id_len)
+{
+	if (k->id_len != id_len)
+		return k->id_len < id_len ? -1 : 1;
+	return id_len ? memcmp(k->id, id, id_len) : 0;
+}
+
+static int batch_label_cmp(const PKCS11_KEY *k, const char *label)
+{
+	return strcmp(k->label ? k->label : "", label);
+}
+
+/* Keys with the same ID or label stay in the enumeration order */
+static int batch_sort_id(const void *a, const void *b)
+{
+	const PKCS11_KEY *x = *(PKCS11_KEY * const *)a;
+	const PKCS11_KEY *y = *(PKCS11_KEY * const *)b;
+	int r = batch_id_cmp(x, (const char *)y->id, y->id_len);
+
+	return r ? r : (x < y ? -1 : x > y);
+}
+
+static int batch_sort_label(const void *a, const void *b)
+{
+	const PKCS11_KEY *x = *(PKCS11_KEY * const *)a;
+	const PKCS11_KEY *y = *(PKCS11_KEY * const *)b;
+	int r = batch_label_cmp(x, y->label ? y->label : "");
+
+	return r ? r : (x < y ? -1 : x > y);
+}
+
+/* Same selection as match_key(), using the sorted indexes */
+static PKCS11_KEY *batch_find(PKCS11_KEY *keys, PKCS11_KEY **by_id,
+		PKCS11_KEY **by_label, unsigned int count, const BATCH_KEY *item)
+{
+	PKCS11_KEY *selected = NULL;
+	unsigned int lo = 0, hi = count, mid;
+
+	if (!item->id_len && !item->label)
+		return count ? keys : NULL; /* Use the first key */
+
+	if (item->id_len) {
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (batch_id_cmp(by_id[mid], item->id, item->id_len) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		for (; lo < count &&
+				!batch_id_cmp(by_id[lo], item->id, item->id_len); lo++)
+			if (!item->label || (by_id[lo]->label &&
+					!strcmp(by_id[lo]->label, item->label)))
+				selected = by_id[lo];
+	} else {
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (batch_label_cmp(by_label[mid], item->label) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		for (; lo < count &&
+				!batch_label_cmp(by_label[lo], item->label); lo++)
+			if (by_label[lo]->label)
+				selected = by_label[lo];
+	}
+	return selected;
+}
+
+/* Parse the URI and find the token holding the key */
+static int batch_parse(ENGINE_CTX *ctx, const char *uri, BATCH_KEY *item)
+{
+	PKCS11_TOKEN *match_tok = NULL;
+	PKCS11_SLOT *slot;
+	char tmp_pin[MAX_PIN_LENGTH+1];
+	size_t tmp_pin_len = MAX_PIN_LENGTH;
+	int slot_nr = -1, n;
+	unsigned int i, matched = 0;
+
+	item->id_len = strlen(uri) + 1;
+	item->id = OPENSSL_malloc(item->id_len);
+	if (!item->id)
+		return 0;
+	if (!strncasecmp(uri, "pkcs11:", 7)) {
+		n = parse_pkcs11_uri(ctx, uri, &match_tok, item->id, &item->id_len,
+			tmp_pin, &tmp_pin_len, &item->label);
+		if (n && tmp_pin_len > 0 && tmp_pin[0] != 0) {
+			tmp_pin[tmp_pin_len] = 0;
+			n = ctx_set_token_pin(ctx, match_tok, tmp_pin);
+			OPENSSL_cleanse(tmp_pin, sizeof(tmp_pin));
+		}
+	} else {
+		n = parse_slot_id_string(ctx, uri, &slot_nr, item->id,
+			&item->id_len, &item->label);
+	}
+	if (!n) {
+		free_match_tok(match_tok);
+		return 0;
+	}
+
+	for (i = 0; i < ctx->slot_count; i++) {
+		slot = ctx->slot_list + i;
+		if (slot_matches(slot, match_tok, slot_nr) &&
+				slot->token && slot->token->initialized) {
+			item->slot = slot;
+			matched++;
+		}
+	}
+	if (matched > 1) {
+		item->slot = NULL;
+		item->fallback = 1;
+	} else if (matched == 0 && !match_tok && slot_nr == -1) {
+		slot = PKCS11_find_token(ctx->pkcs11_ctx,
+			ctx->slot_list, ctx->slot_count);
+		if (slot && slot->token && slot->token->initialized)
+			item->slot = slot;
+	}
+	free_match_tok(match_tok);
+	return 1;
+}
+
+/* Resolve the keys of a single token with one enumeration */
+static unsigned int batch_load_slot(ENGINE_CTX *ctx, PKCS11_SLOT *slot,
+		BATCH_KEY *items, unsigned int count, EVP_PKEY **pkeys)
+{
+	PKCS11_KEY *keys, *key, **by_id, **by_label;
+	unsigned int i, nkeys, loaded = 0;
+
+	ctx_lock_slot(ctx, slot);
+	if (!ctx_login(ctx, slot, slot->token,
+				ctx->ui_method, ctx->callback_data) ||
+			PKCS11_enumerate_keys(slot->token, &keys, &nkeys)) {
+		ctx_log(ctx, 0, "Unable to enumerate private keys of token %s\n",
+			slot->token->label);
+		goto end;
+	}
+	ctx_log(ctx, 1, "Found %u private key%s on token %s\n", nkeys,
+		nkeys == 1 ? "" : "s", slot->token->label);
+	if (nkeys == 0)
+		goto end;
+
+	by_id = OPENSSL_malloc(2 * nkeys * sizeof(PKCS11_KEY *));
+	if (!by_id) {
+		ctx_log(ctx, 0, "Could not allocate memory for the key index\n");
+		goto end;
+	}
+	by_label = by_id + nkeys;
+	for (i = 0; i < nkeys; i++)
+		by_id[i] = by_label[i] = keys + i;
+	qsort(by_id, nkeys, sizeof(PKCS11_KEY *), batch_sort_id);
+	qsort(by_label, nkeys, sizeof(PKCS11_KEY *), batch_sort_label);
+
+	for (i = 0; i < count; i++) {
+		if (items[i].slot != slot)
+			continue;
+		key = batch_find(keys, by_id, by_label, nkeys, items + i);
+		if (key && ctx->signature_cache)
+			PKCS11_set_signature_cache(key, ctx->signature_cache);
+		if (key && ctx->key_rate)
+			PKCS11_set_key_rate_limit(key, ctx->key_rate,
+				ctx->key_rate_burst);
+		if (key)
+			pkeys[i] = PKCS11_get_private_key(key);
+		if (pkeys[i])
+			loaded++;
+	}
+	OPENSSL_free(by_id);
+
+end:
+	ctx_unlock_slot(ctx, slot);
+	return loaded;
+}
+
+unsigned int ctx_load_privkeys(ENGINE_CTX *ctx, unsigned int count,
+		const char **uris, EVP_PKEY **pkeys)
+{
+	BATCH_KEY *items;
+	PKCS11_SLOT *slot;
+	unsigned int i, n, loaded = 0;
+
+	memset(pkeys, 0, count * sizeof(EVP_PKEY *));
+	if (count == 0)
+		return 0;
+	items = OPENSSL_malloc(count * sizeof(BATCH_KEY));
+	if (!items) {
+		ENGerr(ENG_F_CTX_LOAD_PRIVKEY, ERR_R_MALLOC_FAILURE);
+		return 0;
+	}
+	memset(items, 0, count * sizeof(BATCH_KEY));
+
+	if (ctx_begin_load(ctx)) {
+		ENGerr(ENG_F_CTX_LOAD_PRIVKEY, ENG_R_INVALID_PARAMETER);
+		OPENSSL_free(items);
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!uris[i] || !batch_parse(ctx, uris[i], items + i)) {
+			ctx_log(ctx, 0, "The private key ID is not a valid PKCS#11 URI: %s\n",
+				uris[i] ? uris[i] : "(null)");
+			items[i].slot = NULL;
+		}
+	}
+
+	/* Each token holding any of the keys is enumerated once */
+	for (n = 0; n < ctx->slot_count; n++) {
+		slot = ctx->slot_list + n;
+		for (i = 0; i < count && items[i].slot != slot; i++)
+			;
+		if (i < count)
+			loaded += batch_load_slot(ctx, slot, items + i, count - i, pkeys + i);
+	}
+
+	ctx_end_load(ctx);
+
+	for (i = 0; i < count; i++) {
+		if (items[i].fallback) {
+			pkeys[i] = ctx_load_privkey(ctx, uris[i],
+				ctx->ui_method, ctx->callback_data);
+			if (pkeys[i])
+				loaded++;
+		} else if (!pkeys[i] && uris[i]) {
+			ctx_log(ctx, 0, "The private key was not found at: %s\n",
+				uris[i]);
+		}
+		OPENSSL_free(items[i].id);
+		OPENSSL_free(items[i].label);
+	}
+	OPENSSL_free(items);
+	return loaded;
 }
 
 /******************************************************************************/
 /* Engine ctrl request handling                                               */
 /******************************************************************************/
 
+/* The module kept by ctx_finish() is reloaded with the new settings */
+static void ctx_expire_kept(ENGINE_CTX *ctx)
+{
+	if (ctx->idle_since)
+		ctx->expired = 1;
+}
+
 static int ctx_ctrl_set_module(ENGINE_CTX *ctx, const char *modulename)
 {
 	OPENSSL_free(ctx->module);
 	ctx->module = modulename ? OPENSSL_strdup(modulename) : NULL;
+	ctx_expire_kept(ctx);
 	return 1;
 }
 
@@ -968,18 +1689,62 @@ static int ctx_ctrl_set_pin(ENGINE_CTX *ctx, const char *pin)
 
 	/* Copy the PIN. If the string cannot be copied, NULL
 	 * shall be returned and errno shall be set. */
+	pthread_mutex_lock(&ctx->pin_lock);
 	ctx_destroy_pin(ctx);
 	ctx->pin = OPENSSL_strdup(pin);
 	if (!ctx->pin) {
+		pthread_mutex_unlock(&ctx->pin_lock);
 		ENGerr(ENG_F_CTX_CTRL_SET_PIN, ERR_R_MALLOC_FAILURE);
 		errno = ENOMEM;
 		return 0;
 	}
 	ctx->pin_length = strlen(ctx->pin);
 	ctx->forced_pin = 1;
+	pthread_mutex_unlock(&ctx->pin_lock);
 	return 1;
 }
 
+/* Set the PIN of the tokens selected by a PKCS#11 URI such as
+ * "pkcs11:token=foo?pin-value=1234" */
+static int ctx_ctrl_set_token_pin(ENGINE_CTX *ctx, const char *uri)
+{
+	PKCS11_TOKEN *match_tok = NULL;
+	char *id = NULL, *label = NULL;
+	char tmp_pin[MAX_PIN_LENGTH+1];
+	size_t id_len, tmp_pin_len = MAX_PIN_LENGTH;
+	int rv = 0;
+
+	if (!uri) {
+		ENGerr(ENG_F_CTX_CTRL_SET_PIN, ERR_R_PASSED_NULL_PARAMETER);
+		return 0;
+	}
+	id_len = strlen(uri) + 1;
+	id = OPENSSL_malloc(id_len);
+	if (!id) {
+		ENGerr(ENG_F_CTX_CTRL_SET_PIN, ERR_R_MALLOC_FAILURE);
+		return 0;
+	}
+	if (strncasecmp(uri, "pkcs11:", 7) ||
+			!parse_pkcs11_uri(ctx, uri, &match_tok, id, &id_len,
+				tmp_pin, &tmp_pin_len, &label) ||
+			!token_selected(match_tok) ||
+			tmp_pin_len == 0 || tmp_pin[0] == 0) {
+		ctx_log(ctx, 0, "The token PIN is not a PKCS#11 URI with token "
+			"attributes and a PIN\n");
+		ENGerr(ENG_F_CTX_CTRL_SET_PIN, ENG_R_INVALID_PARAMETER);
+		goto end;
+	}
+	tmp_pin[tmp_pin_len] = 0;
+	rv = ctx_set_token_pin(ctx, match_tok, tmp_pin);
+
+end:
+	OPENSSL_cleanse(tmp_pin, sizeof(tmp_pin));
+	free_match_tok(match_tok);
+	OPENSSL_free(label);
+	OPENSSL_free(id);
+	return rv;
+}
+
 static int ctx_ctrl_inc_verbose(ENGINE_CTX *ctx)
 {
 	ctx->verbose++;
@@ -996,6 +1761,7 @@ static int ctx_ctrl_set_init_args(ENGINE_CTX *ctx, const char *init_args_orig)
 {
 	OPENSSL_free(ctx->init_args);
 	ctx->init_args = init_args_orig ? OPENSSL_strdup(init_args_orig) : NULL;
+	ctx_expire_kept(ctx);
 	return 1;
 }
 
@@ -1017,6 +1783,232 @@ static int ctx_ctrl_set_callback_data(ENGINE_CTX *ctx, void *callback_data)
 	return 1;
 }
 
+static int ctx_ctrl_set_slow_op_threshold(ENGINE_CTX *ctx, long threshold)
+{
+	if (threshold < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->slow_op_threshold = (unsigned long)threshold;
+	if (ctx->pkcs11_ctx) /* libp11 is already initialized */
+		PKCS11_set_slow_op_threshold(ctx->pkcs11_ctx, 0,
+			ctx->slow_op_threshold);
+	return 1;
+}
+
+static int ctx_ctrl_set_session_affinity(ENGINE_CTX *ctx, long max_skips)
+{
+	if (max_skips < 0 || max_skips > UINT_MAX) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->session_affinity = (unsigned int)max_skips;
+	if (ctx->pkcs11_ctx) /* libp11 is already initialized */
+		PKCS11_set_session_affinity(ctx->pkcs11_ctx, ctx->session_affinity);
+	return 1;
+}
+
+static int ctx_ctrl_set_key_placement(ENGINE_CTX *ctx, long enable)
+{
+	ctx->key_placement = enable != 0;
+	return 1;
+}
+
+static int ctx_ctrl_set_share_certs(ENGINE_CTX *ctx, long enable)
+{
+	ctx->share_certs = enable != 0;
+	return 1;
+}
+
+static int ctx_ctrl_set_keep_alive(ENGINE_CTX *ctx, long seconds)
+{
+	if (seconds < 0) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->keep_alive = seconds;
+	return 1;
+}
+
+static int ctx_ctrl_set_signature_cache(ENGINE_CTX *ctx, long entries)
+{
+	if (entries < 0 || entries > UINT_MAX) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	/* Applies to the private keys loaded afterwards */
+	ctx->signature_cache = (unsigned int)entries;
+	return 1;
+}
+
+/* Parse "budget[:name]" */
+static int ctx_ctrl_set_session_quota(ENGINE_CTX *ctx, const char *spec)
+{
+	const char *name = "/libp11-sessions";
+	char *end;
+	unsigned long budget;
+
+	if (!spec) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	budget = strtoul(spec, &end, 10);
+	if (end == spec || budget > UINT_MAX || (*end && *end != ':')) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	if (*end == ':' && end[1])
+		name = end + 1;
+	OPENSSL_free(ctx->session_quota_name);
+	ctx->session_quota_name = OPENSSL_strdup(name);
+	ctx->session_quota = (unsigned int)budget;
+	if (!ctx->session_quota_name)
+		ctx->session_quota = 0;
+	if (ctx->pkcs11_ctx && /* libp11 is already initialized */
+			PKCS11_set_session_quota(ctx->pkcs11_ctx,
+				ctx->session_quota_name, ctx->session_quota) < 0)
+		return 0;
+	return 1;
+}
+
+/* Parse "min:max[:max_wait]", or "0" to disable the limit */
+static int ctx_ctrl_set_concurrency_limit(ENGINE_CTX *ctx, const char *spec)
+{
+	unsigned long min = 0, max = 0, wait = 0;
+	char *end;
+
+	if (!spec) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	min = strtoul(spec, &end, 10);
+	if (*end == ':') {
+		max = strtoul(end + 1, &end, 10);
+		if (*end == ':')
+			wait = strtoul(end + 1, &end, 10);
+	}
+	if (end == spec || *end || max > UINT_MAX ||
+			(max ? min < 1 || min > max : min != 0)) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->limit_min = (unsigned int)min;
+	ctx->limit_max = (unsigned int)max;
+	ctx->limit_wait = wait;
+	if (ctx->pkcs11_ctx) /* libp11 is already initialized */
+		PKCS11_set_concurrency_limit(ctx->pkcs11_ctx, ctx->limit_min,
+			ctx->limit_max, ctx->limit_wait);
+	return 1;
+}
+
+/* Parse "rate[:burst[:max_wait]]", or "0" to disable the limit
+ * The burst defaults to 1, and max_wait is only parsed if wait is not NULL */
+static int parse_rate_limit(const char *spec, unsigned long *rate,
+		unsigned long *burst, unsigned long *wait)
+{
+	char *end;
+
+	if (!spec)
+		return 0;
+	*rate = strtoul(spec, &end, 10);
+	*burst = 1;
+	if (wait)
+		*wait = 0;
+	if (end != spec && *end == ':') {
+		*burst = strtoul(end + 1, &end, 10);
+		if (wait && *end == ':')
+			*wait = strtoul(end + 1, &end, 10);
+	}
+	return end != spec && !*end && (!*rate || *burst >= 1);
+}
+
+static int ctx_ctrl_set_rate_limit(ENGINE_CTX *ctx, const char *spec)
+{
+	unsigned long rate, burst, wait;
+
+	if (!parse_rate_limit(spec, &rate, &burst, &wait)) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	ctx->rate = rate;
+	ctx->rate_burst = burst;
+	ctx->rate_wait = wait;
+	if (ctx->pkcs11_ctx) /* libp11 is already initialized */
+		PKCS11_set_rate_limit(ctx->pkcs11_ctx, ctx->rate,
+			ctx->rate_burst, ctx->rate_wait);
+	return 1;
+}
+
+static int ctx_ctrl_set_key_rate_limit(ENGINE_CTX *ctx, const char *spec)
+{
+	unsigned long rate, burst;
+
+	if (!parse_rate_limit(spec, &rate, &burst, NULL)) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_INVALID_PARAMETER);
+		return 0;
+	}
+	/* Applies to the private keys loaded afterwards */
+	ctx->key_rate = rate;
+	ctx->key_rate_burst = burst;
+	return 1;
+}
+
+static int ctx_ctrl_get_slow_ops(ENGINE_CTX *ctx, void *p)
+{
+	struct {
+		PKCS11_SLOW_OP *ops;
+		unsigned int count;
+	} *parms = p;
+
+	if (!parms) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ERR_R_PASSED_NULL_PARAMETER);
+		return 0;
+	}
+	if (!ctx->pkcs11_ctx) { /* nothing recorded yet */
+		parms->count = 0;
+		return 1;
+	}
+	return PKCS11_get_slow_ops(ctx->pkcs11_ctx,
+		parms->ops, &parms->count) == 0;
+}
+
+static int ctx_ctrl_set_lock_profiling(ENGINE_CTX *ctx, long enable)
+{
+	pthread_mutex_lock(&ctx->lock);
+	if (enable && !ctx->lock_profiling)
+		pkcs11_lock_profile_reset(&ctx->lock_prof);
+	ctx->lock_profiling = enable ? 1 : 0;
+	pthread_mutex_unlock(&ctx->lock);
+	if (ctx->pkcs11_ctx) /* libp11 is already initialized */
+		PKCS11_set_lock_profiling(ctx->pkcs11_ctx, ctx->lock_profiling);
+	return 1;
+}
+
+/* The engine lock is reported before the libp11 locks */
+static int ctx_ctrl_get_lock_stats(ENGINE_CTX *ctx, void *p)
+{
+	struct {
+		PKCS11_LOCK_STATS *stats;
+		unsigned int count;
+	} *parms = p;
+	unsigned int n, count;
+
+	if (!parms) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ERR_R_PASSED_NULL_PARAMETER);
+		return 0;
+	}
+	pthread_mutex_lock(&ctx->lock);
+	n = pkcs11_lock_profile_copy(&ctx->lock_prof, &ctx->lock,
+		parms->stats, parms->count);
+	pthread_mutex_unlock(&ctx->lock);
+	count = parms->stats ? parms->count - n : 0;
+	if (ctx->pkcs11_ctx && PKCS11_get_lock_stats(ctx->pkcs11_ctx,
+			parms->stats ? parms->stats + n : NULL, &count) < 0)
+		return 0;
+	parms->count = n + (ctx->pkcs11_ctx ? count : 0);
+	return 1;
+}
+
 static int ctx_ctrl_force_login(ENGINE_CTX *ctx)
 {
 	ctx->force_login = 1;
@@ -1025,7 +2017,6 @@ static int ctx_ctrl_force_login(ENGINE_CTX *ctx)
 
 int ctx_engine_ctrl(ENGINE_CTX *ctx, int cmd, long i, void *p, void (*f)())
 {
-	(void)i; /* We don't currently take integer parameters */
 	(void)f; /* We don't currently take callback parameters */
 	/*int initialised = ((pkcs11_dso == NULL) ? 0 : 1); */
 	switch (cmd) {
@@ -1051,6 +2042,34 @@ int ctx_engine_ctrl(ENGINE_CTX *ctx, int cmd, long i, void *p, void (*f)())
 		return ctx_ctrl_force_login(ctx);
 	case CMD_RE_ENUMERATE:
 		return ctx_enumerate_slots(ctx, ctx->pkcs11_ctx);
+	case CMD_SLOW_OP_THRESHOLD:
+		return ctx_ctrl_set_slow_op_threshold(ctx, i);
+	case CMD_GET_SLOW_OPS:
+		return ctx_ctrl_get_slow_ops(ctx, p);
+	case CMD_SESSION_AFFINITY:
+		return ctx_ctrl_set_session_affinity(ctx, i);
+	case CMD_SESSION_QUOTA:
+		return ctx_ctrl_set_session_quota(ctx, (const char *)p);
+	case CMD_CONCURRENCY_LIMIT:
+		return ctx_ctrl_set_concurrency_limit(ctx, (const char *)p);
+	case CMD_SIGNATURE_CACHE:
+		return ctx_ctrl_set_signature_cache(ctx, i);
+	case CMD_KEY_PLACEMENT:
+		return ctx_ctrl_set_key_placement(ctx, i);
+	case CMD_KEEP_ALIVE:
+		return ctx_ctrl_set_keep_alive(ctx, i);
+	case CMD_TOKEN_PIN:
+		return ctx_ctrl_set_token_pin(ctx, (const char *)p);
+	case CMD_LOCK_PROFILING:
+		return ctx_ctrl_set_lock_profiling(ctx, i);
+	case CMD_GET_LOCK_STATS:
+		return ctx_ctrl_get_lock_stats(ctx, p);
+	case CMD_RATE_LIMIT:
+		return ctx_ctrl_set_rate_limit(ctx, (const char *)p);
+	case CMD_KEY_RATE_LIMIT:
+		return ctx_ctrl_set_key_rate_limit(ctx, (const char *)p);
+	case CMD_SHARE_CERTS:
+		return ctx_ctrl_set_share_certs(ctx, i);
 	default:
 		ENGerr(ENG_F_CTX_ENGINE_CTRL, ENG_R_UNKNOWN_COMMAND);
 		break;
@@ -79,6 +79,66 @@ static const ENGINE_CMD_DEFN engine_cmd_defns[] = {
 		"RE_ENUMERATE",
 		"re enumerate slots",
 		ENGINE_CMD_FLAG_NO_INPUT},
+	{CMD_SLOW_OP_THRESHOLD,
+		"SLOW_OP_THRESHOLD",
+		"Record operations taking at least this many microseconds",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_GET_SLOW_OPS,
+		"GET_SLOW_OPS",
+		"Fetch the recorded slow operations (internal)",
+		ENGINE_CMD_FLAG_INTERNAL},
+	{CMD_SESSION_AFFINITY,
+		"SESSION_AFFINITY",
+		"Prefer sessions that last used the same key, passing over an idle session at most this many times",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_LOAD_PRIVKEYS,
+		"LOAD_PRIVKEYS",
+		"Load a list of private keys with one enumeration per token (internal)",
+		ENGINE_CMD_FLAG_INTERNAL},
+	{CMD_SESSION_QUOTA,
+		"SESSION_QUOTA",
+		"Share a budget of sessions per slot between processes (budget[:shm-name])",
+		ENGINE_CMD_FLAG_STRING},
+	{CMD_CONCURRENCY_LIMIT,
+		"CONCURRENCY_LIMIT",
+		"Adapt the sign and decrypt operations in flight per slot (min:max[:max-wait-us])",
+		ENGINE_CMD_FLAG_STRING},
+	{CMD_SIGNATURE_CACHE,
+		"SIGNATURE_CACHE",
+		"Cache this many deterministic signatures for each private key loaded afterwards",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_KEY_PLACEMENT,
+		"KEY_PLACEMENT",
+		"Search only the token selected by consistent hashing of the object ID (0 = disabled)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_KEEP_ALIVE,
+		"KEEP_ALIVE",
+		"Keep the module loaded and logged in after ENGINE_finish() for reuse by an ENGINE_init() within this many seconds (0 = disabled)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_TOKEN_PIN,
+		"TOKEN_PIN",
+		"Specifies the pin code of the tokens selected by a PKCS#11 URI with pin-value or pin-source",
+		ENGINE_CMD_FLAG_STRING},
+	{CMD_LOCK_PROFILING,
+		"LOCK_PROFILING",
+		"Record the contention of the internal locks (1 = enabled, 0 = disabled)",
+		ENGINE_CMD_FLAG_NUMERIC},
+	{CMD_GET_LOCK_STATS,
+		"GET_LOCK_STATS",
+		"Fetch the recorded lock contention (internal)",
+		ENGINE_CMD_FLAG_INTERNAL},
+	{CMD_RATE_LIMIT,
+		"RATE_LIMIT",
+		"Limit the operations per second on each slot as rate[:burst[:max_wait]] (0 = disabled)",
+		ENGINE_CMD_FLAG_STRING},
+	{CMD_KEY_RATE_LIMIT,
+		"KEY_RATE_LIMIT",
+		"Limit the operations per second with each private key loaded afterwards as rate[:burst] (0 = disabled)",
+		ENGINE_CMD_FLAG_STRING},
+	{CMD_SHARE_CERTS,
+		"SHARE_CERTS",
+		"Return the shared read-only certificate from LOAD_CERT_CTRL instead of a copy (0 = disabled)",
+		ENGINE_CMD_FLAG_NUMERIC},
 	{0, NULL, NULL, 0}
 };
 
@@ -202,6 +262,37 @@ static EVP_PKEY *load_privkey(ENGINE *engine, const char *s_key_id,
 	return pkey;
 }
 
+static int load_privkeys(ENGINE *engine, ENGINE_CTX *ctx, void *p)
+{
+	struct {
+		unsigned int count;
+		const char **uris;
+		EVP_PKEY **keys;
+		unsigned int loaded;
+	} *parms = p;
+#ifdef EVP_F_EVP_PKEY_SET1_ENGINE
+	unsigned int n;
+#endif /* EVP_F_EVP_PKEY_SET1_ENGINE */
+
+	if (!parms || (parms->count && (!parms->uris || !parms->keys))) {
+		ENGerr(ENG_F_CTX_ENGINE_CTRL, ERR_R_PASSED_NULL_PARAMETER);
+		return 0;
+	}
+	parms->loaded = ctx_load_privkeys(ctx, parms->count,
+		parms->uris, parms->keys);
+#ifdef EVP_F_EVP_PKEY_SET1_ENGINE
+	/* See load_privkey() */
+	for (n = 0; n < parms->count; n++) {
+		if (parms->keys[n] && !EVP_PKEY_set1_engine(parms->keys[n], engine)) {
+			EVP_PKEY_free(parms->keys[n]);
+			parms->keys[n] = NULL;
+			parms->loaded--;
+		}
+	}
+#endif /* EVP_F_EVP_PKEY_SET1_ENGINE */
+	return 1;
+}
+
 static int engine_ctrl(ENGINE *engine, int cmd, long i, void *p, void (*f) ())
 {
 	ENGINE_CTX *ctx;
@@ -210,6 +301,8 @@ static int engine_ctrl(ENGINE *engine, int cmd, long i, void *p, void (*f) ())
 	if (!ctx)
 		return 0;
 	bind_helper_methods(engine);
+	if (cmd == CMD_LOAD_PRIVKEYS)
+		return load_privkeys(engine, ctx, p);
 	return ctx_engine_ctrl(ctx, cmd, i, p, f);
 }
 
@@ -56,6 +56,21 @@
 #define CMD_SET_CALLBACK_DATA	(ENGINE_CMD_BASE + 8)
 #define CMD_FORCE_LOGIN	(ENGINE_CMD_BASE+9)
 #define CMD_RE_ENUMERATE	(ENGINE_CMD_BASE+10)
+#define CMD_SLOW_OP_THRESHOLD	(ENGINE_CMD_BASE+11)
+#define CMD_GET_SLOW_OPS	(ENGINE_CMD_BASE+12)
+#define CMD_SESSION_AFFINITY	(ENGINE_CMD_BASE+13)
+#define CMD_LOAD_PRIVKEYS	(ENGINE_CMD_BASE+14)
+#define CMD_SESSION_QUOTA	(ENGINE_CMD_BASE+15)
+#define CMD_CONCURRENCY_LIMIT	(ENGINE_CMD_BASE+16)
+#define CMD_SIGNATURE_CACHE	(ENGINE_CMD_BASE+17)
+#define CMD_KEY_PLACEMENT	(ENGINE_CMD_BASE+18)
+#define CMD_KEEP_ALIVE	(ENGINE_CMD_BASE+19)
+#define CMD_TOKEN_PIN	(ENGINE_CMD_BASE+20)
+#define CMD_LOCK_PROFILING	(ENGINE_CMD_BASE+21)
+#define CMD_GET_LOCK_STATS	(ENGINE_CMD_BASE+22)
+#define CMD_RATE_LIMIT	(ENGINE_CMD_BASE+23)
+#define CMD_KEY_RATE_LIMIT	(ENGINE_CMD_BASE+24)
+#define CMD_SHARE_CERTS	(ENGINE_CMD_BASE+25)
 
 typedef struct st_engine_ctx ENGINE_CTX; /* opaque */
 
@@ -77,6 +92,9 @@ EVP_PKEY *ctx_load_pubkey(ENGINE_CTX *ctx, const char *s_key_id,
 EVP_PKEY *ctx_load_privkey(ENGINE_CTX *ctx, const char *s_key_id,
 	UI_METHOD * ui_method, void *callback_data);
 
+unsigned int ctx_load_privkeys(ENGINE_CTX *ctx, unsigned int count,
+	const char **uris, EVP_PKEY **pkeys);
+
 void ctx_log(ENGINE_CTX *ctx, int level, const char *format, ...)
 #ifdef __GNUC__
 	__attribute__((format(printf, 3, 4)))
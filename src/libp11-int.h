@@ -32,12 +32,33 @@
 #include "pkcs11.h"
 
 #include "p11_pthread.h"
+#include "p11_lock.h"
+#include "p11_place.h"
+
+/* PKCS11_OP_xxx values are below this limit */
+#define PKCS11_OP_COUNT (PKCS11_OP_LOGIN + 1)
+
+/* Maximum number of slow operations kept in the log */
+#define PKCS11_SLOW_OP_LOG_SIZE 64
+
+/*
+ * Padding placed between members written by concurrent operations and
+ * members only read by them, so that they never share a cache line.
+ * Padding rather than alignment keeps plain OPENSSL_malloc() usable.
+ */
+#define PKCS11_CACHE_LINE 64
+#define PKCS11_CACHE_PAD(name) char name[PKCS11_CACHE_LINE]
 
 /* forward and type declarations */
 typedef struct pkcs11_ctx_private PKCS11_CTX_private;
 typedef struct pkcs11_slot_private PKCS11_SLOT_private;
 typedef struct pkcs11_object_private PKCS11_OBJECT_private;
 typedef struct pkcs11_object_ops PKCS11_OBJECT_ops;
+typedef struct pkcs11_attr_entry_st PKCS11_ATTR_ENTRY;
+typedef struct pkcs11_quota_st PKCS11_QUOTA;
+typedef struct pkcs11_sigcache_st PKCS11_SIGCACHE;
+typedef struct pkcs11_sig_entry PKCS11_SIG_ENTRY;
+typedef struct pkcs11_fp_entry PKCS11_FP_ENTRY;
 
 /* get private implementations of PKCS11 structures */
 
@@ -45,6 +66,7 @@ typedef struct pkcs11_object_ops PKCS11_OBJECT_ops;
  * PKCS11_CTX: context for a PKCS11 implementation
  */
 struct pkcs11_ctx_private {
+	/* read by every operation, written only when configured */
 	CK_FUNCTION_LIST_PTR method;
 	void *handle;
 	char *init_args;
@@ -52,39 +74,189 @@ struct pkcs11_ctx_private {
 	UI_METHOD *ui_method; /* UI_METHOD for CKU_CONTEXT_SPECIFIC PINs */
 	void *ui_user_data;
 	unsigned int forkid;
+
+	/* operation hooks installed with PKCS11_set_op_hooks() */
+	PKCS11_OP_PRE_HOOK op_pre;
+	PKCS11_OP_POST_HOOK op_post;
+	void *op_user_data;
+
+	/* thresholds set with PKCS11_set_slow_op_threshold() */
+	unsigned long slow_op_threshold[PKCS11_OP_COUNT];
+	int slow_op_tracking;
+
+	/* session scheduling set with PKCS11_set_session_affinity() */
+	unsigned int session_affinity;
+
+	/* shared segment attached with PKCS11_set_session_quota() */
+	PKCS11_QUOTA *quota;
+
+	/* bounds set with PKCS11_set_concurrency_limit(), 0 if disabled */
+	unsigned int limit_min, limit_max;
+	unsigned long limit_wait;
+
+	/* token bucket set with PKCS11_set_rate_limit(), 0 if disabled */
+	unsigned long rate, rate_burst, rate_wait;
+
+	/* set with PKCS11_set_lock_profiling() */
+	int lock_profiling;
+
+	PKCS11_CACHE_PAD(pad_locks);
 	pthread_mutex_t fork_lock;
+	PKCS11_LOCK_PROFILE fork_lock_prof;
+
+	/* slow operations recorded with PKCS11_set_slow_op_threshold() */
+	pthread_mutex_t slow_op_lock;
+	PKCS11_SLOW_OP *slow_ops;
+	unsigned int slow_op_head, slow_op_count;
+
+	/* live slots, for PKCS11_get_memory_usage() */
+	pthread_mutex_t mem_lock;
+	PKCS11_SLOT_private *slots;
 };
 #define PRIVCTX(_ctx)		((PKCS11_CTX_private *) ((_ctx)->_private))
 
+#define PKCS11_ATTR_CACHE_BUCKETS 64
+#define PKCS11_ATTR_SCRATCH_SIZE 256
+#define PKCS11_ATTR_HINT_CLASSES 3 /* certificates, public and private keys */
+#define PKCS11_ATTR_HINT_TYPES 4 /* label, value, modulus and EC point */
+
+/* Idle session kept in the session pool of a slot */
+typedef struct pkcs11_pooled_session {
+	CK_SESSION_HANDLE handle;
+	CK_OBJECT_HANDLE object; /* key used by the last operation */
+	unsigned int skips; /* times passed over for a more affine session */
+} PKCS11_POOLED_SESSION;
+
 typedef struct pkcs11_keys {
 	int num;
 	PKCS11_KEY *keys;
 } PKCS11_keys;
 
-struct pkcs11_slot_private {
-	int refcnt;
-	PKCS11_CTX_private *ctx;
+/* Ephemeral EC key pairs (session objects) generated ahead of use */
+typedef struct pkcs11_keypool {
 	pthread_mutex_t lock;
 	pthread_cond_t cond;
-	int8_t rw_mode, logged_in;
+	pthread_t thread;
+	int running, stop, refill;
+	pthread_mutex_t session_lock; /* taken before lock, serializes the session */
+	CK_SESSION_HANDLE session; /* dedicated to the key pairs, outside the pool */
+	unsigned int generation; /* incremented when the session objects are lost */
+	unsigned int forkid;
+	unsigned char *params; /* DER-encoded CKA_EC_PARAMS */
+	size_t params_len;
+	unsigned int low, high;
+	CK_OBJECT_HANDLE *avail; /* private and public handle of each pair */
+	unsigned int navail;
+	CK_OBJECT_HANDLE *dead; /* pairs waiting for C_DestroyObject() */
+	unsigned int ndead, dead_size;
+} PKCS11_KEYPOOL;
+
+/* Adaptive limit of the sign and decrypt operations in flight */
+typedef struct pkcs11_limiter {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int forkid;
+	double limit; /* grows by 1/limit, so that it takes limit samples to add one */
+	unsigned int in_flight, waiting;
+	unsigned long long baseline; /* lowest recent latency, in microseconds */
+	unsigned long long window_min, smoothed, last_decrease;
+	unsigned int samples;
+	unsigned long rejected;
+} PKCS11_LIMITER;
+
+/* Token bucket shaping the operations of a slot or a key */
+typedef struct pkcs11_bucket {
+	pthread_mutex_t lock;
+	unsigned int forkid;
+	unsigned long rate, burst; /* of a key bucket, the slots use the context */
+	double tokens; /* negative while operations wait for a token */
+	unsigned long long last; /* time of the last refill, 0 if full */
+	unsigned int waiting;
+	unsigned long admitted, delayed, rejected;
+} PKCS11_BUCKET;
+
+/* Enumerated objects indexed by the hash of their public key value */
+#define PKCS11_FP_LEN 32 /* SHA-256 */
+#define PKCS11_FP_PRV 1
+#define PKCS11_FP_PUB 2
+#define PKCS11_FP_CERT 4
+typedef struct pkcs11_fp_index {
+	pthread_mutex_t lock;
+	PKCS11_FP_ENTRY **buckets;
+	unsigned int nbuckets, nentries;
+	int nprv, npub, ncerts; /* objects of the enumerations already indexed */
+	int complete; /* PKCS11_FP_* of the enumerations holding all the objects */
+} PKCS11_FP_INDEX;
+
+struct pkcs11_slot_private {
+	/* read by every operation, written on enumeration and login */
+	PKCS11_CTX_private *ctx;
 	CK_SLOT_ID id;
-	CK_SESSION_HANDLE *session_pool;
-	unsigned int session_head, session_tail, session_poolsize;
-	unsigned int num_sessions, max_sessions;
+	int8_t rw_mode, logged_in;
 	unsigned int forkid;
 
 	/* options used in last PKCS11_login */
 	char *prev_pin;
+	pthread_mutex_t login_lock; /* serializes the logins and prev_pin */
 
 	/* members concerning the token */
 	CK_BBOOL secure_login;
 	PKCS11_keys prv, pub;
 	int ncerts;
 	PKCS11_CERT *certs;
+
+	/* session pool, updated by every operation */
+	PKCS11_CACHE_PAD(pad_pool);
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	PKCS11_LOCK_PROFILE lock_prof;
+	int refcnt;
+	PKCS11_POOLED_SESSION *session_pool;
+	unsigned int session_head, session_tail, session_poolsize;
+	unsigned int num_sessions, max_sessions, num_waiters;
+
+	/* memory held by the objects of the slot, updated under mem_lock */
+	PKCS11_CACHE_PAD(pad_mem);
+	pthread_mutex_t mem_lock;
+	PKCS11_MEM_USAGE mem;
+
+	/* immutable object attributes memoized by pkcs11_getattr_var() */
+	PKCS11_CACHE_PAD(pad_attr);
+	pthread_mutex_t attr_lock;
+	PKCS11_ATTR_ENTRY *attr_cache[PKCS11_ATTR_CACHE_BUCKETS];
+	unsigned int attr_cached;
+	size_t attr_cached_bytes;
+	size_t attr_size_hint[PKCS11_ATTR_HINT_CLASSES * PKCS11_ATTR_HINT_TYPES];
+
+	/* ephemeral EC key pairs configured with PKCS11_keypool_start() */
+	PKCS11_CACHE_PAD(pad_keypool);
+	PKCS11_KEYPOOL keypool;
+
+	/* operations in flight, limited with PKCS11_set_concurrency_limit() */
+	PKCS11_CACHE_PAD(pad_limiter);
+	PKCS11_LIMITER limiter;
+
+	/* operations per second, limited with PKCS11_set_rate_limit() */
+	PKCS11_CACHE_PAD(pad_bucket);
+	PKCS11_BUCKET bucket;
+
+	/* public key fingerprints of the enumerated objects */
+	PKCS11_CACHE_PAD(pad_fpindex);
+	PKCS11_FP_INDEX fpindex;
+
+	/* list of live slots, updated under ctx->mem_lock */
+	PKCS11_SLOT_private *mem_next, *mem_prev;
 };
 #define PRIVSLOT(_slot)		((PKCS11_SLOT_private *) ((_slot)->_private))
 
+/* Acquire and release the session pool lock of a slot */
+#define SLOT_LOCK(_slot) \
+	PKCS11_LOCK(&(_slot)->lock, &(_slot)->lock_prof, (_slot)->ctx->lock_profiling)
+#define SLOT_UNLOCK(_slot) \
+	PKCS11_UNLOCK(&(_slot)->lock, &(_slot)->lock_prof)
+
 struct pkcs11_object_private {
+	/* read by every operation with the object */
 	PKCS11_SLOT_private *slot;
 	CK_OBJECT_CLASS object_class;
 	CK_OBJECT_HANDLE object;
@@ -95,7 +267,15 @@ struct pkcs11_object_private {
 	PKCS11_OBJECT_ops *ops;
 	EVP_PKEY *evp_key;
 	X509 *x509;
+	const unsigned char *der; /* owned by the certificate store */
+	size_t der_len;
 	unsigned int forkid;
+	PKCS11_SIGCACHE *sigcache; /* set once by PKCS11_set_signature_cache() */
+	PKCS11_BUCKET *bucket; /* set once by PKCS11_set_key_rate_limit() */
+	size_t key_bytes; /* modulus or group order size, set once under lock */
+
+	/* updated when references are taken and released */
+	PKCS11_CACHE_PAD(pad_refcnt);
 	int refcnt;
 	pthread_mutex_t lock;
 };
@@ -151,18 +331,20 @@ extern int pkcs11_reload_object(PKCS11_OBJECT_private *);
 extern int pkcs11_reload_slot(PKCS11_SLOT_private *);
 
 /* Managing object attributes */
-extern int pkcs11_getattr_var(PKCS11_CTX_private *, CK_SESSION_HANDLE, CK_OBJECT_HANDLE,
+extern int pkcs11_getattr_var(PKCS11_SLOT_private *, CK_SESSION_HANDLE, CK_OBJECT_HANDLE,
 	CK_ATTRIBUTE_TYPE, CK_BYTE *, size_t *);
-extern int pkcs11_getattr_val(PKCS11_CTX_private *, CK_SESSION_HANDLE, CK_OBJECT_HANDLE,
+extern int pkcs11_getattr_val(PKCS11_SLOT_private *, CK_SESSION_HANDLE, CK_OBJECT_HANDLE,
 	CK_ATTRIBUTE_TYPE, void *, size_t);
-extern int pkcs11_getattr_alloc(PKCS11_CTX_private *, CK_SESSION_HANDLE, CK_OBJECT_HANDLE,
+extern int pkcs11_getattr_alloc(PKCS11_SLOT_private *, CK_SESSION_HANDLE, CK_OBJECT_HANDLE,
 	CK_ATTRIBUTE_TYPE, CK_BYTE **, size_t *);
 /*
  * Caution: the BIGNUM ** shall reference either a NULL pointer or a
  * pointer to a valid BIGNUM.
  */
-extern int pkcs11_getattr_bn(PKCS11_CTX_private *, CK_SESSION_HANDLE, CK_OBJECT_HANDLE,
+extern int pkcs11_getattr_bn(PKCS11_SLOT_private *, CK_SESSION_HANDLE, CK_OBJECT_HANDLE,
 	CK_ATTRIBUTE_TYPE, BIGNUM **);
+extern void pkcs11_attr_cache_invalidate(PKCS11_SLOT_private *, CK_OBJECT_HANDLE);
+extern void pkcs11_attr_cache_flush(PKCS11_SLOT_private *);
 
 typedef struct pkcs11_template_st {
 	unsigned long allocated;
@@ -184,6 +366,82 @@ extern void pkcs11_zap_attrs(PKCS11_TEMPLATE *);
 /* Atomic reference counting */
 extern int pkcs11_atomic_add(int *, int, pthread_mutex_t *);
 
+/* Certificates shared by all the slots and contexts */
+extern X509 *pkcs11_x509_get(unsigned char *der, size_t len,
+	const unsigned char **cached);
+extern void pkcs11_x509_put(X509 *x509, const unsigned char *der,
+	size_t len);
+
+/* Pool of pre-generated ephemeral EC key pairs */
+extern void pkcs11_keypool_init(PKCS11_SLOT_private *slot);
+extern void pkcs11_keypool_free(PKCS11_SLOT_private *slot);
+extern void pkcs11_keypool_reset(PKCS11_SLOT_private *slot);
+extern void pkcs11_keypool_flush(PKCS11_SLOT_private *slot);
+extern int pkcs11_keypool_start(PKCS11_SLOT_private *slot, int curve_nid,
+	unsigned int low, unsigned int high);
+extern int pkcs11_keypool_stop(PKCS11_SLOT_private *slot);
+extern PKCS11_KEY *pkcs11_keypool_get(PKCS11_SLOT_private *slot);
+extern void pkcs11_keypool_put(PKCS11_KEY *key);
+
+/* Memory accounting */
+extern void pkcs11_mem_slot_link(PKCS11_SLOT_private *slot);
+extern void pkcs11_mem_slot_unlink(PKCS11_SLOT_private *slot);
+extern void pkcs11_mem_object(PKCS11_OBJECT_private *obj, int count);
+extern void pkcs11_mem_pkey(PKCS11_OBJECT_private *obj, EVP_PKEY *pkey, int count);
+extern size_t pkcs11_attr_cache_mem(PKCS11_SLOT_private *slot);
+extern size_t pkcs11_keypool_mem(PKCS11_SLOT_private *slot);
+extern int pkcs11_get_memory_usage(PKCS11_CTX *ctx, PKCS11_MEM_USAGE *usage);
+extern int pkcs11_get_slot_memory_usage(PKCS11_SLOT *slot,
+	PKCS11_MEM_USAGE *usage);
+
+/* Configure and report the lock profiling */
+extern int pkcs11_set_lock_profiling(PKCS11_CTX_private *ctx, int enable);
+extern int pkcs11_get_lock_stats(PKCS11_CTX_private *ctx,
+	PKCS11_LOCK_STATS *stats, unsigned int *count);
+
+/* Monotonic clock in microseconds */
+extern unsigned long long pkcs11_time_usec(void);
+extern int pkcs11_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+	unsigned long long usec);
+extern void pkcs11_sleep_usec(unsigned long long usec);
+
+/* State of a single key operation reported to the operation hooks */
+typedef struct pkcs11_op_st {
+	PKCS11_OP_INFO info;
+	PKCS11_SLOT_private *slot;
+	CK_OBJECT_HANDLE object; /* key used for session affinity */
+	unsigned long long start, session_wait;
+	char *op_label;
+	int hooked;
+	int limited; /* counted by the concurrency limiter */
+	unsigned long long limit_start; /* session acquired, 0 if none */
+	int reason; /* P11_R_* code reported when the operation could not begin */
+} PKCS11_OP;
+
+/* Start an operation: run the pre hook and acquire a session (if sessionp) */
+extern int pkcs11_op_begin(PKCS11_OP *op, int operation,
+	PKCS11_SLOT_private *slot, PKCS11_OBJECT_private *key,
+	CK_MECHANISM_TYPE mechanism, size_t in_len,
+	int rw, CK_SESSION_HANDLE *sessionp);
+
+/* Start an object search described by the template (no session is acquired) */
+extern int pkcs11_op_begin_find(PKCS11_OP *op, PKCS11_SLOT_private *slot,
+	PKCS11_TEMPLATE *tmpl);
+
+/* Finish an operation: release the session (if any) and run the post hook */
+extern void pkcs11_op_end(PKCS11_OP *op, CK_SESSION_HANDLE session,
+	CK_RV rv, size_t out_len);
+
+/* Install the operation hooks */
+extern int pkcs11_set_op_hooks(PKCS11_CTX_private *ctx,
+	PKCS11_OP_PRE_HOOK pre, PKCS11_OP_POST_HOOK post, void *user_data);
+
+/* Configure and retrieve the slow operation log */
+extern int pkcs11_set_slow_op_threshold(PKCS11_CTX_private *ctx,
+	int operation, unsigned long threshold);
+extern int pkcs11_get_slow_ops(PKCS11_CTX_private *ctx,
+	PKCS11_SLOW_OP *ops, unsigned int *count);
+
 /* Allocate the context */
 extern PKCS11_CTX *pkcs11_CTX_new(void);
 
@@ -208,9 +466,91 @@ extern int pkcs11_open_session(PKCS11_SLOT_private *, int rw);
 /* Acquire a session from the slot specific session pool */
 extern int pkcs11_get_session(PKCS11_SLOT_private *, int rw, CK_SESSION_HANDLE *sessionp);
 
+/* Get a session, preferably one that last used the object */
+extern int pkcs11_get_session_for(PKCS11_SLOT_private *, int rw,
+	CK_OBJECT_HANDLE object, CK_SESSION_HANDLE *sessionp);
+
 /* Return a session the the slot specific session pool */
 extern void pkcs11_put_session(PKCS11_SLOT_private *, CK_SESSION_HANDLE session);
 
+/* Return a session used with the object to the session pool */
+extern void pkcs11_put_session_for(PKCS11_SLOT_private *,
+	CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object);
+
+/* Prefer the sessions that last used the same key */
+/* Session quotas shared between processes */
+extern int pkcs11_set_session_quota(PKCS11_CTX_private *ctx,
+	const char *name, unsigned int budget);
+extern int pkcs11_get_session_quota(PKCS11_SLOT_private *slot,
+	PKCS11_SESSION_QUOTA *status);
+extern void pkcs11_quota_detach(PKCS11_CTX_private *ctx);
+extern int pkcs11_quota_acquire(PKCS11_SLOT_private *slot);
+extern void pkcs11_quota_release(PKCS11_SLOT_private *slot, unsigned int count);
+extern void pkcs11_quota_reset(PKCS11_SLOT_private *slot);
+extern int pkcs11_quota_give_back(PKCS11_SLOT_private *slot);
+extern void pkcs11_quota_wait(PKCS11_SLOT_private *slot);
+
+/* Signatures memoized for the keys with a signature cache */
+extern int pkcs11_sigcache_lookup(PKCS11_OBJECT_private *key,
+	CK_MECHANISM_TYPE mechanism, const unsigned char *in, size_t in_len,
+	unsigned char *out, CK_ULONG *out_len,
+	PKCS11_SIG_ENTRY **pending, CK_RV *rv);
+extern void pkcs11_sigcache_complete(PKCS11_OBJECT_private *key,
+	PKCS11_SIG_ENTRY *entry, CK_RV rv,
+	const unsigned char *sig, size_t sig_len);
+extern void pkcs11_sigcache_free(PKCS11_OBJECT_private *key);
+extern int pkcs11_set_signature_cache(PKCS11_OBJECT_private *key,
+	unsigned int entries);
+extern int pkcs11_get_signature_cache(PKCS11_OBJECT_private *key,
+	PKCS11_SIGNATURE_CACHE *stats);
+
+/* Adaptive concurrency limit of the sign and decrypt operations */
+extern void pkcs11_limiter_init(PKCS11_SLOT_private *slot);
+extern void pkcs11_limiter_free(PKCS11_SLOT_private *slot);
+extern int pkcs11_limiter_acquire(PKCS11_SLOT_private *slot);
+extern void pkcs11_limiter_release(PKCS11_SLOT_private *slot,
+	unsigned long long start);
+extern int pkcs11_set_concurrency_limit(PKCS11_CTX_private *ctx,
+	unsigned int min, unsigned int max, unsigned long max_wait);
+extern int pkcs11_get_concurrency(PKCS11_SLOT_private *slot,
+	PKCS11_CONCURRENCY *status);
+
+/* Token bucket rate limit of the sign, decrypt and derive operations */
+extern void pkcs11_bucket_init(PKCS11_BUCKET *bucket);
+extern void pkcs11_bucket_destroy(PKCS11_BUCKET *bucket);
+extern PKCS11_BUCKET *pkcs11_bucket_new(void);
+extern void pkcs11_bucket_free(PKCS11_BUCKET *bucket);
+extern int pkcs11_rate_acquire(PKCS11_SLOT_private *slot,
+	PKCS11_OBJECT_private *key);
+extern int pkcs11_set_rate_limit(PKCS11_CTX_private *ctx, unsigned long rate,
+	unsigned long burst, unsigned long max_wait);
+extern int pkcs11_get_rate_limit(PKCS11_SLOT_private *slot,
+	PKCS11_RATE_LIMIT *status);
+extern int pkcs11_set_key_rate_limit(PKCS11_OBJECT_private *key,
+	unsigned long rate, unsigned long burst);
+extern int pkcs11_get_key_rate_limit(PKCS11_OBJECT_private *key,
+	PKCS11_RATE_LIMIT *status);
+
+/* Public key fingerprint index of the enumerated objects */
+extern void pkcs11_fpindex_init(PKCS11_SLOT_private *slot);
+extern void pkcs11_fpindex_free(PKCS11_SLOT_private *slot);
+extern void pkcs11_fpindex_reset(PKCS11_SLOT_private *slot,
+	CK_OBJECT_CLASS type);
+extern void pkcs11_fpindex_complete(PKCS11_SLOT_private *slot,
+	CK_OBJECT_CLASS type);
+extern int pkcs11_fingerprint_rsa(const BIGNUM *n, unsigned char *fp);
+extern int pkcs11_fingerprint_pkey(EVP_PKEY *pkey, unsigned char *fp);
+extern int pkcs11_fingerprint_object(PKCS11_OBJECT_private *obj,
+	CK_SESSION_HANDLE session, unsigned char *fp);
+extern int pkcs11_fpindex_find(PKCS11_SLOT_private *slot,
+	CK_SESSION_HANDLE session, const unsigned char *fp, int enumerate,
+	PKCS11_KEY **prv, PKCS11_KEY **pub, PKCS11_CERT **cert);
+extern int pkcs11_find_by_public_key(PKCS11_SLOT_private *slot, EVP_PKEY *pkey,
+	PKCS11_KEY **prv, PKCS11_KEY **pub, PKCS11_CERT **cert);
+
+extern int pkcs11_set_session_affinity(PKCS11_CTX_private *ctx,
+	unsigned int max_skips);
+
 /* Get a list of all slots */
 extern int pkcs11_enumerate_slots(PKCS11_CTX_private * ctx,
 			PKCS11_SLOT **slotsp, unsigned int *nslotsp);
@@ -237,12 +577,35 @@ extern int pkcs11_is_logged_in(PKCS11_SLOT_private *, int so, int *res);
 /* Authenticate to the card */
 extern int pkcs11_login(PKCS11_SLOT_private *, int so, const char *pin);
 
+/* Log in again after the token dropped the login state */
+extern int pkcs11_relogin(PKCS11_SLOT_private *, CK_SESSION_HANDLE session);
+
 /* De-authenticate from the card */
 extern int pkcs11_logout(PKCS11_SLOT_private *);
 
 /* Authenticate a private the key operation if needed */
 int pkcs11_authenticate(PKCS11_OBJECT_private *key, CK_SESSION_HANDLE session);
 
+/* Sign or decrypt (operation is PKCS11_OP_SIGN or PKCS11_OP_DECRYPT) */
+extern CK_RV pkcs11_private_op(PKCS11_OBJECT_private *key,
+	CK_SESSION_HANDLE session, int operation, CK_MECHANISM *mechanism,
+	const unsigned char *in, size_t in_len,
+	unsigned char *out, CK_ULONG *out_len);
+
+/* Sign or decrypt with an explicit mechanism */
+extern int pkcs11_sign_mech(PKCS11_OBJECT_private *key,
+	const PKCS11_MECHANISM *mech, const unsigned char *in, size_t in_len,
+	unsigned char *sig, size_t *sig_len);
+extern int pkcs11_decrypt_mech(PKCS11_OBJECT_private *key,
+	const PKCS11_MECHANISM *mech, const unsigned char *in, size_t in_len,
+	unsigned char *out, size_t *out_len);
+
+/* Hash and sign many messages */
+extern int pkcs11_sign_bulk(PKCS11_OBJECT_private *key,
+	const PKCS11_MECHANISM *mech, const EVP_MD *md, unsigned int count,
+	const unsigned char * const *msgs, const size_t *msg_lens,
+	unsigned char **sigs, size_t *sig_lens, unsigned int threads);
+
 /* Get a list of keys matching with template associated with this token */
 extern int pkcs11_enumerate_keys(PKCS11_SLOT_private *, unsigned int type,
 	const PKCS11_KEY *key_template, PKCS11_KEY **keys, unsigned int *nkeys);
@@ -277,6 +640,10 @@ extern PKCS11_CERT *pkcs11_find_certificate(PKCS11_OBJECT_private *key);
 /* Find the corresponding key (if any) */
 extern PKCS11_KEY *pkcs11_find_key(PKCS11_OBJECT_private *cert);
 
+/* Get the DER encoding of a certificate without copying it */
+extern int pkcs11_get_cert_der(PKCS11_OBJECT_private *cert,
+	const unsigned char **der, size_t *len);
+
 /* Get a list of all certificates matching with template associated with this token */
 extern int pkcs11_enumerate_certs(PKCS11_SLOT_private *,
 	const PKCS11_CERT *cert_template, PKCS11_CERT **certs, unsigned int *ncerts);
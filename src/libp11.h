@@ -63,7 +63,7 @@ typedef struct PKCS11_cert_st {
 	char *label;
 	unsigned char *id;
 	size_t id_len;
-	X509 *x509;
+	X509 *x509;			/**< shared with identical certificates, read-only */
 	void *_private;
 } PKCS11_CERT;
 
@@ -227,6 +227,28 @@ PKCS11_SLOT *PKCS11_find_next_token(PKCS11_CTX * ctx,
 			PKCS11_SLOT *slots, unsigned int nslots,
 		   	PKCS11_SLOT *slot);
 
+/**
+ * Select the slot holding a key
+ *
+ * Keys spread over several tokens are placed by rendezvous hashing of the
+ * key id with the manufacturer, model, serial number and label of each
+ * initialized token, so that the same key id is always mapped to the same
+ * token.  Adding or removing a token only moves the keys placed on the
+ * token that is added or removed.  The same list of tokens has to be used
+ * to store or generate keys and to find them.
+ *
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param slots list of slots allocated by PKCS11_enumerate_slots()
+ * @param nslots size of the list
+ * @param id key id (CKA_ID)
+ * @param id_len length of the key id
+ * @retval !=NULL pointer on a slot structure
+ * @retval NULL no initialized token found
+ */
+extern PKCS11_SLOT *PKCS11_place_key(PKCS11_CTX * ctx,
+			PKCS11_SLOT *slots, unsigned int nslots,
+			const unsigned char *id, size_t id_len);
+
 /**
  * Check if user is already authenticated to a card
  *
@@ -241,6 +263,10 @@ extern int PKCS11_is_logged_in(PKCS11_SLOT * slot, int so, int * res);
 /**
  * Authenticate to the card
  *
+ * If the token later drops the login state, e.g. on an idle timeout, the
+ * private key operations failing with CKR_USER_NOT_LOGGED_IN log in again
+ * with the same PIN and are retried once.
+ *
  * @param slot slot returned by PKCS11_find_token()
  * @param so login as CKU_SO if != 0, otherwise login as CKU_USER
  * @param pin PIN value
@@ -298,12 +324,36 @@ extern EVP_PKEY *PKCS11_get_private_key(PKCS11_KEY *key);
  */
 extern EVP_PKEY *PKCS11_get_public_key(PKCS11_KEY *key);
 
-/* Find the corresponding certificate (if any) */
+/* Find the corresponding certificate (if any)
+ * by CKA_ID, or else by public key */
 extern PKCS11_CERT *PKCS11_find_certificate(PKCS11_KEY *);
 
-/* Find the corresponding key (if any) */
+/* Find the corresponding key (if any)
+ * by CKA_ID, or else by public key */
 extern PKCS11_KEY *PKCS11_find_key(PKCS11_CERT *);
 
+/**
+ * Find the objects of a token with a given public key
+ *
+ * The private keys, public keys and certificates of the token are indexed
+ * by the hash of their RSA modulus or EC point, regardless of their
+ * CKA_ID.  All the objects of the requested classes are enumerated on the
+ * first lookup, and the index is kept until the enumerations are
+ * discarded.  Objects without a readable public key are not indexed, for
+ * example EC private keys without CKA_EC_POINT.  Such private keys are
+ * found through the public key object with the same CKA_ID, if any.
+ *
+ * @param token token returned by PKCS11_find_token()
+ * @param pkey public key, for example of a certificate
+ * @param prv if not NULL, receives the private key or NULL
+ * @param pub if not NULL, receives the public key or NULL
+ * @param cert if not NULL, receives the certificate or NULL
+ * @retval 0 at least one object was found
+ * @retval -1 no object found or error
+ */
+extern int PKCS11_find_by_public_key(PKCS11_TOKEN *token, EVP_PKEY *pkey,
+	PKCS11_KEY **prv, PKCS11_KEY **pub, PKCS11_CERT **cert);
+
 /* Get a list of all certificates associated with this token */
 extern int PKCS11_enumerate_certs(PKCS11_TOKEN *, PKCS11_CERT **, unsigned int *);
 
@@ -311,6 +361,22 @@ extern int PKCS11_enumerate_certs(PKCS11_TOKEN *, PKCS11_CERT **, unsigned int *
 extern int PKCS11_enumerate_certs_ext(PKCS11_TOKEN *,
 	const PKCS11_CERT *, PKCS11_CERT **, unsigned int *);
 
+/**
+ * Get the DER encoding of a certificate as read from the token
+ *
+ * The returned buffer is shared with the other certificates holding the
+ * same encoding and must not be modified.  It remains valid as long as
+ * the certificate, i.e. until the slots are released.
+ *
+ * @param cert certificate returned by PKCS11_enumerate_certs()
+ * @param der receives a pointer to the DER encoding
+ * @param len receives the length of the DER encoding
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_get_cert_der(PKCS11_CERT *cert,
+	const unsigned char **der, size_t *len);
+
 /* Remove the certificate from this token */
 extern int PKCS11_remove_certificate(PKCS11_CERT *);
 
@@ -398,6 +464,317 @@ extern int PKCS11_store_certificate(PKCS11_TOKEN * token, X509 * x509,
 extern int PKCS11_seed_random(PKCS11_SLOT *slot, const unsigned char *s, unsigned int s_len);
 extern int PKCS11_generate_random(PKCS11_SLOT *slot, unsigned char *r, unsigned int r_len);
 
+/* Operations reported to the operation hooks */
+#define PKCS11_OP_SIGN		1
+#define PKCS11_OP_DECRYPT	2
+#define PKCS11_OP_DERIVE	3
+#define PKCS11_OP_RANDOM	4
+#define PKCS11_OP_FIND		5
+#define PKCS11_OP_LOGIN		6
+
+/** Description of a single token operation passed to the operation hooks */
+typedef struct PKCS11_op_info_st {
+	int operation;			/**< PKCS11_OP_xxx */
+	unsigned long slot_id;		/**< PKCS#11 slot identifier */
+	const unsigned char *key_id;	/**< CKA_ID of the key or searched object (may be NULL) */
+	size_t key_id_len;
+	const char *key_label;		/**< CKA_LABEL of the key or searched object (may be NULL) */
+	unsigned long mechanism;	/**< CKM_xxx, or CK_UNAVAILABLE_INFORMATION */
+	size_t in_len;			/**< input length in bytes */
+	size_t out_len;			/**< output length in bytes (post hook only) */
+	unsigned long rv;		/**< PKCS#11 return value (post hook only) */
+	unsigned long elapsed;		/**< duration in microseconds (post hook only) */
+	void *op_data;			/**< per-operation data owned by the hooks */
+	unsigned long session;		/**< PKCS#11 session handle used (post hook only) */
+} PKCS11_OP_INFO;
+
+/** Hook called before an operation, return 0 to proceed or -1 to reject it */
+typedef int (*PKCS11_OP_PRE_HOOK)(PKCS11_OP_INFO *info, void *user_data);
+
+/** Hook called after an operation, including operations rejected by the pre hook */
+typedef void (*PKCS11_OP_POST_HOOK)(PKCS11_OP_INFO *info, void *user_data);
+
+/**
+ * Install hooks called around sign, decrypt, derive, random, find and login operations
+ *
+ * The hooks are called from the thread performing the operation, so they
+ * have to be thread-safe.  They should be installed before the context is
+ * used by other threads.  Rejected operations are reported to the post hook
+ * with CKR_FUNCTION_REJECTED and fail with P11_R_OPERATION_REJECTED.
+ *
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param pre hook called before the operation (or NULL)
+ * @param post hook called after the operation (or NULL)
+ * @param user_data opaque pointer passed to both hooks
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_set_op_hooks(PKCS11_CTX *ctx, PKCS11_OP_PRE_HOOK pre,
+	PKCS11_OP_POST_HOOK post, void *user_data);
+
+/** Operation that took longer than the configured threshold */
+typedef struct PKCS11_slow_op_st {
+	int operation;			/**< PKCS11_OP_xxx */
+	unsigned long slot_id;		/**< PKCS#11 slot identifier */
+	unsigned char key_id[255];	/**< CKA_ID of the key or searched object */
+	size_t key_id_len;
+	char key_label[64];		/**< CKA_LABEL (truncated, NUL-terminated) */
+	unsigned long mechanism;	/**< CKM_xxx, or CK_UNAVAILABLE_INFORMATION */
+	unsigned long rv;		/**< PKCS#11 return value */
+	unsigned long elapsed;		/**< total duration in microseconds */
+	unsigned long session_wait;	/**< time spent acquiring a session in microseconds */
+	unsigned int sessions_in_use;	/**< sessions of the slot in use, including this one */
+	unsigned int sessions_waiting;	/**< threads waiting for a session of the slot */
+	unsigned int sessions_max;	/**< maximum number of sessions of the slot */
+} PKCS11_SLOW_OP;
+
+/**
+ * Set the latency threshold above which operations are recorded
+ *
+ * Operations taking at least the threshold are kept in a bounded in-memory
+ * log (the oldest events are overwritten) to be fetched with
+ * PKCS11_get_slow_ops().
+ *
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param operation PKCS11_OP_xxx, or 0 for all operations
+ * @param threshold threshold in microseconds, or 0 to disable
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_set_slow_op_threshold(PKCS11_CTX *ctx, int operation,
+	unsigned long threshold);
+
+/**
+ * Fetch and remove the recorded slow operations, oldest first
+ *
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param ops array receiving the events, or NULL to count them
+ * @param count on input the size of the array, on output the number of events
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_get_slow_ops(PKCS11_CTX *ctx, PKCS11_SLOW_OP *ops,
+	unsigned int *count);
+
+/** Memory held by libp11, in bytes unless stated otherwise */
+typedef struct PKCS11_mem_usage_st {
+	size_t ctx;			/**< context, including the slow operation log */
+	size_t slots;			/**< slot and token structures */
+	size_t sessions;		/**< session pools */
+	size_t keys;			/**< arrays of enumerated keys */
+	size_t certs;			/**< arrays of enumerated certificates */
+	size_t objects;			/**< key and certificate objects, including labels */
+	unsigned long nobjects;		/**< number of key and certificate objects */
+	size_t x509;			/**< DER size of the parsed certificates read from tokens */
+	unsigned long nx509;		/**< number of parsed certificates */
+	size_t pkeys;			/**< DER size of the public keys of EVP_PKEY objects */
+	unsigned long npkeys;		/**< number of EVP_PKEY objects */
+	size_t attrs;			/**< attribute cache */
+	size_t keypool;			/**< ephemeral key pool bookkeeping */
+	size_t total;			/**< sum of the byte counts above */
+} PKCS11_MEM_USAGE;
+
+/**
+ * Report the memory held by a context and all its slots
+ *
+ * The sizes of the parsed certificates and keys are estimated with their
+ * DER encoding.  Certificates shared between slots are counted for each
+ * object holding them.  Slot lists returned by PKCS11_enumerate_slots()
+ * are counted with PKCS11_get_slot_memory_usage().
+ *
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param usage structure receiving the report
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_get_memory_usage(PKCS11_CTX *ctx, PKCS11_MEM_USAGE *usage);
+
+/**
+ * Report the memory held by a slot
+ *
+ * @param slot slot returned by PKCS11_enumerate_slots()
+ * @param usage structure receiving the report
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_get_slot_memory_usage(PKCS11_SLOT *slot,
+	PKCS11_MEM_USAGE *usage);
+
+/**
+ * Prefer the pooled sessions that last used the same key
+ *
+ * Some tokens cache the key material per session, so running consecutive
+ * operations with a key on the same session avoids reloading it.  An idle
+ * session is passed over in favor of a more affine one at most max_skips
+ * times, which bounds the imbalance between the sessions.
+ *
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param max_skips maximum number of times a session is passed over, or 0 to disable
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_set_session_affinity(PKCS11_CTX *ctx, unsigned int max_skips);
+
+/** Sessions of a slot shared with PKCS11_set_session_quota() */
+typedef struct PKCS11_session_quota_st {
+	unsigned int budget;		/**< sessions allowed for all the processes */
+	unsigned int in_use;		/**< sessions opened by all the processes */
+	unsigned int processes;		/**< processes holding sessions */
+	unsigned int waiting;		/**< threads waiting for a session */
+	unsigned int own;		/**< sessions opened by this process */
+} PKCS11_SESSION_QUOTA;
+
+/**
+ * Share a session budget with other processes
+ *
+ * The processes attached to the same shared memory segment open at most
+ * budget sessions per slot in total.  A process may borrow the sessions
+ * that the others do not use, and returns the sessions above its fair
+ * share once they are idle or when another process is waiting.  The
+ * segment is created by the first process and removed with shm_unlink().
+ * Not supported on Windows.
+ *
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param name POSIX shared memory name (e.g. "/libp11-sessions"), or NULL to detach
+ * @param budget maximum number of sessions per slot, or 0 to detach
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_set_session_quota(PKCS11_CTX *ctx, const char *name,
+	unsigned int budget);
+
+/**
+ * Report the shared session budget of a slot
+ *
+ * @param slot slot returned by PKCS11_enumerate_slots()
+ * @param status structure receiving the report
+ * @retval 0 success
+ * @retval -1 no session quota is configured
+ */
+extern int PKCS11_get_session_quota(PKCS11_SLOT *slot,
+	PKCS11_SESSION_QUOTA *status);
+
+/** State of the concurrency limit of a slot */
+typedef struct PKCS11_concurrency_st {
+	unsigned int limit;		/**< operations allowed in flight */
+	unsigned int in_flight;		/**< operations sent to the token */
+	unsigned int waiting;		/**< operations waiting for the limit */
+	unsigned long latency;		/**< smoothed latency in microseconds */
+	unsigned long baseline;		/**< latency of the unloaded token in microseconds */
+	unsigned long rejected;		/**< operations that exceeded the maximum wait */
+} PKCS11_CONCURRENCY;
+
+/**
+ * Adapt the number of sign and decrypt operations in flight on each slot
+ *
+ * The limit starts at min and grows while the latency stays close to the
+ * lowest latency observed, and shrinks when the latency shows that the
+ * token queues the operations.  The operations above the limit wait in
+ * the process, and fail after max_wait microseconds if it is not 0.
+ *
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param min lower bound of the limit (at least 1)
+ * @param max upper bound of the limit, or 0 to disable the limit
+ * @param max_wait maximum wait in microseconds, or 0 to wait indefinitely
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_set_concurrency_limit(PKCS11_CTX *ctx, unsigned int min,
+	unsigned int max, unsigned long max_wait);
+
+/**
+ * Report the concurrency limit of a slot
+ *
+ * @param slot slot returned by PKCS11_enumerate_slots()
+ * @param status structure receiving the report
+ * @retval 0 success
+ * @retval -1 no concurrency limit is configured
+ */
+extern int PKCS11_get_concurrency(PKCS11_SLOT *slot,
+	PKCS11_CONCURRENCY *status);
+
+/** State of the rate limit of a slot or a key */
+typedef struct PKCS11_rate_limit_st {
+	unsigned long rate;		/**< operations per second */
+	unsigned long burst;		/**< operations allowed at once after an idle period */
+	long tokens;			/**< operations allowed immediately, negative while operations wait */
+	unsigned int waiting;		/**< operations waiting for the rate */
+	unsigned long admitted;		/**< operations started without waiting */
+	unsigned long delayed;		/**< operations delayed to respect the rate */
+	unsigned long rejected;		/**< operations that would exceed the maximum wait */
+} PKCS11_RATE_LIMIT;
+
+/**
+ * Limit the rate of sign, decrypt and derive operations on each slot
+ *
+ * Each slot has a token bucket refilled with rate tokens per second and
+ * holding at most burst tokens.  Each operation takes a token before it
+ * acquires a session.  When the bucket is empty, the operation waits for
+ * its token, and fails if it would wait more than max_wait microseconds
+ * when max_wait is not 0.  The rate is enforced in each process.
+ *
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param rate operations per second, or 0 to disable the limit
+ * @param burst maximum number of operations started at once (at least 1)
+ * @param max_wait maximum wait in microseconds, or 0 to wait indefinitely
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_set_rate_limit(PKCS11_CTX *ctx, unsigned long rate,
+	unsigned long burst, unsigned long max_wait);
+
+/**
+ * Report the rate limit of a slot
+ *
+ * @param slot slot returned by PKCS11_enumerate_slots()
+ * @param status structure receiving the report
+ * @retval 0 success
+ * @retval -1 no rate limit is configured
+ */
+extern int PKCS11_get_rate_limit(PKCS11_SLOT *slot, PKCS11_RATE_LIMIT *status);
+
+/** Contention of a lock at one call site, times in nanoseconds */
+typedef struct PKCS11_lock_stats_st {
+	const char *lock;		/**< name of the lock, e.g. "slot->lock" */
+	const void *instance;		/**< address of the lock */
+	unsigned long slot_id;		/**< PKCS#11 slot ID, or -1 for the locks of the context */
+	const char *file;		/**< source file of the call site, or NULL for the remaining sites */
+	int line;			/**< source line of the call site */
+	unsigned long acquisitions;	/**< number of acquisitions */
+	unsigned long contended;	/**< acquisitions that found the lock held */
+	unsigned long long wait_total;	/**< time spent waiting for the lock */
+	unsigned long long wait_max;	/**< longest wait */
+	unsigned long long hold_total;	/**< time the lock was held */
+	unsigned long long hold_max;	/**< longest hold */
+} PKCS11_LOCK_STATS;
+
+/**
+ * Record the contention of the internal locks
+ *
+ * The session pool lock of each slot and the fork lock of the context are
+ * profiled per lock instance and call site.  Enabling the profiling clears
+ * the statistics collected so far.  The statistics of a slot are discarded
+ * with the slot.
+ *
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param enable 1 to enable, 0 to disable the profiling
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_set_lock_profiling(PKCS11_CTX *ctx, int enable);
+
+/**
+ * Report the lock contention recorded with PKCS11_set_lock_profiling()
+ *
+ * @param ctx context allocated by PKCS11_CTX_new()
+ * @param stats array receiving the statistics, or NULL to count them
+ * @param count on input the size of the array, on output the number of entries
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_get_lock_stats(PKCS11_CTX *ctx, PKCS11_LOCK_STATS *stats,
+	unsigned int *count);
+
 /*
  * PKCS#11 implementation for OpenSSL methods
  */
@@ -444,6 +821,57 @@ extern int PKCS11_generate_key(PKCS11_TOKEN * token,
 	int algorithm, unsigned int bits,
 	char *label, unsigned char* id, size_t id_len);
 
+/**
+ * Keep a pool of ephemeral EC key pairs generated on the token
+ *
+ * The key pairs are session objects usable for key derivation, created
+ * in a session of their own, which does not count against the session
+ * quota and stays open until the slot is released.  A
+ * background thread generates them whenever fewer than low_watermark
+ * key pairs are available, until high_watermark key pairs are pooled,
+ * and destroys the key pairs returned with PKCS11_keypool_put().
+ * Starting the pool again replaces its previous configuration.
+ *
+ * @param slot slot returned by PKCS11_find_token()
+ * @param curve_nid NID of the named curve, e.g. NID_X9_62_prime256v1
+ * @param low_watermark pool size below which key pairs are generated
+ * @param high_watermark maximum number of pooled key pairs
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_keypool_start(PKCS11_SLOT *slot, int curve_nid,
+	unsigned int low_watermark, unsigned int high_watermark);
+
+/**
+ * Stop the background thread and destroy the pooled key pairs
+ *
+ * @param slot slot passed to PKCS11_keypool_start()
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_keypool_stop(PKCS11_SLOT *slot);
+
+/**
+ * Take an ephemeral private key from the pool
+ *
+ * The key pair is generated inline if the pool is empty.  The public key
+ * is available with PKCS11_get_public_key().
+ *
+ * @param slot slot passed to PKCS11_keypool_start()
+ * @return the private key, or NULL on error
+ */
+extern PKCS11_KEY *PKCS11_keypool_get(PKCS11_SLOT *slot);
+
+/**
+ * Release a key returned by PKCS11_keypool_get()
+ *
+ * The key pair is destroyed asynchronously.  Neither the key nor any
+ * EVP_PKEY retrieved from it can be used afterwards.
+ *
+ * @param key key returned by PKCS11_keypool_get()
+ */
+extern void PKCS11_keypool_put(PKCS11_KEY *key);
+
 /* Get the RSA key modulus size (in bytes) */
 extern int PKCS11_get_key_size(PKCS11_KEY *);
 
@@ -487,6 +915,145 @@ extern int PKCS11_private_decrypt(
 	int flen, const unsigned char *from,
 	unsigned char *to, PKCS11_KEY * key, int padding);
 
+/** Mechanism used with PKCS11_sign_mech() and PKCS11_decrypt_mech() */
+typedef struct PKCS11_mechanism_st {
+	unsigned long mechanism;	/**< CKM_RSA_PKCS, CKM_RSA_PKCS_PSS, CKM_RSA_PKCS_OAEP, CKM_RSA_X_509 or CKM_ECDSA */
+	unsigned long hash;		/**< CKM_SHAxxx digest for PSS and OAEP */
+	unsigned long mgf;		/**< CKG_MGF1_xxx, or 0 to match the digest */
+	unsigned long salt_len;		/**< PSS salt length in bytes */
+	const unsigned char *label;	/**< OAEP label (may be NULL) */
+	size_t label_len;
+	int der;			/**< ECDSA: DER-encoded instead of raw r|s signature */
+} PKCS11_MECHANISM;
+
+/**
+ * Sign data with the private key using an explicit mechanism
+ *
+ * The data is passed to the token as is, so it has to be a digest (or a
+ * DigestInfo for CKM_RSA_PKCS) prepared by the caller.  No EVP or RSA/EC
+ * method is involved.
+ *
+ * @param key private key object
+ * @param mech mechanism and its parameters
+ * @param in data to be signed
+ * @param in_len length of the data
+ * @param sig output buffer, or NULL to query the signature size
+ * @param sig_len on input the buffer size, on output the signature size
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_sign_mech(PKCS11_KEY *key, const PKCS11_MECHANISM *mech,
+	const unsigned char *in, size_t in_len,
+	unsigned char *sig, size_t *sig_len);
+
+/**
+ * Decrypt data with the private key using an explicit mechanism
+ *
+ * @param key private key object
+ * @param mech mechanism and its parameters
+ * @param in encrypted data
+ * @param in_len length of the encrypted data
+ * @param out output buffer, or NULL to query the maximum output size
+ * @param out_len on input the buffer size, on output the decrypted size
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_decrypt_mech(PKCS11_KEY *key, const PKCS11_MECHANISM *mech,
+	const unsigned char *in, size_t in_len,
+	unsigned char *out, size_t *out_len);
+
+/**
+ * Hash and sign many messages with the private key
+ *
+ * Each message is hashed with md and its digest is signed with mech,
+ * which has to be CKM_RSA_PKCS (the DigestInfo is added for SHA-1 and
+ * SHA-2 digests), CKM_RSA_PKCS_PSS (the hash defaults to md) or
+ * CKM_ECDSA.  Up to threads messages are hashed and signed concurrently,
+ * each on its own session, and the signatures are stored in order.
+ *
+ * @param key private key object
+ * @param mech mechanism and its parameters
+ * @param md message digest
+ * @param count number of messages
+ * @param msgs messages to be signed
+ * @param msg_lens lengths of the messages
+ * @param sigs output buffers of the signatures
+ * @param sig_lens on input the buffer sizes, on output the signature
+ *   sizes, or 0 for the messages that could not be signed
+ * @param threads number of messages signed concurrently (0 or 1 signs
+ *   them in the calling thread)
+ * @retval 0 all the messages were signed
+ * @retval -1 error
+ */
+extern int PKCS11_sign_bulk(PKCS11_KEY *key, const PKCS11_MECHANISM *mech,
+	const EVP_MD *md, unsigned int count,
+	const unsigned char * const *msgs, const size_t *msg_lens,
+	unsigned char **sigs, size_t *sig_lens, unsigned int threads);
+
+/** Statistics of the signature cache of a key */
+typedef struct PKCS11_signature_cache_st {
+	unsigned int capacity;		/**< maximum number of signatures */
+	unsigned int entries;		/**< signatures cached or being computed */
+	unsigned long hits;		/**< signatures returned from the cache */
+	unsigned long misses;		/**< signatures requested from the token */
+	unsigned long coalesced;	/**< requests that waited for an identical one */
+} PKCS11_SIGNATURE_CACHE;
+
+/**
+ * Cache the deterministic signatures of a private key
+ *
+ * RSA PKCS#1 v1.5 and raw RSA signatures of the same data are identical,
+ * so that the signatures of a key can be returned from a cache instead of
+ * the token.  The cache holds at most entries signatures, evicting the
+ * least recently used ones, and concurrent requests for the same
+ * signature wait for the first one.  Signatures returned from the cache
+ * are not reported to the operation hooks.
+ *
+ * @param key private key returned by PKCS11_enumerate_keys()
+ * @param entries maximum number of cached signatures, or 0 to disable the cache
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_set_signature_cache(PKCS11_KEY *key, unsigned int entries);
+
+/**
+ * Report the statistics of the signature cache of a private key
+ *
+ * @param key private key returned by PKCS11_enumerate_keys()
+ * @param stats structure receiving the statistics
+ * @retval 0 success
+ * @retval -1 the key has no signature cache
+ */
+extern int PKCS11_get_signature_cache(PKCS11_KEY *key,
+	PKCS11_SIGNATURE_CACHE *stats);
+
+/**
+ * Limit the rate of sign, decrypt and derive operations with a private key
+ *
+ * The operations with the key take a token from a bucket of the key as
+ * well as from the bucket of its slot configured with
+ * PKCS11_set_rate_limit(), and share the maximum wait of the slots.
+ *
+ * @param key private key returned by PKCS11_enumerate_keys()
+ * @param rate operations per second, or 0 to disable the limit
+ * @param burst maximum number of operations started at once (at least 1)
+ * @retval 0 success
+ * @retval -1 error
+ */
+extern int PKCS11_set_key_rate_limit(PKCS11_KEY *key, unsigned long rate,
+	unsigned long burst);
+
+/**
+ * Report the rate limit of a private key
+ *
+ * @param key private key returned by PKCS11_enumerate_keys()
+ * @param status structure receiving the report
+ * @retval 0 success
+ * @retval -1 the key has no rate limit
+ */
+extern int PKCS11_get_key_rate_limit(PKCS11_KEY *key,
+	PKCS11_RATE_LIMIT *status);
+
 /* Function codes */
 # define CKR_F_PKCS11_CHANGE_PIN                          100
 # define CKR_F_PKCS11_CHECK_TOKEN                         101
@@ -520,6 +1087,10 @@ extern int PKCS11_private_decrypt(
 # define CKR_F_PKCS11_GENERATE_KEY                        130
 # define CKR_F_PKCS11_RELOAD_CERTIFICATE                  131
 # define CKR_F_PKCS11_GET_SESSION                         132
+# define CKR_F_PKCS11_SIGN_MECH                           133
+# define CKR_F_PKCS11_DECRYPT_MECH                        134
+# define CKR_F_PKCS11_KEYPOOL_GET                         135
+# define CKR_F_PKCS11_SIGN_BULK                           136
 
 /* Backward compatibility of error function codes */
 #define PKCS11_F_PKCS11_CHANGE_PIN CKR_F_PKCS11_CHANGE_PIN
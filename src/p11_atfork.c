@@ -65,9 +65,10 @@ static unsigned int _P11_update_forkid(void)
 		int rv = 0; \
 		_P11_update_forkid(); \
 		if (forkid != P11_forkid) { \
-			pthread_mutex_lock(&ctx->fork_lock); \
+			PKCS11_LOCK(&ctx->fork_lock, &ctx->fork_lock_prof, \
+				ctx->lock_profiling); \
 			function_call; \
-			pthread_mutex_unlock(&ctx->fork_lock); \
+			PKCS11_UNLOCK(&ctx->fork_lock, &ctx->fork_lock_prof); \
 		} \
 		return rv; \
 	} while (0)
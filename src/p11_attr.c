@@ -30,66 +30,419 @@
 #include <assert.h>
 #include <string.h>
 
+/*
+ * Memoization of immutable attributes
+ *
+ * The same attributes are read over and over again whenever a key or
+ * a certificate is enumerated or reloaded.  Those that cannot change for
+ * the lifetime of an object handle are kept in a small per-slot cache.
+ */
+struct pkcs11_attr_entry_st {
+	struct pkcs11_attr_entry_st *next;
+	CK_OBJECT_HANDLE object;
+	CK_ATTRIBUTE_TYPE type;
+	size_t size;
+	CK_BYTE value[1];
+};
+
+#define PKCS11_ATTR_CACHE_MAX_ENTRIES 1024
+#define PKCS11_ATTR_CACHE_MAX_BYTES (1024 * 1024)
+
+/* Index of the size hint of the value of certificates */
+#define PKCS11_ATTR_HINT_CERT_VALUE 1
+
+static unsigned int pkcs11_attr_hash(CK_OBJECT_HANDLE object)
+{
+	return (unsigned int)(object ^ (object >> 7)) % PKCS11_ATTR_CACHE_BUCKETS;
+}
+
+static PKCS11_ATTR_ENTRY *pkcs11_attr_find(PKCS11_SLOT_private *slot,
+		CK_OBJECT_HANDLE object, CK_ATTRIBUTE_TYPE type)
+{
+	PKCS11_ATTR_ENTRY *entry;
+
+	for (entry = slot->attr_cache[pkcs11_attr_hash(object)];
+			entry; entry = entry->next)
+		if (entry->object == object && entry->type == type)
+			return entry;
+	return NULL;
+}
+
+/* Must be called with slot->attr_lock held */
+static int pkcs11_attr_cacheable(PKCS11_SLOT_private *slot,
+		CK_OBJECT_HANDLE object, CK_ATTRIBUTE_TYPE type)
+{
+	PKCS11_ATTR_ENTRY *entry;
+
+	switch (type) {
+	case CKA_CLASS:
+	case CKA_KEY_TYPE:
+	case CKA_CERTIFICATE_TYPE:
+	case CKA_ID:
+	case CKA_MODULUS:
+	case CKA_PUBLIC_EXPONENT:
+	case CKA_EC_PARAMS:
+	case CKA_EC_POINT:
+		return 1;
+	case CKA_VALUE:
+		/* Only the value of a certificate is public and immutable */
+		entry = pkcs11_attr_find(slot, object, CKA_CLASS);
+		return entry && entry->size == sizeof(CK_OBJECT_CLASS) &&
+			*(CK_OBJECT_CLASS *)entry->value == CKO_CERTIFICATE;
+	default:
+		return 0;
+	}
+}
+
+/* Must be called with slot->attr_lock held */
+static void pkcs11_attr_cache_clear(PKCS11_SLOT_private *slot)
+{
+	PKCS11_ATTR_ENTRY *entry;
+	unsigned int i;
+
+	for (i = 0; i < PKCS11_ATTR_CACHE_BUCKETS; i++) {
+		while ((entry = slot->attr_cache[i])) {
+			slot->attr_cache[i] = entry->next;
+			OPENSSL_free(entry);
+		}
+	}
+	slot->attr_cached = 0;
+	slot->attr_cached_bytes = 0;
+}
+
+static void pkcs11_attr_cache_add(PKCS11_SLOT_private *slot,
+		CK_OBJECT_HANDLE object, CK_ATTRIBUTE_TYPE type,
+		const CK_BYTE *value, size_t size)
+{
+	PKCS11_ATTR_ENTRY *entry;
+	unsigned int h;
+
+	pthread_mutex_lock(&slot->attr_lock);
+	if (!pkcs11_attr_cacheable(slot, object, type) ||
+			pkcs11_attr_find(slot, object, type)) {
+		pthread_mutex_unlock(&slot->attr_lock);
+		return;
+	}
+	/* Start over rather than growing without bounds */
+	if (slot->attr_cached >= PKCS11_ATTR_CACHE_MAX_ENTRIES ||
+			slot->attr_cached_bytes + size > PKCS11_ATTR_CACHE_MAX_BYTES)
+		pkcs11_attr_cache_clear(slot);
+	entry = OPENSSL_malloc(sizeof(*entry) + size);
+	if (entry) {
+		entry->object = object;
+		entry->type = type;
+		entry->size = size;
+		memcpy(entry->value, value, size);
+		h = pkcs11_attr_hash(object);
+		entry->next = slot->attr_cache[h];
+		slot->attr_cache[h] = entry;
+		slot->attr_cached++;
+		slot->attr_cached_bytes += size;
+	}
+	pthread_mutex_unlock(&slot->attr_lock);
+}
+
+/* Returns 1 on a cache hit, 0 on a miss, -1 on a too short buffer */
+static int pkcs11_attr_cache_get(PKCS11_SLOT_private *slot,
+		CK_OBJECT_HANDLE object, CK_ATTRIBUTE_TYPE type,
+		CK_BYTE *value, size_t *size)
+{
+	PKCS11_ATTR_ENTRY *entry;
+	int ret = 0;
+
+	pthread_mutex_lock(&slot->attr_lock);
+	entry = pkcs11_attr_find(slot, object, type);
+	if (entry) {
+		if (!value) {
+			ret = 1;
+		} else if (*size >= entry->size) {
+			memcpy(value, entry->value, entry->size);
+			ret = 1;
+		} else {
+			ret = -1;
+		}
+		if (ret > 0)
+			*size = entry->size;
+	}
+	pthread_mutex_unlock(&slot->attr_lock);
+	return ret;
+}
+
+/*
+ * Forget the cached attributes of an object handle (e.g. after the object
+ * was destroyed, as the module is free to reuse its handle)
+ */
+void pkcs11_attr_cache_invalidate(PKCS11_SLOT_private *slot,
+		CK_OBJECT_HANDLE object)
+{
+	PKCS11_ATTR_ENTRY **prev, *entry;
+
+	pthread_mutex_lock(&slot->attr_lock);
+	prev = &slot->attr_cache[pkcs11_attr_hash(object)];
+	while ((entry = *prev)) {
+		if (entry->object == object) {
+			*prev = entry->next;
+			slot->attr_cached--;
+			slot->attr_cached_bytes -= entry->size;
+			OPENSSL_free(entry);
+		} else {
+			prev = &entry->next;
+		}
+	}
+	pthread_mutex_unlock(&slot->attr_lock);
+}
+
+/*
+ * Forget all the cached attributes (e.g. when the token was changed)
+ */
+void pkcs11_attr_cache_flush(PKCS11_SLOT_private *slot)
+{
+	pthread_mutex_lock(&slot->attr_lock);
+	pkcs11_attr_cache_clear(slot);
+	pthread_mutex_unlock(&slot->attr_lock);
+}
+
+/*
+ * Memory held by the cached attributes
+ */
+size_t pkcs11_attr_cache_mem(PKCS11_SLOT_private *slot)
+{
+	size_t size;
+
+	pthread_mutex_lock(&slot->attr_lock);
+	size = slot->attr_cached * sizeof(PKCS11_ATTR_ENTRY) +
+		slot->attr_cached_bytes;
+	pthread_mutex_unlock(&slot->attr_lock);
+	return size;
+}
+
 /*
  * Query pkcs11 attributes
  */
-int pkcs11_getattr_var(PKCS11_CTX_private *ctx, CK_SESSION_HANDLE session,
+int pkcs11_getattr_var(PKCS11_SLOT_private *slot, CK_SESSION_HANDLE session,
 		CK_OBJECT_HANDLE object, CK_ATTRIBUTE_TYPE type,
 		CK_BYTE *value, size_t *size)
 {
+	PKCS11_CTX_private *ctx = slot->ctx;
 	CK_ATTRIBUTE templ;
 	int rv;
 
+	switch (pkcs11_attr_cache_get(slot, object, type, value, size)) {
+	case 1:
+		return 0;
+	case -1:
+		CKRerr(CKR_F_PKCS11_GETATTR_INT, CKR_BUFFER_TOO_SMALL);
+		return -1;
+	}
+
 	templ.type = type;
 	templ.pValue = value;
 	templ.ulValueLen = *size;
 	rv = CRYPTOKI_call(ctx, C_GetAttributeValue(session, object, &templ, 1));
 	CRYPTOKI_checkerr(CKR_F_PKCS11_GETATTR_INT, rv);
 	*size = templ.ulValueLen;
+	if (value && templ.ulValueLen != CK_UNAVAILABLE_INFORMATION)
+		pkcs11_attr_cache_add(slot, object, type, value, *size);
 	return 0;
 }
 
-int pkcs11_getattr_val(PKCS11_CTX_private *ctx, CK_SESSION_HANDLE session,
+int pkcs11_getattr_val(PKCS11_SLOT_private *slot, CK_SESSION_HANDLE session,
 		CK_OBJECT_HANDLE object, CK_ATTRIBUTE_TYPE type,
 		void *value, size_t size)
 {
-	return pkcs11_getattr_var(ctx, session, object, type, value, &size);
+	return pkcs11_getattr_var(slot, session, object, type, value, &size);
+}
+
+/*
+ * Index of the size hint of an attribute, or -1 if none is kept.
+ * The hints are kept per object class, as the values of certificates and
+ * of derived secrets differ by orders of magnitude.  Objects of an unknown
+ * class do not share any hint.
+ * Must be called with slot->attr_lock held
+ */
+static int pkcs11_attr_hint_index(PKCS11_SLOT_private *slot,
+		CK_OBJECT_HANDLE object, CK_ATTRIBUTE_TYPE type)
+{
+	PKCS11_ATTR_ENTRY *entry;
+	int i, j;
+
+	entry = pkcs11_attr_find(slot, object, CKA_CLASS);
+	if (!entry || entry->size != sizeof(CK_OBJECT_CLASS))
+		return -1;
+	switch (*(CK_OBJECT_CLASS *)entry->value) {
+	case CKO_CERTIFICATE:
+		i = 0;
+		break;
+	case CKO_PUBLIC_KEY:
+		i = 1;
+		break;
+	case CKO_PRIVATE_KEY:
+		i = 2;
+		break;
+	default:
+		return -1;
+	}
+	switch (type) {
+	case CKA_LABEL:
+		j = 0;
+		break;
+	case CKA_VALUE:
+		j = 1;
+		break;
+	case CKA_MODULUS:
+		j = 2;
+		break;
+	case CKA_EC_POINT:
+		j = 3;
+		break;
+	default:
+		return -1;
+	}
+	return i * PKCS11_ATTR_HINT_TYPES + j;
+}
+
+/*
+ * Expected size of a variable-length attribute: the largest size seen so
+ * far for objects of the same class on the slot or, before the first read,
+ * a typical upper bound
+ */
+static size_t pkcs11_attr_size_hint(PKCS11_SLOT_private *slot,
+		CK_OBJECT_HANDLE object, CK_ATTRIBUTE_TYPE type)
+{
+	size_t hint = 0;
+	int i;
+
+	pthread_mutex_lock(&slot->attr_lock);
+	i = pkcs11_attr_hint_index(slot, object, type);
+	if (i >= 0)
+		hint = slot->attr_size_hint[i];
+	pthread_mutex_unlock(&slot->attr_lock);
+	if (hint)
+		return hint;
+	switch (type) {
+	case CKA_VALUE:
+		return i == PKCS11_ATTR_HINT_CERT_VALUE ?
+			2048 : PKCS11_ATTR_SCRATCH_SIZE;
+	case CKA_MODULUS: /* up to 4096-bit RSA */
+		return 512;
+	default:
+		return PKCS11_ATTR_SCRATCH_SIZE;
+	}
+}
+
+static void pkcs11_attr_size_seen(PKCS11_SLOT_private *slot,
+		CK_OBJECT_HANDLE object, CK_ATTRIBUTE_TYPE type, size_t size)
+{
+	int i;
+
+	pthread_mutex_lock(&slot->attr_lock);
+	i = pkcs11_attr_hint_index(slot, object, type);
+	if (i >= 0 && size > slot->attr_size_hint[i])
+		slot->attr_size_hint[i] = size;
+	pthread_mutex_unlock(&slot->attr_lock);
+}
+
+/*
+ * Read the attribute with a single call into a buffer sized from the
+ * previous reads.  Returns 1 if the buffer was too small, so that the
+ * caller falls back to querying the size first.
+ */
+static int pkcs11_getattr_guess(PKCS11_SLOT_private *slot,
+		CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+		CK_ATTRIBUTE_TYPE type, CK_BYTE **value, size_t *size)
+{
+	PKCS11_CTX_private *ctx = slot->ctx;
+	CK_BYTE scratch[PKCS11_ATTR_SCRATCH_SIZE], *buf, *data;
+	CK_ATTRIBUTE templ;
+	size_t hint = pkcs11_attr_size_hint(slot, object, type);
+	int rv;
+
+	if (hint <= sizeof(scratch)) {
+		buf = scratch;
+		hint = sizeof(scratch);
+	} else {
+		buf = OPENSSL_malloc(hint + 1);
+		if (!buf) {
+			CKRerr(CKR_F_PKCS11_GETATTR_ALLOC, CKR_HOST_MEMORY);
+			return -1;
+		}
+	}
+	templ.type = type;
+	templ.pValue = buf;
+	templ.ulValueLen = hint;
+	rv = CRYPTOKI_call(ctx, C_GetAttributeValue(session, object, &templ, 1));
+	if (rv != CKR_OK || templ.ulValueLen == CK_UNAVAILABLE_INFORMATION) {
+		if (buf != scratch)
+			OPENSSL_free(buf);
+		if (rv == CKR_OK || rv == CKR_BUFFER_TOO_SMALL)
+			return 1;
+		CKRerr(CKR_F_PKCS11_GETATTR_INT, rv);
+		return -1;
+	}
+	*size = templ.ulValueLen;
+	if (buf == scratch) {
+		data = OPENSSL_malloc(*size + 1);
+		if (!data) {
+			CKRerr(CKR_F_PKCS11_GETATTR_ALLOC, CKR_HOST_MEMORY);
+			return -1;
+		}
+		memcpy(data, scratch, *size);
+		OPENSSL_cleanse(scratch, *size);
+	} else {
+		data = buf;
+	}
+	data[*size] = '\0'; /* also null-terminate the allocated data */
+	pkcs11_attr_size_seen(slot, object, type, *size);
+	pkcs11_attr_cache_add(slot, object, type, data, *size);
+	*value = data;
+	return 0;
 }
 
-int pkcs11_getattr_alloc(PKCS11_CTX_private *ctx, CK_SESSION_HANDLE session,
+int pkcs11_getattr_alloc(PKCS11_SLOT_private *slot, CK_SESSION_HANDLE session,
 		CK_OBJECT_HANDLE object, CK_ATTRIBUTE_TYPE type,
 		CK_BYTE **value, size_t *size)
 {
 	CK_BYTE *data;
 	size_t len = 0;
+	int rv = 1;
 
-	if (pkcs11_getattr_var(ctx, session, object, type, NULL, &len))
-		return -1;
-	data = OPENSSL_malloc(len+1);
-	if (!data) {
-		CKRerr(CKR_F_PKCS11_GETATTR_ALLOC, CKR_HOST_MEMORY);
-		return -1;
-	}
-	memset(data, 0, len+1); /* also null-terminate the allocated data */
-	if (pkcs11_getattr_var(ctx, session, object, type, data, &len)) {
-		OPENSSL_free(data);
+	/* Memoized attributes are served by pkcs11_getattr_var() below */
+	if (pkcs11_attr_cache_get(slot, object, type, NULL, &len) == 0)
+		rv = pkcs11_getattr_guess(slot, session, object, type, &data, &len);
+	if (rv < 0)
 		return -1;
+	if (rv > 0) {
+		len = 0;
+		if (pkcs11_getattr_var(slot, session, object, type, NULL, &len))
+			return -1;
+		data = OPENSSL_malloc(len+1);
+		if (!data) {
+			CKRerr(CKR_F_PKCS11_GETATTR_ALLOC, CKR_HOST_MEMORY);
+			return -1;
+		}
+		memset(data, 0, len+1); /* also null-terminate the allocated data */
+		if (pkcs11_getattr_var(slot, session, object, type, data, &len)) {
+			OPENSSL_free(data);
+			return -1;
+		}
 	}
 	if (value)
 		*value = data;
+	else
+		OPENSSL_free(data);
 	if (size)
 		*size = len;
 	return 0;
 }
 
-int pkcs11_getattr_bn(PKCS11_CTX_private *ctx, CK_SESSION_HANDLE session,
+int pkcs11_getattr_bn(PKCS11_SLOT_private *slot, CK_SESSION_HANDLE session,
 		CK_OBJECT_HANDLE object, CK_ATTRIBUTE_TYPE type, BIGNUM **bn)
 {
 	CK_BYTE *binary;
 	size_t size;
 
 	size = 0;
-	if (pkcs11_getattr_alloc(ctx, session, object, type, &binary, &size))
+	if (pkcs11_getattr_alloc(slot, session, object, type, &binary, &size))
 		return -1;
 	/*
 	 * @ALON: invalid object,
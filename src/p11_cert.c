@@ -59,6 +59,8 @@ int pkcs11_enumerate_certs(PKCS11_SLOT_private *slot, const PKCS11_CERT *cert_te
 		pkcs11_destroy_certs(slot);
 		return -1;
 	}
+	if (tmpl.nattr == 1) /* Only CKA_CLASS */
+		pkcs11_fpindex_complete(slot, CKO_CERTIFICATE);
 
 	if (certp)
 		*certp = slot->certs;
@@ -75,18 +77,25 @@ PKCS11_CERT *pkcs11_find_certificate(PKCS11_OBJECT_private *key)
 	PKCS11_OBJECT_private *cpriv;
 	PKCS11_CERT *cert, cert_template = {0};
 	unsigned int n, count;
+	unsigned char fp[PKCS11_FP_LEN];
 
 	cert_template.id = key->id;
 	cert_template.id_len = key->id_len;
-	if (pkcs11_enumerate_certs(key->slot, &cert_template, &cert, &count))
-		return NULL;
-	for (n = 0; n < count; n++, cert++) {
-		cpriv = PRIVCERT(cert);
-		if (cpriv->id_len == key->id_len
-				&& !memcmp(cpriv->id, key->id, key->id_len))
-			return cert;
+	if (!pkcs11_enumerate_certs(key->slot, &cert_template, &cert, &count)) {
+		for (n = 0; n < count; n++, cert++) {
+			cpriv = PRIVCERT(cert);
+			if (cpriv->id_len == key->id_len
+					&& !memcmp(cpriv->id, key->id, key->id_len))
+				return cert;
+		}
 	}
-	return NULL;
+
+	/* No certificate with the same CKA_ID: compare the public keys */
+	if (pkcs11_fingerprint_object(key, CK_INVALID_HANDLE, fp) ||
+			pkcs11_fpindex_find(key->slot, CK_INVALID_HANDLE, fp, 1,
+				NULL, NULL, &cert))
+		return NULL;
+	return cert;
 }
 
 /*
@@ -95,17 +104,29 @@ PKCS11_CERT *pkcs11_find_certificate(PKCS11_OBJECT_private *key)
 static int pkcs11_find_certs(PKCS11_SLOT_private *slot, PKCS11_TEMPLATE *tmpl, CK_SESSION_HANDLE session)
 {
 	PKCS11_CTX_private *ctx = slot->ctx;
+	PKCS11_OP op;
+	size_t found = 0;
 	int rv, res = -1;
 
+	if (pkcs11_op_begin_find(&op, slot, tmpl))
+		return -1;
+
 	/* Tell the PKCS11 lib to enumerate all matching objects */
 	rv = CRYPTOKI_call(ctx, C_FindObjectsInit(session, tmpl->attrs, tmpl->nattr));
-	CRYPTOKI_checkerr(CKR_F_PKCS11_FIND_CERTS, rv);
+	if (rv != CKR_OK) {
+		pkcs11_op_end(&op, CK_INVALID_HANDLE, rv, 0);
+		CRYPTOKI_checkerr(CKR_F_PKCS11_FIND_CERTS, rv);
+	}
 
 	do {
 		res = pkcs11_next_cert(ctx, slot, session);
+		if (res == 0)
+			found++;
 	} while (res == 0);
 
 	CRYPTOKI_call(ctx, C_FindObjectsFinal(session));
+	pkcs11_op_end(&op, CK_INVALID_HANDLE,
+		res < 0 ? CKR_GENERAL_ERROR : CKR_OK, found);
 
 	return (res < 0) ? -1 : 0;
 }
@@ -188,6 +209,20 @@ void pkcs11_destroy_certs(PKCS11_SLOT_private *slot)
 		OPENSSL_free(slot->certs);
 	slot->certs = NULL;
 	slot->ncerts = 0;
+	pkcs11_fpindex_reset(slot, CKO_CERTIFICATE);
+}
+
+/*
+ * Return the DER encoding read from the token
+ */
+int pkcs11_get_cert_der(PKCS11_OBJECT_private *cert,
+		const unsigned char **der, size_t *len)
+{
+	if (!cert->der)
+		return -1;
+	*der = cert->der;
+	*len = cert->der_len;
+	return 0;
 }
 
 /*
@@ -293,6 +328,8 @@ int pkcs11_store_certificate(PKCS11_SLOT_private *slot, X509 *x509, char *label,
 
 	/* Gobble the key object */
 	if (rv == CKR_OK) {
+		/* The module may have reused the handle of a destroyed object */
+		pkcs11_attr_cache_invalidate(slot, object);
 		r = pkcs11_init_cert(slot, session, object, ret_cert);
 	}
 	pkcs11_put_session(slot, session);
@@ -57,6 +57,10 @@ static ERR_STRING_DATA CKR_str_functs[] = {
 	{ERR_FUNC(CKR_F_PKCS11_STORE_KEY), "pkcs11_store_key"},
 	{ERR_FUNC(CKR_F_PKCS11_RELOAD_CERTIFICATE), "pkcs11_reload_certificate"},
 	{ERR_FUNC(CKR_F_PKCS11_GET_SESSION), "pkcs11_get_session"},
+	{ERR_FUNC(CKR_F_PKCS11_SIGN_MECH), "pkcs11_sign_mech"},
+	{ERR_FUNC(CKR_F_PKCS11_DECRYPT_MECH), "pkcs11_decrypt_mech"},
+	{ERR_FUNC(CKR_F_PKCS11_KEYPOOL_GET), "pkcs11_keypool_get"},
+	{ERR_FUNC(CKR_F_PKCS11_SIGN_BULK), "pkcs11_sign_bulk"},
 	{0, NULL}
 };
 
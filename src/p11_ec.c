@@ -196,7 +196,7 @@ static int pkcs11_get_params(EC_KEY *ec, PKCS11_OBJECT_private *key, CK_SESSION_
 	const unsigned char *a;
 	int rv;
 
-	if (pkcs11_getattr_alloc(key->slot->ctx, session, key->object,
+	if (pkcs11_getattr_alloc(key->slot, session, key->object,
 			CKA_EC_PARAMS, &params, &params_len))
 		return -1;
 
@@ -254,7 +254,7 @@ static int pkcs11_get_point(EC_KEY *ec, PKCS11_OBJECT_private *key, CK_SESSION_H
 	if (key->x509 && pkcs11_get_point_x509(ec, key->x509) == 0)
 		return 0;
 
-	if (pkcs11_getattr_alloc(key->slot->ctx, session, key->object,
+	if (pkcs11_getattr_alloc(key->slot, session, key->object,
 			CKA_EC_POINT, &point, &point_len))
 		return -1;
 
@@ -400,27 +400,23 @@ static int pkcs11_ecdsa_sign(const unsigned char *msg, unsigned int msg_len,
 {
 	int rv;
 	PKCS11_SLOT_private *slot = key->slot;
-	PKCS11_CTX_private *ctx = slot->ctx;
 	CK_SESSION_HANDLE session;
 	CK_MECHANISM mechanism;
 	CK_ULONG ck_sigsize;
+	PKCS11_OP op;
 
 	ck_sigsize = *siglen;
 
 	memset(&mechanism, 0, sizeof(mechanism));
 	mechanism.mechanism = CKM_ECDSA;
 
-	if (pkcs11_get_session(slot, 0, &session))
+	if (pkcs11_op_begin(&op, PKCS11_OP_SIGN, slot, key,
+			mechanism.mechanism, msg_len, 0, &session))
 		return -1;
 
-	rv = CRYPTOKI_call(ctx,
-		C_SignInit(session, &mechanism, key->object));
-	if (!rv && key->always_authenticate == CK_TRUE)
-		rv = pkcs11_authenticate(key, session);
-	if (!rv)
-		rv = CRYPTOKI_call(ctx,
-			C_Sign(session, (CK_BYTE *)msg, msg_len, sigret, &ck_sigsize));
-	pkcs11_put_session(slot, session);
+	rv = pkcs11_private_op(key, session, PKCS11_OP_SIGN, &mechanism,
+		msg, msg_len, sigret, &ck_sigsize);
+	pkcs11_op_end(&op, session, rv, ck_sigsize);
 
 	if (rv) {
 		CKRerr(CKR_F_PKCS11_ECDSA_SIGN, rv);
@@ -575,6 +571,7 @@ static int pkcs11_ecdh_derive(unsigned char **out, size_t *outlen,
 	PKCS11_CTX_private *ctx = slot->ctx;
 	CK_SESSION_HANDLE session;
 	CK_MECHANISM mechanism;
+	PKCS11_OP op;
 	int rv;
 
 	CK_BBOOL _true = TRUE;
@@ -614,18 +611,26 @@ static int pkcs11_ecdh_derive(unsigned char **out, size_t *outlen,
 			return -1;
 	}
 
-	if (pkcs11_get_session(slot, 0, &session))
+	if (pkcs11_op_begin(&op, PKCS11_OP_DERIVE, slot, key,
+			ecdh_mechanism, key_len, 0, &session))
 		return -1;
 
 	rv = CRYPTOKI_call(ctx, C_DeriveKey(session, &mechanism, key->object,
 		newkey_template, sizeof(newkey_template)/sizeof(*newkey_template), &newkey));
+	/* Retry once if the token dropped the login state */
+	if (rv == CKR_USER_NOT_LOGGED_IN && pkcs11_relogin(slot, session) == 0)
+		rv = CRYPTOKI_call(ctx, C_DeriveKey(session, &mechanism, key->object,
+			newkey_template, sizeof(newkey_template)/sizeof(*newkey_template), &newkey));
 	if (rv != CKR_OK)
 		goto error;
+	/* The module may have reused the handle of a destroyed object */
+	pkcs11_attr_cache_invalidate(slot, newkey);
 
 	/* Return the value of the secret key and/or the object handle of the secret key */
 	if (out && outlen) { /* pkcs11_ec_ckey only asks for the value */
-		if (pkcs11_getattr_alloc(ctx, session, newkey, CKA_VALUE, out, outlen)) {
+		if (pkcs11_getattr_alloc(slot, session, newkey, CKA_VALUE, out, outlen)) {
 			CRYPTOKI_call(ctx, C_DestroyObject(session, newkey));
+			rv = CKR_GENERAL_ERROR;
 			goto error;
 		}
 	}
@@ -634,11 +639,11 @@ static int pkcs11_ecdh_derive(unsigned char **out, size_t *outlen,
 	else /* Destroy the temporary key */
 		CRYPTOKI_call(ctx, C_DestroyObject(session, newkey));
 
-	pkcs11_put_session(slot, session);
+	pkcs11_op_end(&op, session, CKR_OK, outlen ? *outlen : 0);
 
 	return 0;
 error:
-	pkcs11_put_session(slot, session);
+	pkcs11_op_end(&op, session, rv, 0);
 	CKRerr(CKR_F_PKCS11_ECDH_DERIVE, rv);
 	return -1;
 }
@@ -25,21 +25,33 @@ static ERR_STRING_DATA P11_str_functs[] = {
     {ERR_FUNC(P11_F_PKCS11_CTX_LOAD), "pkcs11_CTX_load"},
     {ERR_FUNC(P11_F_PKCS11_CTX_RELOAD), "pkcs11_CTX_reload"},
     {ERR_FUNC(P11_F_PKCS11_ECDH_DERIVE), "pkcs11_ecdh_derive"},
+    {ERR_FUNC(P11_F_PKCS11_FIND_BY_PUBLIC_KEY), "pkcs11_find_by_public_key"},
     {ERR_FUNC(P11_F_PKCS11_GENERATE_RANDOM), "pkcs11_generate_random"},
     {ERR_FUNC(P11_F_PKCS11_INIT_PIN), "pkcs11_init_pin"},
+    {ERR_FUNC(P11_F_PKCS11_KEYPOOL_GET), "pkcs11_keypool_get"},
+    {ERR_FUNC(P11_F_PKCS11_KEYPOOL_START), "pkcs11_keypool_start"},
     {ERR_FUNC(P11_F_PKCS11_LOGOUT), "pkcs11_logout"},
     {ERR_FUNC(P11_F_PKCS11_MECHANISM), "pkcs11_mechanism"},
+    {ERR_FUNC(P11_F_PKCS11_OP_BEGIN), "pkcs11_op_begin"},
     {ERR_FUNC(P11_F_PKCS11_SEED_RANDOM), "pkcs11_seed_random"},
+    {ERR_FUNC(P11_F_PKCS11_SET_CONCURRENCY_LIMIT), "pkcs11_set_concurrency_limit"},
+    {ERR_FUNC(P11_F_PKCS11_SET_RATE_LIMIT), "pkcs11_set_rate_limit"},
+    {ERR_FUNC(P11_F_PKCS11_SET_SESSION_QUOTA), "pkcs11_set_session_quota"},
+    {ERR_FUNC(P11_F_PKCS11_SET_SIGNATURE_CACHE), "pkcs11_set_signature_cache"},
     {ERR_FUNC(P11_F_PKCS11_STORE_KEY), "pkcs11_store_key"},
     {ERR_FUNC(P11_F_PKCS11_VERIFY), "PKCS11_verify"},
     {0, NULL}
 };
 
 static ERR_STRING_DATA P11_str_reasons[] = {
+    {ERR_REASON(P11_R_INVALID_PARAMETER), "Invalid parameter"},
     {ERR_REASON(P11_R_KEYGEN_FAILED), "Key generation failed"},
     {ERR_REASON(P11_R_LOAD_MODULE_ERROR), "Unable to load PKCS#11 module"},
     {ERR_REASON(P11_R_NOT_SUPPORTED), "Not supported"},
     {ERR_REASON(P11_R_NO_SESSION), "No session open"},
+    {ERR_REASON(P11_R_OPERATION_REJECTED), "Operation rejected by a hook"},
+    {ERR_REASON(P11_R_RATE_LIMITED), "Operation rate limit exceeded"},
+    {ERR_REASON(P11_R_TOKEN_OVERLOADED), "Token overloaded"},
     {ERR_REASON(P11_R_UI_FAILED), "UI request failed"},
     {ERR_REASON(P11_R_UNSUPPORTED_PADDING_TYPE), "Unsupported padding type"},
     {0, NULL}
@@ -32,19 +32,31 @@ void ERR_P11_error(int function, int reason, char *file, int line);
 # define P11_F_PKCS11_CTX_LOAD                            101
 # define P11_F_PKCS11_CTX_RELOAD                          102
 # define P11_F_PKCS11_ECDH_DERIVE                         103
+# define P11_F_PKCS11_FIND_BY_PUBLIC_KEY                  118
 # define P11_F_PKCS11_GENERATE_RANDOM                     105
 # define P11_F_PKCS11_INIT_PIN                            106
+# define P11_F_PKCS11_KEYPOOL_GET                         114
+# define P11_F_PKCS11_KEYPOOL_START                       113
 # define P11_F_PKCS11_LOGOUT                              107
 # define P11_F_PKCS11_MECHANISM                           111
+# define P11_F_PKCS11_OP_BEGIN                            112
 # define P11_F_PKCS11_SEED_RANDOM                         108
+# define P11_F_PKCS11_SET_CONCURRENCY_LIMIT               116
+# define P11_F_PKCS11_SET_RATE_LIMIT                      119
+# define P11_F_PKCS11_SET_SESSION_QUOTA                   115
+# define P11_F_PKCS11_SET_SIGNATURE_CACHE                 117
 # define P11_F_PKCS11_STORE_KEY                           109
 # define P11_F_PKCS11_VERIFY                              110
 
 /* Reason codes. */
+# define P11_R_INVALID_PARAMETER                          1033
 # define P11_R_KEYGEN_FAILED                              1030
 # define P11_R_LOAD_MODULE_ERROR                          1025
 # define P11_R_NOT_SUPPORTED                              1028
 # define P11_R_NO_SESSION                                 1029
+# define P11_R_OPERATION_REJECTED                         1032
+# define P11_R_RATE_LIMITED                               1035
+# define P11_R_TOKEN_OVERLOADED                           1034
 # define P11_R_UI_FAILED                                  1031
 # define P11_R_UNSUPPORTED_PADDING_TYPE                   1026
 
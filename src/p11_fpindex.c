@@ -0,0 +1,495 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Public key fingerprint index.
+ *
+ * Keys and certificates are normally paired by CKA_ID, which tokens
+ * provisioned by different tools do not always set consistently.  The
+ * enumerated private keys, public keys and certificates of each slot are
+ * also indexed by the SHA-256 hash of their public key value: the modulus
+ * of RSA keys and the point of EC keys.  The exponent is left out, so that
+ * RSA private keys without CKA_PUBLIC_EXPONENT are indexed as well.  EC
+ * private keys without CKA_EC_POINT are paired with the public key object
+ * of the same CKA_ID instead.  The objects are indexed lazily, the first
+ * time a lookup follows their enumeration, and the index is dropped with
+ * the enumerations.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+#include <openssl/sha.h>
+
+#define PKCS11_FP_MIN_BUCKETS 64
+
+struct pkcs11_fp_entry {
+	unsigned char fp[PKCS11_FP_LEN];
+	int prv, pub, cert; /* positions in the enumerations, or -1 */
+	PKCS11_FP_ENTRY *next;
+};
+
+void pkcs11_fpindex_init(PKCS11_SLOT_private *slot)
+{
+	PKCS11_FP_INDEX *index = &slot->fpindex;
+
+	memset(index, 0, sizeof(PKCS11_FP_INDEX));
+	pthread_mutex_init(&index->lock, 0);
+}
+
+/* Called with the index lock held */
+static void pkcs11_fpindex_clear(PKCS11_FP_INDEX *index)
+{
+	PKCS11_FP_ENTRY *e, *next;
+	unsigned int n;
+
+	for (n = 0; n < index->nbuckets; n++) {
+		for (e = index->buckets[n]; e; e = next) {
+			next = e->next;
+			OPENSSL_free(e);
+		}
+	}
+	OPENSSL_free(index->buckets);
+	index->buckets = NULL;
+	index->nbuckets = 0;
+	index->nentries = 0;
+	index->nprv = index->npub = index->ncerts = 0;
+}
+
+void pkcs11_fpindex_free(PKCS11_SLOT_private *slot)
+{
+	PKCS11_FP_INDEX *index = &slot->fpindex;
+
+	pkcs11_fpindex_clear(index);
+	pthread_mutex_destroy(&index->lock);
+}
+
+/*
+ * Drop the index when an enumeration is destroyed
+ * The positions in the other enumerations are indexed again on next lookup
+ */
+void pkcs11_fpindex_reset(PKCS11_SLOT_private *slot, CK_OBJECT_CLASS type)
+{
+	PKCS11_FP_INDEX *index = &slot->fpindex;
+
+	pthread_mutex_lock(&index->lock);
+	pkcs11_fpindex_clear(index);
+	switch (type) {
+	case CKO_PRIVATE_KEY:
+		index->complete &= ~PKCS11_FP_PRV;
+		break;
+	case CKO_PUBLIC_KEY:
+		index->complete &= ~PKCS11_FP_PUB;
+		break;
+	case CKO_CERTIFICATE:
+		index->complete &= ~PKCS11_FP_CERT;
+		break;
+	}
+	pthread_mutex_unlock(&index->lock);
+}
+
+/* Record that an enumeration holds all the objects of its class */
+void pkcs11_fpindex_complete(PKCS11_SLOT_private *slot, CK_OBJECT_CLASS type)
+{
+	PKCS11_FP_INDEX *index = &slot->fpindex;
+
+	pthread_mutex_lock(&index->lock);
+	switch (type) {
+	case CKO_PRIVATE_KEY:
+		index->complete |= PKCS11_FP_PRV;
+		break;
+	case CKO_PUBLIC_KEY:
+		index->complete |= PKCS11_FP_PUB;
+		break;
+	case CKO_CERTIFICATE:
+		index->complete |= PKCS11_FP_CERT;
+		break;
+	}
+	pthread_mutex_unlock(&index->lock);
+}
+
+static void pkcs11_fp_hash(int type, const unsigned char *data, size_t len,
+		unsigned char *fp)
+{
+	SHA256_CTX sha;
+	unsigned char prefix = (unsigned char)type;
+
+	/* Leading zeros of big-endian integers are not significant */
+	while (len > 1 && data[0] == 0) {
+		data++;
+		len--;
+	}
+	SHA256_Init(&sha);
+	SHA256_Update(&sha, &prefix, 1);
+	SHA256_Update(&sha, data, len);
+	SHA256_Final(fp, &sha);
+}
+
+int pkcs11_fingerprint_rsa(const BIGNUM *n, unsigned char *fp)
+{
+	unsigned char *buf;
+	int len;
+
+	if (!n || BN_is_zero(n))
+		return -1;
+	len = BN_num_bytes(n);
+	buf = OPENSSL_malloc(len);
+	if (!buf)
+		return -1;
+	BN_bn2bin(n, buf);
+	pkcs11_fp_hash(EVP_PKEY_RSA, buf, len, fp);
+	OPENSSL_free(buf);
+	return 0;
+}
+
+int pkcs11_fingerprint_pkey(EVP_PKEY *pkey, unsigned char *fp)
+{
+	const RSA *rsa;
+	const BIGNUM *n = NULL;
+#ifndef OPENSSL_NO_EC
+	const EC_KEY *ec;
+	unsigned char *point;
+	size_t len;
+#endif
+
+	switch (EVP_PKEY_base_id(pkey)) {
+	case EVP_PKEY_RSA:
+		rsa = EVP_PKEY_get0_RSA(pkey);
+		if (!rsa)
+			return -1;
+#if OPENSSL_VERSION_NUMBER >= 0x10100005L || ( defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER >= 0x3050000fL )
+		RSA_get0_key(rsa, &n, NULL, NULL);
+#else
+		n = rsa->n;
+#endif
+		return pkcs11_fingerprint_rsa(n, fp);
+#ifndef OPENSSL_NO_EC
+	case EVP_PKEY_EC:
+		ec = EVP_PKEY_get0_EC_KEY(pkey);
+		if (!ec || !EC_KEY_get0_public_key(ec) || !EC_KEY_get0_group(ec))
+			return -1;
+		len = EC_POINT_point2oct(EC_KEY_get0_group(ec),
+			EC_KEY_get0_public_key(ec), POINT_CONVERSION_UNCOMPRESSED,
+			NULL, 0, NULL);
+		point = len ? OPENSSL_malloc(len) : NULL;
+		if (!point)
+			return -1;
+		EC_POINT_point2oct(EC_KEY_get0_group(ec), EC_KEY_get0_public_key(ec),
+			POINT_CONVERSION_UNCOMPRESSED, point, len, NULL);
+		pkcs11_fp_hash(EVP_PKEY_EC, point, len, fp);
+		OPENSSL_free(point);
+		return 0;
+#endif
+	}
+	return -1;
+}
+
+/* Read an attribute, with a temporary session if none is provided */
+static int pkcs11_fp_getattr(PKCS11_OBJECT_private *obj,
+		CK_SESSION_HANDLE session, CK_ATTRIBUTE_TYPE type,
+		CK_BYTE **value, size_t *len)
+{
+	PKCS11_SLOT_private *slot = obj->slot;
+	int rv;
+
+	if (session != CK_INVALID_HANDLE)
+		return pkcs11_getattr_alloc(slot, session, obj->object,
+			type, value, len);
+	if (pkcs11_get_session(slot, 0, &session))
+		return -1;
+	rv = pkcs11_getattr_alloc(slot, session, obj->object, type, value, len);
+	pkcs11_put_session(slot, session);
+	return rv;
+}
+
+/* Hash the public key value from the attributes of a key object */
+static int pkcs11_fingerprint_key(PKCS11_OBJECT_private *obj,
+		CK_SESSION_HANDLE session, unsigned char *fp)
+{
+	CK_BYTE *value;
+	size_t len;
+	const unsigned char *a;
+	ASN1_OCTET_STRING *os;
+
+	if (!obj->ops)
+		return -1;
+	switch (obj->ops->pkey_type) {
+	case EVP_PKEY_RSA:
+		if (pkcs11_fp_getattr(obj, session, CKA_MODULUS, &value, &len))
+			return -1;
+		pkcs11_fp_hash(EVP_PKEY_RSA, value, len, fp);
+		OPENSSL_free(value);
+		return 0;
+	case EVP_PKEY_EC:
+		/* Private keys usually have no CKA_EC_POINT */
+		if (pkcs11_fp_getattr(obj, session, CKA_EC_POINT, &value, &len))
+			return -1;
+		/* PKCS#11-compliant modules should return ASN1_OCTET_STRING */
+		a = value;
+		os = d2i_ASN1_OCTET_STRING(NULL, &a, (long)len);
+		if (os && a == value + len) {
+			pkcs11_fp_hash(EVP_PKEY_EC, os->data, os->length, fp);
+		} else { /* Workaround for broken PKCS#11 modules */
+			pkcs11_fp_hash(EVP_PKEY_EC, value, len, fp);
+		}
+		ASN1_STRING_free(os);
+		OPENSSL_free(value);
+		return 0;
+	}
+	return -1;
+}
+
+int pkcs11_fingerprint_object(PKCS11_OBJECT_private *obj,
+		CK_SESSION_HANDLE session, unsigned char *fp)
+{
+	EVP_PKEY *pkey;
+	int rv;
+
+	if (obj->object_class != CKO_CERTIFICATE)
+		return pkcs11_fingerprint_key(obj, session, fp);
+	if (!obj->x509)
+		return -1;
+	pkey = X509_get_pubkey(obj->x509);
+	if (!pkey)
+		return -1;
+	rv = pkcs11_fingerprint_pkey(pkey, fp);
+	EVP_PKEY_free(pkey);
+	return rv;
+}
+
+static unsigned int pkcs11_fp_bucket(const PKCS11_FP_INDEX *index,
+		const unsigned char *fp)
+{
+	return ((unsigned int)fp[0] << 24 | (unsigned int)fp[1] << 16 |
+		(unsigned int)fp[2] << 8 | fp[3]) & (index->nbuckets - 1);
+}
+
+/* Called with the index lock held */
+static PKCS11_FP_ENTRY *pkcs11_fp_lookup(const PKCS11_FP_INDEX *index,
+		const unsigned char *fp)
+{
+	PKCS11_FP_ENTRY *e;
+
+	if (!index->nbuckets)
+		return NULL;
+	for (e = index->buckets[pkcs11_fp_bucket(index, fp)]; e; e = e->next)
+		if (!memcmp(e->fp, fp, PKCS11_FP_LEN))
+			return e;
+	return NULL;
+}
+
+/* Keep the load factor below 2
+ * Called with the index lock held */
+static int pkcs11_fp_grow(PKCS11_FP_INDEX *index)
+{
+	PKCS11_FP_ENTRY **buckets, **old = index->buckets, *e, *next;
+	unsigned int n, nbuckets, old_nbuckets = index->nbuckets;
+
+	if (index->nentries < 2 * index->nbuckets)
+		return 0;
+	nbuckets = old_nbuckets ? 2 * old_nbuckets : PKCS11_FP_MIN_BUCKETS;
+	buckets = OPENSSL_malloc(nbuckets * sizeof(PKCS11_FP_ENTRY *));
+	if (!buckets)
+		return old_nbuckets ? 0 : -1;
+	memset(buckets, 0, nbuckets * sizeof(PKCS11_FP_ENTRY *));
+	index->buckets = buckets;
+	index->nbuckets = nbuckets;
+	for (n = 0; n < old_nbuckets; n++) {
+		for (e = old[n]; e; e = next) {
+			next = e->next;
+			e->next = buckets[pkcs11_fp_bucket(index, e->fp)];
+			buckets[pkcs11_fp_bucket(index, e->fp)] = e;
+		}
+	}
+	OPENSSL_free(old);
+	return 0;
+}
+
+/* Called with the index lock held */
+static void pkcs11_fp_add(PKCS11_FP_INDEX *index, PKCS11_OBJECT_private *obj,
+		CK_SESSION_HANDLE session, int pos)
+{
+	PKCS11_FP_ENTRY *e;
+	unsigned char fp[PKCS11_FP_LEN];
+	unsigned int bucket;
+	int *field;
+
+	if (!obj || pkcs11_fingerprint_object(obj, session, fp))
+		return; /* Not indexed */
+	e = pkcs11_fp_lookup(index, fp);
+	if (!e) {
+		if (pkcs11_fp_grow(index))
+			return;
+		e = OPENSSL_malloc(sizeof(PKCS11_FP_ENTRY));
+		if (!e)
+			return;
+		memcpy(e->fp, fp, PKCS11_FP_LEN);
+		e->prv = e->pub = e->cert = -1;
+		bucket = pkcs11_fp_bucket(index, fp);
+		e->next = index->buckets[bucket];
+		index->buckets[bucket] = e;
+		index->nentries++;
+	}
+	switch (obj->object_class) {
+	case CKO_PRIVATE_KEY:
+		field = &e->prv;
+		break;
+	case CKO_PUBLIC_KEY:
+		field = &e->pub;
+		break;
+	default:
+		field = &e->cert;
+		break;
+	}
+	/* The first object enumerated wins */
+	if (*field < 0)
+		*field = pos;
+}
+
+/* Index the objects enumerated since the last lookup
+ * Called with the index lock held */
+static void pkcs11_fpindex_update(PKCS11_SLOT_private *slot,
+		CK_SESSION_HANDLE session)
+{
+	PKCS11_FP_INDEX *index = &slot->fpindex;
+
+	for (; index->nprv < slot->prv.num; index->nprv++)
+		pkcs11_fp_add(index, PRIVKEY(&slot->prv.keys[index->nprv]),
+			session, index->nprv);
+	for (; index->npub < slot->pub.num; index->npub++)
+		pkcs11_fp_add(index, PRIVKEY(&slot->pub.keys[index->npub]),
+			session, index->npub);
+	for (; index->ncerts < slot->ncerts; index->ncerts++)
+		pkcs11_fp_add(index, PRIVCERT(&slot->certs[index->ncerts]),
+			session, index->ncerts);
+}
+
+/* Enumerate all the objects of the requested classes, once per slot
+ * The public keys are also needed to pair the private keys without
+ * a public key value */
+static void pkcs11_fpindex_enumerate(PKCS11_SLOT_private *slot,
+		PKCS11_KEY **prv, PKCS11_KEY **pub, PKCS11_CERT **cert)
+{
+	int complete;
+
+	pthread_mutex_lock(&slot->fpindex.lock);
+	complete = slot->fpindex.complete;
+	pthread_mutex_unlock(&slot->fpindex.lock);
+
+	/* The enumerations are retried on the next lookup if they failed */
+	ERR_set_mark();
+	if (prv && !(complete & PKCS11_FP_PRV))
+		pkcs11_enumerate_keys(slot, CKO_PRIVATE_KEY, NULL, NULL, NULL);
+	if ((prv || pub) && !(complete & PKCS11_FP_PUB))
+		pkcs11_enumerate_keys(slot, CKO_PUBLIC_KEY, NULL, NULL, NULL);
+	if (cert && !(complete & PKCS11_FP_CERT))
+		pkcs11_enumerate_certs(slot, NULL, NULL, NULL);
+	ERR_pop_to_mark();
+}
+
+/* Private key with the CKA_ID of a public key, for the private keys that
+ * could not be indexed (e.g. EC private keys without CKA_EC_POINT)
+ * Called with the index lock held */
+static PKCS11_KEY *pkcs11_fp_pair(PKCS11_SLOT_private *slot, PKCS11_KEY *pub)
+{
+	int n;
+
+	if (!pub->id_len)
+		return NULL;
+	for (n = 0; n < slot->prv.num; n++)
+		if (slot->prv.keys[n].id_len == pub->id_len &&
+				!memcmp(slot->prv.keys[n].id, pub->id, pub->id_len))
+			return &slot->prv.keys[n];
+	return NULL;
+}
+
+/*
+ * Find the objects with a public key fingerprint
+ * With enumerate set, all the objects of the requested classes are
+ * enumerated first, which requires an invalid session handle.
+ * Returns 0 if any object was found, -1 otherwise
+ */
+int pkcs11_fpindex_find(PKCS11_SLOT_private *slot, CK_SESSION_HANDLE session,
+		const unsigned char *fp, int enumerate,
+		PKCS11_KEY **prv, PKCS11_KEY **pub, PKCS11_CERT **cert)
+{
+	PKCS11_FP_INDEX *index = &slot->fpindex;
+	PKCS11_FP_ENTRY *e;
+	int release = 0, found = 0;
+
+	if (prv)
+		*prv = NULL;
+	if (pub)
+		*pub = NULL;
+	if (cert)
+		*cert = NULL;
+	if (enumerate && session == CK_INVALID_HANDLE)
+		pkcs11_fpindex_enumerate(slot, prv, pub, cert);
+
+	if (session == CK_INVALID_HANDLE) {
+		if (pkcs11_get_session(slot, 0, &session))
+			return -1;
+		release = 1;
+	}
+	pthread_mutex_lock(&index->lock);
+	/* The attributes missing from some objects are not errors */
+	ERR_set_mark();
+	pkcs11_fpindex_update(slot, session);
+	ERR_pop_to_mark();
+	e = pkcs11_fp_lookup(index, fp);
+	if (e) {
+		if (prv && e->prv >= 0 && e->prv < slot->prv.num) {
+			*prv = &slot->prv.keys[e->prv];
+			found = 1;
+		} else if (prv && e->pub >= 0 && e->pub < slot->pub.num) {
+			*prv = pkcs11_fp_pair(slot, &slot->pub.keys[e->pub]);
+			found = *prv != NULL;
+		}
+		if (pub && e->pub >= 0 && e->pub < slot->pub.num) {
+			*pub = &slot->pub.keys[e->pub];
+			found = 1;
+		}
+		if (cert && e->cert >= 0 && e->cert < slot->ncerts) {
+			*cert = &slot->certs[e->cert];
+			found = 1;
+		}
+	}
+	pthread_mutex_unlock(&index->lock);
+	if (release)
+		pkcs11_put_session(slot, session);
+	return found ? 0 : -1;
+}
+
+int pkcs11_find_by_public_key(PKCS11_SLOT_private *slot, EVP_PKEY *pkey,
+		PKCS11_KEY **prv, PKCS11_KEY **pub, PKCS11_CERT **cert)
+{
+	unsigned char fp[PKCS11_FP_LEN];
+
+	if (prv)
+		*prv = NULL;
+	if (pub)
+		*pub = NULL;
+	if (cert)
+		*cert = NULL;
+	if (!pkey || pkcs11_fingerprint_pkey(pkey, fp)) {
+		P11err(P11_F_PKCS11_FIND_BY_PUBLIC_KEY, P11_R_INVALID_PARAMETER);
+		return -1;
+	}
+	return pkcs11_fpindex_find(slot, CK_INVALID_HANDLE, fp, 1,
+		prv, pub, cert);
+}
+
+/* vim: set noexpandtab: */
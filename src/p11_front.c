@@ -136,6 +136,27 @@ PKCS11_SLOT *PKCS11_find_token(PKCS11_CTX *ctx,
 	return best;
 }
 
+PKCS11_SLOT *PKCS11_place_key(PKCS11_CTX *ctx,
+		PKCS11_SLOT *slots, unsigned int nslots,
+		const unsigned char *id, size_t id_len)
+{
+	PKCS11_SLOT **list, *placed;
+	unsigned int n;
+
+	if (check_fork(PRIVCTX(ctx)) < 0)
+		return NULL;
+	if (!slots || nslots == 0)
+		return NULL;
+	list = OPENSSL_malloc(nslots * sizeof(PKCS11_SLOT *));
+	if (!list)
+		return NULL;
+	for (n = 0; n < nslots; n++)
+		list[n] = slots + n;
+	placed = pkcs11_place_key(list, nslots, id, id_len);
+	OPENSSL_free(list);
+	return placed;
+}
+
 PKCS11_SLOT *PKCS11_find_next_token(PKCS11_CTX *ctx,
 		PKCS11_SLOT *slots, unsigned int nslots,
 		PKCS11_SLOT *current)
@@ -274,6 +295,15 @@ PKCS11_KEY *PKCS11_find_key(PKCS11_CERT *pcert)
 	return pkcs11_find_key(cert);
 }
 
+int PKCS11_find_by_public_key(PKCS11_TOKEN *token, EVP_PKEY *pkey,
+		PKCS11_KEY **prv, PKCS11_KEY **pub, PKCS11_CERT **cert)
+{
+	PKCS11_SLOT_private *slot = PRIVSLOT(token->slot);
+	if (check_slot_fork(slot) < 0)
+		return -1;
+	return pkcs11_find_by_public_key(slot, pkey, prv, pub, cert);
+}
+
 int PKCS11_enumerate_certs_ext(PKCS11_TOKEN *token, const PKCS11_CERT *cert_template,
 		PKCS11_CERT **certs, unsigned int *ncerts)
 {
@@ -289,6 +319,15 @@ int PKCS11_enumerate_certs(PKCS11_TOKEN *token,
 	return PKCS11_enumerate_certs_ext(token, NULL, certs, ncerts);
 }
 
+int PKCS11_get_cert_der(PKCS11_CERT *pcert,
+		const unsigned char **der, size_t *len)
+{
+	PKCS11_OBJECT_private *cert = PRIVCERT(pcert);
+	if (!der || !len)
+		return -1;
+	return pkcs11_get_cert_der(cert, der, len);
+}
+
 int PKCS11_remove_certificate(PKCS11_CERT *pcert)
 {
 	PKCS11_OBJECT_private *cert = PRIVCERT(pcert);
@@ -399,6 +438,125 @@ int PKCS11_set_ui_method(PKCS11_CTX *pctx, UI_METHOD *ui_method, void *ui_user_d
 	return pkcs11_set_ui_method(ctx, ui_method, ui_user_data);
 }
 
+int PKCS11_set_op_hooks(PKCS11_CTX *pctx, PKCS11_OP_PRE_HOOK pre,
+		PKCS11_OP_POST_HOOK post, void *user_data)
+{
+	PKCS11_CTX_private *ctx = PRIVCTX(pctx);
+	if (check_fork(ctx) < 0)
+		return -1;
+	return pkcs11_set_op_hooks(ctx, pre, post, user_data);
+}
+
+int PKCS11_set_slow_op_threshold(PKCS11_CTX *pctx, int operation,
+		unsigned long threshold)
+{
+	PKCS11_CTX_private *ctx = PRIVCTX(pctx);
+	if (check_fork(ctx) < 0)
+		return -1;
+	return pkcs11_set_slow_op_threshold(ctx, operation, threshold);
+}
+
+int PKCS11_get_slow_ops(PKCS11_CTX *pctx, PKCS11_SLOW_OP *ops,
+		unsigned int *count)
+{
+	PKCS11_CTX_private *ctx = PRIVCTX(pctx);
+	if (check_fork(ctx) < 0)
+		return -1;
+	return pkcs11_get_slow_ops(ctx, ops, count);
+}
+
+int PKCS11_get_memory_usage(PKCS11_CTX *pctx, PKCS11_MEM_USAGE *usage)
+{
+	PKCS11_CTX_private *ctx = PRIVCTX(pctx);
+	if (check_fork(ctx) < 0)
+		return -1;
+	return pkcs11_get_memory_usage(pctx, usage);
+}
+
+int PKCS11_get_slot_memory_usage(PKCS11_SLOT *pslot, PKCS11_MEM_USAGE *usage)
+{
+	PKCS11_SLOT_private *slot = PRIVSLOT(pslot);
+	if (check_slot_fork(slot) < 0)
+		return -1;
+	return pkcs11_get_slot_memory_usage(pslot, usage);
+}
+
+int PKCS11_set_session_affinity(PKCS11_CTX *pctx, unsigned int max_skips)
+{
+	PKCS11_CTX_private *ctx = PRIVCTX(pctx);
+	if (check_fork(ctx) < 0)
+		return -1;
+	return pkcs11_set_session_affinity(ctx, max_skips);
+}
+
+int PKCS11_set_session_quota(PKCS11_CTX *pctx, const char *name,
+		unsigned int budget)
+{
+	PKCS11_CTX_private *ctx = PRIVCTX(pctx);
+	if (check_fork(ctx) < 0)
+		return -1;
+	return pkcs11_set_session_quota(ctx, name, budget);
+}
+
+int PKCS11_get_session_quota(PKCS11_SLOT *pslot, PKCS11_SESSION_QUOTA *status)
+{
+	PKCS11_SLOT_private *slot = PRIVSLOT(pslot);
+	if (check_slot_fork(slot) < 0)
+		return -1;
+	return pkcs11_get_session_quota(slot, status);
+}
+
+int PKCS11_set_concurrency_limit(PKCS11_CTX *pctx, unsigned int min,
+		unsigned int max, unsigned long max_wait)
+{
+	PKCS11_CTX_private *ctx = PRIVCTX(pctx);
+	if (check_fork(ctx) < 0)
+		return -1;
+	return pkcs11_set_concurrency_limit(ctx, min, max, max_wait);
+}
+
+int PKCS11_get_concurrency(PKCS11_SLOT *pslot, PKCS11_CONCURRENCY *status)
+{
+	PKCS11_SLOT_private *slot = PRIVSLOT(pslot);
+	if (check_slot_fork(slot) < 0)
+		return -1;
+	return pkcs11_get_concurrency(slot, status);
+}
+
+int PKCS11_set_rate_limit(PKCS11_CTX *pctx, unsigned long rate,
+		unsigned long burst, unsigned long max_wait)
+{
+	PKCS11_CTX_private *ctx = PRIVCTX(pctx);
+	if (check_fork(ctx) < 0)
+		return -1;
+	return pkcs11_set_rate_limit(ctx, rate, burst, max_wait);
+}
+
+int PKCS11_get_rate_limit(PKCS11_SLOT *pslot, PKCS11_RATE_LIMIT *status)
+{
+	PKCS11_SLOT_private *slot = PRIVSLOT(pslot);
+	if (check_slot_fork(slot) < 0)
+		return -1;
+	return pkcs11_get_rate_limit(slot, status);
+}
+
+int PKCS11_set_lock_profiling(PKCS11_CTX *pctx, int enable)
+{
+	PKCS11_CTX_private *ctx = PRIVCTX(pctx);
+	if (check_fork(ctx) < 0)
+		return -1;
+	return pkcs11_set_lock_profiling(ctx, enable);
+}
+
+int PKCS11_get_lock_stats(PKCS11_CTX *pctx, PKCS11_LOCK_STATS *stats,
+		unsigned int *count)
+{
+	PKCS11_CTX_private *ctx = PRIVCTX(pctx);
+	if (check_fork(ctx) < 0)
+		return -1;
+	return pkcs11_get_lock_stats(ctx, stats, count);
+}
+
 /* External interface to the deprecated features */
 
 int PKCS11_generate_key(PKCS11_TOKEN *token,
@@ -411,6 +569,37 @@ int PKCS11_generate_key(PKCS11_TOKEN *token,
 	return pkcs11_generate_key(slot, algorithm, bits, label, id, id_len);
 }
 
+int PKCS11_keypool_start(PKCS11_SLOT *pslot, int curve_nid,
+		unsigned int low_watermark, unsigned int high_watermark)
+{
+	PKCS11_SLOT_private *slot = PRIVSLOT(pslot);
+	if (check_slot_fork(slot) < 0)
+		return -1;
+	return pkcs11_keypool_start(slot, curve_nid, low_watermark, high_watermark);
+}
+
+int PKCS11_keypool_stop(PKCS11_SLOT *pslot)
+{
+	PKCS11_SLOT_private *slot = PRIVSLOT(pslot);
+	if (check_slot_fork(slot) < 0)
+		return -1;
+	return pkcs11_keypool_stop(slot);
+}
+
+PKCS11_KEY *PKCS11_keypool_get(PKCS11_SLOT *pslot)
+{
+	PKCS11_SLOT_private *slot = PRIVSLOT(pslot);
+	if (check_slot_fork(slot) < 0)
+		return NULL;
+	return pkcs11_keypool_get(slot);
+}
+
+void PKCS11_keypool_put(PKCS11_KEY *key)
+{
+	/* Key pairs lost in fork() are recognized by the pool itself */
+	pkcs11_keypool_put(key);
+}
+
 int PKCS11_get_key_size(PKCS11_KEY *pkey)
 {
 	PKCS11_OBJECT_private *key = PRIVKEY(pkey);
@@ -462,6 +651,72 @@ int PKCS11_private_decrypt(int flen, const unsigned char *from, unsigned char *t
 	return pkcs11_private_decrypt(flen, from, to, key, padding);
 }
 
+int PKCS11_sign_mech(PKCS11_KEY *pkey, const PKCS11_MECHANISM *mech,
+		const unsigned char *in, size_t in_len,
+		unsigned char *sig, size_t *sig_len)
+{
+	PKCS11_OBJECT_private *key = PRIVKEY(pkey);
+	if (check_object_fork(key) < 0)
+		return -1;
+	return pkcs11_sign_mech(key, mech, in, in_len, sig, sig_len);
+}
+
+int PKCS11_sign_bulk(PKCS11_KEY *pkey, const PKCS11_MECHANISM *mech,
+		const EVP_MD *md, unsigned int count,
+		const unsigned char * const *msgs, const size_t *msg_lens,
+		unsigned char **sigs, size_t *sig_lens, unsigned int threads)
+{
+	PKCS11_OBJECT_private *key = PRIVKEY(pkey);
+	if (check_object_fork(key) < 0)
+		return -1;
+	return pkcs11_sign_bulk(key, mech, md, count, msgs, msg_lens,
+		sigs, sig_lens, threads);
+}
+
+int PKCS11_set_signature_cache(PKCS11_KEY *pkey, unsigned int entries)
+{
+	PKCS11_OBJECT_private *key = PRIVKEY(pkey);
+	if (check_object_fork(key) < 0)
+		return -1;
+	return pkcs11_set_signature_cache(key, entries);
+}
+
+int PKCS11_get_signature_cache(PKCS11_KEY *pkey,
+		PKCS11_SIGNATURE_CACHE *stats)
+{
+	PKCS11_OBJECT_private *key = PRIVKEY(pkey);
+	if (check_object_fork(key) < 0)
+		return -1;
+	return pkcs11_get_signature_cache(key, stats);
+}
+
+int PKCS11_set_key_rate_limit(PKCS11_KEY *pkey, unsigned long rate,
+		unsigned long burst)
+{
+	PKCS11_OBJECT_private *key = PRIVKEY(pkey);
+	if (check_object_fork(key) < 0)
+		return -1;
+	return pkcs11_set_key_rate_limit(key, rate, burst);
+}
+
+int PKCS11_get_key_rate_limit(PKCS11_KEY *pkey, PKCS11_RATE_LIMIT *status)
+{
+	PKCS11_OBJECT_private *key = PRIVKEY(pkey);
+	if (check_object_fork(key) < 0)
+		return -1;
+	return pkcs11_get_key_rate_limit(key, status);
+}
+
+int PKCS11_decrypt_mech(PKCS11_KEY *pkey, const PKCS11_MECHANISM *mech,
+		const unsigned char *in, size_t in_len,
+		unsigned char *out, size_t *out_len)
+{
+	PKCS11_OBJECT_private *key = PRIVKEY(pkey);
+	if (check_object_fork(key) < 0)
+		return -1;
+	return pkcs11_decrypt_mech(key, mech, in, in_len, out, out_len);
+}
+
 int PKCS11_verify(int type, const unsigned char *m, unsigned int m_len,
 		unsigned char *signature, unsigned int siglen, PKCS11_KEY *key)
 {
@@ -43,9 +43,14 @@ static CK_OBJECT_HANDLE pkcs11_handle_from_template(PKCS11_SLOT_private *slot,
 {
 	PKCS11_CTX_private *ctx = slot->ctx;
 	CK_OBJECT_HANDLE object;
-	CK_ULONG count;
+	CK_ULONG count = 0;
+	PKCS11_OP op;
 	CK_RV rv;
 
+	if (pkcs11_op_begin_find(&op, slot, tmpl)) {
+		pkcs11_zap_attrs(tmpl);
+		return CK_INVALID_HANDLE;
+	}
 	rv = CRYPTOKI_call(ctx,
 		C_FindObjectsInit(session, tmpl->attrs, tmpl->nattr));
 	if (rv == CKR_OK) {
@@ -53,6 +58,7 @@ static CK_OBJECT_HANDLE pkcs11_handle_from_template(PKCS11_SLOT_private *slot,
 			C_FindObjects(session, &object, 1, &count));
 		CRYPTOKI_call(ctx, C_FindObjectsFinal(session));
 	}
+	pkcs11_op_end(&op, CK_INVALID_HANDLE, rv, count);
 	pkcs11_zap_attrs(tmpl);
 
 	if (rv == CKR_OK && count == 1)
@@ -65,7 +71,6 @@ static CK_OBJECT_HANDLE pkcs11_handle_from_template(PKCS11_SLOT_private *slot,
 PKCS11_OBJECT_private *pkcs11_object_from_handle(PKCS11_SLOT_private *slot,
 		CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object)
 {
-	PKCS11_CTX_private *ctx = slot->ctx;
 	PKCS11_OBJECT_private *obj;
 	PKCS11_OBJECT_ops *ops = NULL;
 	CK_OBJECT_CLASS object_class = -1;
@@ -74,14 +79,14 @@ PKCS11_OBJECT_private *pkcs11_object_from_handle(PKCS11_SLOT_private *slot,
 	size_t size;
 	unsigned char *data;
 
-	if (pkcs11_getattr_val(ctx, session, object, CKA_CLASS,
+	if (pkcs11_getattr_val(slot, session, object, CKA_CLASS,
 			(CK_BYTE *) &object_class, sizeof(object_class)))
 		return NULL;
 
 	switch (object_class) {
 	case CKO_PUBLIC_KEY:
 	case CKO_PRIVATE_KEY:
-		if (pkcs11_getattr_val(ctx, session, object, CKA_KEY_TYPE,
+		if (pkcs11_getattr_val(slot, session, object, CKA_KEY_TYPE,
 				(CK_BYTE *)&key_type, sizeof(key_type)))
 			return NULL;
 		switch (key_type) {
@@ -99,7 +104,7 @@ PKCS11_OBJECT_private *pkcs11_object_from_handle(PKCS11_SLOT_private *slot,
 		}
 		break;
 	case CKO_CERTIFICATE:
-		if (pkcs11_getattr_val(ctx, session, object, CKA_CERTIFICATE_TYPE,
+		if (pkcs11_getattr_val(slot, session, object, CKA_CERTIFICATE_TYPE,
 				(CK_BYTE *)&cert_type, sizeof(cert_type)))
 			return NULL;
 		/* Ignore unknown certificate types */
@@ -121,14 +126,14 @@ PKCS11_OBJECT_private *pkcs11_object_from_handle(PKCS11_SLOT_private *slot,
 	obj->object = object;
 	obj->slot = pkcs11_slot_ref(slot);
 	obj->id_len = sizeof(obj->id);
-	if (pkcs11_getattr_var(ctx, session, object, CKA_ID, obj->id, &obj->id_len))
+	if (pkcs11_getattr_var(slot, session, object, CKA_ID, obj->id, &obj->id_len))
 		obj->id_len = 0;
-	pkcs11_getattr_alloc(ctx, session, object, CKA_LABEL, (CK_BYTE **)&obj->label, NULL);
+	pkcs11_getattr_alloc(slot, session, object, CKA_LABEL, (CK_BYTE **)&obj->label, NULL);
 	obj->ops = ops;
 	obj->forkid = get_forkid();
 	switch (object_class) {
 	case CKO_PRIVATE_KEY:
-		if (pkcs11_getattr_val(ctx, session, object, CKA_ALWAYS_AUTHENTICATE,
+		if (pkcs11_getattr_val(slot, session, object, CKA_ALWAYS_AUTHENTICATE,
 				&obj->always_authenticate, sizeof(CK_BBOOL))) {
 #ifdef DEBUG
 			fprintf(stderr, "Missing CKA_ALWAYS_AUTHENTICATE attribute\n");
@@ -136,14 +141,15 @@ PKCS11_OBJECT_private *pkcs11_object_from_handle(PKCS11_SLOT_private *slot,
 		}
 		break;
 	case CKO_CERTIFICATE:
-		if (!pkcs11_getattr_alloc(ctx, session, object, CKA_VALUE,
+		if (!pkcs11_getattr_alloc(slot, session, object, CKA_VALUE,
 				&data, &size)) {
-			const unsigned char *p = data;
-			obj->x509 = d2i_X509(NULL, &p, (long)size);
-			OPENSSL_free(data);
+			obj->x509 = pkcs11_x509_get(data, size, &obj->der);
+			if (obj->der)
+				obj->der_len = size;
 		}
 		break;
 	}
+	pkcs11_mem_object(obj, 1);
 	return obj;
 }
 
@@ -192,11 +198,15 @@ void pkcs11_object_free(PKCS11_OBJECT_private *obj)
 		 * it will call this function again. */
 		EVP_PKEY *pkey = obj->evp_key;
 		obj->evp_key = NULL;
+		pkcs11_mem_pkey(obj, pkey, -1);
 		EVP_PKEY_free(pkey);
 		return;
 	}
+	pkcs11_mem_object(obj, -1);
+	pkcs11_sigcache_free(obj);
+	pkcs11_bucket_free(obj->bucket);
 	pkcs11_slot_unref(obj->slot);
-	X509_free(obj->x509);
+	pkcs11_x509_put(obj->x509, obj->der, obj->der_len);
 	OPENSSL_free(obj->label);
 	pthread_mutex_destroy(&obj->lock);
 	OPENSSL_free(obj);
@@ -220,20 +230,28 @@ PKCS11_KEY *pkcs11_find_key(PKCS11_OBJECT_private *cert)
 {
 	PKCS11_KEY *keys, key_template = {0};
 	unsigned int n, count;
+	unsigned char fp[PKCS11_FP_LEN];
 	key_template.isPrivate = 1;
 
 	key_template.id = cert->id;
 	key_template.id_len = cert->id_len;
 
-	if (pkcs11_enumerate_keys(cert->slot, CKO_PRIVATE_KEY, &key_template, &keys, &count))
-		return NULL;
-	for (n = 0; n < count; n++) {
-		PKCS11_OBJECT_private *kpriv = PRIVKEY(&keys[n]);
-		if (kpriv && cert->id_len == kpriv->id_len
-				&& !memcmp(cert->id, kpriv->id, cert->id_len))
-			return &keys[n];
+	if (!pkcs11_enumerate_keys(cert->slot, CKO_PRIVATE_KEY, &key_template,
+			&keys, &count)) {
+		for (n = 0; n < count; n++) {
+			PKCS11_OBJECT_private *kpriv = PRIVKEY(&keys[n]);
+			if (kpriv && cert->id_len == kpriv->id_len
+					&& !memcmp(cert->id, kpriv->id, cert->id_len))
+				return &keys[n];
+		}
 	}
-	return NULL;
+
+	/* No private key with the same CKA_ID: compare the public keys */
+	if (pkcs11_fingerprint_object(cert, CK_INVALID_HANDLE, fp) ||
+			pkcs11_fpindex_find(cert->slot, CK_INVALID_HANDLE, fp, 1,
+				&keys, NULL, NULL))
+		return NULL;
+	return keys;
 }
 
 /*
@@ -427,6 +445,8 @@ static int pkcs11_store_key(PKCS11_SLOT_private *slot, EVP_PKEY *pk,
 	pkcs11_zap_attrs(&tmpl);
 
 	if (rv == CKR_OK) {
+		/* The module may have reused the handle of a destroyed object */
+		pkcs11_attr_cache_invalidate(slot, object);
 		/* Gobble the key object */
 		r = pkcs11_init_key(slot, session, object, type, ret_key);
 	}
@@ -464,6 +484,7 @@ EVP_PKEY *pkcs11_get_key(PKCS11_OBJECT_private *key0, CK_OBJECT_CLASS object_cla
 		key->evp_key = key->ops->get_evp_key(key);
 		if (!key->evp_key)
 			goto err;
+		pkcs11_mem_pkey(key, key->evp_key, 1);
 	}
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L || ( defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER >= 0x3050000fL )
 	EVP_PKEY_up_ref(key->evp_key);
@@ -530,6 +551,56 @@ int pkcs11_authenticate(PKCS11_OBJECT_private *key, CK_SESSION_HANDLE session)
 	return rv == CKR_USER_ALREADY_LOGGED_IN ? 0 : rv;
 }
 
+/* A single attempt of pkcs11_private_op() */
+static CK_RV pkcs11_private_op_once(PKCS11_OBJECT_private *key,
+		CK_SESSION_HANDLE session, int operation, CK_MECHANISM *mechanism,
+		const unsigned char *in, size_t in_len,
+		unsigned char *out, CK_ULONG *out_len)
+{
+	PKCS11_CTX_private *ctx = key->slot->ctx;
+	CK_RV rv;
+
+	if (operation == PKCS11_OP_SIGN)
+		rv = CRYPTOKI_call(ctx,
+			C_SignInit(session, mechanism, key->object));
+	else
+		rv = CRYPTOKI_call(ctx,
+			C_DecryptInit(session, mechanism, key->object));
+	if (!rv && key->always_authenticate == CK_TRUE)
+		rv = pkcs11_authenticate(key, session);
+	if (rv)
+		return rv;
+	if (operation == PKCS11_OP_SIGN)
+		return CRYPTOKI_call(ctx,
+			C_Sign(session, (CK_BYTE_PTR)in, in_len, out, out_len));
+	return CRYPTOKI_call(ctx,
+		C_Decrypt(session, (CK_BYTE_PTR)in, in_len, out, out_len));
+}
+
+/*
+ * Run a single-part sign or decrypt operation with the private key
+ * The session is expected to be acquired by the caller
+ */
+CK_RV pkcs11_private_op(PKCS11_OBJECT_private *key, CK_SESSION_HANDLE session,
+		int operation, CK_MECHANISM *mechanism,
+		const unsigned char *in, size_t in_len,
+		unsigned char *out, CK_ULONG *out_len)
+{
+	CK_ULONG len = *out_len;
+	CK_RV rv;
+
+	rv = pkcs11_private_op_once(key, session, operation, mechanism,
+		in, in_len, out, out_len);
+	/* Retry once if the token dropped the login state */
+	if (rv == CKR_USER_NOT_LOGGED_IN &&
+			pkcs11_relogin(key->slot, session) == 0) {
+		*out_len = len;
+		rv = pkcs11_private_op_once(key, session, operation, mechanism,
+			in, in_len, out, out_len);
+	}
+	return rv;
+}
+
 /*
  * Return keys of a given type (public or private) matching the key_template
  * Use the cached values if available
@@ -561,6 +632,8 @@ int pkcs11_enumerate_keys(PKCS11_SLOT_private *slot, unsigned int type, const PK
 		pkcs11_destroy_keys(slot, type);
 		return -1;
 	}
+	if (tmpl.nattr == 1) /* Only CKA_CLASS */
+		pkcs11_fpindex_complete(slot, type);
 
 	if (keyp)
 		*keyp = keys->keys;
@@ -585,6 +658,7 @@ int pkcs11_remove_object(PKCS11_OBJECT_private *obj)
 	rv = CRYPTOKI_call(ctx, C_DestroyObject(session, obj->object));
 	pkcs11_put_session(slot, session);
 	CRYPTOKI_checkerr(CKR_F_PKCS11_REMOVE_KEY, rv);
+	pkcs11_attr_cache_invalidate(slot, obj->object);
 
 	return 0;
 }
@@ -595,18 +669,30 @@ int pkcs11_remove_object(PKCS11_OBJECT_private *obj)
 static int pkcs11_find_keys(PKCS11_SLOT_private *slot, CK_SESSION_HANDLE session, unsigned int type, PKCS11_TEMPLATE *tmpl)
 {
 	PKCS11_CTX_private *ctx = slot->ctx;
+	PKCS11_OP op;
+	size_t found = 0;
 	int rv, res = -1;
 
+	if (pkcs11_op_begin_find(&op, slot, tmpl))
+		return -1;
+
 	/* Tell the PKCS11 lib to enumerate all matching objects */
 	rv = CRYPTOKI_call(ctx,
 		C_FindObjectsInit(session, tmpl->attrs, tmpl->nattr));
-	CRYPTOKI_checkerr(CKR_F_PKCS11_FIND_KEYS, rv);
+	if (rv != CKR_OK) {
+		pkcs11_op_end(&op, CK_INVALID_HANDLE, rv, 0);
+		CRYPTOKI_checkerr(CKR_F_PKCS11_FIND_KEYS, rv);
+	}
 
 	do {
 		res = pkcs11_next_key(ctx, slot, session, type);
+		if (res == 0)
+			found++;
 	} while (res == 0);
 
 	CRYPTOKI_call(ctx, C_FindObjectsFinal(session));
+	pkcs11_op_end(&op, CK_INVALID_HANDLE,
+		res < 0 ? CKR_GENERAL_ERROR : CKR_OK, found);
 
 	return (res < 0) ? -1 : 0;
 }
@@ -698,6 +784,7 @@ void pkcs11_destroy_keys(PKCS11_SLOT_private *slot, unsigned int type)
 		OPENSSL_free(keys->keys);
 	keys->keys = NULL;
 	keys->num = 0;
+	pkcs11_fpindex_reset(slot, type);
 }
 
 /* vim: set noexpandtab: */
@@ -0,0 +1,631 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * This file implements a per-slot pool of ephemeral EC key pairs.  The key
+ * pairs are session objects generated on the token by a background thread,
+ * so that protocols needing a fresh key for every key exchange do not wait
+ * for C_GenerateKeyPair().  Used key pairs are destroyed by the same thread.
+ *
+ * Session objects disappear with the session that created them, so the
+ * key pairs are all generated in a session dedicated to the pool, which is
+ * kept out of the session pool and of the session quota.  The pool is only
+ * emptied when that session is closed.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+#include <openssl/rand.h>
+
+#ifndef OPENSSL_NO_EC
+
+/* Length of the random CKA_ID linking the private and the public key */
+#define PKCS11_KEYPOOL_ID_LEN 16
+
+/* Key returned by pkcs11_keypool_get() */
+typedef struct pkcs11_pooled_key {
+	PKCS11_KEY key; /* must be the first member */
+	CK_OBJECT_HANDLE pub;
+	unsigned int generation;
+} PKCS11_POOLED_KEY;
+
+/* Return 1 if the session (and its objects) no longer exists */
+static int pkcs11_keypool_lost(CK_RV rv)
+{
+	return rv == CKR_SESSION_HANDLE_INVALID || rv == CKR_SESSION_CLOSED ||
+		rv == CKR_DEVICE_REMOVED || rv == CKR_TOKEN_NOT_PRESENT;
+}
+
+/*
+ * Forget the key pairs of the dedicated session
+ * Called with pool->session_lock held
+ */
+static void pkcs11_keypool_forget(PKCS11_KEYPOOL *pool)
+{
+	pool->session = CK_INVALID_HANDLE;
+	pthread_mutex_lock(&pool->lock);
+	pool->navail = 0;
+	pool->ndead = 0;
+	pool->generation++;
+	if (pool->running) {
+		pool->refill = 1;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Open the dedicated session if needed
+ * Called with pool->session_lock held
+ */
+static CK_RV pkcs11_keypool_session(PKCS11_SLOT_private *slot)
+{
+	PKCS11_CTX_private *ctx = slot->ctx;
+	PKCS11_KEYPOOL *pool = &slot->keypool;
+	CK_SESSION_HANDLE session;
+	CK_RV rv;
+
+	if (pool->session != CK_INVALID_HANDLE)
+		return CKR_OK;
+	rv = CRYPTOKI_call(ctx, C_OpenSession(slot->id,
+		CKF_SERIAL_SESSION, NULL, NULL, &session));
+	/* Read-only sessions are not allowed while the SO is logged in */
+	if (rv == CKR_SESSION_READ_WRITE_SO_EXISTS)
+		rv = CRYPTOKI_call(ctx, C_OpenSession(slot->id,
+			CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL, NULL, &session));
+	if (rv == CKR_OK)
+		pool->session = session;
+	return rv;
+}
+
+/* Generate a key pair as session objects of the dedicated session */
+static CK_RV pkcs11_keypool_generate(PKCS11_SLOT_private *slot,
+		const unsigned char *params, size_t params_len,
+		CK_OBJECT_HANDLE *priv, CK_OBJECT_HANDLE *pub,
+		unsigned int *generation)
+{
+	PKCS11_CTX_private *ctx = slot->ctx;
+	PKCS11_KEYPOOL *pool = &slot->keypool;
+	PKCS11_TEMPLATE pubtmpl = {0}, privtmpl = {0};
+	CK_MECHANISM mechanism = {
+		CKM_EC_KEY_PAIR_GEN, NULL_PTR, 0
+	};
+	unsigned char id[PKCS11_KEYPOOL_ID_LEN];
+	int retry = 1;
+	CK_RV rv;
+
+	if (RAND_bytes(id, sizeof(id)) <= 0)
+		return CKR_FUNCTION_FAILED;
+
+	/* pubkey attributes */
+	pkcs11_addattr(&pubtmpl, CKA_ID, id, sizeof(id));
+	pkcs11_addattr_bool(&pubtmpl, CKA_TOKEN, FALSE);
+	pkcs11_addattr(&pubtmpl, CKA_EC_PARAMS, (void *)params, params_len);
+
+	/* privkey attributes */
+	pkcs11_addattr(&privtmpl, CKA_ID, id, sizeof(id));
+	pkcs11_addattr_bool(&privtmpl, CKA_TOKEN, FALSE);
+	pkcs11_addattr_bool(&privtmpl, CKA_SENSITIVE, TRUE);
+	pkcs11_addattr_bool(&privtmpl, CKA_EXTRACTABLE, FALSE);
+	pkcs11_addattr_bool(&privtmpl, CKA_DERIVE, TRUE);
+
+	pthread_mutex_lock(&pool->session_lock);
+	do {
+		rv = pkcs11_keypool_session(slot);
+		if (rv != CKR_OK)
+			break;
+		rv = CRYPTOKI_call(ctx, C_GenerateKeyPair(
+			pool->session, &mechanism,
+			pubtmpl.attrs, pubtmpl.nattr,
+			privtmpl.attrs, privtmpl.nattr,
+			pub, priv));
+		if (!pkcs11_keypool_lost(rv))
+			break;
+		/* Open a new session once */
+		pkcs11_keypool_forget(pool);
+	} while (retry--);
+	pthread_mutex_lock(&pool->lock);
+	*generation = pool->generation;
+	pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_unlock(&pool->session_lock);
+
+	pkcs11_zap_attrs(&privtmpl);
+	pkcs11_zap_attrs(&pubtmpl);
+
+	if (rv == CKR_OK) {
+		/* The module may have reused the handles of destroyed objects */
+		pkcs11_attr_cache_invalidate(slot, *priv);
+		pkcs11_attr_cache_invalidate(slot, *pub);
+	}
+	return rv;
+}
+
+/* Destroy key pairs, unless their session was already closed */
+static void pkcs11_keypool_destroy(PKCS11_SLOT_private *slot,
+		const CK_OBJECT_HANDLE *handles, unsigned int npairs,
+		unsigned int generation)
+{
+	PKCS11_CTX_private *ctx = slot->ctx;
+	PKCS11_KEYPOOL *pool = &slot->keypool;
+	unsigned int i;
+	int alive;
+	CK_RV rv;
+
+	if (npairs == 0)
+		return;
+	pthread_mutex_lock(&pool->session_lock);
+	pthread_mutex_lock(&pool->lock);
+	alive = generation == pool->generation &&
+		pool->session != CK_INVALID_HANDLE;
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; alive && i < 2 * npairs; i++) {
+		rv = CRYPTOKI_call(ctx, C_DestroyObject(pool->session, handles[i]));
+		if (pkcs11_keypool_lost(rv)) {
+			pkcs11_keypool_forget(pool);
+			alive = 0;
+		}
+	}
+	pthread_mutex_unlock(&pool->session_lock);
+	for (i = 0; i < 2 * npairs; i++)
+		pkcs11_attr_cache_invalidate(slot, handles[i]);
+}
+
+/* Threads do not survive fork(), and neither do the session objects */
+static void pkcs11_keypool_check_fork(PKCS11_KEYPOOL *pool)
+{
+	unsigned int forkid = get_forkid();
+
+	if (pool->forkid == forkid)
+		return;
+	pool->forkid = forkid;
+	pool->running = 0;
+	pool->navail = 0;
+	pool->ndead = 0;
+	pool->generation++;
+}
+
+/* Add a used key pair to the destruction queue, called with pool->lock held */
+static int pkcs11_keypool_bury(PKCS11_KEYPOOL *pool,
+		CK_OBJECT_HANDLE priv, CK_OBJECT_HANDLE pub)
+{
+	CK_OBJECT_HANDLE *tmp;
+
+	if (pool->ndead == pool->dead_size) {
+		tmp = OPENSSL_realloc(pool->dead,
+			2 * (pool->dead_size + pool->high) * sizeof(CK_OBJECT_HANDLE));
+		if (!tmp)
+			return -1;
+		pool->dead = tmp;
+		pool->dead_size += pool->high;
+	}
+	pool->dead[2 * pool->ndead] = priv;
+	pool->dead[2 * pool->ndead + 1] = pub;
+	pool->ndead++;
+	return 0;
+}
+
+/* Refill the pool and destroy used key pairs */
+static void *pkcs11_keypool_worker(void *arg)
+{
+	PKCS11_SLOT_private *slot = arg;
+	PKCS11_KEYPOOL *pool = &slot->keypool;
+	CK_OBJECT_HANDLE *dead, priv, pub;
+	unsigned int ndead, generation;
+	CK_RV rv;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stop) {
+		if (pool->ndead) {
+			dead = pool->dead;
+			ndead = pool->ndead;
+			generation = pool->generation;
+			pool->dead = NULL;
+			pool->ndead = pool->dead_size = 0;
+			pthread_mutex_unlock(&pool->lock);
+			pkcs11_keypool_destroy(slot, dead, ndead, generation);
+			OPENSSL_free(dead);
+			pthread_mutex_lock(&pool->lock);
+			continue;
+		}
+		if (pool->refill && pool->navail < pool->high) {
+			pthread_mutex_unlock(&pool->lock);
+			rv = pkcs11_keypool_generate(slot,
+				pool->params, pool->params_len, &priv, &pub,
+				&generation);
+			pthread_mutex_lock(&pool->lock);
+			if (rv != CKR_OK) {
+				/* Retry when the pool drops below the low watermark again */
+				pool->refill = 0;
+				ERR_clear_error();
+			} else if (generation == pool->generation) {
+				pool->avail[2 * pool->navail] = priv;
+				pool->avail[2 * pool->navail + 1] = pub;
+				pool->navail++;
+				pthread_cond_broadcast(&pool->cond);
+			} /* else the objects are already gone with their session */
+			if (pool->navail >= pool->high)
+				pool->refill = 0;
+			continue;
+		}
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Wrap a private key handle into a PKCS11_KEY */
+static PKCS11_KEY *pkcs11_keypool_wrap(PKCS11_SLOT_private *slot,
+		CK_OBJECT_HANDLE priv, CK_OBJECT_HANDLE pub, unsigned int generation)
+{
+	PKCS11_POOLED_KEY *pooled;
+	PKCS11_OBJECT_private *obj;
+	CK_SESSION_HANDLE session;
+
+	pooled = OPENSSL_malloc(sizeof(PKCS11_POOLED_KEY));
+	if (!pooled)
+		return NULL;
+	memset(pooled, 0, sizeof(PKCS11_POOLED_KEY));
+	/* Session objects are visible in all the sessions of the application */
+	if (pkcs11_get_session(slot, 0, &session)) {
+		OPENSSL_free(pooled);
+		return NULL;
+	}
+	obj = pkcs11_object_from_handle(slot, session, priv);
+	pkcs11_put_session(slot, session);
+	if (!obj) {
+		OPENSSL_free(pooled);
+		return NULL;
+	}
+	pooled->key._private = obj;
+	pooled->key.id = obj->id;
+	pooled->key.id_len = obj->id_len;
+	pooled->key.label = obj->label;
+	pooled->key.isPrivate = 1;
+	pooled->pub = pub;
+	pooled->generation = generation;
+	return &pooled->key;
+}
+
+void pkcs11_keypool_init(PKCS11_SLOT_private *slot)
+{
+	PKCS11_KEYPOOL *pool = &slot->keypool;
+
+	memset(pool, 0, sizeof(PKCS11_KEYPOOL));
+	pthread_mutex_init(&pool->lock, 0);
+	pthread_cond_init(&pool->cond, 0);
+	pthread_mutex_init(&pool->session_lock, 0);
+	pool->session = CK_INVALID_HANDLE;
+	pool->forkid = get_forkid();
+}
+
+void pkcs11_keypool_free(PKCS11_SLOT_private *slot)
+{
+	PKCS11_KEYPOOL *pool = &slot->keypool;
+
+	pkcs11_keypool_stop(slot);
+	/* The keys still held by the application are destroyed as well */
+	pthread_mutex_lock(&pool->session_lock);
+	if (pool->session != CK_INVALID_HANDLE && slot->ctx->handle &&
+			pool->forkid == get_forkid())
+		CRYPTOKI_call(slot->ctx, C_CloseSession(pool->session));
+	pool->session = CK_INVALID_HANDLE;
+	pthread_mutex_unlock(&pool->session_lock);
+	pthread_mutex_destroy(&pool->session_lock);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+}
+
+/* Memory held by the pool bookkeeping (the pooled keys are objects) */
+size_t pkcs11_keypool_mem(PKCS11_SLOT_private *slot)
+{
+	PKCS11_KEYPOOL *pool = &slot->keypool;
+	size_t size;
+
+	pthread_mutex_lock(&pool->lock);
+	size = pool->params_len + 2 * sizeof(CK_OBJECT_HANDLE) *
+		((pool->avail ? pool->high : 0) + pool->dead_size);
+	pthread_mutex_unlock(&pool->lock);
+	return size;
+}
+
+/*
+ * Forget the pooled key pairs after the dedicated session was closed,
+ * e.g. by C_CloseAllSessions()
+ * May be called with slot->lock held
+ */
+void pkcs11_keypool_reset(PKCS11_SLOT_private *slot)
+{
+	PKCS11_KEYPOOL *pool = &slot->keypool;
+
+	pthread_mutex_lock(&pool->session_lock);
+	pthread_mutex_lock(&pool->lock);
+	pkcs11_keypool_check_fork(pool);
+	pthread_mutex_unlock(&pool->lock);
+	pkcs11_keypool_forget(pool);
+	pthread_mutex_unlock(&pool->session_lock);
+}
+
+/*
+ * Destroy the available key pairs, e.g. before logging out
+ * Must not be called with slot->lock held
+ */
+void pkcs11_keypool_flush(PKCS11_SLOT_private *slot)
+{
+	PKCS11_KEYPOOL *pool = &slot->keypool;
+	CK_OBJECT_HANDLE *avail = NULL;
+	unsigned int navail, generation;
+
+	pthread_mutex_lock(&pool->lock);
+	pkcs11_keypool_check_fork(pool);
+	navail = pool->navail;
+	generation = pool->generation;
+	if (navail) {
+		avail = OPENSSL_malloc(2 * navail * sizeof(CK_OBJECT_HANDLE));
+		if (avail) {
+			memcpy(avail, pool->avail, 2 * navail * sizeof(CK_OBJECT_HANDLE));
+			pool->navail = 0;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (avail) {
+		pkcs11_keypool_destroy(slot, avail, navail, generation);
+		OPENSSL_free(avail);
+	}
+}
+
+int pkcs11_keypool_start(PKCS11_SLOT_private *slot, int curve_nid,
+		unsigned int low, unsigned int high)
+{
+	PKCS11_KEYPOOL *pool = &slot->keypool;
+	ASN1_OBJECT *curve;
+	unsigned char *params = NULL;
+	CK_OBJECT_HANDLE *avail;
+	int params_len;
+
+	if (high == 0 || low > high) {
+		P11err(P11_F_PKCS11_KEYPOOL_START, P11_R_INVALID_PARAMETER);
+		return -1;
+	}
+	curve = OBJ_nid2obj(curve_nid);
+	params_len = curve ? i2d_ASN1_OBJECT(curve, &params) : 0;
+	if (params_len <= 0) {
+		P11err(P11_F_PKCS11_KEYPOOL_START, P11_R_NOT_SUPPORTED);
+		return -1;
+	}
+	avail = OPENSSL_malloc(2 * high * sizeof(CK_OBJECT_HANDLE));
+	if (!avail) {
+		OPENSSL_free(params);
+		return -1;
+	}
+
+	/* Discard the previous configuration and its key pairs */
+	pkcs11_keypool_stop(slot);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->params = params;
+	pool->params_len = params_len;
+	pool->avail = avail;
+	pool->low = low;
+	pool->high = high;
+	pool->stop = 0;
+	pool->refill = 1;
+	pool->running = pthread_create(&pool->thread, NULL,
+		pkcs11_keypool_worker, slot) == 0;
+	pthread_mutex_unlock(&pool->lock);
+	if (!pool->running) {
+		pkcs11_keypool_stop(slot);
+		return -1;
+	}
+	return 0;
+}
+
+/* The dedicated session stays open for the keys still in use */
+int pkcs11_keypool_stop(PKCS11_SLOT_private *slot)
+{
+	PKCS11_KEYPOOL *pool = &slot->keypool;
+	CK_OBJECT_HANDLE *avail, *dead;
+	unsigned int navail, ndead, generation;
+
+	pthread_mutex_lock(&pool->lock);
+	pkcs11_keypool_check_fork(pool);
+	if (pool->running) {
+		pool->stop = 1;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+		pthread_join(pool->thread, NULL);
+		pthread_mutex_lock(&pool->lock);
+		pool->running = 0;
+	}
+	avail = pool->avail;
+	navail = pool->navail;
+	dead = pool->dead;
+	ndead = pool->ndead;
+	generation = pool->generation;
+	pool->avail = pool->dead = NULL;
+	pool->navail = pool->ndead = pool->dead_size = 0;
+	pool->low = pool->high = 0;
+	OPENSSL_free(pool->params);
+	pool->params = NULL;
+	pool->params_len = 0;
+	pthread_mutex_unlock(&pool->lock);
+
+	pkcs11_keypool_destroy(slot, avail, navail, generation);
+	pkcs11_keypool_destroy(slot, dead, ndead, generation);
+	OPENSSL_free(avail);
+	OPENSSL_free(dead);
+	return 0;
+}
+
+PKCS11_KEY *pkcs11_keypool_get(PKCS11_SLOT_private *slot)
+{
+	PKCS11_KEYPOOL *pool = &slot->keypool;
+	unsigned char *params = NULL;
+	size_t params_len = 0;
+	CK_OBJECT_HANDLE priv = CK_INVALID_HANDLE, pub = CK_INVALID_HANDLE;
+	CK_OBJECT_HANDLE handles[2];
+	unsigned int generation;
+	PKCS11_KEY *key;
+	CK_RV rv;
+
+	pthread_mutex_lock(&pool->lock);
+	pkcs11_keypool_check_fork(pool);
+	if (!pool->params) {
+		pthread_mutex_unlock(&pool->lock);
+		P11err(P11_F_PKCS11_KEYPOOL_GET, P11_R_NOT_SUPPORTED);
+		return NULL;
+	}
+	if (!pool->running) { /* restart the worker in a child process */
+		pool->stop = 0;
+		pool->running = pthread_create(&pool->thread, NULL,
+			pkcs11_keypool_worker, slot) == 0;
+	}
+	if (pool->navail) {
+		pool->navail--;
+		priv = pool->avail[2 * pool->navail];
+		pub = pool->avail[2 * pool->navail + 1];
+	} else {
+		/* Empty pool: generate the key pair inline */
+		params = OPENSSL_malloc(pool->params_len);
+		if (params) {
+			memcpy(params, pool->params, pool->params_len);
+			params_len = pool->params_len;
+		}
+	}
+	if (pool->navail < pool->low || pool->navail == 0) {
+		pool->refill = 1;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	generation = pool->generation;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (priv == CK_INVALID_HANDLE) {
+		if (!params)
+			return NULL;
+		rv = pkcs11_keypool_generate(slot, params, params_len,
+			&priv, &pub, &generation);
+		OPENSSL_free(params);
+		if (rv != CKR_OK) {
+			CKRerr(CKR_F_PKCS11_KEYPOOL_GET, rv);
+			return NULL;
+		}
+	}
+
+	key = pkcs11_keypool_wrap(slot, priv, pub, generation);
+	if (!key) {
+		handles[0] = priv;
+		handles[1] = pub;
+		pkcs11_keypool_destroy(slot, handles, 1, generation);
+	}
+	return key;
+}
+
+void pkcs11_keypool_put(PKCS11_KEY *key)
+{
+	PKCS11_POOLED_KEY *pooled = (PKCS11_POOLED_KEY *)key;
+	PKCS11_OBJECT_private *obj;
+	PKCS11_SLOT_private *slot;
+	PKCS11_KEYPOOL *pool;
+	CK_OBJECT_HANDLE handles[2];
+	int queued = 0, stale;
+
+	if (!key)
+		return;
+	obj = PRIVKEY(key);
+	slot = obj->slot;
+	pool = &slot->keypool;
+	handles[0] = obj->object;
+	handles[1] = pooled->pub;
+
+	pthread_mutex_lock(&pool->lock);
+	pkcs11_keypool_check_fork(pool);
+	/* A stale key pair was closed with the dedicated session */
+	stale = pooled->generation != pool->generation;
+	if (!stale && pool->running && !pool->stop &&
+			pkcs11_keypool_bury(pool, handles[0], handles[1]) == 0) {
+		pthread_cond_broadcast(&pool->cond);
+		queued = 1;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	/* Without a worker the key pair is destroyed by the caller */
+	if (!stale && !queued)
+		pkcs11_keypool_destroy(slot, handles, 1, pooled->generation);
+	pkcs11_object_free(obj);
+	OPENSSL_free(pooled);
+}
+
+#else /* OPENSSL_NO_EC */
+
+void pkcs11_keypool_init(PKCS11_SLOT_private *slot)
+{
+	(void)slot;
+}
+
+void pkcs11_keypool_free(PKCS11_SLOT_private *slot)
+{
+	(void)slot;
+}
+
+void pkcs11_keypool_reset(PKCS11_SLOT_private *slot)
+{
+	(void)slot;
+}
+
+void pkcs11_keypool_flush(PKCS11_SLOT_private *slot)
+{
+	(void)slot;
+}
+
+size_t pkcs11_keypool_mem(PKCS11_SLOT_private *slot)
+{
+	(void)slot;
+	return 0;
+}
+
+int pkcs11_keypool_start(PKCS11_SLOT_private *slot, int curve_nid,
+		unsigned int low, unsigned int high)
+{
+	(void)slot;
+	(void)curve_nid;
+	(void)low;
+	(void)high;
+	P11err(P11_F_PKCS11_KEYPOOL_START, P11_R_NOT_SUPPORTED);
+	return -1;
+}
+
+int pkcs11_keypool_stop(PKCS11_SLOT_private *slot)
+{
+	(void)slot;
+	return 0;
+}
+
+PKCS11_KEY *pkcs11_keypool_get(PKCS11_SLOT_private *slot)
+{
+	(void)slot;
+	P11err(P11_F_PKCS11_KEYPOOL_GET, P11_R_NOT_SUPPORTED);
+	return NULL;
+}
+
+void pkcs11_keypool_put(PKCS11_KEY *key)
+{
+	(void)key;
+}
+
+#endif /* OPENSSL_NO_EC */
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,210 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Adaptive concurrency limit.
+ *
+ * Tokens queue the requests they cannot serve immediately, so that the
+ * latency of every request grows with the load once the token is
+ * saturated.  The number of sign and decrypt operations in flight on each
+ * slot is limited with additive increase and multiplicative decrease, as in
+ * TCP congestion control.  The lowest recent latency is the baseline of an
+ * unloaded token.  While the latency stays within PKCS11_LIMIT_TOLERANCE
+ * times the baseline and the limit is reached, the limit grows by one every
+ * limit operations.  A slower operation reduces the limit by
+ * PKCS11_LIMIT_BACKOFF, at most once per smoothed latency.  The operations
+ * above the limit wait in the process, where they can give up after the
+ * configured maximum wait.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+
+#define PKCS11_LIMIT_TOLERANCE 2 /* congestion above twice the baseline */
+#define PKCS11_LIMIT_BACKOFF 0.75
+#define PKCS11_LIMIT_WINDOW 256 /* operations between baseline updates */
+
+void pkcs11_limiter_init(PKCS11_SLOT_private *slot)
+{
+	PKCS11_LIMITER *limiter = &slot->limiter;
+
+	memset(limiter, 0, sizeof(PKCS11_LIMITER));
+	pthread_mutex_init(&limiter->lock, 0);
+	pthread_cond_init(&limiter->cond, 0);
+	limiter->forkid = get_forkid();
+}
+
+void pkcs11_limiter_free(PKCS11_SLOT_private *slot)
+{
+	PKCS11_LIMITER *limiter = &slot->limiter;
+
+	pthread_mutex_destroy(&limiter->lock);
+	pthread_cond_destroy(&limiter->cond);
+}
+
+/* Keep the limit within the configured bounds
+ * Called with the limiter lock held */
+static void pkcs11_limiter_clamp(PKCS11_LIMITER *limiter,
+		PKCS11_CTX_private *ctx)
+{
+	/* The operations in flight in the parent are not in the child */
+	if (limiter->forkid != get_forkid()) {
+		limiter->forkid = get_forkid();
+		limiter->in_flight = 0;
+		limiter->waiting = 0;
+	}
+	if (limiter->limit < ctx->limit_min)
+		limiter->limit = ctx->limit_min;
+	if (limiter->limit > ctx->limit_max)
+		limiter->limit = ctx->limit_max;
+}
+
+/*
+ * Wait until an operation can be sent to the token
+ * Returns 0 on success, -1 if the maximum wait expired
+ */
+int pkcs11_limiter_acquire(PKCS11_SLOT_private *slot)
+{
+	PKCS11_CTX_private *ctx = slot->ctx;
+	PKCS11_LIMITER *limiter = &slot->limiter;
+	unsigned long long deadline = 0, now;
+
+	pthread_mutex_lock(&limiter->lock);
+	pkcs11_limiter_clamp(limiter, ctx);
+	if (ctx->limit_wait)
+		deadline = pkcs11_time_usec() + ctx->limit_wait;
+	while (limiter->in_flight >= (unsigned int)limiter->limit &&
+			ctx->limit_max) {
+		limiter->waiting++;
+		if (deadline) {
+			now = pkcs11_time_usec();
+			if (now < deadline)
+				pkcs11_cond_timedwait(&limiter->cond, &limiter->lock,
+					deadline - now);
+		} else {
+			pthread_cond_wait(&limiter->cond, &limiter->lock);
+		}
+		limiter->waiting--;
+		if (deadline && pkcs11_time_usec() >= deadline &&
+				limiter->in_flight >= (unsigned int)limiter->limit) {
+			limiter->rejected++;
+			pthread_mutex_unlock(&limiter->lock);
+			return -1;
+		}
+		pkcs11_limiter_clamp(limiter, ctx);
+	}
+	limiter->in_flight++;
+	pthread_mutex_unlock(&limiter->lock);
+	return 0;
+}
+
+/* Update the limit with the latency of an operation */
+static void pkcs11_limiter_sample(PKCS11_LIMITER *limiter,
+		PKCS11_CTX_private *ctx, unsigned long long latency,
+		unsigned long long now)
+{
+	if (latency == 0)
+		latency = 1;
+	limiter->smoothed = limiter->smoothed ?
+		(limiter->smoothed * 7 + latency) / 8 : latency;
+
+	/* Follow the baseline down immediately, and up once per window */
+	if (!limiter->baseline || latency < limiter->baseline)
+		limiter->baseline = latency;
+	if (!limiter->window_min || latency < limiter->window_min)
+		limiter->window_min = latency;
+	if (++limiter->samples >= PKCS11_LIMIT_WINDOW) {
+		if (limiter->window_min > limiter->baseline)
+			limiter->baseline += (limiter->window_min - limiter->baseline) / 4;
+		limiter->window_min = 0;
+		limiter->samples = 0;
+	}
+
+	if (latency > limiter->baseline * PKCS11_LIMIT_TOLERANCE) {
+		/* The token is queuing: back off once per round trip */
+		if (now - limiter->last_decrease >= limiter->smoothed) {
+			limiter->limit *= PKCS11_LIMIT_BACKOFF;
+			limiter->last_decrease = now;
+		}
+	} else if (limiter->in_flight + 1 >= (unsigned int)limiter->limit) {
+		/* Probe for more throughput only while the limit is reached */
+		limiter->limit += 1.0 / limiter->limit;
+	}
+	pkcs11_limiter_clamp(limiter, ctx);
+}
+
+/*
+ * Finish an operation started at start (0 if it did not reach the token
+ * or failed, so that its latency is not sampled)
+ */
+void pkcs11_limiter_release(PKCS11_SLOT_private *slot,
+		unsigned long long start)
+{
+	PKCS11_CTX_private *ctx = slot->ctx;
+	PKCS11_LIMITER *limiter = &slot->limiter;
+	unsigned long long now = start ? pkcs11_time_usec() : 0;
+
+	pthread_mutex_lock(&limiter->lock);
+	if (limiter->in_flight > 0)
+		limiter->in_flight--;
+	if (start && ctx->limit_max)
+		pkcs11_limiter_sample(limiter, ctx, now - start, now);
+	if (limiter->waiting) {
+		if (limiter->in_flight + 1 < (unsigned int)limiter->limit)
+			pthread_cond_broadcast(&limiter->cond);
+		else
+			pthread_cond_signal(&limiter->cond);
+	}
+	pthread_mutex_unlock(&limiter->lock);
+}
+
+int pkcs11_set_concurrency_limit(PKCS11_CTX_private *ctx,
+		unsigned int min, unsigned int max, unsigned long max_wait)
+{
+	if (!ctx)
+		return -1;
+	if (max && (min < 1 || min > max)) {
+		P11err(P11_F_PKCS11_SET_CONCURRENCY_LIMIT, P11_R_INVALID_PARAMETER);
+		return -1;
+	}
+	ctx->limit_min = min;
+	ctx->limit_wait = max_wait;
+	ctx->limit_max = max;
+	return 0;
+}
+
+int pkcs11_get_concurrency(PKCS11_SLOT_private *slot,
+		PKCS11_CONCURRENCY *status)
+{
+	PKCS11_LIMITER *limiter = &slot->limiter;
+
+	memset(status, 0, sizeof(*status));
+	if (!slot->ctx->limit_max)
+		return -1;
+	pthread_mutex_lock(&limiter->lock);
+	pkcs11_limiter_clamp(limiter, slot->ctx);
+	status->limit = (unsigned int)limiter->limit;
+	status->in_flight = limiter->in_flight;
+	status->waiting = limiter->waiting;
+	status->latency = (unsigned long)limiter->smoothed;
+	status->baseline = (unsigned long)limiter->baseline;
+	status->rejected = limiter->rejected;
+	pthread_mutex_unlock(&limiter->lock);
+	return 0;
+}
+
+/* vim: set noexpandtab: */
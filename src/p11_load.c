@@ -41,6 +41,10 @@ PKCS11_CTX *pkcs11_CTX_new(void)
 	ctx->_private = cpriv;
 	cpriv->forkid = get_forkid();
 	pthread_mutex_init(&cpriv->fork_lock, 0);
+	pkcs11_lock_profile_init(&cpriv->fork_lock_prof, "ctx->fork_lock",
+		(unsigned long)-1);
+	pthread_mutex_init(&cpriv->slow_op_lock, 0);
+	pthread_mutex_init(&cpriv->mem_lock, 0);
 
 	return ctx;
 fail:
@@ -143,6 +147,9 @@ void pkcs11_CTX_unload(PKCS11_CTX *ctx)
 {
 	PKCS11_CTX_private *cpriv = PRIVCTX(ctx);
 
+	/* Return the sessions of the process to the shared budget */
+	pkcs11_quota_detach(cpriv);
+
 	/* Tell the PKCS11 library to shut down */
 	if (cpriv->forkid == get_forkid())
 		cpriv->method->C_Finalize(NULL);
@@ -171,6 +178,9 @@ void pkcs11_CTX_free(PKCS11_CTX *ctx)
 		OPENSSL_free(cpriv->handle);
 	}
 	pthread_mutex_destroy(&cpriv->fork_lock);
+	pthread_mutex_destroy(&cpriv->slow_op_lock);
+	pthread_mutex_destroy(&cpriv->mem_lock);
+	OPENSSL_free(cpriv->slow_ops);
 	OPENSSL_free(ctx->manufacturer);
 	OPENSSL_free(ctx->description);
 	OPENSSL_free(ctx->_private);
@@ -0,0 +1,238 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Lock contention profiling.
+ *
+ * A profiled mutex is first tried without blocking, so that the
+ * uncontended acquisitions only cost two clock reads.  The counters of a
+ * mutex are only updated while it is held, so profiling needs no lock of
+ * its own.  The hold time ends before the mutex is released, and is
+ * suspended while the holder waits on a condition variable.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+unsigned long long pkcs11_time_nsec(void)
+{
+#if defined(_WIN32)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000000 +
+		(unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000000 /
+		freq.QuadPart;
+#else
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void pkcs11_lock_profile_init(PKCS11_LOCK_PROFILE *prof, const char *name,
+		unsigned long slot_id)
+{
+	memset(prof, 0, sizeof(PKCS11_LOCK_PROFILE));
+	prof->name = name;
+	prof->slot_id = slot_id;
+}
+
+/* Find or add the statistics of a call site */
+static unsigned int pkcs11_lock_site(PKCS11_LOCK_PROFILE *prof,
+		const char *file, int line)
+{
+	unsigned int i;
+
+	for (i = 0; i < prof->nsites; i++)
+		if (prof->sites[i].line == line && prof->sites[i].file == file)
+			return i;
+	if (prof->nsites == PKCS11_LOCK_SITES) {
+		/* Collect the remaining call sites in the last entry */
+		i = PKCS11_LOCK_SITES - 1;
+		prof->sites[i].file = NULL;
+		prof->sites[i].line = 0;
+		return i;
+	}
+	prof->sites[i].file = file;
+	prof->sites[i].line = line;
+	prof->nsites++;
+	return i;
+}
+
+void pkcs11_lock_profiled(pthread_mutex_t *mutex, PKCS11_LOCK_PROFILE *prof,
+		int enabled, const char *file, int line)
+{
+	PKCS11_LOCK_STATS *site;
+	unsigned long long start, now, wait = 0;
+	int contended = 0;
+
+	if (!enabled) {
+		pthread_mutex_lock(mutex);
+		return;
+	}
+	start = pkcs11_time_nsec();
+	if (pthread_mutex_trylock(mutex)) {
+		pthread_mutex_lock(mutex);
+		now = pkcs11_time_nsec();
+		wait = now > start ? now - start : 0;
+		contended = 1;
+	} else {
+		now = start;
+	}
+	prof->held_site = pkcs11_lock_site(prof, file, line);
+	prof->held_since = now ? now : 1;
+	site = &prof->sites[prof->held_site];
+	site->acquisitions++;
+	if (contended) {
+		site->contended++;
+		site->wait_total += wait;
+		if (wait > site->wait_max)
+			site->wait_max = wait;
+	}
+}
+
+/* Account for the time the mutex was held by the profiled holder */
+static void pkcs11_lock_hold_end(PKCS11_LOCK_PROFILE *prof)
+{
+	PKCS11_LOCK_STATS *site;
+	unsigned long long now, hold;
+
+	if (!prof->held_since)
+		return;
+	now = pkcs11_time_nsec();
+	hold = now > prof->held_since ? now - prof->held_since : 0;
+	site = &prof->sites[prof->held_site];
+	site->hold_total += hold;
+	if (hold > site->hold_max)
+		site->hold_max = hold;
+	prof->held_since = 0;
+}
+
+void pkcs11_unlock_profiled(pthread_mutex_t *mutex, PKCS11_LOCK_PROFILE *prof)
+{
+	pkcs11_lock_hold_end(prof);
+	pthread_mutex_unlock(mutex);
+}
+
+unsigned int pkcs11_lock_suspend(PKCS11_LOCK_PROFILE *prof)
+{
+	unsigned int held = prof->held_since ? prof->held_site + 1 : 0;
+
+	pkcs11_lock_hold_end(prof);
+	return held;
+}
+
+void pkcs11_lock_resume(PKCS11_LOCK_PROFILE *prof, unsigned int held)
+{
+	/* Other holders changed the call site meanwhile, or reset it */
+	if (held && held <= prof->nsites) {
+		prof->held_site = held - 1;
+		prof->held_since = pkcs11_time_nsec();
+		if (!prof->held_since)
+			prof->held_since = 1;
+	}
+}
+
+void pkcs11_cond_wait_profiled(pthread_cond_t *cond, pthread_mutex_t *mutex,
+		PKCS11_LOCK_PROFILE *prof)
+{
+	unsigned int held = pkcs11_lock_suspend(prof);
+
+	pthread_cond_wait(cond, mutex);
+	pkcs11_lock_resume(prof, held);
+}
+
+void pkcs11_lock_profile_reset(PKCS11_LOCK_PROFILE *prof)
+{
+	prof->nsites = 0;
+	prof->held_since = 0;
+	memset(prof->sites, 0, sizeof(prof->sites));
+}
+
+unsigned int pkcs11_lock_profile_copy(PKCS11_LOCK_PROFILE *prof,
+		const void *instance, PKCS11_LOCK_STATS *stats, unsigned int count)
+{
+	unsigned int i;
+
+	if (!stats)
+		return prof->nsites;
+	for (i = 0; i < count && i < prof->nsites; i++) {
+		stats[i] = prof->sites[i];
+		stats[i].lock = prof->name;
+		stats[i].instance = instance;
+		stats[i].slot_id = prof->slot_id;
+	}
+	return i;
+}
+
+int pkcs11_set_lock_profiling(PKCS11_CTX_private *ctx, int enable)
+{
+	PKCS11_SLOT_private *slot;
+
+	if (!ctx)
+		return -1;
+	if (enable && !ctx->lock_profiling) {
+		pthread_mutex_lock(&ctx->fork_lock);
+		pkcs11_lock_profile_reset(&ctx->fork_lock_prof);
+		pthread_mutex_unlock(&ctx->fork_lock);
+		pthread_mutex_lock(&ctx->mem_lock);
+		for (slot = ctx->slots; slot; slot = slot->mem_next) {
+			pthread_mutex_lock(&slot->lock);
+			pkcs11_lock_profile_reset(&slot->lock_prof);
+			pthread_mutex_unlock(&slot->lock);
+		}
+		pthread_mutex_unlock(&ctx->mem_lock);
+	}
+	ctx->lock_profiling = enable ? 1 : 0;
+	return 0;
+}
+
+int pkcs11_get_lock_stats(PKCS11_CTX_private *ctx,
+		PKCS11_LOCK_STATS *stats, unsigned int *count)
+{
+	PKCS11_SLOT_private *slot;
+	unsigned int n;
+
+	if (!ctx || !count)
+		return -1;
+
+	pthread_mutex_lock(&ctx->fork_lock);
+	n = pkcs11_lock_profile_copy(&ctx->fork_lock_prof, &ctx->fork_lock,
+		stats, *count);
+	pthread_mutex_unlock(&ctx->fork_lock);
+	pthread_mutex_lock(&ctx->mem_lock);
+	for (slot = ctx->slots; slot; slot = slot->mem_next) {
+		pthread_mutex_lock(&slot->lock);
+		n += pkcs11_lock_profile_copy(&slot->lock_prof, &slot->lock,
+			stats ? stats + n : NULL, *count - n);
+		pthread_mutex_unlock(&slot->lock);
+	}
+	pthread_mutex_unlock(&ctx->mem_lock);
+	*count = n;
+	return 0;
+}
+
+/* vim: set noexpandtab: */
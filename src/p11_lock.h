@@ -0,0 +1,71 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef _P11_LOCK_H
+#define _P11_LOCK_H
+
+#include "libp11.h"
+#include "p11_pthread.h"
+
+/* Call sites recorded for each lock, the last one collects the others */
+#define PKCS11_LOCK_SITES 16
+
+/*
+ * Contention statistics of a mutex, updated while the mutex is held.
+ * The mutex is acquired with PKCS11_LOCK() and released with PKCS11_UNLOCK(),
+ * so that the acquisitions are attributed to their call site.
+ */
+typedef struct pkcs11_lock_profile {
+	const char *name;
+	unsigned long slot_id;
+	unsigned long long held_since; /* 0 if the holder is not profiled */
+	unsigned int held_site;
+	unsigned int nsites;
+	PKCS11_LOCK_STATS sites[PKCS11_LOCK_SITES];
+} PKCS11_LOCK_PROFILE;
+
+#define PKCS11_LOCK(mutex, prof, enabled) \
+	pkcs11_lock_profiled((mutex), (prof), (enabled), __FILE__, __LINE__)
+#define PKCS11_UNLOCK(mutex, prof) \
+	pkcs11_unlock_profiled((mutex), (prof))
+#define PKCS11_COND_WAIT(cond, mutex, prof) \
+	pkcs11_cond_wait_profiled((cond), (mutex), (prof))
+
+/* Monotonic clock in nanoseconds */
+extern unsigned long long pkcs11_time_nsec(void);
+
+extern void pkcs11_lock_profile_init(PKCS11_LOCK_PROFILE *prof,
+	const char *name, unsigned long slot_id);
+extern void pkcs11_lock_profiled(pthread_mutex_t *mutex,
+	PKCS11_LOCK_PROFILE *prof, int enabled, const char *file, int line);
+extern void pkcs11_unlock_profiled(pthread_mutex_t *mutex,
+	PKCS11_LOCK_PROFILE *prof);
+extern void pkcs11_cond_wait_profiled(pthread_cond_t *cond,
+	pthread_mutex_t *mutex, PKCS11_LOCK_PROFILE *prof);
+
+/* Called with the mutex held, around the waits releasing it */
+extern unsigned int pkcs11_lock_suspend(PKCS11_LOCK_PROFILE *prof);
+extern void pkcs11_lock_resume(PKCS11_LOCK_PROFILE *prof, unsigned int held);
+
+/* Called with the mutex held */
+extern void pkcs11_lock_profile_reset(PKCS11_LOCK_PROFILE *prof);
+extern unsigned int pkcs11_lock_profile_copy(PKCS11_LOCK_PROFILE *prof,
+	const void *instance, PKCS11_LOCK_STATS *stats, unsigned int count);
+
+#endif
+
+/* vim: set noexpandtab: */
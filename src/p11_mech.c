@@ -0,0 +1,544 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * This file implements signing and decryption with an explicit mechanism.
+ * The request goes straight from the key reference to the token: no
+ * EVP_PKEY, RSA or EC_KEY object is created, and the output sizes are
+ * derived from the (memoized) key attributes.
+ *
+ * Bulk signing hashes and signs a list of messages with several threads,
+ * each holding its own pooled session, so that hashing on the host
+ * overlaps with the signatures computed by the token.
+ */
+
+#include "libp11-int.h"
+#include <limits.h>
+#include <string.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+
+/* Largest EC group order supported for DER-encoded signatures (P-521) */
+#define PKCS11_MECH_MAX_ORDER_BYTES 66
+
+/* Maximum number of threads used by pkcs11_sign_bulk() */
+#define PKCS11_BULK_MAX_THREADS 64
+
+/* Length of the DigestInfo prefixes below */
+#define PKCS11_BULK_PREFIX_LEN 19
+
+typedef struct pkcs11_mech_params_st {
+	CK_MECHANISM mechanism;
+	union {
+		CK_RSA_PKCS_PSS_PARAMS pss;
+		CK_RSA_PKCS_OAEP_PARAMS oaep;
+	} u;
+} PKCS11_MECH_PARAMS;
+
+static CK_RSA_PKCS_MGF_TYPE pkcs11_mech_mgf(CK_MECHANISM_TYPE hash)
+{
+	switch (hash) {
+	case CKM_SHA_1:
+		return CKG_MGF1_SHA1;
+	case CKM_SHA224:
+		return CKG_MGF1_SHA224;
+	case CKM_SHA256:
+		return CKG_MGF1_SHA256;
+	case CKM_SHA384:
+		return CKG_MGF1_SHA384;
+	case CKM_SHA512:
+		return CKG_MGF1_SHA512;
+	default:
+		return 0;
+	}
+}
+
+/* Translate the public descriptor into a CK_MECHANISM
+ * return a PKCS#11 error code */
+static CK_RV pkcs11_mech_params(PKCS11_MECH_PARAMS *params,
+		PKCS11_OBJECT_private *key, int operation,
+		const PKCS11_MECHANISM *mech)
+{
+	int key_type = pkcs11_get_key_type(key);
+	CK_RSA_PKCS_MGF_TYPE mgf;
+
+	if (key->object_class != CKO_PRIVATE_KEY)
+		return CKR_KEY_FUNCTION_NOT_PERMITTED;
+
+	memset(params, 0, sizeof(PKCS11_MECH_PARAMS));
+	params->mechanism.mechanism = mech->mechanism;
+	switch (mech->mechanism) {
+	case CKM_RSA_PKCS:
+	case CKM_RSA_X_509:
+		if (key_type != EVP_PKEY_RSA)
+			return CKR_KEY_TYPE_INCONSISTENT;
+		return CKR_OK;
+	case CKM_ECDSA:
+		if (key_type != EVP_PKEY_EC)
+			return CKR_KEY_TYPE_INCONSISTENT;
+		return operation == PKCS11_OP_SIGN ?
+			CKR_OK : CKR_MECHANISM_INVALID;
+	case CKM_RSA_PKCS_PSS:
+	case CKM_RSA_PKCS_OAEP:
+		break;
+	default:
+		return CKR_MECHANISM_INVALID;
+	}
+
+	if (key_type != EVP_PKEY_RSA)
+		return CKR_KEY_TYPE_INCONSISTENT;
+	mgf = mech->mgf ? mech->mgf : pkcs11_mech_mgf(mech->hash);
+	if (!mech->hash || !mgf)
+		return CKR_MECHANISM_PARAM_INVALID;
+	if (mech->mechanism == CKM_RSA_PKCS_PSS) {
+		if (operation != PKCS11_OP_SIGN)
+			return CKR_MECHANISM_INVALID;
+		params->u.pss.hashAlg = mech->hash;
+		params->u.pss.mgf = mgf;
+		params->u.pss.sLen = mech->salt_len;
+		params->mechanism.pParameter = &params->u.pss;
+		params->mechanism.ulParameterLen = sizeof(params->u.pss);
+	} else {
+		if (operation != PKCS11_OP_DECRYPT)
+			return CKR_MECHANISM_INVALID;
+		params->u.oaep.hashAlg = mech->hash;
+		params->u.oaep.mgf = mgf;
+		params->u.oaep.source = CKZ_DATA_SPECIFIED;
+		params->u.oaep.pSourceData = (CK_VOID_PTR)mech->label;
+		params->u.oaep.ulSourceDataLen = mech->label_len;
+		params->mechanism.pParameter = &params->u.oaep;
+		params->mechanism.ulParameterLen = sizeof(params->u.oaep);
+	}
+	return CKR_OK;
+}
+
+/* Size of the RSA modulus, or of the EC group order, in bytes
+ * return a PKCS#11 error code */
+static CK_RV pkcs11_mech_key_bytes(PKCS11_OBJECT_private *key,
+		CK_SESSION_HANDLE session, size_t *bytes)
+{
+	PKCS11_SLOT_private *slot = key->slot;
+	BIGNUM *bn = NULL;
+	EC_GROUP *group;
+	CK_BYTE *params;
+	size_t params_len = 0;
+	const unsigned char *a;
+
+	/* Computed once for each key */
+	pthread_mutex_lock(&key->lock);
+	*bytes = key->key_bytes;
+	pthread_mutex_unlock(&key->lock);
+	if (*bytes)
+		return CKR_OK;
+
+	if (pkcs11_get_key_type(key) == EVP_PKEY_RSA) {
+		if (pkcs11_getattr_bn(slot, session, key->object, CKA_MODULUS, &bn))
+			return CKR_ATTRIBUTE_TYPE_INVALID;
+		*bytes = BN_num_bytes(bn);
+		BN_free(bn);
+	} else {
+		if (pkcs11_getattr_alloc(slot, session, key->object,
+				CKA_EC_PARAMS, &params, &params_len))
+			return CKR_ATTRIBUTE_TYPE_INVALID;
+		a = params;
+		group = d2i_ECPKParameters(NULL, &a, (long)params_len);
+		OPENSSL_free(params);
+		if (!group)
+			return CKR_DOMAIN_PARAMS_INVALID;
+		*bytes = BN_num_bytes(EC_GROUP_get0_order(group));
+		EC_GROUP_free(group);
+	}
+
+	pthread_mutex_lock(&key->lock);
+	key->key_bytes = *bytes;
+	pthread_mutex_unlock(&key->lock);
+	return CKR_OK;
+}
+
+/* Upper bound of a DER-encoded ECDSA-Sig-Value for an order of n bytes */
+static size_t pkcs11_mech_der_size(size_t n)
+{
+	size_t integer = n + 1; /* leading zero of a positive INTEGER */
+	size_t content;
+
+	integer += integer < 128 ? 2 : 3;
+	content = 2 * integer;
+	return content + (content < 128 ? 2 : 3);
+}
+
+/* Output size of the operation (maximum size for decryption)
+ * return a PKCS#11 error code */
+static CK_RV pkcs11_mech_out_size(PKCS11_OBJECT_private *key,
+		CK_SESSION_HANDLE session, const PKCS11_MECHANISM *mech,
+		size_t *key_bytes, size_t *size)
+{
+	CK_RV rv;
+
+	rv = pkcs11_mech_key_bytes(key, session, key_bytes);
+	if (rv)
+		return rv;
+	if (mech->mechanism != CKM_ECDSA)
+		*size = *key_bytes;
+	else if (mech->der)
+		*size = pkcs11_mech_der_size(*key_bytes);
+	else
+		*size = 2 * *key_bytes;
+	return CKR_OK;
+}
+
+/* Convert a raw r|s signature into DER */
+static CK_RV pkcs11_mech_ecdsa_der(const unsigned char *raw, size_t raw_len,
+		unsigned char *sig, size_t *sig_len)
+{
+	ECDSA_SIG *ecdsa;
+	BIGNUM *r, *s;
+	unsigned char *p = sig;
+	int len;
+
+	ecdsa = ECDSA_SIG_new();
+	if (!ecdsa)
+		return CKR_HOST_MEMORY;
+	r = BN_bin2bn(raw, raw_len / 2, NULL);
+	s = BN_bin2bn(raw + raw_len / 2, raw_len / 2, NULL);
+	if (!r || !s || !ECDSA_SIG_set0(ecdsa, r, s)) {
+		BN_free(r);
+		BN_free(s);
+		ECDSA_SIG_free(ecdsa);
+		return CKR_HOST_MEMORY;
+	}
+	len = i2d_ECDSA_SIG(ecdsa, NULL);
+	if (len <= 0) {
+		ECDSA_SIG_free(ecdsa);
+		return CKR_FUNCTION_FAILED;
+	}
+	if ((size_t)len > *sig_len) {
+		ECDSA_SIG_free(ecdsa);
+		*sig_len = len;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+	len = i2d_ECDSA_SIG(ecdsa, &p);
+	ECDSA_SIG_free(ecdsa);
+	*sig_len = len;
+	return CKR_OK;
+}
+
+/*
+ * Perform the operation, or report the output size if out is NULL
+ * The buffer handed to the token is always large enough, as a failed
+ * C_Sign() or C_Decrypt() for a short buffer would leave the operation
+ * active on a pooled session
+ * If the operation could not begin, *reason is set to the P11_R_* code
+ * reported by pkcs11_op_begin()
+ */
+static CK_RV pkcs11_mech_op(PKCS11_OBJECT_private *key, int operation,
+		const PKCS11_MECHANISM *mech,
+		const unsigned char *in, size_t in_len,
+		unsigned char *out, size_t *out_len, int *reason)
+{
+	PKCS11_SLOT_private *slot = key->slot;
+	PKCS11_MECH_PARAMS params;
+	CK_SESSION_HANDLE session;
+	unsigned char raw[2 * PKCS11_MECH_MAX_ORDER_BYTES];
+	unsigned char *buf = out;
+	size_t key_bytes, size = 0;
+	CK_ULONG ck_len = 0;
+	PKCS11_SIG_ENTRY *pending = NULL;
+	PKCS11_OP op;
+	CK_RV rv;
+
+	if (!mech || !out_len)
+		return CKR_ARGUMENTS_BAD;
+	rv = pkcs11_mech_params(&params, key, operation, mech);
+	if (rv)
+		return rv;
+
+	if (!out) {
+		if (pkcs11_get_session(slot, 0, &session))
+			return CKR_SESSION_HANDLE_INVALID;
+		rv = pkcs11_mech_out_size(key, session, mech, &key_bytes, out_len);
+		pkcs11_put_session(slot, session);
+		return rv;
+	}
+	/* The size query does not read the input */
+	if (!in)
+		return CKR_ARGUMENTS_BAD;
+
+	if (operation == PKCS11_OP_SIGN) {
+		ck_len = *out_len;
+		if (pkcs11_sigcache_lookup(key, params.mechanism.mechanism,
+				in, in_len, out, &ck_len, &pending, &rv)) {
+			*out_len = ck_len;
+			return rv;
+		}
+	}
+
+	if (pkcs11_op_begin(&op, operation, slot, key,
+			mech->mechanism, in_len, 0, &session)) {
+		if (pending)
+			pkcs11_sigcache_complete(key, pending,
+				CKR_FUNCTION_REJECTED, NULL, 0);
+		*reason = op.reason;
+		return CKR_FUNCTION_REJECTED;
+	}
+	rv = pkcs11_mech_out_size(key, session, mech, &key_bytes, &size);
+	if (rv)
+		goto end;
+
+	if (mech->mechanism == CKM_ECDSA && mech->der) {
+		if (key_bytes > PKCS11_MECH_MAX_ORDER_BYTES) {
+			rv = CKR_KEY_SIZE_RANGE;
+			goto end;
+		}
+		/* The length of the encoding depends on the signature */
+		if (*out_len < size) {
+			*out_len = size;
+			rv = CKR_BUFFER_TOO_SMALL;
+			goto end;
+		}
+		buf = raw;
+		size = 2 * key_bytes;
+	} else if (*out_len < size) {
+		if (operation == PKCS11_OP_SIGN) {
+			*out_len = size;
+			rv = CKR_BUFFER_TOO_SMALL;
+			goto end;
+		}
+		/* The plaintext may still fit once the padding is removed */
+		buf = OPENSSL_malloc(size);
+		if (!buf) {
+			rv = CKR_HOST_MEMORY;
+			goto end;
+		}
+	}
+
+	ck_len = size;
+	rv = pkcs11_private_op(key, session, operation, &params.mechanism,
+		in, in_len, buf, &ck_len);
+	if (rv)
+		goto end;
+
+	if (buf == raw) {
+		rv = pkcs11_mech_ecdsa_der(raw, ck_len, out, out_len);
+		ck_len = *out_len;
+	} else if (buf != out) {
+		if (ck_len > *out_len) {
+			rv = CKR_BUFFER_TOO_SMALL;
+		} else {
+			memcpy(out, buf, ck_len);
+			*out_len = ck_len;
+		}
+	} else {
+		*out_len = ck_len;
+	}
+
+end:
+	pkcs11_op_end(&op, session, rv, rv ? 0 : ck_len);
+	if (pending)
+		pkcs11_sigcache_complete(key, pending, rv, out, rv ? 0 : *out_len);
+	if (buf == raw) {
+		OPENSSL_cleanse(raw, sizeof(raw));
+	} else if (buf != out) {
+		OPENSSL_cleanse(buf, size);
+		OPENSSL_free(buf);
+	}
+	return rv;
+}
+
+int pkcs11_sign_mech(PKCS11_OBJECT_private *key,
+		const PKCS11_MECHANISM *mech, const unsigned char *in, size_t in_len,
+		unsigned char *sig, size_t *sig_len)
+{
+	int reason = 0;
+	CK_RV rv;
+
+	rv = pkcs11_mech_op(key, PKCS11_OP_SIGN, mech, in, in_len,
+		sig, sig_len, &reason);
+	if (rv) {
+		/* The reason the operation could not begin is already queued */
+		if (!reason)
+			CKRerr(CKR_F_PKCS11_SIGN_MECH, rv);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * DER encoding of the DigestInfo preceding the digest (RFC 8017, 9.2)
+ * The SHA-1 prefix is 4 bytes shorter, as its OID has no parameters
+ */
+static const struct {
+	int nid;
+	CK_MECHANISM_TYPE hash;
+	size_t prefix_len;
+	unsigned char prefix[PKCS11_BULK_PREFIX_LEN];
+} pkcs11_bulk_digests[] = {
+	{NID_sha1, CKM_SHA_1, 15, {0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2b,
+		0x0e, 0x03, 0x02, 0x1a, 0x05, 0x00, 0x04, 0x14}},
+	{NID_sha224, CKM_SHA224, 19, {0x30, 0x2d, 0x30, 0x0d, 0x06, 0x09, 0x60,
+		0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x04, 0x05, 0x00, 0x04, 0x1c}},
+	{NID_sha256, CKM_SHA256, 19, {0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60,
+		0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20}},
+	{NID_sha384, CKM_SHA384, 19, {0x30, 0x41, 0x30, 0x0d, 0x06, 0x09, 0x60,
+		0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x02, 0x05, 0x00, 0x04, 0x30}},
+	{NID_sha512, CKM_SHA512, 19, {0x30, 0x51, 0x30, 0x0d, 0x06, 0x09, 0x60,
+		0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x03, 0x05, 0x00, 0x04, 0x40}},
+};
+
+typedef struct pkcs11_bulk_st {
+	PKCS11_OBJECT_private *key;
+	PKCS11_MECHANISM mech;
+	const EVP_MD *md;
+	const unsigned char *prefix;
+	size_t prefix_len;
+	int count;
+	const unsigned char * const *msgs;
+	const size_t *msg_lens;
+	unsigned char **sigs;
+	size_t *sig_lens;
+	pthread_mutex_t lock;
+	int next; /* index of the next message to be signed */
+	CK_RV rv; /* first error */
+	int reason; /* P11_R_* code of the first error, if any */
+} PKCS11_BULK;
+
+/* Sign messages until none are left */
+static void *pkcs11_bulk_worker(void *arg)
+{
+	PKCS11_BULK *bulk = arg;
+	unsigned char in[PKCS11_BULK_PREFIX_LEN + EVP_MAX_MD_SIZE];
+	unsigned int md_len;
+	int i, reason;
+	CK_RV rv;
+
+	if (bulk->prefix_len)
+		memcpy(in, bulk->prefix, bulk->prefix_len);
+	while ((i = pkcs11_atomic_add(&bulk->next, 1, &bulk->lock) - 1) < bulk->count) {
+		reason = 0;
+		if (!EVP_Digest(bulk->msgs[i], bulk->msg_lens[i],
+				in + bulk->prefix_len, &md_len, bulk->md, NULL))
+			rv = CKR_FUNCTION_FAILED;
+		else
+			rv = pkcs11_mech_op(bulk->key, PKCS11_OP_SIGN, &bulk->mech,
+				in, bulk->prefix_len + md_len,
+				bulk->sigs[i], &bulk->sig_lens[i], &reason);
+		if (rv) {
+			bulk->sig_lens[i] = 0;
+			pthread_mutex_lock(&bulk->lock);
+			if (!bulk->rv) {
+				bulk->rv = rv;
+				bulk->reason = reason;
+			}
+			pthread_mutex_unlock(&bulk->lock);
+		}
+	}
+	return NULL;
+}
+
+int pkcs11_sign_bulk(PKCS11_OBJECT_private *key,
+		const PKCS11_MECHANISM *mech, const EVP_MD *md, unsigned int count,
+		const unsigned char * const *msgs, const size_t *msg_lens,
+		unsigned char **sigs, size_t *sig_lens, unsigned int threads)
+{
+	PKCS11_BULK bulk;
+	pthread_t workers[PKCS11_BULK_MAX_THREADS];
+	unsigned int i, n, started = 0;
+	CK_MECHANISM_TYPE hash = 0;
+
+	if (!mech || !md || count > INT_MAX || (count &&
+			(!msgs || !msg_lens || !sigs || !sig_lens))) {
+		CKRerr(CKR_F_PKCS11_SIGN_BULK, CKR_ARGUMENTS_BAD);
+		return -1;
+	}
+	memset(&bulk, 0, sizeof(bulk));
+	for (i = 0; i < sizeof(pkcs11_bulk_digests) / sizeof(pkcs11_bulk_digests[0]); i++) {
+		if (pkcs11_bulk_digests[i].nid == EVP_MD_type(md)) {
+			hash = pkcs11_bulk_digests[i].hash;
+			bulk.prefix = pkcs11_bulk_digests[i].prefix;
+			bulk.prefix_len = pkcs11_bulk_digests[i].prefix_len;
+		}
+	}
+	bulk.mech = *mech;
+	switch (mech->mechanism) {
+	case CKM_RSA_PKCS: /* the DigestInfo is added to each digest */
+		if (!hash) {
+			CKRerr(CKR_F_PKCS11_SIGN_BULK, CKR_MECHANISM_PARAM_INVALID);
+			return -1;
+		}
+		break;
+	case CKM_RSA_PKCS_PSS:
+		if (!bulk.mech.hash)
+			bulk.mech.hash = hash;
+		/* fall through */
+	case CKM_ECDSA:
+		bulk.prefix_len = 0;
+		break;
+	default:
+		CKRerr(CKR_F_PKCS11_SIGN_BULK, CKR_MECHANISM_INVALID);
+		return -1;
+	}
+	bulk.key = key;
+	bulk.md = md;
+	bulk.count = (int)count;
+	bulk.msgs = msgs;
+	bulk.msg_lens = msg_lens;
+	bulk.sigs = sigs;
+	bulk.sig_lens = sig_lens;
+	pthread_mutex_init(&bulk.lock, 0);
+
+	n = threads < count ? threads : count;
+	if (n > PKCS11_BULK_MAX_THREADS)
+		n = PKCS11_BULK_MAX_THREADS;
+	/* The calling thread is one of the workers */
+	for (i = 1; i < n; i++) {
+		if (pthread_create(&workers[started], NULL, pkcs11_bulk_worker, &bulk))
+			break;
+		started++;
+	}
+	pkcs11_bulk_worker(&bulk);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	pthread_mutex_destroy(&bulk.lock);
+
+	if (bulk.rv) {
+		/* The errors of the workers are queued in their own threads */
+		if (bulk.reason)
+			P11err(P11_F_PKCS11_OP_BEGIN, bulk.reason);
+		else
+			CKRerr(CKR_F_PKCS11_SIGN_BULK, bulk.rv);
+		return -1;
+	}
+	return 0;
+}
+
+int pkcs11_decrypt_mech(PKCS11_OBJECT_private *key,
+		const PKCS11_MECHANISM *mech, const unsigned char *in, size_t in_len,
+		unsigned char *out, size_t *out_len)
+{
+	int reason = 0;
+	CK_RV rv;
+
+	rv = pkcs11_mech_op(key, PKCS11_OP_DECRYPT, mech, in, in_len,
+		out, out_len, &reason);
+	if (rv) {
+		if (!reason)
+			CKRerr(CKR_F_PKCS11_DECRYPT_MECH, rv);
+		return -1;
+	}
+	return 0;
+}
+
+/* vim: set noexpandtab: */
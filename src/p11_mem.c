@@ -0,0 +1,193 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Memory accounting.
+ *
+ * Objects, parsed certificates and EVP_PKEY objects are counted by each slot
+ * when they are created and destroyed.  The remaining categories are derived
+ * from the slot state when a report is requested.  Contexts keep a list of
+ * their live slots so that a report can cover a whole context.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+
+static size_t pkcs11_mem_object_size(PKCS11_OBJECT_private *obj)
+{
+	return sizeof(*obj) + (obj->label ? strlen(obj->label) + 1 : 0);
+}
+
+/* Account for an object being created (count 1) or destroyed (count -1) */
+void pkcs11_mem_object(PKCS11_OBJECT_private *obj, int count)
+{
+	PKCS11_SLOT_private *slot = obj->slot;
+	size_t size = pkcs11_mem_object_size(obj);
+	/* Certificates not kept by the shared store are not encoded again */
+	size_t x509_size = obj->der ? obj->der_len : 0;
+
+	pthread_mutex_lock(&slot->mem_lock);
+	if (count > 0) {
+		slot->mem.objects += size;
+		slot->mem.nobjects++;
+		if (obj->x509) {
+			slot->mem.x509 += x509_size;
+			slot->mem.nx509++;
+		}
+	} else {
+		slot->mem.objects -= size;
+		slot->mem.nobjects--;
+		if (obj->x509) {
+			slot->mem.x509 -= x509_size;
+			slot->mem.nx509--;
+		}
+	}
+	pthread_mutex_unlock(&slot->mem_lock);
+}
+
+/* Account for the EVP_PKEY of an object being created or destroyed */
+void pkcs11_mem_pkey(PKCS11_OBJECT_private *obj, EVP_PKEY *pkey, int count)
+{
+	PKCS11_SLOT_private *slot = obj->slot;
+	int len = i2d_PUBKEY(pkey, NULL);
+	size_t size = len > 0 ? (size_t)len : 0;
+
+	pthread_mutex_lock(&slot->mem_lock);
+	if (count > 0) {
+		slot->mem.pkeys += size;
+		slot->mem.npkeys++;
+	} else {
+		slot->mem.pkeys -= size;
+		slot->mem.npkeys--;
+	}
+	pthread_mutex_unlock(&slot->mem_lock);
+}
+
+void pkcs11_mem_slot_link(PKCS11_SLOT_private *slot)
+{
+	PKCS11_CTX_private *ctx = slot->ctx;
+
+	pthread_mutex_lock(&ctx->mem_lock);
+	slot->mem_prev = NULL;
+	slot->mem_next = ctx->slots;
+	if (ctx->slots)
+		ctx->slots->mem_prev = slot;
+	ctx->slots = slot;
+	pthread_mutex_unlock(&ctx->mem_lock);
+}
+
+void pkcs11_mem_slot_unlink(PKCS11_SLOT_private *slot)
+{
+	PKCS11_CTX_private *ctx = slot->ctx;
+
+	pthread_mutex_lock(&ctx->mem_lock);
+	if (slot->mem_prev)
+		slot->mem_prev->mem_next = slot->mem_next;
+	else if (ctx->slots == slot)
+		ctx->slots = slot->mem_next;
+	if (slot->mem_next)
+		slot->mem_next->mem_prev = slot->mem_prev;
+	slot->mem_next = slot->mem_prev = NULL;
+	pthread_mutex_unlock(&ctx->mem_lock);
+}
+
+/* Add the memory held by the private part of a slot */
+static void pkcs11_mem_slot_add(PKCS11_SLOT_private *slot,
+		PKCS11_MEM_USAGE *usage)
+{
+	SLOT_LOCK(slot);
+	usage->slots += sizeof(*slot) +
+		(slot->prev_pin ? strlen(slot->prev_pin) + 1 : 0);
+	usage->sessions += slot->session_poolsize * sizeof(PKCS11_POOLED_SESSION);
+	usage->keys += (size_t)(slot->prv.num + slot->pub.num) * sizeof(PKCS11_KEY);
+	usage->certs += (size_t)slot->ncerts * sizeof(PKCS11_CERT);
+	SLOT_UNLOCK(slot);
+
+	pthread_mutex_lock(&slot->mem_lock);
+	usage->objects += slot->mem.objects;
+	usage->nobjects += slot->mem.nobjects;
+	usage->x509 += slot->mem.x509;
+	usage->nx509 += slot->mem.nx509;
+	usage->pkeys += slot->mem.pkeys;
+	usage->npkeys += slot->mem.npkeys;
+	pthread_mutex_unlock(&slot->mem_lock);
+
+	usage->attrs += pkcs11_attr_cache_mem(slot);
+	usage->keypool += pkcs11_keypool_mem(slot);
+}
+
+static void pkcs11_mem_total(PKCS11_MEM_USAGE *usage)
+{
+	usage->total = usage->ctx + usage->slots + usage->sessions +
+		usage->keys + usage->certs + usage->objects + usage->x509 +
+		usage->pkeys + usage->attrs + usage->keypool;
+}
+
+static size_t pkcs11_mem_str(const char *s)
+{
+	return s ? strlen(s) + 1 : 0;
+}
+
+int pkcs11_get_memory_usage(PKCS11_CTX *pctx, PKCS11_MEM_USAGE *usage)
+{
+	PKCS11_CTX_private *ctx = pctx ? PRIVCTX(pctx) : NULL;
+	PKCS11_SLOT_private *slot;
+
+	if (!ctx || !usage)
+		return -1;
+	memset(usage, 0, sizeof(*usage));
+
+	usage->ctx = sizeof(*pctx) + sizeof(*ctx) +
+		pkcs11_mem_str(pctx->manufacturer) +
+		pkcs11_mem_str(pctx->description) +
+		pkcs11_mem_str(ctx->init_args);
+	pthread_mutex_lock(&ctx->slow_op_lock);
+	if (ctx->slow_ops)
+		usage->ctx += PKCS11_SLOW_OP_LOG_SIZE * sizeof(PKCS11_SLOW_OP);
+	pthread_mutex_unlock(&ctx->slow_op_lock);
+
+	pthread_mutex_lock(&ctx->mem_lock);
+	for (slot = ctx->slots; slot; slot = slot->mem_next)
+		pkcs11_mem_slot_add(slot, usage);
+	pthread_mutex_unlock(&ctx->mem_lock);
+
+	pkcs11_mem_total(usage);
+	return 0;
+}
+
+int pkcs11_get_slot_memory_usage(PKCS11_SLOT *slot, PKCS11_MEM_USAGE *usage)
+{
+	PKCS11_TOKEN *token = slot ? slot->token : NULL;
+
+	if (!slot || !usage)
+		return -1;
+	memset(usage, 0, sizeof(*usage));
+
+	usage->slots = sizeof(PKCS11_SLOT) + pkcs11_mem_str(slot->manufacturer) +
+		pkcs11_mem_str(slot->description);
+	if (token)
+		usage->slots += sizeof(PKCS11_TOKEN) + pkcs11_mem_str(token->label) +
+			pkcs11_mem_str(token->manufacturer) +
+			pkcs11_mem_str(token->model) +
+			pkcs11_mem_str(token->serialnr);
+	pkcs11_mem_slot_add(PRIVSLOT(slot), usage);
+
+	pkcs11_mem_total(usage);
+	return 0;
+}
+
+/* vim: set noexpandtab: */
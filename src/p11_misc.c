@@ -20,6 +20,11 @@
 #include "libp11-int.h"
 #include <string.h>
 #include <openssl/crypto.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <sys/time.h>
+#include <time.h>
+#endif
 
 /* PKCS11 strings are fixed size blank padded,
  * so when strduping them we must make sure
@@ -60,4 +65,64 @@ int pkcs11_atomic_add(int *value, int amount, pthread_mutex_t *lock)
 #endif
 }
 
+/* Monotonic clock in microseconds, only meaningful for measuring intervals */
+unsigned long long pkcs11_time_usec(void)
+{
+#if defined(_WIN32)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000 +
+		(unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000 /
+		freq.QuadPart;
+#else
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* Wait on a condition variable for at most the given number of microseconds
+ * Returns 0 if signaled, 1 on timeout or error */
+int pkcs11_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+		unsigned long long usec)
+{
+#if defined(_WIN32)
+	DWORD ms = (DWORD)((usec + 999) / 1000);
+
+	return SleepConditionVariableCS(cond, mutex, ms) ? 0 : 1;
+#else
+	struct timespec deadline;
+	struct timeval now;
+	unsigned long long nsec;
+
+	/* pthread_cond_timedwait() uses the realtime clock by default */
+	gettimeofday(&now, NULL);
+	nsec = (unsigned long long)now.tv_usec * 1000 + usec * 1000;
+	deadline.tv_sec = now.tv_sec + (time_t)(nsec / 1000000000);
+	deadline.tv_nsec = (long)(nsec % 1000000000);
+	return pthread_cond_timedwait(cond, mutex, &deadline) ? 1 : 0;
+#endif
+}
+
+/* Suspend the calling thread for the given number of microseconds */
+void pkcs11_sleep_usec(unsigned long long usec)
+{
+#if defined(_WIN32)
+	Sleep((DWORD)((usec + 999) / 1000));
+#else
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(usec / 1000000);
+	ts.tv_nsec = (long)(usec % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+#endif
+}
+
 /* vim: set noexpandtab: */
@@ -0,0 +1,311 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * This file implements the tracking of individual token operations
+ * (sign, decrypt, derive, random, find and login), so that applications
+ * can observe or reject them with their own hooks, and the log of the
+ * operations exceeding a configured latency threshold.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+
+int pkcs11_set_op_hooks(PKCS11_CTX_private *ctx,
+		PKCS11_OP_PRE_HOOK pre, PKCS11_OP_POST_HOOK post, void *user_data)
+{
+	if (!ctx)
+		return -1;
+	ctx->op_pre = pre;
+	ctx->op_post = post;
+	ctx->op_user_data = user_data;
+	return 0;
+}
+
+int pkcs11_set_slow_op_threshold(PKCS11_CTX_private *ctx,
+		int operation, unsigned long threshold)
+{
+	int i, tracking = 0;
+
+	if (!ctx || operation < 0 || operation >= PKCS11_OP_COUNT)
+		return -1;
+
+	pthread_mutex_lock(&ctx->slow_op_lock);
+	if (threshold && !ctx->slow_ops) {
+		ctx->slow_ops = OPENSSL_malloc(PKCS11_SLOW_OP_LOG_SIZE *
+			sizeof(PKCS11_SLOW_OP));
+		if (!ctx->slow_ops) {
+			pthread_mutex_unlock(&ctx->slow_op_lock);
+			return -1;
+		}
+		ctx->slow_op_head = ctx->slow_op_count = 0;
+	}
+	for (i = 1; i < PKCS11_OP_COUNT; i++) {
+		if (operation == 0 || operation == i)
+			ctx->slow_op_threshold[i] = threshold;
+		if (ctx->slow_op_threshold[i])
+			tracking = 1;
+	}
+	ctx->slow_op_tracking = tracking;
+	pthread_mutex_unlock(&ctx->slow_op_lock);
+	return 0;
+}
+
+int pkcs11_get_slow_ops(PKCS11_CTX_private *ctx,
+		PKCS11_SLOW_OP *ops, unsigned int *count)
+{
+	unsigned int n;
+
+	if (!ctx || !count)
+		return -1;
+
+	pthread_mutex_lock(&ctx->slow_op_lock);
+	if (!ops) {
+		*count = ctx->slow_op_count;
+		pthread_mutex_unlock(&ctx->slow_op_lock);
+		return 0;
+	}
+	for (n = 0; n < *count && ctx->slow_op_count > 0; n++) {
+		ops[n] = ctx->slow_ops[ctx->slow_op_head];
+		ctx->slow_op_head = (ctx->slow_op_head + 1) % PKCS11_SLOW_OP_LOG_SIZE;
+		ctx->slow_op_count--;
+	}
+	pthread_mutex_unlock(&ctx->slow_op_lock);
+	*count = n;
+	return 0;
+}
+
+/* Append an operation to the slow operation log */
+static void pkcs11_slow_op_record(PKCS11_OP *op, CK_RV rv,
+		unsigned long long elapsed)
+{
+	PKCS11_SLOT_private *slot = op->slot;
+	PKCS11_CTX_private *ctx = slot->ctx;
+	PKCS11_SLOW_OP *event;
+	unsigned int pooled, in_use, waiting, max;
+
+	/* Capture the state of the session pool while still holding our session */
+	SLOT_LOCK(slot);
+	pooled = (slot->session_tail + slot->session_poolsize -
+		slot->session_head) % slot->session_poolsize;
+	in_use = slot->num_sessions > pooled ? slot->num_sessions - pooled : 0;
+	waiting = slot->num_waiters;
+	max = slot->max_sessions;
+	SLOT_UNLOCK(slot);
+
+	pthread_mutex_lock(&ctx->slow_op_lock);
+	if (!ctx->slow_ops) {
+		pthread_mutex_unlock(&ctx->slow_op_lock);
+		return;
+	}
+	if (ctx->slow_op_count == PKCS11_SLOW_OP_LOG_SIZE) { /* drop the oldest */
+		ctx->slow_op_head = (ctx->slow_op_head + 1) % PKCS11_SLOW_OP_LOG_SIZE;
+		ctx->slow_op_count--;
+	}
+	event = &ctx->slow_ops[(ctx->slow_op_head + ctx->slow_op_count++) %
+		PKCS11_SLOW_OP_LOG_SIZE];
+	memset(event, 0, sizeof(*event));
+	event->operation = op->info.operation;
+	event->slot_id = op->info.slot_id;
+	if (op->info.key_id) {
+		event->key_id_len = op->info.key_id_len < sizeof(event->key_id) ?
+			op->info.key_id_len : sizeof(event->key_id);
+		memcpy(event->key_id, op->info.key_id, event->key_id_len);
+	}
+	if (op->info.key_label)
+		strncpy(event->key_label, op->info.key_label,
+			sizeof(event->key_label) - 1);
+	event->mechanism = op->info.mechanism;
+	event->rv = rv;
+	event->elapsed = (unsigned long)elapsed;
+	event->session_wait = (unsigned long)op->session_wait;
+	event->sessions_in_use = in_use;
+	event->sessions_waiting = waiting;
+	event->sessions_max = max;
+	pthread_mutex_unlock(&ctx->slow_op_lock);
+}
+
+/* Fill the description of the operation for the hooks */
+static void pkcs11_op_init(PKCS11_OP *op, int operation,
+		PKCS11_SLOT_private *slot, PKCS11_OBJECT_private *key,
+		CK_MECHANISM_TYPE mechanism, size_t in_len)
+{
+	memset(&op->info, 0, sizeof(op->info));
+	op->op_label = NULL;
+	op->session_wait = 0;
+	op->info.operation = operation;
+	op->info.slot_id = slot->id;
+	if (key) {
+		op->info.key_id = key->id_len ? key->id : NULL;
+		op->info.key_id_len = key->id_len;
+		op->info.key_label = key->label;
+	}
+	op->info.mechanism = mechanism;
+	op->info.in_len = in_len;
+}
+
+/* Function code of the errors reported when an operation cannot start */
+static int pkcs11_op_func(int operation)
+{
+	return operation == PKCS11_OP_RANDOM ?
+		P11_F_PKCS11_GENERATE_RANDOM : P11_F_PKCS11_OP_BEGIN;
+}
+
+/* Start the clock and run the pre hook */
+static int pkcs11_op_start(PKCS11_OP *op)
+{
+	PKCS11_CTX_private *ctx = op->slot->ctx;
+	PKCS11_OP_PRE_HOOK pre = ctx->op_pre;
+
+	op->start = pkcs11_time_usec();
+	if (pre && pre(&op->info, ctx->op_user_data)) {
+		pkcs11_op_end(op, CK_INVALID_HANDLE, CKR_FUNCTION_REJECTED, 0);
+		op->reason = P11_R_OPERATION_REJECTED;
+		P11err(pkcs11_op_func(op->info.operation), op->reason);
+		return -1;
+	}
+	return 0;
+}
+
+int pkcs11_op_begin(PKCS11_OP *op, int operation,
+		PKCS11_SLOT_private *slot, PKCS11_OBJECT_private *key,
+		CK_MECHANISM_TYPE mechanism, size_t in_len,
+		int rw, CK_SESSION_HANDLE *sessionp)
+{
+	PKCS11_CTX_private *ctx = slot->ctx;
+
+	op->slot = slot;
+	op->object = key ? key->object : CK_INVALID_HANDLE;
+	op->limited = 0;
+	op->reason = 0;
+	/* Keep the path without hooks as cheap as possible */
+	op->hooked = ctx->op_pre || ctx->op_post || ctx->slow_op_tracking;
+	if (op->hooked) {
+		pkcs11_op_init(op, operation, slot, key, mechanism, in_len);
+		if (pkcs11_op_start(op))
+			return -1;
+	}
+	if ((ctx->rate || (key && key->bucket)) && sessionp &&
+			(operation == PKCS11_OP_SIGN || operation == PKCS11_OP_DECRYPT ||
+			operation == PKCS11_OP_DERIVE) &&
+			pkcs11_rate_acquire(slot, key)) {
+		pkcs11_op_end(op, CK_INVALID_HANDLE, CKR_FUNCTION_REJECTED, 0);
+		op->reason = P11_R_RATE_LIMITED;
+		P11err(P11_F_PKCS11_OP_BEGIN, op->reason);
+		return -1;
+	}
+	if (ctx->limit_max && sessionp && (operation == PKCS11_OP_SIGN ||
+			operation == PKCS11_OP_DECRYPT)) {
+		if (pkcs11_limiter_acquire(slot)) {
+			pkcs11_op_end(op, CK_INVALID_HANDLE, CKR_FUNCTION_REJECTED, 0);
+			op->reason = P11_R_TOKEN_OVERLOADED;
+			P11err(P11_F_PKCS11_OP_BEGIN, op->reason);
+			return -1;
+		}
+		op->limited = 1;
+		op->limit_start = 0;
+	}
+	if (sessionp && pkcs11_get_session_for(slot, rw, op->object, sessionp)) {
+		pkcs11_op_end(op, CK_INVALID_HANDLE, CKR_GENERAL_ERROR, 0);
+		op->reason = P11_R_NO_SESSION;
+		P11err(pkcs11_op_func(operation), op->reason);
+		return -1;
+	}
+	/* The latency of the token excludes the wait for a session */
+	if (op->limited)
+		op->limit_start = pkcs11_time_usec();
+	if (op->hooked && sessionp)
+		op->session_wait = pkcs11_time_usec() - op->start;
+	return 0;
+}
+
+int pkcs11_op_begin_find(PKCS11_OP *op, PKCS11_SLOT_private *slot,
+		PKCS11_TEMPLATE *tmpl)
+{
+	PKCS11_CTX_private *ctx = slot->ctx;
+	unsigned int i;
+
+	op->slot = slot;
+	op->object = CK_INVALID_HANDLE;
+	op->hooked = ctx->op_pre || ctx->op_post || ctx->slow_op_tracking;
+	if (!op->hooked)
+		return 0;
+	pkcs11_op_init(op, PKCS11_OP_FIND, slot, NULL,
+		CK_UNAVAILABLE_INFORMATION, 0);
+	for (i = 0; i < tmpl->nattr; i++) {
+		switch (tmpl->attrs[i].type) {
+		case CKA_ID:
+			op->info.key_id = tmpl->attrs[i].pValue;
+			op->info.key_id_len = tmpl->attrs[i].ulValueLen;
+			break;
+		case CKA_LABEL:
+			/* pkcs11_addattr_s() stores the label without a terminator */
+			op->op_label = OPENSSL_malloc(tmpl->attrs[i].ulValueLen + 1);
+			if (op->op_label) {
+				memcpy(op->op_label, tmpl->attrs[i].pValue,
+					tmpl->attrs[i].ulValueLen);
+				op->op_label[tmpl->attrs[i].ulValueLen] = '\0';
+			}
+			op->info.key_label = op->op_label;
+			break;
+		}
+	}
+	return pkcs11_op_start(op);
+}
+
+void pkcs11_op_end(PKCS11_OP *op, CK_SESSION_HANDLE session,
+		CK_RV rv, size_t out_len)
+{
+	PKCS11_CTX_private *ctx = op->slot->ctx;
+	PKCS11_OP_POST_HOOK post;
+	unsigned long long elapsed;
+	unsigned long threshold;
+
+	if (op->limited) {
+		op->limited = 0;
+		/* Fast failures would pull the latency baseline down */
+		pkcs11_limiter_release(op->slot,
+			session != CK_INVALID_HANDLE && rv == CKR_OK ?
+				op->limit_start : 0);
+	}
+	if (!op->hooked) {
+		if (session != CK_INVALID_HANDLE)
+			pkcs11_put_session_for(op->slot, session, op->object);
+		return;
+	}
+	op->hooked = 0;
+
+	elapsed = pkcs11_time_usec() - op->start;
+	threshold = ctx->slow_op_threshold[op->info.operation];
+	if (threshold && elapsed >= threshold)
+		pkcs11_slow_op_record(op, rv, elapsed);
+	if (session != CK_INVALID_HANDLE)
+		pkcs11_put_session_for(op->slot, session, op->object);
+
+	post = ctx->op_post;
+	if (post) {
+		op->info.session = session;
+		op->info.rv = rv;
+		op->info.out_len = rv == CKR_OK ? out_len : 0;
+		op->info.elapsed = (unsigned long)elapsed;
+		post(&op->info, ctx->op_user_data);
+	}
+	OPENSSL_free(op->op_label);
+	op->op_label = NULL;
+}
+
+/* vim: set noexpandtab: */
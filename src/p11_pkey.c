@@ -321,11 +321,11 @@ static int pkcs11_try_pkey_rsa_sign(EVP_PKEY_CTX *evp_pkey_ctx,
 	CK_ULONG size = *siglen;
 	PKCS11_OBJECT_private *key;
 	PKCS11_SLOT_private *slot;
-	PKCS11_CTX_private *ctx;
 	const EVP_MD *sig_md;
 	CK_SESSION_HANDLE session;
 	CK_MECHANISM mechanism;
 	CK_RSA_PKCS_PSS_PARAMS pss_params;
+	PKCS11_OP op;
 
 #ifdef DEBUG
 	fprintf(stderr, "%s:%d pkcs11_try_pkey_rsa_sign() "
@@ -349,7 +349,6 @@ static int pkcs11_try_pkey_rsa_sign(EVP_PKEY_CTX *evp_pkey_ctx,
 		return -1;
 
 	slot = key->slot;
-	ctx = slot->ctx;
 	if (!evp_pkey_ctx)
 		return -1;
 	if (EVP_PKEY_CTX_get_signature_md(evp_pkey_ctx, &sig_md) <= 0)
@@ -379,17 +378,13 @@ static int pkcs11_try_pkey_rsa_sign(EVP_PKEY_CTX *evp_pkey_ctx,
 		return -1;
 	} /* end switch(padding) */
 
-	if (pkcs11_get_session(slot, 0, &session))
+	if (pkcs11_op_begin(&op, PKCS11_OP_SIGN, slot, key,
+			mechanism.mechanism, tbslen, 0, &session))
 		return -1;
 
-	rv = CRYPTOKI_call(ctx,
-		C_SignInit(session, &mechanism, key->object));
-	if (!rv && key->always_authenticate == CK_TRUE)
-		rv = pkcs11_authenticate(key, session);
-	if (!rv)
-		rv = CRYPTOKI_call(ctx,
-			C_Sign(session, (CK_BYTE_PTR)tbs, tbslen, sig, &size));
-	pkcs11_put_session(slot, session);
+	rv = pkcs11_private_op(key, session, PKCS11_OP_SIGN, &mechanism,
+		tbs, tbslen, sig, &size);
+	pkcs11_op_end(&op, session, rv, size);
 #ifdef DEBUG
 	fprintf(stderr, "%s:%d C_SignInit or C_Sign rv=%d\n",
 		__FILE__, __LINE__, rv);
@@ -423,10 +418,10 @@ static int pkcs11_try_pkey_rsa_decrypt(EVP_PKEY_CTX *evp_pkey_ctx,
 	CK_ULONG size = *outlen;
 	PKCS11_OBJECT_private *key;
 	PKCS11_SLOT_private *slot;
-	PKCS11_CTX_private *ctx;
 	CK_SESSION_HANDLE session;
 	CK_MECHANISM mechanism;
 	CK_RSA_PKCS_OAEP_PARAMS oaep_params;
+	PKCS11_OP op;
 
 #ifdef DEBUG
 	fprintf(stderr, "%s:%d pkcs11_try_pkey_rsa_decrypt() "
@@ -450,7 +445,6 @@ static int pkcs11_try_pkey_rsa_decrypt(EVP_PKEY_CTX *evp_pkey_ctx,
 		return -1;
 
 	slot = key->slot;
-	ctx = slot->ctx;
 
 	if (!evp_pkey_ctx)
 		return -1;
@@ -486,17 +480,13 @@ static int pkcs11_try_pkey_rsa_decrypt(EVP_PKEY_CTX *evp_pkey_ctx,
 		return -1;
 	} /* end switch(padding) */
 
-	if (pkcs11_get_session(slot, 0, &session))
+	if (pkcs11_op_begin(&op, PKCS11_OP_DECRYPT, slot, key,
+			mechanism.mechanism, inlen, 0, &session))
 		return -1;
 
-	rv = CRYPTOKI_call(ctx,
-		C_DecryptInit(session, &mechanism, key->object));
-	if (!rv && key->always_authenticate == CK_TRUE)
-		rv = pkcs11_authenticate(key, session);
-	if (!rv)
-		rv = CRYPTOKI_call(ctx,
-			C_Decrypt(session, (CK_BYTE_PTR)in, inlen, out, &size));
-	pkcs11_put_session(slot, session);
+	rv = pkcs11_private_op(key, session, PKCS11_OP_DECRYPT, &mechanism,
+		in, inlen, out, &size);
+	pkcs11_op_end(&op, session, rv, size);
 #ifdef DEBUG
 	fprintf(stderr, "%s:%d C_DecryptInit or C_Decrypt rv=%d\n",
 		__FILE__, __LINE__, rv);
@@ -561,11 +551,11 @@ static int pkcs11_try_pkey_ec_sign(EVP_PKEY_CTX *evp_pkey_ctx,
 	CK_ULONG size = *siglen;
 	PKCS11_OBJECT_private *key;
 	PKCS11_SLOT_private *slot;
-	PKCS11_CTX_private *ctx;
 	CK_SESSION_HANDLE session;
 	const EVP_MD *sig_md;
 	ECDSA_SIG *ossl_sig;
 	CK_MECHANISM mechanism;
+	PKCS11_OP op;
 
 #ifdef DEBUG
 	fprintf(stderr, "%s:%d pkcs11_try_pkey_ec_sign() "
@@ -599,7 +589,6 @@ static int pkcs11_try_pkey_ec_sign(EVP_PKEY_CTX *evp_pkey_ctx,
 		goto error;
 
 	slot = key->slot;
-	ctx = slot->ctx;
 
 	if (!evp_pkey_ctx)
 		goto error;
@@ -614,16 +603,14 @@ static int pkcs11_try_pkey_ec_sign(EVP_PKEY_CTX *evp_pkey_ctx,
 	memset(&mechanism, 0, sizeof mechanism);
 	mechanism.mechanism = CKM_ECDSA;
 
-	if (pkcs11_get_session(slot, 0, &session))
-		return -1;
-	rv = CRYPTOKI_call(ctx,
-		C_SignInit(session, &mechanism, key->object));
-	if (!rv && key->always_authenticate == CK_TRUE)
-		rv = pkcs11_authenticate(key, session);
-	if (!rv)
-		rv = CRYPTOKI_call(ctx,
-			C_Sign(session, (CK_BYTE_PTR)tbs, tbslen, sig, &size));
-	pkcs11_put_session(slot, session);
+	if (pkcs11_op_begin(&op, PKCS11_OP_SIGN, slot, key,
+			mechanism.mechanism, tbslen, 0, &session)) {
+		rv = CKR_GENERAL_ERROR;
+		goto error;
+	}
+	rv = pkcs11_private_op(key, session, PKCS11_OP_SIGN, &mechanism,
+		tbs, tbslen, sig, &size);
+	pkcs11_op_end(&op, session, rv, size);
 
 #ifdef DEBUG
 	fprintf(stderr, "%s:%d C_SignInit or C_Sign rv=%d\n",
@@ -0,0 +1,30 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+#ifndef _P11_PLACE_H
+#define _P11_PLACE_H
+
+#include "libp11.h"
+
+/* Select the slot holding a key by rendezvous hashing of its id,
+ * among a list of slots that may be picked from several slot lists */
+extern PKCS11_SLOT *pkcs11_place_key(PKCS11_SLOT **slots, unsigned int nslots,
+	const unsigned char *id, size_t id_len);
+
+#endif
+
+/* vim: set noexpandtab: */
@@ -52,6 +52,11 @@ static int pthread_mutex_lock(pthread_mutex_t *mutex)
 	return 0;
 }
 
+static int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+	return TryEnterCriticalSection(mutex) ? 0 : 1;
+}
+
 static int pthread_mutex_unlock(pthread_mutex_t *mutex)
 {
 	LeaveCriticalSection(mutex);
@@ -87,6 +92,76 @@ static int pthread_cond_signal(pthread_cond_t *cond)
 	return 0;
 }
 
+static int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+	WakeAllConditionVariable(cond);
+	return 0;
+}
+
+typedef HANDLE pthread_t;
+typedef void pthread_attr_t;
+
+typedef struct {
+	void *(*start_routine)(void *);
+	void *arg;
+} pthread_start_t;
+
+static DWORD WINAPI pthread_start(LPVOID param)
+{
+	pthread_start_t start = *(pthread_start_t *)param;
+
+	HeapFree(GetProcessHeap(), 0, param);
+	start.start_routine(start.arg);
+	return 0;
+}
+
+static int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+	void *(*start_routine)(void *), void *arg)
+{
+	pthread_start_t *start;
+
+	(void)attr;
+	start = HeapAlloc(GetProcessHeap(), 0, sizeof(pthread_start_t));
+	if (!start)
+		return 1;
+	start->start_routine = start_routine;
+	start->arg = arg;
+	*thread = CreateThread(NULL, 0, pthread_start, start, 0, NULL);
+	if (!*thread) {
+		HeapFree(GetProcessHeap(), 0, start);
+		return 1;
+	}
+	return 0;
+}
+
+static int pthread_join(pthread_t thread, void **retval)
+{
+	if (retval)
+		*retval = NULL;
+	if (WaitForSingleObject(thread, INFINITE) != WAIT_OBJECT_0)
+		return 1;
+	CloseHandle(thread);
+	return 0;
+}
+
+typedef INIT_ONCE pthread_once_t;
+#define PTHREAD_ONCE_INIT INIT_ONCE_STATIC_INIT
+
+static BOOL CALLBACK pthread_once_callback(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+	(void)once;
+	(void)context;
+	((void (*)(void))param)();
+	return TRUE;
+}
+
+static int pthread_once(pthread_once_t *once, void (*init_routine)(void))
+{
+	if (!InitOnceExecuteOnce(once, pthread_once_callback, (PVOID)init_routine, NULL))
+		return 1;
+	return 0;
+}
+
 #else
 
 #error Locking not supported on this platform.
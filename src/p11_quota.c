@@ -0,0 +1,461 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Session quotas shared between processes.
+ *
+ * Each process of a prefork server opens up to max_sessions sessions per
+ * slot, so that a few processes are enough to exceed the session limit of
+ * the token.  Contexts configured with PKCS11_set_session_quota() record
+ * the sessions opened by their process for each slot in a shared memory
+ * segment.  A new session is only opened while the sessions of all the
+ * processes stay within the budget of the slot, so that busy processes
+ * borrow the sessions that others do not use.  A process holding more than
+ * its fair share (the budget divided by the number of processes) closes
+ * the surplus sessions as they are returned to the pool, once it no longer
+ * needs them or when another process is waiting.  The records of processes
+ * that no longer exist are reclaimed.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PKCS11_QUOTA_MAGIC 0x70313171
+#define PKCS11_QUOTA_RECORDS 256
+#define PKCS11_QUOTA_RETRY_MS 10
+#define PKCS11_QUOTA_ATTACH_MS 1000
+
+typedef struct pkcs11_quota_record {
+	pid_t pid; /* 0 for an unused record */
+	CK_SLOT_ID slot_id;
+	unsigned int in_use; /* sessions opened by the process */
+	unsigned int waiting; /* threads of the process waiting for a session */
+} PKCS11_QUOTA_RECORD;
+
+struct pkcs11_quota_st {
+	unsigned int magic; /* set once the segment is initialized */
+	pthread_mutex_t lock;
+	unsigned int budget; /* sessions per slot for all the processes */
+	PKCS11_QUOTA_RECORD records[PKCS11_QUOTA_RECORDS];
+};
+
+#if defined(__GNUC__) && defined(__ATOMIC_ACQUIRE)
+#define pkcs11_quota_get_magic(q) __atomic_load_n(&(q)->magic, __ATOMIC_ACQUIRE)
+#define pkcs11_quota_set_magic(q) \
+	__atomic_store_n(&(q)->magic, PKCS11_QUOTA_MAGIC, __ATOMIC_RELEASE)
+#else
+#define pkcs11_quota_get_magic(q) (*(volatile unsigned int *)&(q)->magic)
+#define pkcs11_quota_set_magic(q) \
+	(*(volatile unsigned int *)&(q)->magic = PKCS11_QUOTA_MAGIC)
+#endif
+
+static void pkcs11_quota_lock(PKCS11_QUOTA *quota)
+{
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+	/* The previous owner died: the records stay consistent, as they are
+	 * only updated with single stores */
+	if (pthread_mutex_lock(&quota->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&quota->lock);
+#else
+	pthread_mutex_lock(&quota->lock);
+#endif
+}
+
+/* Forget the processes that no longer exist
+ * Called with the quota lock held */
+static void pkcs11_quota_reclaim(PKCS11_QUOTA *quota, pid_t self)
+{
+	PKCS11_QUOTA_RECORD *rec;
+
+	for (rec = quota->records; rec < quota->records + PKCS11_QUOTA_RECORDS; rec++)
+		if (rec->pid && rec->pid != self &&
+				kill(rec->pid, 0) && errno == ESRCH)
+			memset(rec, 0, sizeof(*rec));
+}
+
+/* Find (or create) the record of the process for the slot
+ * Called with the quota lock held */
+static PKCS11_QUOTA_RECORD *pkcs11_quota_record(PKCS11_QUOTA *quota,
+		pid_t self, CK_SLOT_ID slot_id, int create)
+{
+	PKCS11_QUOTA_RECORD *rec, *unused = NULL;
+
+	for (rec = quota->records; rec < quota->records + PKCS11_QUOTA_RECORDS; rec++) {
+		if (rec->pid == self && rec->slot_id == slot_id)
+			return rec;
+		if (!rec->pid && !unused)
+			unused = rec;
+	}
+	if (!create || !unused)
+		return NULL;
+	memset(unused, 0, sizeof(*unused));
+	unused->pid = self;
+	unused->slot_id = slot_id;
+	return unused;
+}
+
+/* Sessions opened for the slot, and number of processes holding them
+ * Called with the quota lock held */
+static unsigned int pkcs11_quota_total(PKCS11_QUOTA *quota,
+		CK_SLOT_ID slot_id, unsigned int *processes, unsigned int *waiting)
+{
+	PKCS11_QUOTA_RECORD *rec;
+	unsigned int total = 0;
+
+	*processes = *waiting = 0;
+	for (rec = quota->records; rec < quota->records + PKCS11_QUOTA_RECORDS; rec++) {
+		if (!rec->pid || rec->slot_id != slot_id)
+			continue;
+		total += rec->in_use;
+		*waiting += rec->waiting;
+		(*processes)++;
+	}
+	return total;
+}
+
+/*
+ * Reserve a session before it is opened
+ * Returns 0 if the session can be opened, -1 if the budget is exhausted
+ */
+int pkcs11_quota_acquire(PKCS11_SLOT_private *slot)
+{
+	PKCS11_QUOTA *quota = slot->ctx->quota;
+	PKCS11_QUOTA_RECORD *rec;
+	unsigned int total, processes, waiting;
+	pid_t self = getpid();
+	int ret = 0;
+
+	if (!quota)
+		return 0;
+	pkcs11_quota_lock(quota);
+	pkcs11_quota_reclaim(quota, self);
+	rec = pkcs11_quota_record(quota, self, slot->id, 1);
+	if (rec) { /* The sessions are not limited if the table is full */
+		total = pkcs11_quota_total(quota, slot->id, &processes, &waiting);
+		if (total < quota->budget)
+			rec->in_use++;
+		else
+			ret = -1;
+	}
+	pthread_mutex_unlock(&quota->lock);
+	return ret;
+}
+
+/*
+ * Account for sessions that were closed
+ */
+void pkcs11_quota_release(PKCS11_SLOT_private *slot, unsigned int count)
+{
+	PKCS11_QUOTA *quota = slot->ctx->quota;
+	PKCS11_QUOTA_RECORD *rec;
+
+	if (!quota)
+		return;
+	pkcs11_quota_lock(quota);
+	rec = pkcs11_quota_record(quota, getpid(), slot->id, 0);
+	if (rec)
+		rec->in_use = rec->in_use > count ? rec->in_use - count : 0;
+	pthread_mutex_unlock(&quota->lock);
+}
+
+/*
+ * Subtract the sessions of the slot from the record of the process
+ * Called with quota->lock held
+ */
+static void pkcs11_quota_sub(PKCS11_QUOTA *quota, PKCS11_SLOT_private *slot)
+{
+	PKCS11_QUOTA_RECORD *rec;
+	unsigned int count = slot->num_sessions;
+
+	rec = pkcs11_quota_record(quota, getpid(), slot->id, 0);
+	if (rec) {
+		rec->in_use = rec->in_use > count ? rec->in_use - count : 0;
+		if (!rec->in_use && !rec->waiting)
+			memset(rec, 0, sizeof(*rec));
+	}
+}
+
+/*
+ * Account for all the sessions of the slot being closed
+ * Only the sessions of this context are released, as other contexts of the
+ * process share the record.  Called before slot->num_sessions is cleared.
+ */
+void pkcs11_quota_reset(PKCS11_SLOT_private *slot)
+{
+	PKCS11_QUOTA *quota = slot->ctx->quota;
+
+	if (!quota)
+		return;
+	pkcs11_quota_lock(quota);
+	pkcs11_quota_sub(quota, slot);
+	pthread_mutex_unlock(&quota->lock);
+}
+
+/*
+ * Decide whether a session returned to the pool should be closed instead
+ * Returns 1 (and releases the session from the quota) if the process holds
+ * more than its fair share, and either another process is waiting or the
+ * session is not needed (idle sessions are pooled and nobody waits).
+ * Called with slot->lock held.
+ */
+int pkcs11_quota_give_back(PKCS11_SLOT_private *slot)
+{
+	PKCS11_QUOTA *quota = slot->ctx->quota;
+	PKCS11_QUOTA_RECORD *rec;
+	unsigned int processes, waiting, share, pooled;
+	int ret = 0;
+
+	if (!quota)
+		return 0;
+	pooled = (slot->session_tail + slot->session_poolsize -
+		slot->session_head) % slot->session_poolsize;
+	pkcs11_quota_lock(quota);
+	rec = pkcs11_quota_record(quota, getpid(), slot->id, 0);
+	if (rec) {
+		pkcs11_quota_total(quota, slot->id, &processes, &waiting);
+		share = quota->budget / processes;
+		if (share == 0)
+			share = 1;
+		if (rec->in_use > share && (waiting > rec->waiting ||
+				(pooled > 0 && slot->num_waiters == 0))) {
+			rec->in_use--;
+			ret = 1;
+		}
+	}
+	pthread_mutex_unlock(&quota->lock);
+	return ret;
+}
+
+/*
+ * Wait for a session while the budget is exhausted
+ * Sessions closed by other processes do not signal slot->cond, so the
+ * budget is checked again after a short delay.
+ * Called with slot->lock held.
+ */
+void pkcs11_quota_wait(PKCS11_SLOT_private *slot)
+{
+	PKCS11_QUOTA *quota = slot->ctx->quota;
+	PKCS11_QUOTA_RECORD *rec;
+	pid_t self = getpid();
+
+	pkcs11_quota_lock(quota);
+	rec = pkcs11_quota_record(quota, self, slot->id, 1);
+	if (rec)
+		rec->waiting++;
+	pthread_mutex_unlock(&quota->lock);
+
+	pkcs11_cond_timedwait(&slot->cond, &slot->lock,
+		PKCS11_QUOTA_RETRY_MS * 1000);
+
+	pkcs11_quota_lock(quota);
+	rec = pkcs11_quota_record(quota, self, slot->id, 0);
+	if (rec && rec->waiting > 0)
+		rec->waiting--;
+	pthread_mutex_unlock(&quota->lock);
+}
+
+/* Map the shared segment, initializing it if it was just created */
+static PKCS11_QUOTA *pkcs11_quota_map(const char *name)
+{
+	PKCS11_QUOTA *quota;
+	pthread_mutexattr_t attr;
+	struct stat st;
+	int fd, created = 0, i;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0)
+		created = 1;
+	else if (errno == EEXIST)
+		fd = shm_open(name, O_RDWR, 0600);
+	if (fd < 0)
+		return NULL;
+
+	if (created) {
+		if (ftruncate(fd, sizeof(PKCS11_QUOTA))) {
+			close(fd);
+			shm_unlink(name);
+			return NULL;
+		}
+	} else { /* Wait for the creator to size the segment */
+		for (i = 0; i < PKCS11_QUOTA_ATTACH_MS; i++) {
+			if (fstat(fd, &st) || st.st_size >= (off_t)sizeof(PKCS11_QUOTA))
+				break;
+			usleep(1000);
+		}
+		if (fstat(fd, &st) || st.st_size < (off_t)sizeof(PKCS11_QUOTA)) {
+			close(fd);
+			return NULL;
+		}
+	}
+	quota = mmap(NULL, sizeof(PKCS11_QUOTA), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (quota == MAP_FAILED)
+		return NULL;
+
+	if (created) {
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+		pthread_mutex_init(&quota->lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+		pkcs11_quota_set_magic(quota);
+		return quota;
+	}
+	for (i = 0; i < PKCS11_QUOTA_ATTACH_MS; i++) {
+		if (pkcs11_quota_get_magic(quota) == PKCS11_QUOTA_MAGIC)
+			return quota;
+		usleep(1000);
+	}
+	munmap(quota, sizeof(PKCS11_QUOTA));
+	return NULL;
+}
+
+/*
+ * Return the sessions of this context and unmap the segment
+ * Other contexts of the process may share the records
+ */
+void pkcs11_quota_detach(PKCS11_CTX_private *ctx)
+{
+	PKCS11_QUOTA *quota = ctx->quota;
+	PKCS11_SLOT_private *slot;
+
+	if (!quota)
+		return;
+	pthread_mutex_lock(&ctx->mem_lock);
+	for (slot = ctx->slots; slot; slot = slot->mem_next) {
+		pthread_mutex_lock(&slot->lock);
+		pkcs11_quota_lock(quota);
+		pkcs11_quota_sub(quota, slot);
+		pthread_mutex_unlock(&quota->lock);
+		pthread_mutex_unlock(&slot->lock);
+	}
+	ctx->quota = NULL;
+	pthread_mutex_unlock(&ctx->mem_lock);
+	munmap(quota, sizeof(PKCS11_QUOTA));
+}
+
+int pkcs11_set_session_quota(PKCS11_CTX_private *ctx, const char *name,
+		unsigned int budget)
+{
+	PKCS11_QUOTA *quota;
+
+	pkcs11_quota_detach(ctx);
+	if (!name || !budget)
+		return 0;
+
+	quota = pkcs11_quota_map(name);
+	if (!quota) {
+		P11err(P11_F_PKCS11_SET_SESSION_QUOTA, ERR_R_SYS_LIB);
+		return -1;
+	}
+	pkcs11_quota_lock(quota);
+	quota->budget = budget;
+	pthread_mutex_unlock(&quota->lock);
+	ctx->quota = quota;
+	return 0;
+}
+
+int pkcs11_get_session_quota(PKCS11_SLOT_private *slot,
+		PKCS11_SESSION_QUOTA *status)
+{
+	PKCS11_QUOTA *quota = slot->ctx->quota;
+	PKCS11_QUOTA_RECORD *rec;
+	pid_t self = getpid();
+
+	memset(status, 0, sizeof(*status));
+	if (!quota)
+		return -1;
+	pkcs11_quota_lock(quota);
+	pkcs11_quota_reclaim(quota, self);
+	status->budget = quota->budget;
+	status->in_use = pkcs11_quota_total(quota, slot->id,
+		&status->processes, &status->waiting);
+	rec = pkcs11_quota_record(quota, self, slot->id, 0);
+	if (rec)
+		status->own = rec->in_use;
+	pthread_mutex_unlock(&quota->lock);
+	return 0;
+}
+
+#else /* _WIN32 */
+
+int pkcs11_quota_acquire(PKCS11_SLOT_private *slot)
+{
+	(void)slot;
+	return 0;
+}
+
+void pkcs11_quota_release(PKCS11_SLOT_private *slot, unsigned int count)
+{
+	(void)slot;
+	(void)count;
+}
+
+void pkcs11_quota_reset(PKCS11_SLOT_private *slot)
+{
+	(void)slot;
+}
+
+int pkcs11_quota_give_back(PKCS11_SLOT_private *slot)
+{
+	(void)slot;
+	return 0;
+}
+
+void pkcs11_quota_wait(PKCS11_SLOT_private *slot)
+{
+	pthread_cond_wait(&slot->cond, &slot->lock);
+}
+
+void pkcs11_quota_detach(PKCS11_CTX_private *ctx)
+{
+	(void)ctx;
+}
+
+int pkcs11_set_session_quota(PKCS11_CTX_private *ctx, const char *name,
+		unsigned int budget)
+{
+	(void)ctx;
+	if (!name || !budget)
+		return 0;
+	P11err(P11_F_PKCS11_SET_SESSION_QUOTA, P11_R_NOT_SUPPORTED);
+	return -1;
+}
+
+int pkcs11_get_session_quota(PKCS11_SLOT_private *slot,
+		PKCS11_SESSION_QUOTA *status)
+{
+	(void)slot;
+	memset(status, 0, sizeof(*status));
+	return -1;
+}
+
+#endif /* _WIN32 */
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,275 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Token bucket rate shaping.
+ *
+ * Tokens licensed for a number of operations per second throttle or
+ * reject the operations above that rate.  The sign, decrypt and derive
+ * operations of each slot, and optionally of each key, take a token from
+ * a bucket refilled at the configured rate and holding at most the
+ * configured burst.  An operation finding the bucket empty reserves the
+ * next token, leaving a negative balance, and sleeps until the time the
+ * token is refilled, so that the waiting operations start in order without
+ * holding any lock.  An operation that would wait longer than the maximum
+ * wait fails without reserving a token.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+
+void pkcs11_bucket_init(PKCS11_BUCKET *bucket)
+{
+	memset(bucket, 0, sizeof(PKCS11_BUCKET));
+	pthread_mutex_init(&bucket->lock, 0);
+	bucket->forkid = get_forkid();
+}
+
+void pkcs11_bucket_destroy(PKCS11_BUCKET *bucket)
+{
+	pthread_mutex_destroy(&bucket->lock);
+}
+
+PKCS11_BUCKET *pkcs11_bucket_new(void)
+{
+	PKCS11_BUCKET *bucket = OPENSSL_malloc(sizeof(PKCS11_BUCKET));
+
+	if (bucket)
+		pkcs11_bucket_init(bucket);
+	return bucket;
+}
+
+void pkcs11_bucket_free(PKCS11_BUCKET *bucket)
+{
+	if (!bucket)
+		return;
+	pkcs11_bucket_destroy(bucket);
+	OPENSSL_free(bucket);
+}
+
+/* Tokens available at the given time
+ * Called with the bucket lock held */
+static double pkcs11_bucket_level(PKCS11_BUCKET *bucket, unsigned long rate,
+		unsigned long burst, unsigned long long now)
+{
+	double tokens;
+
+	/* The threads waiting in the parent are not in the child */
+	if (bucket->forkid != get_forkid()) {
+		bucket->forkid = get_forkid();
+		bucket->waiting = 0;
+	}
+	if (!bucket->last)
+		return (double)burst;
+	tokens = bucket->tokens;
+	if (now > bucket->last)
+		tokens += (double)(now - bucket->last) * rate / 1000000;
+	return tokens < burst ? tokens : (double)burst;
+}
+
+/*
+ * Take a token from the bucket, with the rate and burst of a key bucket
+ * if rate is 0.  Sets the delay in microseconds before the operation may
+ * start.  Returns 1 if a token was taken, 0 if the bucket is disabled, or
+ * -1 if the delay would exceed max_wait
+ */
+static int pkcs11_bucket_take(PKCS11_BUCKET *bucket, unsigned long rate,
+		unsigned long burst, unsigned long max_wait, unsigned long long now,
+		unsigned long long *delay)
+{
+	pthread_mutex_lock(&bucket->lock);
+	if (!rate) {
+		rate = bucket->rate;
+		burst = bucket->burst;
+	}
+	if (!rate) {
+		pthread_mutex_unlock(&bucket->lock);
+		return 0;
+	}
+	*delay = 0;
+	bucket->tokens = pkcs11_bucket_level(bucket, rate, burst, now);
+	bucket->last = now;
+	if (bucket->tokens < 1) {
+		*delay = (unsigned long long)((1 - bucket->tokens) * 1000000 / rate) + 1;
+		if (max_wait && *delay > max_wait) {
+			bucket->rejected++;
+			pthread_mutex_unlock(&bucket->lock);
+			return -1;
+		}
+		bucket->waiting++;
+		bucket->delayed++;
+	} else {
+		bucket->admitted++;
+	}
+	bucket->tokens -= 1;
+	pthread_mutex_unlock(&bucket->lock);
+	return 1;
+}
+
+/* Return a token taken with the given delay */
+static void pkcs11_bucket_untake(PKCS11_BUCKET *bucket,
+		unsigned long long delay)
+{
+	pthread_mutex_lock(&bucket->lock);
+	bucket->tokens += 1;
+	if (delay) {
+		bucket->waiting--;
+		bucket->delayed--;
+	} else {
+		bucket->admitted--;
+	}
+	pthread_mutex_unlock(&bucket->lock);
+}
+
+/* Account for the end of the delay of an operation */
+static void pkcs11_bucket_woken(PKCS11_BUCKET *bucket)
+{
+	pthread_mutex_lock(&bucket->lock);
+	if (bucket->waiting > 0)
+		bucket->waiting--;
+	pthread_mutex_unlock(&bucket->lock);
+}
+
+/*
+ * Wait until the rate limits of the slot and of the key allow an operation
+ * Returns 0 on success, -1 if the maximum wait would be exceeded
+ */
+int pkcs11_rate_acquire(PKCS11_SLOT_private *slot, PKCS11_OBJECT_private *key)
+{
+	PKCS11_CTX_private *ctx = slot->ctx;
+	PKCS11_BUCKET *kb = key ? key->bucket : NULL;
+	unsigned long long now = pkcs11_time_usec();
+	unsigned long long kdelay = 0, sdelay = 0;
+	int kt = 0, st = 0;
+
+	if (kb) {
+		kt = pkcs11_bucket_take(kb, 0, 0, ctx->rate_wait, now, &kdelay);
+		if (kt < 0)
+			return -1;
+	}
+	if (ctx->rate) {
+		st = pkcs11_bucket_take(&slot->bucket, ctx->rate,
+			ctx->rate_burst, ctx->rate_wait, now, &sdelay);
+		if (st < 0) {
+			if (kt)
+				pkcs11_bucket_untake(kb, kdelay);
+			return -1;
+		}
+	}
+	if (kdelay || sdelay)
+		pkcs11_sleep_usec(kdelay > sdelay ? kdelay : sdelay);
+	if (kdelay)
+		pkcs11_bucket_woken(kb);
+	if (sdelay)
+		pkcs11_bucket_woken(&slot->bucket);
+	return 0;
+}
+
+/* Report the state of a bucket, with the rate and burst of a key bucket
+ * if rate is 0.  Returns -1 if the bucket is disabled */
+static int pkcs11_bucket_status(PKCS11_BUCKET *bucket, unsigned long rate,
+		unsigned long burst, PKCS11_RATE_LIMIT *status)
+{
+	pthread_mutex_lock(&bucket->lock);
+	if (!rate) {
+		rate = bucket->rate;
+		burst = bucket->burst;
+	}
+	if (rate) {
+		status->rate = rate;
+		status->burst = burst;
+		status->tokens = (long)pkcs11_bucket_level(bucket, rate, burst,
+			pkcs11_time_usec());
+		status->waiting = bucket->waiting;
+		status->admitted = bucket->admitted;
+		status->delayed = bucket->delayed;
+		status->rejected = bucket->rejected;
+	}
+	pthread_mutex_unlock(&bucket->lock);
+	return rate ? 0 : -1;
+}
+
+int pkcs11_set_rate_limit(PKCS11_CTX_private *ctx, unsigned long rate,
+		unsigned long burst, unsigned long max_wait)
+{
+	if (!ctx)
+		return -1;
+	if (rate && burst < 1) {
+		P11err(P11_F_PKCS11_SET_RATE_LIMIT, P11_R_INVALID_PARAMETER);
+		return -1;
+	}
+	ctx->rate_burst = burst;
+	ctx->rate_wait = max_wait;
+	ctx->rate = rate;
+	return 0;
+}
+
+int pkcs11_get_rate_limit(PKCS11_SLOT_private *slot, PKCS11_RATE_LIMIT *status)
+{
+	PKCS11_CTX_private *ctx = slot->ctx;
+
+	memset(status, 0, sizeof(*status));
+	if (!ctx->rate)
+		return -1;
+	return pkcs11_bucket_status(&slot->bucket, ctx->rate, ctx->rate_burst,
+		status);
+}
+
+int pkcs11_set_key_rate_limit(PKCS11_OBJECT_private *key, unsigned long rate,
+		unsigned long burst)
+{
+	PKCS11_BUCKET *bucket;
+
+	if (key->object_class != CKO_PRIVATE_KEY || (rate && burst < 1)) {
+		P11err(P11_F_PKCS11_SET_RATE_LIMIT, P11_R_INVALID_PARAMETER);
+		return -1;
+	}
+
+	/* The bucket is allocated once, and released with the key */
+	pthread_mutex_lock(&key->lock);
+	bucket = key->bucket;
+	if (!bucket && rate) {
+		bucket = pkcs11_bucket_new();
+		key->bucket = bucket;
+	}
+	pthread_mutex_unlock(&key->lock);
+	if (!bucket) {
+		if (!rate)
+			return 0;
+		P11err(P11_F_PKCS11_SET_RATE_LIMIT, ERR_R_MALLOC_FAILURE);
+		return -1;
+	}
+
+	pthread_mutex_lock(&bucket->lock);
+	bucket->burst = burst;
+	bucket->rate = rate;
+	pthread_mutex_unlock(&bucket->lock);
+	return 0;
+}
+
+int pkcs11_get_key_rate_limit(PKCS11_OBJECT_private *key,
+		PKCS11_RATE_LIMIT *status)
+{
+	PKCS11_BUCKET *bucket = key->bucket;
+
+	memset(status, 0, sizeof(*status));
+	if (!bucket)
+		return -1;
+	return pkcs11_bucket_status(bucket, 0, 0, status);
+}
+
+/* vim: set noexpandtab: */
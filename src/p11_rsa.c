@@ -94,6 +94,25 @@ pkcs11_oaep_param(CK_MECHANISM *mechanism, CK_RSA_PKCS_OAEP_PARAMS *oaep_params)
 	oaep_params->pSourceData = NULL;
 	oaep_params->ulSourceDataLen = 0;
 }
+/* A single attempt of the encryption fallback of pkcs11_private_encrypt() */
+static CK_RV pkcs11_encrypt_once(PKCS11_OBJECT_private *key,
+		CK_SESSION_HANDLE session, CK_MECHANISM *mechanism,
+		const unsigned char *in, int in_len,
+		unsigned char *out, CK_ULONG *out_len)
+{
+	PKCS11_CTX_private *ctx = key->slot->ctx;
+	CK_RV rv;
+
+	rv = CRYPTOKI_call(ctx,
+		C_EncryptInit(session, mechanism, key->object));
+	if (!rv && key->always_authenticate == CK_TRUE)
+		rv = pkcs11_authenticate(key, session);
+	if (rv)
+		return rv;
+	return CRYPTOKI_call(ctx,
+		C_Encrypt(session, (CK_BYTE *)in, in_len, out, out_len));
+}
+
 /* RSA private key encryption (also invoked by OpenSSL for signing) */
 /* OpenSSL assumes that the output buffer is always big enough */
 int pkcs11_private_encrypt(int flen,
@@ -101,10 +120,12 @@ int pkcs11_private_encrypt(int flen,
 		PKCS11_OBJECT_private *key, int padding)
 {
 	PKCS11_SLOT_private *slot = key->slot;
-	PKCS11_CTX_private *ctx = slot->ctx;
 	CK_MECHANISM mechanism;
 	CK_ULONG size;
 	CK_SESSION_HANDLE session;
+	PKCS11_SIG_ENTRY *pending;
+	PKCS11_OP op;
+	CK_RV cached;
 	int rv;
 	CK_RSA_PKCS_OAEP_PARAMS oaep_params;
 
@@ -116,28 +137,48 @@ int pkcs11_private_encrypt(int flen,
 	if (mechanism.mechanism == CKM_RSA_PKCS_OAEP)
 		pkcs11_oaep_param(&mechanism, &oaep_params);
 
-	if (pkcs11_get_session(slot, 0, &session))
+	if (pkcs11_sigcache_lookup(key, mechanism.mechanism, from, flen,
+			to, &size, &pending, &cached)) {
+		if (cached) {
+			CKRerr(CKR_F_PKCS11_PRIVATE_ENCRYPT, cached);
+			return -1;
+		}
+		return size;
+	}
+
+	if (pkcs11_op_begin(&op, PKCS11_OP_SIGN, slot, key,
+			mechanism.mechanism, flen, 0, &session)) {
+		if (pending)
+			pkcs11_sigcache_complete(key, pending,
+				CKR_FUNCTION_REJECTED, NULL, 0);
 		return -1;
+	}
 
 	/* Try signing first, as applications are more likely to use it */
-	rv = CRYPTOKI_call(ctx,
-		C_SignInit(session, &mechanism, key->object));
-	if (!rv && key->always_authenticate == CK_TRUE)
-		rv = pkcs11_authenticate(key, session);
-	if (!rv)
-		rv = CRYPTOKI_call(ctx,
-			C_Sign(session, (CK_BYTE *)from, flen, to, &size));
+	rv = pkcs11_private_op(key, session, PKCS11_OP_SIGN, &mechanism,
+		from, flen, to, &size);
 	if (rv == CKR_KEY_FUNCTION_NOT_PERMITTED) {
+		/* The randomly padded ciphertext must not be cached or handed
+		 * to the coalesced signatures, which retry on their own */
+		if (pending) {
+			pkcs11_sigcache_complete(key, pending, rv, NULL, 0);
+			pending = NULL;
+		}
 		/* OpenSSL may use it for encryption rather than signing */
-		rv = CRYPTOKI_call(ctx,
-			C_EncryptInit(session, &mechanism, key->object));
-		if (!rv && key->always_authenticate == CK_TRUE)
-			rv = pkcs11_authenticate(key, session);
-		if (!rv)
-			rv = CRYPTOKI_call(ctx,
-				C_Encrypt(session, (CK_BYTE *)from, flen, to, &size));
+		size = pkcs11_get_key_size(key);
+		rv = pkcs11_encrypt_once(key, session, &mechanism,
+			from, flen, to, &size);
+		/* Retry once if the token dropped the login state */
+		if (rv == CKR_USER_NOT_LOGGED_IN &&
+				pkcs11_relogin(slot, session) == 0) {
+			size = pkcs11_get_key_size(key);
+			rv = pkcs11_encrypt_once(key, session, &mechanism,
+				from, flen, to, &size);
+		}
 	}
-	pkcs11_put_session(slot, session);
+	pkcs11_op_end(&op, session, rv, size);
+	if (pending)
+		pkcs11_sigcache_complete(key, pending, rv, to, rv ? 0 : size);
 
 	if (rv) {
 		CKRerr(CKR_F_PKCS11_PRIVATE_ENCRYPT, rv);
@@ -152,11 +193,11 @@ int pkcs11_private_decrypt(int flen, const unsigned char *from, unsigned char *t
 		PKCS11_OBJECT_private *key, int padding)
 {
 	PKCS11_SLOT_private *slot = key->slot;
-	PKCS11_CTX_private *ctx = slot->ctx;
 	CK_SESSION_HANDLE session;
 	CK_MECHANISM mechanism;
 	CK_ULONG size = flen;
 	CK_RV rv;
+	PKCS11_OP op;
 	CK_RSA_PKCS_OAEP_PARAMS oaep_params;
 
 	if (pkcs11_mechanism(&mechanism, padding) < 0)
@@ -165,18 +206,13 @@ int pkcs11_private_decrypt(int flen, const unsigned char *from, unsigned char *t
 	if (mechanism.mechanism == CKM_RSA_PKCS_OAEP)
 		pkcs11_oaep_param(&mechanism, &oaep_params);
 
-	if (pkcs11_get_session(slot, 0, &session))
+	if (pkcs11_op_begin(&op, PKCS11_OP_DECRYPT, slot, key,
+			mechanism.mechanism, flen, 0, &session))
 		return -1;
 
-	rv = CRYPTOKI_call(ctx,
-		C_DecryptInit(session, &mechanism, key->object));
-	if (!rv && key->always_authenticate == CK_TRUE)
-		rv = pkcs11_authenticate(key, session);
-	if (!rv)
-		rv = CRYPTOKI_call(ctx,
-			C_Decrypt(session, (CK_BYTE *)from, size,
-				(CK_BYTE_PTR)to, &size));
-	pkcs11_put_session(slot, session);
+	rv = pkcs11_private_op(key, session, PKCS11_OP_DECRYPT, &mechanism,
+		from, size, to, &size);
+	pkcs11_op_end(&op, session, rv, size);
 
 	if (rv) {
 		CKRerr(CKR_F_PKCS11_PRIVATE_DECRYPT, rv);
@@ -209,23 +245,28 @@ static RSA *pkcs11_get_rsa(PKCS11_OBJECT_private *key)
 {
 	CK_OBJECT_CLASS class_public_key = CKO_PUBLIC_KEY;
 	PKCS11_SLOT_private *slot = key->slot;
-	PKCS11_CTX_private *ctx = slot->ctx;
 	PKCS11_OBJECT_private *pubkey;
 	PKCS11_TEMPLATE tmpl = {0};
 	CK_OBJECT_HANDLE object = key->object;
 	CK_SESSION_HANDLE session;
 	RSA *rsa;
 	BIGNUM *rsa_n = NULL, *rsa_e = NULL;
+	const RSA *cert_rsa;
+	const BIGNUM *cert_e = NULL;
+	unsigned char fp[PKCS11_FP_LEN];
+	PKCS11_KEY *pub;
+	PKCS11_CERT *cert;
+	EVP_PKEY *pkey;
 
 	if (pkcs11_get_session(slot, 0, &session))
 		return NULL;
 
 	/* Retrieve the modulus */
-	if (pkcs11_getattr_bn(ctx, session, object, CKA_MODULUS, &rsa_n))
+	if (pkcs11_getattr_bn(slot, session, object, CKA_MODULUS, &rsa_n))
 		goto failure;
 
 	/* Retrieve the public exponent */
-	if (!pkcs11_getattr_bn(ctx, session, object, CKA_PUBLIC_EXPONENT, &rsa_e)) {
+	if (!pkcs11_getattr_bn(slot, session, object, CKA_PUBLIC_EXPONENT, &rsa_e)) {
 		if (!BN_is_zero(rsa_e)) /* A valid public exponent */
 			goto success;
 		BN_clear_free(rsa_e);
@@ -233,11 +274,35 @@ static RSA *pkcs11_get_rsa(PKCS11_OBJECT_private *key)
 	}
 
 	/* The public exponent was not found in the private key:
-	 * retrieve it from the corresponding public key */
+	 * retrieve it from an enumerated certificate or public key with the
+	 * same modulus */
+	if (!pkcs11_fingerprint_rsa(rsa_n, fp) &&
+			!pkcs11_fpindex_find(slot, session, fp, 0, NULL, &pub, &cert)) {
+		if (cert && cert->x509 &&
+				(pkey = X509_get_pubkey(cert->x509)) != NULL) {
+			cert_rsa = EVP_PKEY_get0_RSA(pkey);
+			if (cert_rsa) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100005L || ( defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER >= 0x3050000fL )
+				RSA_get0_key(cert_rsa, NULL, &cert_e, NULL);
+#else
+				cert_e = cert_rsa->e;
+#endif
+				rsa_e = cert_e ? BN_dup(cert_e) : NULL;
+			}
+			EVP_PKEY_free(pkey);
+			if (rsa_e)
+				goto success;
+		}
+		if (pub && !pkcs11_getattr_bn(slot, session, PRIVKEY(pub)->object,
+				CKA_PUBLIC_EXPONENT, &rsa_e))
+			goto success;
+	}
+
+	/* Otherwise search the corresponding public key */
 	pkcs11_addattr_var(&tmpl, CKA_CLASS, class_public_key);
 	pkcs11_addattr_bn(&tmpl, CKA_MODULUS, rsa_n);
 	pubkey = pkcs11_object_from_template(slot, session, &tmpl);
-	if (pubkey && !pkcs11_getattr_bn(ctx, session, pubkey->object,
+	if (pubkey && !pkcs11_getattr_bn(slot, session, pubkey->object,
 			CKA_PUBLIC_EXPONENT, &rsa_e)) {
 		pkcs11_object_free(pubkey);
 		goto success;
@@ -0,0 +1,166 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Process-wide store of parsed certificates.
+ *
+ * The same certificates are often present on many tokens (e.g. replicated
+ * HSMs).  Certificates are indexed by the SHA-256 hash of their DER
+ * encoding, so that every slot and context shares a single X509 object
+ * for identical certificates instead of parsing its own copy.  The store
+ * also keeps the DER encoding read from the token, so that it can be
+ * returned without encoding the X509 object again.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+#include <openssl/sha.h>
+
+#define PKCS11_SHARE_BUCKETS 256
+
+typedef struct pkcs11_shared_x509_st {
+	struct pkcs11_shared_x509_st *next;
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	X509 *x509;
+	unsigned char *der;
+	int refcnt;
+} PKCS11_SHARED_X509;
+
+static pthread_once_t pkcs11_share_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pkcs11_share_lock;
+static PKCS11_SHARED_X509 *pkcs11_shared_x509[PKCS11_SHARE_BUCKETS];
+
+static void pkcs11_share_init(void)
+{
+	pthread_mutex_init(&pkcs11_share_lock, 0);
+}
+
+static PKCS11_SHARED_X509 **pkcs11_share_find(const unsigned char *digest)
+{
+	PKCS11_SHARED_X509 **entry;
+
+	for (entry = &pkcs11_shared_x509[digest[0]]; *entry;
+			entry = &(*entry)->next)
+		if (!memcmp((*entry)->digest, digest, SHA256_DIGEST_LENGTH))
+			return entry;
+	return entry;
+}
+
+/*
+ * Return the certificate with the given DER encoding, parsing it only if
+ * no identical certificate is already in use.  The DER buffer is taken
+ * over by the store, and *cached is set to the DER encoding kept by the
+ * store, or NULL if the certificate could not be shared.  Both remain
+ * valid until the returned reference is released with pkcs11_x509_put().
+ */
+X509 *pkcs11_x509_get(unsigned char *der, size_t len,
+		const unsigned char **cached)
+{
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	PKCS11_SHARED_X509 **entry, *shared;
+	const unsigned char *p = der;
+	X509 *x509;
+
+	*cached = NULL;
+	if (!EVP_Digest(der, len, digest, NULL, EVP_sha256(), NULL)) {
+		x509 = d2i_X509(NULL, &p, (long)len);
+		OPENSSL_free(der);
+		return x509;
+	}
+
+	pthread_once(&pkcs11_share_once, pkcs11_share_init);
+	pthread_mutex_lock(&pkcs11_share_lock);
+	entry = pkcs11_share_find(digest);
+	if (*entry) {
+		shared = *entry;
+		shared->refcnt++;
+		X509_up_ref(shared->x509);
+		*cached = shared->der;
+		pthread_mutex_unlock(&pkcs11_share_lock);
+		OPENSSL_free(der);
+		return shared->x509;
+	}
+	pthread_mutex_unlock(&pkcs11_share_lock);
+
+	/* Parse without holding the lock */
+	x509 = d2i_X509(NULL, &p, (long)len);
+	if (!x509) {
+		OPENSSL_free(der);
+		return NULL;
+	}
+	shared = OPENSSL_malloc(sizeof(*shared));
+	if (!shared) {
+		OPENSSL_free(der);
+		return x509; /* Not shared, but still usable */
+	}
+	memcpy(shared->digest, digest, SHA256_DIGEST_LENGTH);
+	shared->refcnt = 1;
+	shared->next = NULL;
+
+	pthread_mutex_lock(&pkcs11_share_lock);
+	entry = pkcs11_share_find(digest);
+	if (*entry) { /* Another thread was faster */
+		OPENSSL_free(shared);
+		OPENSSL_free(der);
+		X509_free(x509);
+		shared = *entry;
+		shared->refcnt++;
+		X509_up_ref(shared->x509);
+		x509 = shared->x509;
+	} else { /* The store holds its own reference */
+		shared->x509 = x509;
+		shared->der = der;
+		X509_up_ref(x509);
+		*entry = shared;
+	}
+	*cached = shared->der;
+	pthread_mutex_unlock(&pkcs11_share_lock);
+	return x509;
+}
+
+/*
+ * Release a certificate returned by pkcs11_x509_get() with the DER encoding
+ * it returned.  The entry is found by the digest of the encoding read from
+ * the token, as the certificate may not encode back to the same bytes.
+ */
+void pkcs11_x509_put(X509 *x509, const unsigned char *der, size_t len)
+{
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	PKCS11_SHARED_X509 **entry, *shared = NULL;
+
+	if (!x509)
+		return;
+	/* Certificates without a cached encoding were not shared */
+	if (der && EVP_Digest(der, len, digest, NULL, EVP_sha256(), NULL)) {
+		pthread_once(&pkcs11_share_once, pkcs11_share_init);
+		pthread_mutex_lock(&pkcs11_share_lock);
+		entry = pkcs11_share_find(digest);
+		if (*entry && (*entry)->x509 == x509 && --(*entry)->refcnt == 0) {
+			shared = *entry;
+			*entry = shared->next;
+		}
+		pthread_mutex_unlock(&pkcs11_share_lock);
+	}
+	if (shared) {
+		X509_free(shared->x509); /* The reference held by the store */
+		OPENSSL_free(shared->der);
+		OPENSSL_free(shared);
+	}
+	X509_free(x509);
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,413 @@
+/* libp11, a simple layer on to of PKCS#11 API
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ */
+
+/*
+ * Signature cache.
+ *
+ * RSA PKCS#1 v1.5 and raw RSA signatures only depend on the key and the
+ * signed data, so that a key configured with PKCS11_set_signature_cache()
+ * can return the signatures it already computed instead of calling the
+ * token again.  The cache maps the mechanism and the input of C_Sign() to
+ * the signature, and evicts the least recently used entries beyond its
+ * capacity.  An entry is inserted as pending before the token is called, so
+ * that identical concurrent requests wait for the first one instead of
+ * reaching the token.  Failed signatures are not cached, and their waiters
+ * try again.
+ */
+
+#include "libp11-int.h"
+#include <string.h>
+
+#define PKCS11_SIGCACHE_MAX_INPUT 1024 /* larger inputs are not cached */
+#define PKCS11_SIGCACHE_MAX_BUCKETS 65536
+
+#define PKCS11_SIG_PENDING 0
+#define PKCS11_SIG_READY 1
+#define PKCS11_SIG_FAILED 2
+
+struct pkcs11_sig_entry {
+	PKCS11_SIG_ENTRY *next; /* hash chain */
+	PKCS11_SIG_ENTRY *lru_prev, *lru_next; /* ready entries only */
+	unsigned int hash;
+	CK_MECHANISM_TYPE mechanism;
+	int state;
+	unsigned int refs; /* owner while pending, and waiters */
+	unsigned char *sig;
+	size_t sig_len, in_len;
+	/* followed by the input */
+};
+
+struct pkcs11_sigcache_st {
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* signaled when a pending entry completes */
+	unsigned int forkid;
+	unsigned int capacity, count;
+	PKCS11_SIG_ENTRY **buckets;
+	unsigned int nbuckets; /* power of two */
+	PKCS11_SIG_ENTRY *lru_head, *lru_tail;
+	unsigned long hits, misses, coalesced;
+};
+
+#define PKCS11_SIG_INPUT(e) ((unsigned char *)((e) + 1))
+
+/* Mechanisms producing the same signature for the same input */
+static int pkcs11_sig_deterministic(CK_MECHANISM_TYPE mechanism)
+{
+	switch (mechanism) {
+	case CKM_RSA_PKCS:
+	case CKM_RSA_X_509:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* FNV-1a */
+static unsigned int pkcs11_sig_hash(CK_MECHANISM_TYPE mechanism,
+		const unsigned char *in, size_t in_len)
+{
+	unsigned int hash = 2166136261u ^ (unsigned int)mechanism;
+	size_t i;
+
+	for (i = 0; i < in_len; i++)
+		hash = (hash ^ in[i]) * 16777619u;
+	return hash;
+}
+
+static void pkcs11_sig_lru_unlink(PKCS11_SIGCACHE *cache, PKCS11_SIG_ENTRY *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else if (cache->lru_head == e)
+		cache->lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else if (cache->lru_tail == e)
+		cache->lru_tail = e->lru_prev;
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void pkcs11_sig_lru_push(PKCS11_SIGCACHE *cache, PKCS11_SIG_ENTRY *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = e;
+	cache->lru_head = e;
+	if (!cache->lru_tail)
+		cache->lru_tail = e;
+}
+
+static void pkcs11_sig_unhash(PKCS11_SIGCACHE *cache, PKCS11_SIG_ENTRY *e)
+{
+	PKCS11_SIG_ENTRY **p = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+
+	while (*p && *p != e)
+		p = &(*p)->next;
+	if (*p)
+		*p = e->next;
+	e->next = NULL;
+	cache->count--;
+}
+
+static void pkcs11_sig_entry_free(PKCS11_SIG_ENTRY *e)
+{
+	OPENSSL_free(e->sig);
+	OPENSSL_free(e);
+}
+
+/* Drop the least recently used entries nobody waits for
+ * Called with the cache lock held */
+static void pkcs11_sig_evict(PKCS11_SIGCACHE *cache, unsigned int capacity)
+{
+	PKCS11_SIG_ENTRY *e = cache->lru_tail, *prev;
+
+	while (e && cache->count > capacity) {
+		prev = e->lru_prev;
+		if (!e->refs) {
+			pkcs11_sig_lru_unlink(cache, e);
+			pkcs11_sig_unhash(cache, e);
+			pkcs11_sig_entry_free(e);
+		}
+		e = prev;
+	}
+}
+
+/* Forget the entries (pending ones belong to threads of the parent)
+ * Called with the cache lock held */
+static void pkcs11_sig_flush(PKCS11_SIGCACHE *cache)
+{
+	PKCS11_SIG_ENTRY *e, *next;
+	unsigned int i;
+
+	for (i = 0; i < cache->nbuckets; i++) {
+		for (e = cache->buckets[i]; e; e = next) {
+			next = e->next;
+			pkcs11_sig_entry_free(e);
+		}
+		cache->buckets[i] = NULL;
+	}
+	cache->lru_head = cache->lru_tail = NULL;
+	cache->count = 0;
+}
+
+static void pkcs11_sig_check_fork(PKCS11_SIGCACHE *cache)
+{
+	if (cache->forkid != get_forkid()) {
+		cache->forkid = get_forkid();
+		pkcs11_sig_flush(cache);
+	}
+}
+
+/* Copy a ready signature
+ * Called with the cache lock held */
+static CK_RV pkcs11_sig_copy(PKCS11_SIGCACHE *cache, PKCS11_SIG_ENTRY *e,
+		unsigned char *out, CK_ULONG *out_len)
+{
+	pkcs11_sig_lru_unlink(cache, e);
+	pkcs11_sig_lru_push(cache, e);
+	if (*out_len < e->sig_len) {
+		*out_len = e->sig_len;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+	memcpy(out, e->sig, e->sig_len);
+	*out_len = e->sig_len;
+	return CKR_OK;
+}
+
+/*
+ * Look up a signature before calling the token
+ * Returns 1 with *rv set if the signature was found, and 0 otherwise.
+ * If *pending is not NULL on return, the caller computes the signature
+ * and passes it to pkcs11_sigcache_complete().
+ */
+int pkcs11_sigcache_lookup(PKCS11_OBJECT_private *key,
+		CK_MECHANISM_TYPE mechanism, const unsigned char *in, size_t in_len,
+		unsigned char *out, CK_ULONG *out_len,
+		PKCS11_SIG_ENTRY **pending, CK_RV *rv)
+{
+	PKCS11_SIGCACHE *cache = key->sigcache;
+	PKCS11_SIG_ENTRY *e;
+	unsigned int hash;
+
+	*pending = NULL;
+	if (!cache || !cache->capacity || !pkcs11_sig_deterministic(mechanism) ||
+			in_len > PKCS11_SIGCACHE_MAX_INPUT)
+		return 0;
+	hash = pkcs11_sig_hash(mechanism, in, in_len);
+
+	pthread_mutex_lock(&cache->lock);
+	pkcs11_sig_check_fork(cache);
+	for (;;) {
+		for (e = cache->buckets[hash & (cache->nbuckets - 1)]; e; e = e->next)
+			if (e->hash == hash && e->mechanism == mechanism &&
+					e->in_len == in_len &&
+					!memcmp(PKCS11_SIG_INPUT(e), in, in_len))
+				break;
+		if (!e)
+			break;
+		if (e->state == PKCS11_SIG_READY) {
+			cache->hits++;
+			*rv = pkcs11_sig_copy(cache, e, out, out_len);
+			pthread_mutex_unlock(&cache->lock);
+			return 1;
+		}
+
+		/* Wait for the identical request already sent to the token */
+		cache->coalesced++;
+		e->refs++;
+		while (e->state == PKCS11_SIG_PENDING)
+			pthread_cond_wait(&cache->cond, &cache->lock);
+		e->refs--;
+		if (e->state == PKCS11_SIG_READY) {
+			*rv = pkcs11_sig_copy(cache, e, out, out_len);
+			pthread_mutex_unlock(&cache->lock);
+			return 1;
+		}
+		/* The request failed: the last waiter releases the entry */
+		if (!e->refs)
+			pkcs11_sig_entry_free(e);
+	}
+
+	cache->misses++;
+	e = OPENSSL_malloc(sizeof(PKCS11_SIG_ENTRY) + in_len);
+	if (e) {
+		memset(e, 0, sizeof(PKCS11_SIG_ENTRY));
+		e->hash = hash;
+		e->mechanism = mechanism;
+		e->state = PKCS11_SIG_PENDING;
+		e->refs = 1;
+		e->in_len = in_len;
+		memcpy(PKCS11_SIG_INPUT(e), in, in_len);
+		e->next = cache->buckets[hash & (cache->nbuckets - 1)];
+		cache->buckets[hash & (cache->nbuckets - 1)] = e;
+		cache->count++;
+		pkcs11_sig_evict(cache, cache->capacity);
+		*pending = e;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return 0;
+}
+
+/*
+ * Store the signature computed for a pending entry, and wake up the
+ * identical requests waiting for it
+ */
+void pkcs11_sigcache_complete(PKCS11_OBJECT_private *key,
+		PKCS11_SIG_ENTRY *e, CK_RV rv,
+		const unsigned char *sig, size_t sig_len)
+{
+	PKCS11_SIGCACHE *cache = key->sigcache;
+
+	pthread_mutex_lock(&cache->lock);
+	e->refs--;
+	if (rv == CKR_OK) {
+		e->sig = OPENSSL_malloc(sig_len);
+		if (e->sig) {
+			memcpy(e->sig, sig, sig_len);
+			e->sig_len = sig_len;
+		}
+	}
+	if (e->sig) {
+		e->state = PKCS11_SIG_READY;
+		pkcs11_sig_lru_push(cache, e);
+		pkcs11_sig_evict(cache, cache->capacity);
+	} else {
+		e->state = PKCS11_SIG_FAILED;
+		pkcs11_sig_unhash(cache, e);
+		if (!e->refs)
+			pkcs11_sig_entry_free(e);
+	}
+	pthread_cond_broadcast(&cache->cond);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void pkcs11_sigcache_free(PKCS11_OBJECT_private *key)
+{
+	PKCS11_SIGCACHE *cache = key->sigcache;
+
+	if (!cache)
+		return;
+	key->sigcache = NULL;
+	pkcs11_sig_flush(cache);
+	OPENSSL_free(cache->buckets);
+	pthread_mutex_destroy(&cache->lock);
+	pthread_cond_destroy(&cache->cond);
+	OPENSSL_free(cache);
+}
+
+/* Size the hash table for the capacity
+ * Called with the cache lock held */
+static int pkcs11_sig_resize(PKCS11_SIGCACHE *cache, unsigned int capacity)
+{
+	PKCS11_SIG_ENTRY **buckets, *e, *next;
+	unsigned int nbuckets = 16, i;
+
+	while (nbuckets < capacity && nbuckets < PKCS11_SIGCACHE_MAX_BUCKETS)
+		nbuckets *= 2;
+	if (nbuckets <= cache->nbuckets)
+		return 0;
+	buckets = OPENSSL_malloc(nbuckets * sizeof(PKCS11_SIG_ENTRY *));
+	if (!buckets)
+		return -1;
+	memset(buckets, 0, nbuckets * sizeof(PKCS11_SIG_ENTRY *));
+	for (i = 0; i < cache->nbuckets; i++) {
+		for (e = cache->buckets[i]; e; e = next) {
+			next = e->next;
+			e->next = buckets[e->hash & (nbuckets - 1)];
+			buckets[e->hash & (nbuckets - 1)] = e;
+		}
+	}
+	OPENSSL_free(cache->buckets);
+	cache->buckets = buckets;
+	cache->nbuckets = nbuckets;
+	return 0;
+}
+
+int pkcs11_set_signature_cache(PKCS11_OBJECT_private *key,
+		unsigned int entries)
+{
+	PKCS11_SIGCACHE *cache;
+	int rv = 0;
+
+	if (key->object_class != CKO_PRIVATE_KEY) {
+		P11err(P11_F_PKCS11_SET_SIGNATURE_CACHE, P11_R_INVALID_PARAMETER);
+		return -1;
+	}
+
+	/* The cache is allocated once, and released with the key */
+	pthread_mutex_lock(&key->lock);
+	cache = key->sigcache;
+	if (!cache && entries) {
+		cache = OPENSSL_malloc(sizeof(PKCS11_SIGCACHE));
+		if (cache) {
+			memset(cache, 0, sizeof(PKCS11_SIGCACHE));
+			pthread_mutex_init(&cache->lock, 0);
+			pthread_cond_init(&cache->cond, 0);
+			cache->forkid = get_forkid();
+			if (pkcs11_sig_resize(cache, entries)) {
+				pthread_mutex_destroy(&cache->lock);
+				pthread_cond_destroy(&cache->cond);
+				OPENSSL_free(cache);
+				cache = NULL;
+			}
+		}
+		key->sigcache = cache;
+		if (!cache)
+			rv = -1;
+	}
+	pthread_mutex_unlock(&key->lock);
+	if (rv) {
+		P11err(P11_F_PKCS11_SET_SIGNATURE_CACHE, ERR_R_MALLOC_FAILURE);
+		return -1;
+	}
+	if (!cache)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	if (pkcs11_sig_resize(cache, entries) == 0) {
+		cache->capacity = entries;
+		pkcs11_sig_evict(cache, entries);
+	} else {
+		rv = -1;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	if (rv)
+		P11err(P11_F_PKCS11_SET_SIGNATURE_CACHE, ERR_R_MALLOC_FAILURE);
+	return rv;
+}
+
+int pkcs11_get_signature_cache(PKCS11_OBJECT_private *key,
+		PKCS11_SIGNATURE_CACHE *stats)
+{
+	PKCS11_SIGCACHE *cache = key->sigcache;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!cache)
+		return -1;
+	pthread_mutex_lock(&cache->lock);
+	pkcs11_sig_check_fork(cache);
+	stats->capacity = cache->capacity;
+	stats->entries = cache->count;
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->coalesced = cache->coalesced;
+	pthread_mutex_unlock(&cache->lock);
+	return 0;
+}
+
+/* vim: set noexpandtab: */
@@ -111,15 +111,19 @@ int pkcs11_open_session(PKCS11_SLOT_private *slot, int rw)
 {
 	PKCS11_CTX_private *ctx = slot->ctx;
 
-	pthread_mutex_lock(&slot->lock);
+	SLOT_LOCK(slot);
 	/* If different mode requested, flush pool */
 	if (rw != slot->rw_mode) {
 		CRYPTOKI_call(ctx, C_CloseAllSessions(slot->id));
 		slot->rw_mode = rw;
+		/* Session objects are gone with their sessions */
+		pkcs11_attr_cache_flush(slot);
+		pkcs11_keypool_reset(slot);
+		pkcs11_quota_reset(slot);
 	}
 	slot->num_sessions = 0;
 	slot->session_head = slot->session_tail = 0;
-	pthread_mutex_unlock(&slot->lock);
+	SLOT_UNLOCK(slot);
 
 	return 0;
 }
@@ -130,25 +134,76 @@ static void pkcs11_wipe_cache(PKCS11_SLOT_private *slot)
 	pkcs11_destroy_keys(slot, CKO_PRIVATE_KEY);
 	pkcs11_destroy_keys(slot, CKO_PUBLIC_KEY);
 	pkcs11_destroy_certs(slot);
+	pkcs11_attr_cache_flush(slot);
+}
+
+/*
+ * Move the most suitable pooled session for the object to the head of the
+ * pool.  A session that last used the object is preferred, unless the
+ * oldest pooled session was already passed over max_skips times.
+ * Called with slot->lock held.
+ */
+static void pkcs11_session_affinity(PKCS11_SLOT_private *slot,
+		CK_OBJECT_HANDLE object)
+{
+	unsigned int max_skips = slot->ctx->session_affinity;
+	unsigned int size = slot->session_poolsize;
+	unsigned int head = slot->session_head, pos, prev;
+	PKCS11_POOLED_SESSION found;
+
+	if (!max_skips || object == CK_INVALID_HANDLE ||
+			slot->session_pool[head].object == object ||
+			slot->session_pool[head].skips >= max_skips)
+		return;
+	for (pos = (head + 1) % size; pos != slot->session_tail; pos = (pos + 1) % size)
+		if (slot->session_pool[pos].object == object)
+			break;
+	if (pos == slot->session_tail)
+		return;
+
+	/* Keep the order of the sessions passed over */
+	found = slot->session_pool[pos];
+	for (; pos != head; pos = prev) {
+		prev = (pos + size - 1) % size;
+		slot->session_pool[pos] = slot->session_pool[prev];
+		slot->session_pool[pos].skips++;
+	}
+	slot->session_pool[head] = found;
+}
+
+int pkcs11_set_session_affinity(PKCS11_CTX_private *ctx, unsigned int max_skips)
+{
+	if (!ctx)
+		return -1;
+	ctx->session_affinity = max_skips;
+	return 0;
 }
 
 int pkcs11_get_session(PKCS11_SLOT_private * slot, int rw, CK_SESSION_HANDLE *sessionp)
+{
+	return pkcs11_get_session_for(slot, rw, CK_INVALID_HANDLE, sessionp);
+}
+
+int pkcs11_get_session_for(PKCS11_SLOT_private *slot, int rw,
+		CK_OBJECT_HANDLE object, CK_SESSION_HANDLE *sessionp)
 {
 	PKCS11_CTX_private *ctx = slot->ctx;
-	int rv = CKR_OK;
+	int rv = CKR_OK, over_quota;
 	CK_SESSION_INFO session_info;
+	unsigned int held;
 
 	if (rw < 0)
 		return -1;
 
-	pthread_mutex_lock(&slot->lock);
+	SLOT_LOCK(slot);
 	if (slot->rw_mode < 0)
 		slot->rw_mode = rw;
 	rw = slot->rw_mode;
 	do {
 		/* Get session from the pool */
 		if (slot->session_head != slot->session_tail) {
-			*sessionp = slot->session_pool[slot->session_head];
+			pkcs11_session_affinity(slot, object);
+			*sessionp = slot->session_pool[slot->session_head].handle;
 			slot->session_head = (slot->session_head + 1) % slot->session_poolsize;
 
 			/* Check if session is valid */
@@ -159,6 +214,7 @@ int pkcs11_get_session(PKCS11_SLOT_private * slot, int rw, CK_SESSION_HANDLE *se
 			} else {
 				/* Forget this session */
 				slot->num_sessions--;
+				pkcs11_quota_release(slot, 1);
 				if (slot->num_sessions == 0) {
 					/* Object handles are valid across
 					   sessions, so the cache should only be
@@ -171,7 +227,11 @@ int pkcs11_get_session(PKCS11_SLOT_private * slot, int rw, CK_SESSION_HANDLE *se
 		}
 
 		/* Check if new can be instantiated */
+		over_quota = 0;
 		if (slot->num_sessions < slot->max_sessions) {
+			over_quota = pkcs11_quota_acquire(slot);
+		}
+		if (slot->num_sessions < slot->max_sessions && !over_quota) {
 			rv = CRYPTOKI_call(ctx,
 				C_OpenSession(slot->id,
 					CKF_SERIAL_SESSION | (rw ? CKF_RW_SESSION : 0),
@@ -180,6 +240,7 @@ int pkcs11_get_session(PKCS11_SLOT_private * slot, int rw, CK_SESSION_HANDLE *se
 				slot->num_sessions++;
 				break;
 			}
+			pkcs11_quota_release(slot, 1);
 
 			/* Remember the maximum session count */
 			if (rv == CKR_SESSION_COUNT)
@@ -187,22 +248,46 @@ int pkcs11_get_session(PKCS11_SLOT_private * slot, int rw, CK_SESSION_HANDLE *se
 		}
 
 		/* Wait for a session to become available */
-		pthread_cond_wait(&slot->cond, &slot->lock);
+		slot->num_waiters++;
+		held = pkcs11_lock_suspend(&slot->lock_prof);
+		if (over_quota) /* Other processes do not signal slot->cond */
+			pkcs11_quota_wait(slot);
+		else
+			pthread_cond_wait(&slot->cond, &slot->lock);
+		pkcs11_lock_resume(&slot->lock_prof, held);
+		slot->num_waiters--;
 	} while (1);
-	pthread_mutex_unlock(&slot->lock);
+	SLOT_UNLOCK(slot);
 
 	return 0;
 }
 
 void pkcs11_put_session(PKCS11_SLOT_private *slot, CK_SESSION_HANDLE session)
 {
-	pthread_mutex_lock(&slot->lock);
+	pkcs11_put_session_for(slot, session, CK_INVALID_HANDLE);
+}
 
-	slot->session_pool[slot->session_tail] = session;
-	slot->session_tail = (slot->session_tail + 1) % slot->session_poolsize;
+void pkcs11_put_session_for(PKCS11_SLOT_private *slot,
+		CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object)
+{
+	PKCS11_POOLED_SESSION *pooled;
+
+	SLOT_LOCK(slot);
+
+	if (pkcs11_quota_give_back(slot)) {
+		/* Return the session to the other processes */
+		CRYPTOKI_call(slot->ctx, C_CloseSession(session));
+		slot->num_sessions--;
+	} else {
+		pooled = &slot->session_pool[slot->session_tail];
+		pooled->handle = session;
+		pooled->object = object;
+		pooled->skips = 0;
+		slot->session_tail = (slot->session_tail + 1) % slot->session_poolsize;
+	}
 	pthread_cond_signal(&slot->cond);
 
-	pthread_mutex_unlock(&slot->lock);
+	SLOT_UNLOCK(slot);
 }
 
 /*
@@ -221,23 +306,26 @@ int pkcs11_login(PKCS11_SLOT_private *slot, int so, const char *pin)
 {
 	PKCS11_CTX_private *ctx = slot->ctx;
 	CK_SESSION_HANDLE session;
+	PKCS11_OP op;
 	int rv;
 
 	if (slot->logged_in >= 0)
 		return 0; /* Nothing to do */
 
 	/* SO needs a r/w session, user can be checked with a r/o session. */
-	if (pkcs11_get_session(slot, so, &session))
+	if (pkcs11_op_begin(&op, PKCS11_OP_LOGIN, slot, NULL,
+			CK_UNAVAILABLE_INFORMATION, 0, so, &session))
 		return -1;
 
 	rv = CRYPTOKI_call(ctx,
 		C_Login(session, so ? CKU_SO : CKU_USER,
 			(CK_UTF8CHAR *) pin, pin ? (unsigned long) strlen(pin) : 0));
-	pkcs11_put_session(slot, session);
+	pkcs11_op_end(&op, session, rv, 0);
 
 	if (rv && rv != CKR_USER_ALREADY_LOGGED_IN) { /* logged in -> OK */
 		CRYPTOKI_checkerr(CKR_F_PKCS11_LOGIN, rv);
 	}
+	pthread_mutex_lock(&slot->login_lock);
 	if (slot->prev_pin != pin) {
 		if (slot->prev_pin) {
 			OPENSSL_cleanse(slot->prev_pin, strlen(slot->prev_pin));
@@ -246,9 +334,50 @@ int pkcs11_login(PKCS11_SLOT_private *slot, int so, const char *pin)
 		slot->prev_pin = OPENSSL_strdup(pin);
 	}
 	slot->logged_in = so;
+	pthread_mutex_unlock(&slot->login_lock);
 	return 0;
 }
 
+/*
+ * Log in again on a session after the token dropped the login state,
+ * e.g. on the idle timeout of a network HSM or a device reset.
+ * A single thread logs in again, the other ones find the session logged in.
+ */
+int pkcs11_relogin(PKCS11_SLOT_private *slot, CK_SESSION_HANDLE session)
+{
+	PKCS11_CTX_private *ctx = slot->ctx;
+	CK_SESSION_INFO info;
+	PKCS11_OP op;
+	int so;
+	CK_RV rv;
+
+	pthread_mutex_lock(&slot->login_lock);
+	so = slot->logged_in;
+	/* Only restore a login with a PIN, not a protected authentication path */
+	if (so < 0 || !slot->prev_pin) {
+		pthread_mutex_unlock(&slot->login_lock);
+		return -1;
+	}
+	rv = CRYPTOKI_call(ctx, C_GetSessionInfo(session, &info));
+	if (rv == CKR_OK && (info.state == CKS_RO_PUBLIC_SESSION ||
+			info.state == CKS_RW_PUBLIC_SESSION)) {
+		if (pkcs11_op_begin(&op, PKCS11_OP_LOGIN, slot, NULL,
+				CK_UNAVAILABLE_INFORMATION, 0, so, NULL)) {
+			pthread_mutex_unlock(&slot->login_lock);
+			return -1;
+		}
+		rv = CRYPTOKI_call(ctx,
+			C_Login(session, so ? CKU_SO : CKU_USER,
+				(CK_UTF8CHAR *)slot->prev_pin,
+				(unsigned long)strlen(slot->prev_pin)));
+		pkcs11_op_end(&op, CK_INVALID_HANDLE, rv, 0);
+		if (rv == CKR_USER_ALREADY_LOGGED_IN)
+			rv = CKR_OK;
+	}
+	pthread_mutex_unlock(&slot->login_lock);
+	return rv == CKR_OK ? 0 : -1;
+}
+
 /*
  * Reopens the slot by creating a session and logging in if needed.
  */
@@ -256,8 +385,12 @@ int pkcs11_reload_slot(PKCS11_SLOT_private *slot)
 {
 	int logged_in = slot->logged_in;
 
+	pkcs11_quota_reset(slot);
 	slot->num_sessions = 0;
 	slot->session_head = slot->session_tail = 0;
+	/* The object handles are no longer valid */
+	pkcs11_attr_cache_flush(slot);
+	pkcs11_keypool_reset(slot);
 	if (logged_in >= 0) {
 		slot->logged_in = -1;
 		if (pkcs11_login(slot, logged_in, slot->prev_pin))
@@ -279,6 +412,8 @@ int pkcs11_logout(PKCS11_SLOT_private *slot)
 	/* Calling PKCS11_logout invalidates all cached
 	 * keys we have */
 	pkcs11_wipe_cache(slot);
+	/* The pooled key pairs are still accessible to be destroyed */
+	pkcs11_keypool_flush(slot);
 
 	if (pkcs11_get_session(slot, slot->logged_in, &session) == 0) {
 		rv = CRYPTOKI_call(ctx, C_Logout(session));
@@ -405,16 +540,16 @@ int pkcs11_generate_random(PKCS11_SLOT_private *slot, unsigned char *r,
 {
 	PKCS11_CTX_private *ctx = slot->ctx;
 	CK_SESSION_HANDLE session;
+	PKCS11_OP op;
 	int rv;
 
-	if (pkcs11_get_session(slot, 0, &session)) {
-		P11err(P11_F_PKCS11_GENERATE_RANDOM, P11_R_NO_SESSION);
+	if (pkcs11_op_begin(&op, PKCS11_OP_RANDOM, slot, NULL,
+			CK_UNAVAILABLE_INFORMATION, 0, 0, &session))
 		return -1;
-	}
 
 	rv = CRYPTOKI_call(ctx,
 		C_GenerateRandom(session, (CK_BYTE_PTR) r, r_len));
-	pkcs11_put_session(slot, session);
+	pkcs11_op_end(&op, session, rv, r_len);
 
 	CRYPTOKI_checkerr(CKR_F_PKCS11_GENERATE_RANDOM, rv);
 
@@ -440,9 +575,18 @@ static PKCS11_SLOT_private *pkcs11_slot_new(PKCS11_CTX_private *ctx, CK_SLOT_ID
 	slot->rw_mode = -1;
 	slot->max_sessions = 16;
 	slot->session_poolsize = slot->max_sessions + 1;
-	slot->session_pool = OPENSSL_malloc(slot->session_poolsize * sizeof(CK_SESSION_HANDLE));
+	slot->session_pool = OPENSSL_malloc(slot->session_poolsize * sizeof(PKCS11_POOLED_SESSION));
 	pthread_mutex_init(&slot->lock, 0);
 	pthread_cond_init(&slot->cond, 0);
+	pkcs11_lock_profile_init(&slot->lock_prof, "slot->lock", id);
+	pthread_mutex_init(&slot->attr_lock, 0);
+	pthread_mutex_init(&slot->login_lock, 0);
+	pthread_mutex_init(&slot->mem_lock, 0);
+	pkcs11_keypool_init(slot);
+	pkcs11_limiter_init(slot);
+	pkcs11_bucket_init(&slot->bucket);
+	pkcs11_fpindex_init(slot);
+	pkcs11_mem_slot_link(slot);
 	return slot;
 }
 
@@ -457,15 +601,25 @@ int pkcs11_slot_unref(PKCS11_SLOT_private *slot)
 	if (pkcs11_atomic_add(&slot->refcnt, -1, &slot->lock) != 0)
 		return 0;
 
+	pkcs11_mem_slot_unlink(slot);
+	pkcs11_keypool_stop(slot);
+	pkcs11_limiter_free(slot);
+	pkcs11_bucket_destroy(&slot->bucket);
 	pkcs11_wipe_cache(slot);
+	pkcs11_keypool_free(slot);
+	pkcs11_fpindex_free(slot);
 	if (slot->prev_pin) {
 		OPENSSL_cleanse(slot->prev_pin, strlen(slot->prev_pin));
 		OPENSSL_free(slot->prev_pin);
 	}
 	CRYPTOKI_call(slot->ctx, C_CloseAllSessions(slot->id));
+	pkcs11_quota_reset(slot);
 	OPENSSL_free(slot->session_pool);
 	pthread_mutex_destroy(&slot->lock);
 	pthread_cond_destroy(&slot->cond);
+	pthread_mutex_destroy(&slot->attr_lock);
+	pthread_mutex_destroy(&slot->login_lock);
+	pthread_mutex_destroy(&slot->mem_lock);
 
 	return 1;
 }
@@ -490,6 +644,69 @@ static int pkcs11_init_slot(PKCS11_CTX_private *ctx, PKCS11_SLOT *slot, PKCS11_S
 	return 0;
 }
 
+/* 64-bit FNV-1a of a field followed by a separator */
+static unsigned long long pkcs11_place_hash(unsigned long long hash,
+		const unsigned char *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ data[i]) * 1099511628211ULL;
+	return (hash ^ 0xff) * 1099511628211ULL;
+}
+
+/* Spread the bits of the FNV hash over the whole score */
+static unsigned long long pkcs11_place_mix(unsigned long long x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static unsigned long long pkcs11_place_field(unsigned long long hash,
+		const char *field)
+{
+	if (!field)
+		field = "";
+	return pkcs11_place_hash(hash, (const unsigned char *)field,
+		strlen(field));
+}
+
+/*
+ * Rendezvous hashing: each key is placed on the token with the highest
+ * score computed from the token identity and the key id.  Adding a token
+ * only moves the keys that get their highest score on the new token, and
+ * removing a token only moves the keys that were placed on it.
+ */
+PKCS11_SLOT *pkcs11_place_key(PKCS11_SLOT **slots, unsigned int nslots,
+		const unsigned char *id, size_t id_len)
+{
+	PKCS11_SLOT *slot, *best = NULL;
+	PKCS11_TOKEN *tok;
+	unsigned long long hash, score, best_score = 0;
+	unsigned int n;
+
+	if (!slots || !id || id_len == 0)
+		return NULL;
+	for (n = 0; n < nslots; n++) {
+		slot = slots[n];
+		tok = slot->token;
+		if (!tok || !tok->initialized)
+			continue;
+		hash = 14695981039346656037ULL;
+		hash = pkcs11_place_field(hash, tok->manufacturer);
+		hash = pkcs11_place_field(hash, tok->model);
+		hash = pkcs11_place_field(hash, tok->serialnr);
+		hash = pkcs11_place_field(hash, tok->label);
+		score = pkcs11_place_mix(pkcs11_place_hash(hash, id, id_len));
+		if (!best || score > best_score) {
+			best = slot;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
 void pkcs11_release_all_slots(PKCS11_SLOT *slots, unsigned int nslots)
 {
 	unsigned int i;
@@ -0,0 +1,139 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Loads a list of private keys with the LOAD_PRIVKEYS engine ctrl command,
+ * followed by a key that does not exist, and checks that every existing
+ * key was loaded and can sign. */
+
+#include <stdio.h>
+#include <string.h>
+
+/* this code extensively uses deprecated features, so warnings are useless */
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <libp11.h>
+#include <openssl/engine.h>
+
+#define MAX_KEYS 64
+
+static const char missing_uri[] =
+	"pkcs11:object=no-such-key;type=private";
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static int sign(EVP_PKEY *pkey)
+{
+	EVP_MD_CTX *mctx;
+	unsigned char data[] = "libp11 batch key loading";
+	unsigned char sig[1024];
+	size_t siglen = sizeof(sig);
+	int ok;
+
+	mctx = EVP_MD_CTX_create();
+	ok = mctx &&
+		EVP_DigestSignInit(mctx, NULL, EVP_sha256(), NULL, pkey) > 0 &&
+		EVP_DigestSignUpdate(mctx, data, sizeof(data)) > 0 &&
+		EVP_DigestSignFinal(mctx, sig, &siglen) > 0;
+	EVP_MD_CTX_destroy(mctx);
+	return ok ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	ENGINE *e;
+	struct {
+		unsigned int count;
+		const char **uris;
+		EVP_PKEY **keys;
+		unsigned int loaded;
+	} parms;
+	const char *uris[MAX_KEYS + 1];
+	EVP_PKEY *keys[MAX_KEYS + 1];
+	unsigned int i, count;
+	int ret = 1;
+
+	if (argc < 5 || argc - 4 > MAX_KEYS) {
+		fprintf(stderr, "usage: %s pkcs11.so /usr/lib/opensc-pkcs11.so PIN KEY-URI...\n",
+			argv[0]);
+		return 1;
+	}
+	count = (unsigned int)argc - 4;
+	for (i = 0; i < count; i++)
+		uris[i] = argv[i + 4];
+	uris[count] = missing_uri;
+
+	ENGINE_load_dynamic();
+	e = ENGINE_by_id("dynamic");
+	if (!e ||
+			!ENGINE_ctrl_cmd_string(e, "SO_PATH", argv[1], 0) ||
+			!ENGINE_ctrl_cmd_string(e, "ID", "pkcs11", 0) ||
+			!ENGINE_ctrl_cmd_string(e, "LOAD", NULL, 0)) {
+		error_queue("ENGINE_by_id");
+		ENGINE_free(e);
+		return 1;
+	}
+	if (!ENGINE_ctrl_cmd_string(e, "MODULE_PATH", argv[2], 0) ||
+			!ENGINE_ctrl_cmd_string(e, "PIN", argv[3], 0)) {
+		error_queue("ENGINE_ctrl_cmd_string");
+		goto free;
+	}
+	if (!ENGINE_init(e)) {
+		error_queue("ENGINE_init");
+		goto free;
+	}
+
+	parms.count = count + 1;
+	parms.uris = uris;
+	parms.keys = keys;
+	parms.loaded = 0;
+	if (!ENGINE_ctrl_cmd(e, "LOAD_PRIVKEYS", 0, &parms, NULL, 0)) {
+		error_queue("LOAD_PRIVKEYS");
+		goto finish;
+	}
+	ERR_clear_error();
+	printf("Loaded %u of %u private keys\n", parms.loaded, parms.count);
+
+	if (parms.loaded != count || keys[count]) {
+		fprintf(stderr, "Expected %u keys to be loaded\n", count);
+		goto cleanup;
+	}
+	for (i = 0; i < count; i++) {
+		if (!keys[i] || sign(keys[i])) {
+			error_queue("EVP_DigestSign");
+			fprintf(stderr, "Could not sign with %s\n", uris[i]);
+			goto cleanup;
+		}
+	}
+
+	printf("Batch key loading works as expected\n");
+	ret = 0;
+
+cleanup:
+	for (i = 0; i <= count; i++)
+		EVP_PKEY_free(keys[i]);
+finish:
+	ENGINE_finish(e);
+free:
+	ENGINE_free(e);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
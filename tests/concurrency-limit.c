@@ -0,0 +1,192 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that the adaptive concurrency limit bounds the signatures in
+ * flight on a slot, that it reports the observed latency, and that the
+ * signatures waiting longer than the maximum wait fail and are counted. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libp11.h>
+
+#include "../src/pkcs11.h"
+
+#define MAX_THREADS 64
+#define MAX_LIMIT 4
+
+static PKCS11_SLOT *slot;
+static PKCS11_KEY *key;
+static PKCS11_MECHANISM mech;
+static unsigned int ops_per_thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int failures, violations;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static void *worker(void *arg)
+{
+	PKCS11_CONCURRENCY status;
+	unsigned char tbs[32], sig[1024];
+	size_t siglen;
+	unsigned int i, failed = 0, violated = 0;
+
+	(void)arg;
+	memset(tbs, 0x5a, sizeof(tbs));
+	for (i = 0; i < ops_per_thread; i++) {
+		siglen = sizeof(sig);
+		if (PKCS11_sign_mech(key, &mech, tbs, sizeof(tbs), sig, &siglen))
+			failed++;
+		if (PKCS11_get_concurrency(slot, &status) ||
+				status.in_flight > MAX_LIMIT ||
+				status.limit < 1 || status.limit > MAX_LIMIT)
+			violated++;
+	}
+	ERR_clear_error();
+	pthread_mutex_lock(&lock);
+	failures += failed;
+	violations += violated;
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static int run(unsigned int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	unsigned int i, n;
+
+	failures = violations = 0;
+	for (n = 0; n < nthreads; n++)
+		if (pthread_create(&threads[n], NULL, worker, NULL))
+			break;
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	return n < nthreads ? -1 : 0;
+}
+
+static void print_status(const char *name, const PKCS11_CONCURRENCY *status)
+{
+	printf("%s: limit %u, in flight %u, waiting %u, latency %lu us, "
+		"baseline %lu us, rejected %lu\n", name,
+		status->limit, status->in_flight, status->waiting,
+		status->latency, status->baseline, status->rejected);
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots;
+	PKCS11_KEY *keys;
+	PKCS11_CONCURRENCY status;
+	unsigned int nslots, nkeys, nthreads;
+	unsigned long rejected;
+	int rc, ret = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN [THREADS] [SIGNATURES]\n",
+			argv[0]);
+		return 1;
+	}
+	nthreads = argc > 3 ? (unsigned int)atoi(argv[3]) : 8;
+	ops_per_thread = argc > 4 ? (unsigned int)atoi(argv[4]) : 100;
+	if (nthreads < 1 || nthreads > MAX_THREADS || ops_per_thread < 1) {
+		fprintf(stderr, "Invalid number of threads or signatures\n");
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	if (PKCS11_set_concurrency_limit(ctx, 1, MAX_LIMIT, 0)) {
+		error_queue("PKCS11_set_concurrency_limit");
+		goto nolib;
+	}
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+	rc = PKCS11_login(slot, 0, argv[2]);
+	error_queue("PKCS11_login");
+	if (rc)
+		goto notoken;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc || nkeys == 0)
+		goto notoken;
+	key = &keys[0];
+	memset(&mech, 0, sizeof(mech));
+	mech.mechanism = PKCS11_get_key_type(key) == EVP_PKEY_EC ?
+		CKM_ECDSA : CKM_RSA_PKCS;
+
+	/* Without a maximum wait, every signature succeeds */
+	if (run(nthreads) || failures || violations ||
+			PKCS11_get_concurrency(slot, &status)) {
+		fprintf(stderr, "%u signatures failed, %u limit violations\n",
+			failures, violations);
+		goto notoken;
+	}
+	print_status("adaptive", &status);
+	if (status.in_flight || status.waiting || status.rejected ||
+			!status.baseline || !status.latency) {
+		fprintf(stderr, "Unexpected state of the concurrency limit\n");
+		goto notoken;
+	}
+
+	/* With a single operation in flight and a 1 us wait, every rejected
+	 * signature fails */
+	if (PKCS11_set_concurrency_limit(ctx, 1, 1, 1) ||
+			run(nthreads) || violations ||
+			PKCS11_get_concurrency(slot, &status)) {
+		fprintf(stderr, "%u limit violations\n", violations);
+		goto notoken;
+	}
+	print_status("bounded wait", &status);
+	rejected = status.rejected;
+	if (status.limit != 1 || status.in_flight || rejected != failures) {
+		fprintf(stderr, "%u signatures failed, %lu were rejected\n",
+			failures, rejected);
+		goto notoken;
+	}
+
+	if (PKCS11_set_concurrency_limit(ctx, 0, 0, 0) ||
+			PKCS11_get_concurrency(slot, &status) == 0) {
+		fprintf(stderr, "The concurrency limit was not disabled\n");
+		goto notoken;
+	}
+	ret = 0;
+
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,161 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Takes ephemeral EC keys from the pool and checks that ECDH with each of
+ * them agrees with the peer computing the secret in software. */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* this code uses the EC_KEY API to reach the ECDH method of the key */
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <libp11.h>
+#include <openssl/ec.h>
+#include <openssl/ecdh.h>
+#include <openssl/obj_mac.h>
+
+#define ROUNDS 6
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+/* Derive a secret with an ephemeral key from the pool */
+static int exchange(PKCS11_SLOT *slot, EC_KEY *peer)
+{
+	PKCS11_KEY *key;
+	EVP_PKEY *priv = NULL, *pub = NULL;
+	const EC_KEY *priv_ec, *pub_ec;
+	unsigned char s1[66], s2[66];
+	int l1, l2, ok = 0;
+
+	key = PKCS11_keypool_get(slot);
+	if (!key) {
+		error_queue("PKCS11_keypool_get");
+		return 0;
+	}
+	priv = PKCS11_get_private_key(key);
+	pub = PKCS11_get_public_key(key);
+	if (!priv || !pub) {
+		error_queue("PKCS11_get_private_key");
+		goto end;
+	}
+	priv_ec = EVP_PKEY_get0_EC_KEY(priv);
+	pub_ec = EVP_PKEY_get0_EC_KEY(pub);
+	if (!priv_ec || !pub_ec)
+		goto end;
+
+	/* The token side uses C_DeriveKey() through the EC_KEY method */
+	l1 = ECDH_compute_key(s1, sizeof(s1),
+		EC_KEY_get0_public_key(peer), (EC_KEY *)priv_ec, NULL);
+	l2 = ECDH_compute_key(s2, sizeof(s2),
+		EC_KEY_get0_public_key(pub_ec), peer, NULL);
+	if (l1 <= 0 || l1 != l2 || memcmp(s1, s2, l1)) {
+		error_queue("ECDH_compute_key");
+		fprintf(stderr, "Shared secrets do not match\n");
+		goto end;
+	}
+	ok = 1;
+
+end:
+	EVP_PKEY_free(priv);
+	EVP_PKEY_free(pub);
+	PKCS11_keypool_put(key);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	EC_KEY *peer = NULL;
+	unsigned int nslots;
+	int i, rc, ret = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+
+	rc = PKCS11_login(slot, 0, argv[2]);
+	error_queue("PKCS11_login");
+	if (rc)
+		goto notoken;
+
+	peer = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+	if (!peer || !EC_KEY_generate_key(peer))
+		goto notoken;
+
+	/* Invalid watermarks are rejected */
+	if (PKCS11_keypool_start(slot, NID_X9_62_prime256v1, 4, 2) == 0) {
+		fprintf(stderr, "Invalid watermarks accepted\n");
+		goto notoken;
+	}
+	ERR_clear_error();
+
+	if (PKCS11_keypool_start(slot, NID_X9_62_prime256v1, 2, 4)) {
+		error_queue("PKCS11_keypool_start");
+		goto notoken;
+	}
+	for (i = 0; i < ROUNDS; i++) {
+		if (!exchange(slot, peer))
+			goto stop;
+		if (i == ROUNDS / 2)
+			usleep(100000); /* let the pool refill */
+	}
+
+	/* The pool can be reconfigured while running */
+	if (PKCS11_keypool_start(slot, NID_X9_62_prime256v1, 1, 1) ||
+			!exchange(slot, peer)) {
+		error_queue("PKCS11_keypool_start");
+		goto stop;
+	}
+
+	printf("Ephemeral key pool works as expected\n");
+	ret = 0;
+
+stop:
+	PKCS11_keypool_stop(slot);
+notoken:
+	EC_KEY_free(peer);
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
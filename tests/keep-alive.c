@@ -0,0 +1,129 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that the KEEP_ALIVE engine ctrl command keeps the module loaded
+ * and logged in across ENGINE_finish() and ENGINE_init(), so that a wrong
+ * PIN is not even tried, and that the module is released after the idle
+ * timeout, after MODULE_PATH or without KEEP_ALIVE. */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* this code extensively uses deprecated features, so warnings are useless */
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <libp11.h>
+#include <openssl/engine.h>
+
+static const char wrong_pin[] = "0000";
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+/* Initialize the engine, load the public key with login, and finish the
+ * engine */
+static int cycle(ENGINE *e, const char *pin, const char *uri)
+{
+	EVP_PKEY *pkey;
+
+	if (!ENGINE_ctrl_cmd_string(e, "PIN", pin, 0) || !ENGINE_init(e))
+		return -1;
+	pkey = ENGINE_load_public_key(e, uri, NULL, NULL);
+	EVP_PKEY_free(pkey);
+	ENGINE_finish(e);
+	ERR_clear_error();
+	return pkey ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	ENGINE *e;
+	int ret = 1;
+
+	if (argc < 5) {
+		fprintf(stderr, "usage: %s pkcs11.so /usr/lib/opensc-pkcs11.so PIN KEY-URI\n",
+			argv[0]);
+		return 1;
+	}
+
+	ENGINE_load_dynamic();
+	e = ENGINE_by_id("dynamic");
+	if (!e ||
+			!ENGINE_ctrl_cmd_string(e, "SO_PATH", argv[1], 0) ||
+			!ENGINE_ctrl_cmd_string(e, "ID", "pkcs11", 0) ||
+			!ENGINE_ctrl_cmd_string(e, "LOAD", NULL, 0)) {
+		error_queue("ENGINE_by_id");
+		ENGINE_free(e);
+		return 1;
+	}
+	/* Public keys are loaded without pinning the engine, but with login */
+	if (!ENGINE_ctrl_cmd_string(e, "MODULE_PATH", argv[2], 0) ||
+			!ENGINE_ctrl_cmd_string(e, "FORCE_LOGIN", NULL, 0) ||
+			!ENGINE_ctrl_cmd_string(e, "KEEP_ALIVE", "60", 0)) {
+		error_queue("ENGINE_ctrl_cmd_string");
+		goto free;
+	}
+
+	/* The login survives ENGINE_finish() */
+	if (cycle(e, argv[3], argv[4]) || cycle(e, wrong_pin, argv[4])) {
+		fprintf(stderr, "The login state was not kept\n");
+		goto free;
+	}
+	printf("The login state was kept across ENGINE_finish()\n");
+
+	/* Until the idle timeout */
+	if (!ENGINE_ctrl_cmd_string(e, "KEEP_ALIVE", "1", 0) ||
+			cycle(e, argv[3], argv[4])) {
+		fprintf(stderr, "The module was released too early\n");
+		goto free;
+	}
+	sleep(2);
+	if (!cycle(e, wrong_pin, argv[4])) {
+		fprintf(stderr, "The module was kept after the idle timeout\n");
+		goto free;
+	}
+	printf("The module was released after the idle timeout\n");
+
+	/* Or once the module is configured again */
+	if (!ENGINE_ctrl_cmd_string(e, "KEEP_ALIVE", "60", 0) ||
+			cycle(e, argv[3], argv[4]) ||
+			!ENGINE_ctrl_cmd_string(e, "MODULE_PATH", argv[2], 0) ||
+			!cycle(e, wrong_pin, argv[4])) {
+		fprintf(stderr, "The module was kept after MODULE_PATH\n");
+		goto free;
+	}
+	printf("The module was released after MODULE_PATH\n");
+
+	/* Without KEEP_ALIVE */
+	if (!ENGINE_ctrl_cmd_string(e, "KEEP_ALIVE", "0", 0) ||
+			cycle(e, argv[3], argv[4]) || !cycle(e, wrong_pin, argv[4])) {
+		fprintf(stderr, "The module was kept without KEEP_ALIVE\n");
+		goto free;
+	}
+	printf("The module was released without KEEP_ALIVE\n");
+	ret = 0;
+
+free:
+	ENGINE_free(e);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
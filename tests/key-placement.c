@@ -0,0 +1,215 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that PKCS11_place_key() maps key ids to initialized tokens
+ * deterministically and evenly, and that adding or removing a token only
+ * moves the keys placed on that token. */
+
+#include <stdio.h>
+#include <string.h>
+#include <libp11.h>
+
+#define TOKENS 32
+#define KEYS 20000
+
+static PKCS11_SLOT slots[TOKENS + 1];
+static PKCS11_TOKEN tokens[TOKENS + 1];
+static char labels[TOKENS + 1][32], serials[TOKENS + 1][17];
+static unsigned int placement[KEYS];
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static void key_id(unsigned int n, unsigned char *id)
+{
+	id[0] = (unsigned char)(n >> 24);
+	id[1] = (unsigned char)(n >> 16);
+	id[2] = (unsigned char)(n >> 8);
+	id[3] = (unsigned char)n;
+}
+
+static void init_tokens(void)
+{
+	unsigned int n;
+
+	memset(slots, 0, sizeof(slots));
+	memset(tokens, 0, sizeof(tokens));
+	for (n = 0; n <= TOKENS; n++) {
+		snprintf(labels[n], sizeof(labels[n]), "partition-%u", n);
+		snprintf(serials[n], sizeof(serials[n]), "%016u", 1000 + n);
+		tokens[n].label = labels[n];
+		tokens[n].manufacturer = "libp11";
+		tokens[n].model = "test";
+		tokens[n].serialnr = serials[n];
+		tokens[n].initialized = 1;
+		tokens[n].slot = &slots[n];
+		slots[n].description = labels[n];
+		slots[n].token = &tokens[n];
+	}
+}
+
+/* Place every key on the tokens named by the slots array */
+static int place(PKCS11_CTX *ctx, PKCS11_SLOT *list, unsigned int nslots,
+		unsigned int *result)
+{
+	PKCS11_SLOT *slot;
+	unsigned char id[4];
+	unsigned int n;
+
+	for (n = 0; n < KEYS; n++) {
+		key_id(n, id);
+		slot = PKCS11_place_key(ctx, list, nslots, id, sizeof(id));
+		if (!slot)
+			return -1;
+		result[n] = (unsigned int)(slot->token - tokens);
+	}
+	return 0;
+}
+
+static int check_tokens(PKCS11_CTX *ctx)
+{
+	static unsigned int moved[KEYS];
+	PKCS11_SLOT removed[TOKENS];
+	unsigned int counts[TOKENS + 1], n, m, min, max, changed;
+
+	init_tokens();
+
+	/* Deterministic and balanced */
+	if (place(ctx, slots, TOKENS, placement) ||
+			place(ctx, slots, TOKENS, moved)) {
+		fprintf(stderr, "No token selected\n");
+		return -1;
+	}
+	memset(counts, 0, sizeof(counts));
+	for (n = 0; n < KEYS; n++) {
+		if (moved[n] != placement[n]) {
+			fprintf(stderr, "Key %u placed on tokens %u and %u\n",
+				n, placement[n], moved[n]);
+			return -1;
+		}
+		counts[placement[n]]++;
+	}
+	min = max = counts[0];
+	for (n = 1; n < TOKENS; n++) {
+		if (counts[n] < min)
+			min = counts[n];
+		if (counts[n] > max)
+			max = counts[n];
+	}
+	printf("%u keys on %u tokens: between %u and %u keys per token\n",
+		KEYS, TOKENS, min, max);
+	if (min < KEYS / TOKENS * 3 / 4 || max > KEYS / TOKENS * 5 / 4) {
+		fprintf(stderr, "The keys are not evenly placed\n");
+		return -1;
+	}
+
+	/* Adding a token only moves keys to that token */
+	if (place(ctx, slots, TOKENS + 1, moved))
+		return -1;
+	for (n = 0, changed = 0; n < KEYS; n++) {
+		if (moved[n] == placement[n])
+			continue;
+		if (moved[n] != TOKENS) {
+			fprintf(stderr, "Key %u moved between existing tokens\n", n);
+			return -1;
+		}
+		changed++;
+	}
+	printf("Adding a token moved %u keys\n", changed);
+	if (changed == 0 || changed > 2 * KEYS / (TOKENS + 1)) {
+		fprintf(stderr, "Unexpected number of moved keys\n");
+		return -1;
+	}
+
+	/* Removing a token only moves the keys placed on it, and ignores
+	 * uninitialized tokens */
+	for (n = 0, m = 0; n < TOKENS; n++)
+		if (n != 7)
+			removed[m++] = slots[n];
+	tokens[TOKENS].initialized = 0;
+	removed[m++] = slots[TOKENS];
+	if (place(ctx, removed, m, moved))
+		return -1;
+	for (n = 0, changed = 0; n < KEYS; n++) {
+		if (moved[n] == TOKENS || (placement[n] != 7 ?
+				moved[n] != placement[n] : moved[n] == 7)) {
+			fprintf(stderr, "Key %u moved from token %u to %u\n",
+				n, placement[n], moved[n]);
+			return -1;
+		}
+		if (moved[n] != placement[n])
+			changed++;
+	}
+	printf("Removing a token moved %u keys\n", changed);
+	if (changed != counts[7]) {
+		fprintf(stderr, "Unexpected number of moved keys\n");
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *module_slots, *slot;
+	unsigned char id[4];
+	unsigned int nslots;
+	int rc, ret = 1;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &module_slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+
+	/* The slots of the module without an initialized token are skipped */
+	key_id(1, id);
+	slot = PKCS11_place_key(ctx, module_slots, nslots, id, sizeof(id));
+	if (!slot || !slot->token || !slot->token->initialized ||
+			PKCS11_place_key(ctx, module_slots, nslots, id, 0)) {
+		fprintf(stderr, "Unexpected token selected on the module\n");
+		goto notoken;
+	}
+
+	if (check_tokens(ctx))
+		goto notoken;
+	printf("Keys are placed as expected\n");
+	ret = 0;
+
+notoken:
+	PKCS11_release_all_slots(ctx, module_slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,185 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that the lock profiling attributes the acquisitions of the
+ * session pool lock to their call sites while concurrent threads sign,
+ * that the reported times are consistent, and that enabling the profiling
+ * again clears the statistics. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libp11.h>
+
+#include "../src/pkcs11.h"
+
+#define THREADS 8
+#define SIGNATURES 50
+#define MAX_STATS 256
+
+static PKCS11_KEY *key;
+static PKCS11_MECHANISM mech;
+static int failed;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static void *worker(void *arg)
+{
+	unsigned char tbs[32], sig[1024];
+	size_t siglen;
+	int i;
+
+	(void)arg;
+	memset(tbs, 0x5a, sizeof(tbs));
+	for (i = 0; i < SIGNATURES; i++) {
+		siglen = sizeof(sig);
+		if (PKCS11_sign_mech(key, &mech, tbs, sizeof(tbs), sig, &siglen))
+			failed = 1;
+	}
+	return NULL;
+}
+
+/* Returns the acquisitions of the session pool lock, or -1 on error */
+static long check_stats(PKCS11_CTX *ctx)
+{
+	PKCS11_LOCK_STATS stats[MAX_STATS];
+	unsigned int count = 0, i;
+	long acquisitions = 0;
+
+	if (PKCS11_get_lock_stats(ctx, NULL, &count))
+		return -1;
+	if (count > MAX_STATS)
+		count = MAX_STATS;
+	if (PKCS11_get_lock_stats(ctx, stats, &count))
+		return -1;
+	for (i = 0; i < count; i++) {
+		printf("%s %p %s:%d: %lu acquisitions, %lu contended, "
+			"wait %llu/%llu ns, hold %llu/%llu ns\n",
+			stats[i].lock, stats[i].instance,
+			stats[i].file ? stats[i].file : "(other)", stats[i].line,
+			stats[i].acquisitions, stats[i].contended,
+			stats[i].wait_total, stats[i].wait_max,
+			stats[i].hold_total, stats[i].hold_max);
+		if (!stats[i].lock || !stats[i].instance ||
+				stats[i].contended > stats[i].acquisitions ||
+				stats[i].wait_max > stats[i].wait_total ||
+				stats[i].hold_max > stats[i].hold_total) {
+			fprintf(stderr, "Inconsistent lock statistics\n");
+			return -1;
+		}
+		if (!strcmp(stats[i].lock, "slot->lock"))
+			acquisitions += (long)stats[i].acquisitions;
+	}
+	return acquisitions;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys;
+	pthread_t threads[THREADS];
+	unsigned int nslots, nkeys, count, i, n;
+	long acquisitions;
+	int rc, ret = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+	rc = PKCS11_login(slot, 0, argv[2]);
+	error_queue("PKCS11_login");
+	if (rc)
+		goto notoken;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc || nkeys == 0)
+		goto notoken;
+	key = &keys[0];
+	memset(&mech, 0, sizeof(mech));
+	mech.mechanism = PKCS11_get_key_type(key) == EVP_PKEY_EC ?
+		CKM_ECDSA : CKM_RSA_PKCS;
+
+	/* Nothing is recorded until the profiling is enabled */
+	if (check_stats(ctx) != 0) {
+		fprintf(stderr, "Locks were profiled while disabled\n");
+		goto notoken;
+	}
+
+	if (PKCS11_set_lock_profiling(ctx, 1)) {
+		error_queue("PKCS11_set_lock_profiling");
+		goto notoken;
+	}
+	for (n = 0; n < THREADS; n++)
+		if (pthread_create(&threads[n], NULL, worker, NULL))
+			break;
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	if (n < THREADS || failed) {
+		fprintf(stderr, "Concurrent signatures failed\n");
+		goto notoken;
+	}
+
+	/* Each signature acquires and returns a pooled session */
+	acquisitions = check_stats(ctx);
+	if (acquisitions < 2 * THREADS * SIGNATURES) {
+		fprintf(stderr, "Expected at least %d acquisitions of slot->lock\n",
+			2 * THREADS * SIGNATURES);
+		goto notoken;
+	}
+
+	/* Enabling the profiling again clears the statistics */
+	if (PKCS11_set_lock_profiling(ctx, 0) ||
+			PKCS11_set_lock_profiling(ctx, 1) ||
+			PKCS11_get_lock_stats(ctx, NULL, &count) || count != 0) {
+		fprintf(stderr, "The lock statistics were not cleared\n");
+		goto notoken;
+	}
+	PKCS11_set_lock_profiling(ctx, 0);
+
+	printf("Lock contention is recorded as expected\n");
+	ret = 0;
+
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,165 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that the memory reports follow the enumeration of slots, keys
+ * and certificates, and their release, and that EVP_PKEY objects are
+ * reported. */
+
+#include <stdio.h>
+#include <string.h>
+#include <libp11.h>
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static PKCS11_SLOT *open_token(PKCS11_CTX *ctx, PKCS11_SLOT **slots,
+		unsigned int *nslots, const char *pin)
+{
+	PKCS11_SLOT *slot;
+
+	if (PKCS11_enumerate_slots(ctx, slots, nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		return NULL;
+	}
+	slot = PKCS11_find_token(ctx, *slots, *nslots);
+	if (!slot || !slot->token || PKCS11_login(slot, 0, pin)) {
+		error_queue("PKCS11_login");
+		PKCS11_release_all_slots(ctx, *slots, *nslots);
+		return NULL;
+	}
+	return slot;
+}
+
+static void print_usage(const char *name, const PKCS11_MEM_USAGE *usage)
+{
+	printf("%s: total %lu, ctx %lu, slots %lu, sessions %lu, keys %lu, "
+		"certs %lu, objects %lu (%lu), x509 %lu (%lu), pkeys %lu (%lu), "
+		"attrs %lu, keypool %lu\n", name,
+		(unsigned long)usage->total, (unsigned long)usage->ctx,
+		(unsigned long)usage->slots, (unsigned long)usage->sessions,
+		(unsigned long)usage->keys, (unsigned long)usage->certs,
+		(unsigned long)usage->objects, usage->nobjects,
+		(unsigned long)usage->x509, usage->nx509,
+		(unsigned long)usage->pkeys, usage->npkeys,
+		(unsigned long)usage->attrs, (unsigned long)usage->keypool);
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys;
+	PKCS11_CERT *certs;
+	PKCS11_MEM_USAGE empty, usage, slot_usage;
+	EVP_PKEY *pkey;
+	unsigned int nslots, nkeys, ncerts;
+	int rc, ret = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	if (PKCS11_get_memory_usage(ctx, &empty) ||
+			empty.ctx == 0 || empty.total != empty.ctx) {
+		print_usage("loaded", &empty);
+		fprintf(stderr, "Unexpected usage of a context without slots\n");
+		goto nolib;
+	}
+
+	slot = open_token(ctx, &slots, &nslots, argv[2]);
+	if (!slot)
+		goto noslots;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc || nkeys == 0)
+		goto notoken;
+	rc = PKCS11_enumerate_certs(slot->token, &certs, &ncerts);
+	error_queue("PKCS11_enumerate_certs");
+	if (rc || ncerts == 0)
+		goto notoken;
+
+	if (PKCS11_get_memory_usage(ctx, &usage) ||
+			PKCS11_get_slot_memory_usage(slot, &slot_usage)) {
+		error_queue("PKCS11_get_memory_usage");
+		goto notoken;
+	}
+	print_usage("context", &usage);
+	print_usage("slot", &slot_usage);
+	if (usage.slots == 0 || usage.sessions == 0 ||
+			usage.keys < nkeys * sizeof(PKCS11_KEY) ||
+			usage.certs < ncerts * sizeof(PKCS11_CERT) ||
+			usage.nobjects < nkeys + ncerts || usage.objects == 0 ||
+			usage.nx509 < ncerts || usage.x509 == 0) {
+		fprintf(stderr, "Missing categories in the context usage\n");
+		goto notoken;
+	}
+	if (usage.total <= empty.total ||
+			slot_usage.ctx != 0 || slot_usage.nobjects == 0 ||
+			slot_usage.total > usage.total + slot_usage.slots) {
+		fprintf(stderr, "Inconsistent slot usage\n");
+		goto notoken;
+	}
+
+	PKCS11_release_all_slots(ctx, slots, nslots);
+	if (PKCS11_get_memory_usage(ctx, &usage) ||
+			usage.total != empty.total || usage.nobjects != 0) {
+		print_usage("released", &usage);
+		fprintf(stderr, "Memory still accounted after releasing the slots\n");
+		goto noslots;
+	}
+
+	slot = open_token(ctx, &slots, &nslots, argv[2]);
+	if (!slot)
+		goto noslots;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc || nkeys == 0)
+		goto notoken;
+	pkey = PKCS11_get_private_key(&keys[0]);
+	if (!pkey)
+		goto notoken;
+	EVP_PKEY_free(pkey);
+	if (PKCS11_get_memory_usage(ctx, &usage) ||
+			usage.npkeys == 0 || usage.pkeys == 0) {
+		print_usage("key", &usage);
+		fprintf(stderr, "EVP_PKEY objects are not reported\n");
+		goto notoken;
+	}
+
+	printf("Memory usage is reported as expected\n");
+	ret = 0;
+
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
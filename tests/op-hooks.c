@@ -0,0 +1,162 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that the operation hooks see login, find, sign and random
+ * operations, and that the pre hook can reject an operation. */
+
+#include <stdio.h>
+#include <string.h>
+#include <libp11.h>
+
+#include "../src/pkcs11.h"
+
+#define OP_MAX 7
+
+struct op_counters {
+	int pre[OP_MAX];
+	int post[OP_MAX];
+	int reject;
+	unsigned long last_rv;
+};
+
+static int pre_hook(PKCS11_OP_INFO *info, void *user_data)
+{
+	struct op_counters *c = user_data;
+
+	if (info->operation <= 0 || info->operation >= OP_MAX)
+		return 0;
+	c->pre[info->operation]++;
+	info->op_data = c;
+	return c->reject ? -1 : 0;
+}
+
+static void post_hook(PKCS11_OP_INFO *info, void *user_data)
+{
+	struct op_counters *c = user_data;
+
+	if (info->operation <= 0 || info->operation >= OP_MAX)
+		return;
+	if (info->op_data != c) /* the per-operation data has to survive */
+		return;
+	c->post[info->operation]++;
+	c->last_rv = info->rv;
+}
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys;
+	EVP_PKEY *pkey = NULL;
+	EVP_MD_CTX *mctx = NULL;
+	struct op_counters c;
+	unsigned char data[] = "libp11 operation hooks";
+	unsigned char sig[1024], random[32];
+	size_t siglen = sizeof(sig);
+	unsigned int nslots, nkeys;
+	int i, rc, ret = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n", argv[0]);
+		return 1;
+	}
+
+	memset(&c, 0, sizeof(c));
+	ctx = PKCS11_CTX_new();
+	if (PKCS11_set_op_hooks(ctx, pre_hook, post_hook, &c)) {
+		fprintf(stderr, "PKCS11_set_op_hooks failed\n");
+		goto nolib;
+	}
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+
+	rc = PKCS11_login(slot, 0, argv[2]);
+	error_queue("PKCS11_login");
+	if (rc)
+		goto notoken;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc || nkeys == 0)
+		goto notoken;
+
+	pkey = PKCS11_get_private_key(&keys[0]);
+	mctx = EVP_MD_CTX_create();
+	if (!pkey || !mctx ||
+			EVP_DigestSignInit(mctx, NULL, EVP_sha256(), NULL, pkey) <= 0 ||
+			EVP_DigestSign(mctx, sig, &siglen, data, sizeof(data)) <= 0) {
+		error_queue("EVP_DigestSign");
+		goto notoken;
+	}
+
+	if (PKCS11_generate_random(slot, random, sizeof(random))) {
+		error_queue("PKCS11_generate_random");
+		goto notoken;
+	}
+
+	for (i = 1; i < OP_MAX; i++) {
+		printf("operation %d: pre %d, post %d\n", i, c.pre[i], c.post[i]);
+		if (c.pre[i] != c.post[i])
+			goto notoken;
+	}
+	if (!c.pre[PKCS11_OP_LOGIN] || !c.pre[PKCS11_OP_FIND] ||
+			!c.pre[PKCS11_OP_SIGN] || c.pre[PKCS11_OP_RANDOM] != 1)
+		goto notoken;
+
+	/* A rejected operation must fail and still reach the post hook */
+	c.reject = 1;
+	if (PKCS11_generate_random(slot, random, sizeof(random)) == 0) {
+		fprintf(stderr, "Rejected operation succeeded\n");
+		goto notoken;
+	}
+	ERR_clear_error();
+	if (c.post[PKCS11_OP_RANDOM] != 2 || c.last_rv != CKR_FUNCTION_REJECTED) {
+		fprintf(stderr, "Rejected operation was not reported\n");
+		goto notoken;
+	}
+	c.reject = 0;
+
+	printf("Operation hooks work as expected\n");
+	ret = 0;
+
+notoken:
+	EVP_MD_CTX_destroy(mctx);
+	EVP_PKEY_free(pkey);
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
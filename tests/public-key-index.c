@@ -0,0 +1,154 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that keys and certificates are paired by public key when their
+ * CKA_ID differ, and that PKCS11_find_by_public_key() returns the private
+ * key, the public key and the certificate of a public key. */
+
+#include <stdio.h>
+#include <string.h>
+#include <libp11.h>
+
+static const unsigned char other_id[] = {0xfe, 0xed, 0xfa, 0xce};
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static int same_id(const PKCS11_KEY *key, const unsigned char *id, size_t id_len)
+{
+	return key && key->id_len == id_len && !memcmp(key->id, id, id_len);
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys, *key, *prv, *pub;
+	PKCS11_CERT *certs, *cert, *copy, *found;
+	EVP_PKEY *pkey = NULL;
+	unsigned int nslots, nkeys, ncerts, i;
+	int rc, ret = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+	rc = PKCS11_open_session(slot, 1);
+	error_queue("PKCS11_open_session");
+	if (rc)
+		goto notoken;
+	rc = PKCS11_login(slot, 0, argv[2]);
+	error_queue("PKCS11_login");
+	if (rc)
+		goto notoken;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc || nkeys == 0)
+		goto notoken;
+	for (i = 0; i < nkeys && PKCS11_get_key_type(&keys[i]) != EVP_PKEY_RSA; i++)
+		;
+	if (i == nkeys) {
+		fprintf(stderr, "No RSA key found\n");
+		goto notoken;
+	}
+	key = &keys[i];
+	cert = PKCS11_find_certificate(key);
+	if (!cert || !cert->x509) {
+		error_queue("PKCS11_find_certificate");
+		fprintf(stderr, "No certificate with the id of the key\n");
+		goto notoken;
+	}
+
+	/* Store the certificate again with another id */
+	rc = PKCS11_store_certificate(slot->token, cert->x509, "public-key-index",
+		(unsigned char *)other_id, sizeof(other_id), &copy);
+	error_queue("PKCS11_store_certificate");
+	if (rc || !copy)
+		goto notoken;
+	rc = PKCS11_enumerate_certs(slot->token, &certs, &ncerts);
+	error_queue("PKCS11_enumerate_certs");
+	if (rc)
+		goto notoken;
+	for (i = 0; i < ncerts; i++)
+		if (certs[i].id_len == sizeof(other_id) &&
+				!memcmp(certs[i].id, other_id, sizeof(other_id)))
+			break;
+	if (i == ncerts) {
+		fprintf(stderr, "The stored certificate was not enumerated\n");
+		goto notoken;
+	}
+	copy = &certs[i];
+
+	/* Paired by public key despite the different id */
+	prv = PKCS11_find_key(copy);
+	if (!same_id(prv, key->id, key->id_len)) {
+		error_queue("PKCS11_find_key");
+		fprintf(stderr, "The key of the certificate was not found\n");
+		goto notoken;
+	}
+	printf("Found the key of a certificate with a different id\n");
+
+	/* All the objects of a public key */
+	pkey = X509_get_pubkey(copy->x509);
+	rc = PKCS11_find_by_public_key(slot->token, pkey, &prv, &pub, &found);
+	error_queue("PKCS11_find_by_public_key");
+	if (rc || !same_id(prv, key->id, key->id_len) || !found) {
+		fprintf(stderr, "The objects of the public key were not found\n");
+		goto notoken;
+	}
+	printf("Found the private key%s and a certificate of the public key\n",
+		pub ? ", the public key" : "");
+
+	/* Unknown public keys are not found */
+	EVP_PKEY_free(pkey);
+	pkey = EVP_PKEY_new();
+	if (!pkey || PKCS11_find_by_public_key(slot->token, pkey,
+			&prv, &pub, &found) == 0 || prv || pub || found) {
+		fprintf(stderr, "An invalid public key was found\n");
+		goto notoken;
+	}
+	ERR_clear_error();
+	ret = 0;
+
+notoken:
+	EVP_PKEY_free(pkey);
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
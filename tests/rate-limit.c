@@ -0,0 +1,218 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that the token bucket of a slot spaces concurrent signatures at
+ * the configured rate after the burst, that the signatures that would wait
+ * longer than the maximum wait fail with a rate limit error, and that the
+ * bucket of a key limits the signatures with that key. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <libp11.h>
+
+#include "../src/pkcs11.h"
+
+#define THREADS 4
+#define SIGNATURES 10
+#define RATE 100
+#define BURST 5
+
+static PKCS11_KEY *key;
+static PKCS11_MECHANISM mech;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int failures;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int sign(void)
+{
+	unsigned char tbs[32], sig[1024];
+	size_t siglen = sizeof(sig);
+
+	memset(tbs, 0x5a, sizeof(tbs));
+	return PKCS11_sign_mech(key, &mech, tbs, sizeof(tbs), sig, &siglen);
+}
+
+static void *worker(void *arg)
+{
+	unsigned int i, failed = 0;
+
+	(void)arg;
+	for (i = 0; i < SIGNATURES; i++)
+		if (sign())
+			failed++;
+	ERR_clear_error();
+	pthread_mutex_lock(&lock);
+	failures += failed;
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static void print_status(const char *name, const PKCS11_RATE_LIMIT *status)
+{
+	printf("%s: rate %lu/s, burst %lu, tokens %ld, waiting %u, "
+		"admitted %lu, delayed %lu, rejected %lu\n", name,
+		status->rate, status->burst, status->tokens, status->waiting,
+		status->admitted, status->delayed, status->rejected);
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys;
+	PKCS11_RATE_LIMIT status;
+	pthread_t threads[THREADS];
+	unsigned int nslots, nkeys, i, n, rejected = 0;
+	unsigned long err;
+	double start, elapsed;
+	int rc, ret = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	if (PKCS11_set_rate_limit(ctx, RATE, BURST, 0)) {
+		error_queue("PKCS11_set_rate_limit");
+		goto nolib;
+	}
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+	rc = PKCS11_login(slot, 0, argv[2]);
+	error_queue("PKCS11_login");
+	if (rc)
+		goto notoken;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc || nkeys == 0)
+		goto notoken;
+	key = &keys[0];
+	memset(&mech, 0, sizeof(mech));
+	mech.mechanism = PKCS11_get_key_type(key) == EVP_PKEY_EC ?
+		CKM_ECDSA : CKM_RSA_PKCS;
+
+	/* The signatures after the burst are spaced at the rate */
+	start = now();
+	for (n = 0; n < THREADS; n++)
+		if (pthread_create(&threads[n], NULL, worker, NULL))
+			break;
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = now() - start;
+	if (n < THREADS || failures || PKCS11_get_rate_limit(slot, &status)) {
+		fprintf(stderr, "%u signatures failed\n", failures);
+		goto notoken;
+	}
+	print_status("slot", &status);
+	printf("%d signatures in %.3f s\n", THREADS * SIGNATURES, elapsed);
+	if (status.admitted + status.delayed != THREADS * SIGNATURES ||
+			status.admitted < BURST || status.waiting ||
+			status.rejected ||
+			elapsed < 0.9 * (THREADS * SIGNATURES - BURST) / RATE) {
+		fprintf(stderr, "The signatures exceeded the rate limit\n");
+		goto notoken;
+	}
+
+	/* With a short maximum wait, the signatures fail fast */
+	if (PKCS11_set_rate_limit(ctx, 10, 1, 1000))
+		goto notoken;
+	for (i = 0; i < 5; i++) {
+		if (sign() == 0)
+			continue;
+		err = ERR_peek_error();
+		if (ERR_GET_REASON(err) != P11_R_RATE_LIMITED) {
+			error_queue("PKCS11_sign_mech");
+			goto notoken;
+		}
+		ERR_clear_error();
+		rejected++;
+	}
+	if (PKCS11_get_rate_limit(slot, &status))
+		goto notoken;
+	print_status("bounded wait", &status);
+	if (!rejected || status.rejected != rejected) {
+		fprintf(stderr, "%u signatures failed, %lu were rejected\n",
+			rejected, status.rejected);
+		goto notoken;
+	}
+
+	/* The bucket of a key limits the signatures with the key */
+	if (PKCS11_set_rate_limit(ctx, 0, 0, 0) ||
+			PKCS11_get_rate_limit(slot, &status) == 0 ||
+			PKCS11_set_key_rate_limit(key, RATE, 1)) {
+		fprintf(stderr, "Unable to move the rate limit to the key\n");
+		goto notoken;
+	}
+	start = now();
+	for (i = 0; i < SIGNATURES; i++) {
+		if (sign()) {
+			error_queue("PKCS11_sign_mech");
+			goto notoken;
+		}
+	}
+	elapsed = now() - start;
+	if (PKCS11_get_key_rate_limit(key, &status))
+		goto notoken;
+	print_status("key", &status);
+	if (status.admitted + status.delayed != SIGNATURES ||
+			elapsed < 0.9 * (SIGNATURES - 1) / RATE) {
+		fprintf(stderr, "The signatures exceeded the rate limit of the key\n");
+		goto notoken;
+	}
+	if (PKCS11_set_key_rate_limit(key, 0, 0) ||
+			PKCS11_get_key_rate_limit(key, &status) == 0) {
+		fprintf(stderr, "The rate limit of the key was not disabled\n");
+		goto notoken;
+	}
+	ret = 0;
+
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
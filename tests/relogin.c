@@ -0,0 +1,187 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that the signatures failing with CKR_USER_NOT_LOGGED_IN after the
+ * token dropped the login state log in again and succeed, and that
+ * concurrent signatures log in again only once. */
+
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <libp11.h>
+
+#include "../src/pkcs11.h"
+
+#define THREADS 8
+
+static PKCS11_KEY *key;
+static PKCS11_MECHANISM mech;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int failures, logins;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static void post_hook(PKCS11_OP_INFO *info, void *user_data)
+{
+	(void)user_data;
+	if (info->operation == PKCS11_OP_LOGIN && info->rv == CKR_OK) {
+		pthread_mutex_lock(&lock);
+		logins++;
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+static int sign(void)
+{
+	unsigned char tbs[32], sig[1024];
+	size_t siglen = sizeof(sig);
+
+	memset(tbs, 0x5a, sizeof(tbs));
+	return PKCS11_sign_mech(key, &mech, tbs, sizeof(tbs), sig, &siglen);
+}
+
+static void *worker(void *arg)
+{
+	(void)arg;
+	if (sign()) {
+		pthread_mutex_lock(&lock);
+		failures++;
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+/* Log out behind the back of libp11, as an idle timeout of the token */
+static int drop_login(const char *module, unsigned long slot_id)
+{
+	CK_C_GetFunctionList get_function_list;
+	CK_FUNCTION_LIST_PTR funcs;
+	CK_SESSION_HANDLE session;
+	void *handle;
+	CK_RV rv;
+
+	/* The module is already loaded and initialized by libp11 */
+	handle = dlopen(module, RTLD_NOW);
+	if (!handle)
+		return -1;
+	get_function_list = (CK_C_GetFunctionList)dlsym(handle, "C_GetFunctionList");
+	if (!get_function_list || get_function_list(&funcs) != CKR_OK ||
+			funcs->C_OpenSession(slot_id, CKF_SERIAL_SESSION,
+				NULL, NULL, &session) != CKR_OK) {
+		dlclose(handle);
+		return -1;
+	}
+	rv = funcs->C_Logout(session);
+	funcs->C_CloseSession(session);
+	dlclose(handle);
+	return rv == CKR_OK ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys;
+	pthread_t threads[THREADS];
+	unsigned int nslots, nkeys, i, n;
+	int rc, logged_in, ret = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	PKCS11_set_op_hooks(ctx, NULL, post_hook, NULL);
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+	rc = PKCS11_login(slot, 0, argv[2]);
+	error_queue("PKCS11_login");
+	if (rc)
+		goto notoken;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc || nkeys == 0)
+		goto notoken;
+	key = &keys[0];
+	memset(&mech, 0, sizeof(mech));
+	mech.mechanism = PKCS11_get_key_type(key) == EVP_PKEY_EC ?
+		CKM_ECDSA : CKM_RSA_PKCS;
+	if (sign()) {
+		error_queue("PKCS11_sign_mech");
+		goto notoken;
+	}
+	logins = 0;
+
+	/* A single signature logs in again */
+	if (drop_login(argv[1], PKCS11_get_slotid_from_slot(slot))) {
+		fprintf(stderr, "Could not log out of the token\n");
+		goto notoken;
+	}
+	if (sign() || logins != 1) {
+		error_queue("PKCS11_sign_mech");
+		fprintf(stderr, "The signature did not log in again (%u logins)\n",
+			logins);
+		goto notoken;
+	}
+	printf("The signature logged in again\n");
+
+	/* Concurrent signatures log in again once */
+	if (drop_login(argv[1], PKCS11_get_slotid_from_slot(slot)))
+		goto notoken;
+	for (n = 0; n < THREADS; n++)
+		if (pthread_create(&threads[n], NULL, worker, NULL))
+			break;
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	if (n < THREADS || failures || logins != 2) {
+		fprintf(stderr, "%u signatures failed, %u logins\n",
+			failures, logins - 1);
+		goto notoken;
+	}
+	if (PKCS11_is_logged_in(slot, 0, &logged_in) || !logged_in) {
+		fprintf(stderr, "The login state was lost\n");
+		goto notoken;
+	}
+	printf("Concurrent signatures logged in again once\n");
+	ret = 0;
+
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,204 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Fills the session pool with two sessions and checks that consecutive
+ * signatures with the same key keep using the same session, and that
+ * the idle session is passed over at most the configured number of times. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <libp11.h>
+
+#include "../src/pkcs11.h"
+
+#define WARMUP_ROUNDS 20
+#define WARMUP_SIGNS 50
+#define ROUNDS 9
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long sessions[2];
+static unsigned int nsessions;
+static unsigned long last_session;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static void post_hook(PKCS11_OP_INFO *info, void *user_data)
+{
+	(void)user_data;
+	if (info->operation != PKCS11_OP_SIGN)
+		return;
+	pthread_mutex_lock(&lock);
+	if (nsessions < 2 && (nsessions == 0 || sessions[0] != info->session))
+		sessions[nsessions++] = info->session;
+	last_session = info->session;
+	pthread_mutex_unlock(&lock);
+}
+
+static int sign(PKCS11_KEY *key)
+{
+	PKCS11_MECHANISM mech;
+	unsigned char tbs[32], sig[1024];
+	size_t siglen = sizeof(sig);
+
+	memset(&mech, 0, sizeof(mech));
+	mech.mechanism = CKM_RSA_PKCS;
+	memset(tbs, 0x5a, sizeof(tbs));
+	if (PKCS11_sign_mech(key, &mech, tbs, sizeof(tbs), sig, &siglen)) {
+		error_queue("PKCS11_sign_mech");
+		return -1;
+	}
+	return 0;
+}
+
+static void *worker(void *arg)
+{
+	int i;
+
+	for (i = 0; i < WARMUP_SIGNS; i++)
+		if (sign(arg))
+			break;
+	return NULL;
+}
+
+/* Returns the number of signatures made on the first session used */
+static int first_run(PKCS11_SLOT *slot, PKCS11_KEY *key)
+{
+	unsigned char r[8];
+	unsigned long first = 0;
+	int i, n = 0;
+
+	/* Make the sessions forget the key */
+	if (PKCS11_generate_random(slot, r, sizeof(r)) ||
+			PKCS11_generate_random(slot, r, sizeof(r)))
+		return -1;
+	for (i = 0; i < ROUNDS; i++) {
+		if (sign(key))
+			return -1;
+		if (i == 0)
+			first = last_session;
+		else if (last_session != first)
+			break;
+		n++;
+	}
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys, *key = NULL;
+	pthread_t threads[2];
+	unsigned int nslots, nkeys, i;
+	int rc, n, ret = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+
+	rc = PKCS11_login(slot, 0, argv[2]);
+	error_queue("PKCS11_login");
+	if (rc)
+		goto notoken;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc)
+		goto notoken;
+	for (i = 0; i < nkeys; i++)
+		if (PKCS11_get_key_type(&keys[i]) == EVP_PKEY_RSA)
+			key = &keys[i];
+	if (!key) {
+		fprintf(stderr, "No RSA private key found\n");
+		goto notoken;
+	}
+	PKCS11_set_op_hooks(ctx, NULL, post_hook, NULL);
+
+	/* Concurrent signatures make the pool open a second session */
+	for (i = 0; i < WARMUP_ROUNDS && nsessions < 2; i++) {
+		if (pthread_create(&threads[0], NULL, worker, key))
+			goto notoken;
+		if (pthread_create(&threads[1], NULL, worker, key)) {
+			pthread_join(threads[0], NULL);
+			goto notoken;
+		}
+		pthread_join(threads[0], NULL);
+		pthread_join(threads[1], NULL);
+	}
+	if (nsessions < 2) {
+		printf("Could not open two sessions, skipping\n");
+		ret = 77;
+		goto notoken;
+	}
+
+	/* Without affinity the sessions are used in turn */
+	n = first_run(slot, key);
+	if (n != 1) {
+		fprintf(stderr, "Expected 1 signature per session, got %d\n", n);
+		goto notoken;
+	}
+
+	/* With affinity the same session is reused */
+	PKCS11_set_session_affinity(ctx, 100);
+	n = first_run(slot, key);
+	if (n != ROUNDS) {
+		fprintf(stderr, "Expected %d signatures on one session, got %d\n",
+			ROUNDS, n);
+		goto notoken;
+	}
+
+	/* The idle session is passed over at most twice */
+	PKCS11_set_session_affinity(ctx, 2);
+	n = first_run(slot, key);
+	if (n != 3) {
+		fprintf(stderr, "Expected 3 signatures on one session, got %d\n", n);
+		goto notoken;
+	}
+
+	printf("Session affinity works as expected\n");
+	ret = 0;
+
+notoken:
+	PKCS11_set_op_hooks(ctx, NULL, NULL, NULL);
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
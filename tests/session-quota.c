@@ -0,0 +1,187 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that forked processes sharing a session quota never open more
+ * sessions than the budget together, that they all make progress, and that
+ * the sessions of the processes that exited are returned to the budget. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <libp11.h>
+
+#include "../src/pkcs11.h"
+
+#define PROCESSES 2
+#define THREADS 4
+#define SIGNATURES 50
+
+static PKCS11_SLOT *slot;
+static PKCS11_KEY *key;
+static PKCS11_MECHANISM mech;
+static unsigned int budget;
+static int failed;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static void *worker(void *arg)
+{
+	PKCS11_SESSION_QUOTA status;
+	unsigned char tbs[32], sig[1024];
+	size_t siglen;
+	unsigned int i;
+
+	(void)arg;
+	memset(tbs, 0x5a, sizeof(tbs));
+	for (i = 0; i < SIGNATURES && !failed; i++) {
+		siglen = sizeof(sig);
+		if (PKCS11_sign_mech(key, &mech, tbs, sizeof(tbs), sig, &siglen)) {
+			error_queue("PKCS11_sign_mech");
+			failed = 1;
+			break;
+		}
+		if (PKCS11_get_session_quota(slot, &status) ||
+				status.in_use > budget) {
+			fprintf(stderr, "%u sessions opened for a budget of %u\n",
+				status.in_use, budget);
+			failed = 1;
+		}
+	}
+	return NULL;
+}
+
+static int child(void)
+{
+	pthread_t threads[THREADS];
+	unsigned int i, n;
+
+	for (n = 0; n < THREADS; n++)
+		if (pthread_create(&threads[n], NULL, worker, NULL))
+			break;
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	return n < THREADS || failed;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots;
+	PKCS11_KEY *keys;
+	PKCS11_SESSION_QUOTA status;
+	char name[64];
+	pid_t pids[PROCESSES];
+	unsigned int nslots, nkeys, n, i;
+	int rc, ret = 1, wstatus;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN [BUDGET]\n",
+			argv[0]);
+		return 1;
+	}
+	budget = argc > 3 ? (unsigned int)atoi(argv[3]) : 3;
+	if (budget < 2) {
+		fprintf(stderr, "The budget should allow the parent and a child\n");
+		return 1;
+	}
+	snprintf(name, sizeof(name), "/libp11-test-%ld", (long)getpid());
+
+	ctx = PKCS11_CTX_new();
+	rc = PKCS11_set_session_quota(ctx, name, budget);
+	error_queue("PKCS11_set_session_quota");
+	if (rc)
+		goto nolib;
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+	rc = PKCS11_login(slot, 0, argv[2]);
+	error_queue("PKCS11_login");
+	if (rc)
+		goto notoken;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc || nkeys == 0)
+		goto notoken;
+	key = &keys[0];
+	memset(&mech, 0, sizeof(mech));
+	mech.mechanism = PKCS11_get_key_type(key) == EVP_PKEY_EC ?
+		CKM_ECDSA : CKM_RSA_PKCS;
+
+	if (PKCS11_get_session_quota(slot, &status) || status.budget != budget ||
+			status.own == 0 || status.in_use != status.own) {
+		fprintf(stderr, "Unexpected quota of the parent process\n");
+		goto notoken;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	for (n = 0; n < PROCESSES; n++) {
+		pids[n] = fork();
+		if (pids[n] < 0)
+			break;
+		if (pids[n] == 0)
+			exit(child());
+	}
+	ret = n < PROCESSES;
+	for (i = 0; i < n; i++) {
+		if (waitpid(pids[i], &wstatus, 0) != pids[i] ||
+				!WIFEXITED(wstatus) || WEXITSTATUS(wstatus)) {
+			fprintf(stderr, "Child %u failed\n", i);
+			ret = 1;
+		}
+	}
+	if (ret)
+		goto notoken;
+
+	/* The children did not unload the module */
+	ret = 1;
+	if (PKCS11_get_session_quota(slot, &status) ||
+			status.processes != 1 || status.in_use != status.own) {
+		fprintf(stderr, "The sessions of the children were not reclaimed\n");
+		goto notoken;
+	}
+	printf("%u processes shared %u sessions\n", PROCESSES + 1, budget);
+	ret = 0;
+
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	shm_unlink(name);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
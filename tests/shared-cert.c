@@ -0,0 +1,109 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that identical certificates found on different tokens share
+ * a single parsed X509 object and a single DER encoding. */
+
+#include <stdio.h>
+#include <string.h>
+#include <libp11.h>
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_CERT *certs;
+	X509 *first = NULL;
+	const unsigned char *first_der = NULL, *der;
+	unsigned char *encoded = NULL;
+	size_t der_len;
+	unsigned int nslots, ncerts, i;
+	int rc, tokens = 0, ret = 1;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+
+	for (i = 0; i < nslots; i++) {
+		slot = &slots[i];
+		if (!slot->token || !slot->token->initialized)
+			continue;
+		rc = PKCS11_enumerate_certs(slot->token, &certs, &ncerts);
+		error_queue("PKCS11_enumerate_certs");
+		if (rc || ncerts == 0 || !certs[0].x509)
+			continue;
+		if (PKCS11_get_cert_der(&certs[0], &der, &der_len)) {
+			fprintf(stderr, "No DER encoding on token %s\n",
+				slot->token->label);
+			goto notoken;
+		}
+		rc = i2d_X509(certs[0].x509, &encoded);
+		if (rc < 0 || (size_t)rc != der_len || memcmp(encoded, der, der_len)) {
+			fprintf(stderr, "Wrong DER encoding on token %s\n",
+				slot->token->label);
+			goto notoken;
+		}
+		OPENSSL_free(encoded);
+		encoded = NULL;
+		if (!first) {
+			first = certs[0].x509;
+			first_der = der;
+		} else if (X509_cmp(first, certs[0].x509) == 0 &&
+				(first != certs[0].x509 || first_der != der)) {
+			fprintf(stderr, "Certificate on token %s was not shared\n",
+				slot->token->label);
+			goto notoken;
+		}
+		tokens++;
+	}
+	if (tokens < 2) {
+		fprintf(stderr, "Expected certificates on at least 2 tokens\n");
+		goto notoken;
+	}
+
+	printf("Identical certificates on %d tokens are shared\n", tokens);
+	ret = 0;
+
+notoken:
+	OPENSSL_free(encoded);
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,165 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Signs a list of messages with PKCS11_sign_bulk() using PKCS#1 v1.5 and
+ * PSS padding, and verifies each signature against its message with the
+ * public key. */
+
+#include <stdio.h>
+#include <string.h>
+#include <libp11.h>
+#include <openssl/rsa.h>
+
+#include "../src/pkcs11.h"
+
+#define MESSAGES 64
+#define THREADS 4
+
+static unsigned char data[MESSAGES][64];
+static const unsigned char *msgs[MESSAGES];
+static size_t msg_lens[MESSAGES];
+static unsigned char sig_bufs[MESSAGES][1024];
+static unsigned char *sigs[MESSAGES];
+static size_t sig_lens[MESSAGES];
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static int verify(EVP_PKEY *pubkey, int pss, unsigned int i)
+{
+	EVP_MD_CTX *mctx;
+	EVP_PKEY_CTX *pctx;
+	int ok;
+
+	mctx = EVP_MD_CTX_create();
+	ok = mctx &&
+		EVP_DigestVerifyInit(mctx, &pctx, EVP_sha256(), NULL, pubkey) > 0 &&
+		(!pss || (EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PSS_PADDING) > 0 &&
+			EVP_PKEY_CTX_set_rsa_pss_saltlen(pctx, 32) > 0)) &&
+		EVP_DigestVerifyUpdate(mctx, msgs[i], msg_lens[i]) > 0 &&
+		EVP_DigestVerifyFinal(mctx, sigs[i], sig_lens[i]) > 0;
+	EVP_MD_CTX_destroy(mctx);
+	return ok ? 0 : -1;
+}
+
+static int sign_and_verify(PKCS11_KEY *key, EVP_PKEY *pubkey,
+		const PKCS11_MECHANISM *mech, int pss)
+{
+	unsigned int i;
+
+	for (i = 0; i < MESSAGES; i++) {
+		sigs[i] = sig_bufs[i];
+		sig_lens[i] = sizeof(sig_bufs[i]);
+	}
+	if (PKCS11_sign_bulk(key, mech, EVP_sha256(), MESSAGES,
+			msgs, msg_lens, sigs, sig_lens, THREADS)) {
+		error_queue("PKCS11_sign_bulk");
+		return -1;
+	}
+	for (i = 0; i < MESSAGES; i++) {
+		if (verify(pubkey, pss, i)) {
+			error_queue("EVP_DigestVerify");
+			fprintf(stderr, "Signature %u does not match its message\n", i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys, *key = NULL;
+	PKCS11_MECHANISM mech;
+	EVP_PKEY *pubkey = NULL;
+	unsigned int nslots, nkeys, i;
+	int rc, ret = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n", argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < MESSAGES; i++) {
+		memset(data[i], (int)i, sizeof(data[i]));
+		msgs[i] = data[i];
+		msg_lens[i] = 1 + i % sizeof(data[i]);
+	}
+
+	ctx = PKCS11_CTX_new();
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+
+	rc = PKCS11_login(slot, 0, argv[2]);
+	error_queue("PKCS11_login");
+	if (rc)
+		goto notoken;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc)
+		goto notoken;
+	for (i = 0; i < nkeys; i++)
+		if (PKCS11_get_key_type(&keys[i]) == EVP_PKEY_RSA)
+			key = &keys[i];
+	if (!key) {
+		fprintf(stderr, "No RSA private key found\n");
+		goto notoken;
+	}
+	pubkey = PKCS11_get_public_key(key);
+	if (!pubkey) {
+		error_queue("PKCS11_get_public_key");
+		goto notoken;
+	}
+
+	memset(&mech, 0, sizeof(mech));
+	mech.mechanism = CKM_RSA_PKCS;
+	if (sign_and_verify(key, pubkey, &mech, 0))
+		goto notoken;
+
+	mech.mechanism = CKM_RSA_PKCS_PSS;
+	mech.salt_len = 32;
+	if (sign_and_verify(key, pubkey, &mech, 1))
+		goto notoken;
+
+	printf("%d messages were signed and verified\n", 2 * MESSAGES);
+	ret = 0;
+
+notoken:
+	EVP_PKEY_free(pubkey);
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
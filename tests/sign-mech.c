@@ -0,0 +1,202 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Signs with PKCS#1 v1.5 and PSS, and decrypts with OAEP, using explicit
+ * mechanisms, and checks the results with the public key. */
+
+#include <stdio.h>
+#include <string.h>
+#include <libp11.h>
+
+#include "../src/pkcs11.h"
+
+static const unsigned char sha256_prefix[] = {
+	0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01,
+	0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20
+};
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static int verify(EVP_PKEY *pubkey, int padding,
+		const unsigned char *sig, size_t siglen,
+		const unsigned char *md, size_t mdlen)
+{
+	EVP_PKEY_CTX *pctx;
+	int ok;
+
+	pctx = EVP_PKEY_CTX_new(pubkey, NULL);
+	ok = pctx && EVP_PKEY_verify_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_rsa_padding(pctx, padding) > 0 &&
+		EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha256()) > 0 &&
+		(padding != RSA_PKCS1_PSS_PADDING ||
+			EVP_PKEY_CTX_set_rsa_pss_saltlen(pctx, 32) > 0) &&
+		EVP_PKEY_verify(pctx, sig, siglen, md, mdlen) == 1;
+	EVP_PKEY_CTX_free(pctx);
+	return ok;
+}
+
+static int encrypt(EVP_PKEY *pubkey, const unsigned char *in, size_t inlen,
+		unsigned char *out, size_t *outlen)
+{
+	EVP_PKEY_CTX *pctx;
+	int ok;
+
+	pctx = EVP_PKEY_CTX_new(pubkey, NULL);
+	ok = pctx && EVP_PKEY_encrypt_init(pctx) > 0 &&
+		EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_OAEP_PADDING) > 0 &&
+		EVP_PKEY_CTX_set_rsa_oaep_md(pctx, EVP_sha256()) > 0 &&
+		EVP_PKEY_CTX_set_rsa_mgf1_md(pctx, EVP_sha256()) > 0 &&
+		EVP_PKEY_encrypt(pctx, out, outlen, in, inlen) > 0;
+	EVP_PKEY_CTX_free(pctx);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys, *key = NULL;
+	PKCS11_MECHANISM mech;
+	EVP_PKEY *pubkey = NULL;
+	unsigned char data[] = "libp11 explicit mechanisms";
+	unsigned char md[32], tbs[sizeof(sha256_prefix) + 32];
+	unsigned char sig[1024], enc[1024], dec[64];
+	size_t siglen, enclen, declen;
+	unsigned int nslots, nkeys, i;
+	int rc, ret = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+
+	rc = PKCS11_login(slot, 0, argv[2]);
+	error_queue("PKCS11_login");
+	if (rc)
+		goto notoken;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc)
+		goto notoken;
+	for (i = 0; i < nkeys; i++)
+		if (PKCS11_get_key_type(&keys[i]) == EVP_PKEY_RSA)
+			key = &keys[i];
+	if (!key) {
+		fprintf(stderr, "No RSA private key found\n");
+		goto notoken;
+	}
+	pubkey = PKCS11_get_public_key(key);
+	if (!pubkey)
+		goto notoken;
+
+	EVP_Digest(data, sizeof(data), md, NULL, EVP_sha256(), NULL);
+	memcpy(tbs, sha256_prefix, sizeof(sha256_prefix));
+	memcpy(tbs + sizeof(sha256_prefix), md, sizeof(md));
+
+	/* PKCS#1 v1.5 over a DigestInfo, with a size query first */
+	memset(&mech, 0, sizeof(mech));
+	mech.mechanism = CKM_RSA_PKCS;
+	if (PKCS11_sign_mech(key, &mech, tbs, sizeof(tbs), NULL, &siglen) ||
+			siglen != (size_t)EVP_PKEY_size(pubkey)) {
+		error_queue("PKCS11_sign_mech");
+		fprintf(stderr, "Wrong signature size\n");
+		goto notoken;
+	}
+	/* The size query does not need the input */
+	siglen = 0;
+	if (PKCS11_sign_mech(key, &mech, NULL, 0, NULL, &siglen) ||
+			siglen != (size_t)EVP_PKEY_size(pubkey)) {
+		error_queue("PKCS11_sign_mech");
+		fprintf(stderr, "Size query without input failed\n");
+		goto notoken;
+	}
+	siglen = sizeof(sig);
+	if (PKCS11_sign_mech(key, &mech, tbs, sizeof(tbs), sig, &siglen) ||
+			!verify(pubkey, RSA_PKCS1_PADDING, sig, siglen, md, sizeof(md))) {
+		error_queue("PKCS11_sign_mech");
+		fprintf(stderr, "PKCS#1 v1.5 signature failed\n");
+		goto notoken;
+	}
+
+	/* A short buffer is rejected and the required size reported */
+	siglen = 16;
+	if (PKCS11_sign_mech(key, &mech, tbs, sizeof(tbs), sig, &siglen) == 0 ||
+			siglen != (size_t)EVP_PKEY_size(pubkey)) {
+		fprintf(stderr, "Short signature buffer was not reported\n");
+		goto notoken;
+	}
+	ERR_clear_error();
+
+	/* PSS over the digest */
+	mech.mechanism = CKM_RSA_PKCS_PSS;
+	mech.hash = CKM_SHA256;
+	mech.salt_len = 32;
+	siglen = sizeof(sig);
+	if (PKCS11_sign_mech(key, &mech, md, sizeof(md), sig, &siglen) ||
+			!verify(pubkey, RSA_PKCS1_PSS_PADDING, sig, siglen, md, sizeof(md))) {
+		error_queue("PKCS11_sign_mech");
+		fprintf(stderr, "PSS signature failed\n");
+		goto notoken;
+	}
+
+	/* OAEP into a buffer shorter than the modulus */
+	enclen = sizeof(enc);
+	if (!encrypt(pubkey, data, sizeof(data), enc, &enclen))
+		goto notoken;
+	memset(&mech, 0, sizeof(mech));
+	mech.mechanism = CKM_RSA_PKCS_OAEP;
+	mech.hash = CKM_SHA256;
+	declen = sizeof(dec);
+	if (PKCS11_decrypt_mech(key, &mech, enc, enclen, dec, &declen) ||
+			declen != sizeof(data) || memcmp(dec, data, declen)) {
+		error_queue("PKCS11_decrypt_mech");
+		fprintf(stderr, "OAEP decryption failed\n");
+		goto notoken;
+	}
+
+	printf("Explicit mechanisms work as expected\n");
+	ret = 0;
+
+notoken:
+	EVP_PKEY_free(pubkey);
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,215 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that repeated RSA PKCS#1 v1.5 signatures of the same data are
+ * returned from the signature cache, through both PKCS11_sign_mech() and
+ * EVP_PKEY_sign(), that identical concurrent requests are coalesced, and
+ * that the cache stays within its capacity. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <libp11.h>
+
+#include "../src/pkcs11.h"
+
+#define CAPACITY 4
+#define THREADS 8
+
+static PKCS11_KEY *key;
+static PKCS11_MECHANISM mech;
+static unsigned char expected[1024];
+static size_t expected_len;
+static int failed;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static int sign(unsigned char tag, unsigned char *sig, size_t *siglen)
+{
+	unsigned char tbs[32];
+
+	memset(tbs, tag, sizeof(tbs));
+	*siglen = 1024;
+	return PKCS11_sign_mech(key, &mech, tbs, sizeof(tbs), sig, siglen);
+}
+
+static void *worker(void *arg)
+{
+	unsigned char sig[1024];
+	size_t siglen;
+
+	(void)arg;
+	if (sign(0x33, sig, &siglen) || siglen != expected_len ||
+			memcmp(sig, expected, siglen))
+		failed = 1;
+	return NULL;
+}
+
+static int check_stats(const char *name, unsigned int entries,
+		unsigned long hits, unsigned long misses)
+{
+	PKCS11_SIGNATURE_CACHE stats;
+
+	if (PKCS11_get_signature_cache(key, &stats)) {
+		fprintf(stderr, "%s: no signature cache\n", name);
+		return -1;
+	}
+	printf("%s: capacity %u, entries %u, hits %lu, misses %lu, coalesced %lu\n",
+		name, stats.capacity, stats.entries, stats.hits, stats.misses,
+		stats.coalesced);
+	if (stats.entries != entries || stats.hits + stats.coalesced != hits ||
+			stats.misses != misses) {
+		fprintf(stderr, "%s: expected %u entries, %lu hits, %lu misses\n",
+			name, entries, hits, misses);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys;
+	EVP_PKEY *pkey = NULL;
+	EVP_PKEY_CTX *pctx = NULL;
+	pthread_t threads[THREADS];
+	unsigned char sig[1024], tbs[32];
+	size_t siglen, evp_len;
+	unsigned int nslots, nkeys, i, n;
+	int rc, ret = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+	rc = PKCS11_login(slot, 0, argv[2]);
+	error_queue("PKCS11_login");
+	if (rc)
+		goto notoken;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc || nkeys == 0)
+		goto notoken;
+	for (i = 0; i < nkeys && PKCS11_get_key_type(&keys[i]) != EVP_PKEY_RSA; i++)
+		;
+	if (i == nkeys) {
+		fprintf(stderr, "No RSA key found\n");
+		goto notoken;
+	}
+	key = &keys[i];
+	memset(&mech, 0, sizeof(mech));
+	mech.mechanism = CKM_RSA_PKCS;
+
+	if (PKCS11_set_signature_cache(key, CAPACITY)) {
+		error_queue("PKCS11_set_signature_cache");
+		goto notoken;
+	}
+
+	/* Repeated signatures of the same data */
+	if (sign(0x11, expected, &expected_len)) {
+		error_queue("PKCS11_sign_mech");
+		goto notoken;
+	}
+	for (i = 0; i < 3; i++) {
+		if (sign(0x11, sig, &siglen) || siglen != expected_len ||
+				memcmp(sig, expected, siglen)) {
+			fprintf(stderr, "The cached signature differs\n");
+			goto notoken;
+		}
+	}
+	if (check_stats("repeated", 1, 3, 1))
+		goto notoken;
+
+	/* The RSA method shares the cache */
+	pkey = PKCS11_get_private_key(key);
+	pctx = pkey ? EVP_PKEY_CTX_new(pkey, NULL) : NULL;
+	memset(tbs, 0x11, sizeof(tbs));
+	evp_len = sizeof(sig);
+	if (!pctx || EVP_PKEY_sign_init(pctx) <= 0 ||
+			EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_PADDING) <= 0 ||
+			EVP_PKEY_sign(pctx, sig, &evp_len, tbs, sizeof(tbs)) <= 0 ||
+			evp_len != expected_len || memcmp(sig, expected, evp_len)) {
+		error_queue("EVP_PKEY_sign");
+		fprintf(stderr, "EVP_PKEY_sign did not return the cached signature\n");
+		goto notoken;
+	}
+	if (check_stats("EVP_PKEY_sign", 1, 4, 1))
+		goto notoken;
+
+	/* Identical concurrent requests reach the token once */
+	if (sign(0x33, expected, &expected_len) ||
+			PKCS11_set_signature_cache(key, 0) ||
+			PKCS11_set_signature_cache(key, CAPACITY))
+		goto notoken;
+	if (check_stats("flushed", 0, 4, 2))
+		goto notoken;
+	for (n = 0; n < THREADS; n++)
+		if (pthread_create(&threads[n], NULL, worker, NULL))
+			break;
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	if (n < THREADS || failed) {
+		fprintf(stderr, "Concurrent signatures failed\n");
+		goto notoken;
+	}
+	if (check_stats("concurrent", 1, 4 + THREADS - 1, 3))
+		goto notoken;
+
+	/* The least recently used signatures are evicted */
+	for (i = 0; i < 2 * CAPACITY; i++) {
+		if (sign((unsigned char)(0x40 + i), sig, &siglen)) {
+			error_queue("PKCS11_sign_mech");
+			goto notoken;
+		}
+	}
+	if (check_stats("evicted", CAPACITY, 4 + THREADS - 1, 3 + 2 * CAPACITY))
+		goto notoken;
+
+	printf("Signatures are cached as expected\n");
+	ret = 0;
+
+notoken:
+	EVP_PKEY_CTX_free(pctx);
+	EVP_PKEY_free(pkey);
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
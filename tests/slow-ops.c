@@ -0,0 +1,131 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that operations exceeding the latency threshold are recorded
+ * together with the key and the state of the session pool. */
+
+#include <stdio.h>
+#include <string.h>
+#include <libp11.h>
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys;
+	PKCS11_SLOW_OP ops[4];
+	EVP_PKEY *pkey = NULL;
+	EVP_MD_CTX *mctx = NULL;
+	unsigned char data[] = "libp11 slow operations";
+	unsigned char sig[1024];
+	size_t siglen = sizeof(sig);
+	unsigned int nslots, nkeys, count;
+	int rc, ret = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN\n", argv[0]);
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	/* Any signature takes at least a microsecond */
+	if (PKCS11_set_slow_op_threshold(ctx, PKCS11_OP_SIGN, 1)) {
+		fprintf(stderr, "PKCS11_set_slow_op_threshold failed\n");
+		goto nolib;
+	}
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+
+	rc = PKCS11_login(slot, 0, argv[2]);
+	error_queue("PKCS11_login");
+	if (rc)
+		goto notoken;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc || nkeys == 0)
+		goto notoken;
+
+	pkey = PKCS11_get_private_key(&keys[0]);
+	mctx = EVP_MD_CTX_create();
+	if (!pkey || !mctx ||
+			EVP_DigestSignInit(mctx, NULL, EVP_sha256(), NULL, pkey) <= 0 ||
+			EVP_DigestSign(mctx, sig, &siglen, data, sizeof(data)) <= 0) {
+		error_queue("EVP_DigestSign");
+		goto notoken;
+	}
+
+	/* Only the signature exceeds a threshold */
+	if (PKCS11_get_slow_ops(ctx, NULL, &count) || count != 1) {
+		fprintf(stderr, "Expected 1 slow operation\n");
+		goto notoken;
+	}
+	count = sizeof(ops) / sizeof(ops[0]);
+	if (PKCS11_get_slow_ops(ctx, ops, &count) || count != 1) {
+		fprintf(stderr, "Failed to fetch the slow operation\n");
+		goto notoken;
+	}
+	printf("operation %d: %lu us (%lu us waiting for a session), "
+		"sessions %u/%u, %u waiting, rv %lu, key \"%s\"\n",
+		ops[0].operation, ops[0].elapsed, ops[0].session_wait,
+		ops[0].sessions_in_use, ops[0].sessions_max,
+		ops[0].sessions_waiting, ops[0].rv, ops[0].key_label);
+	if (ops[0].operation != PKCS11_OP_SIGN || ops[0].rv != 0 ||
+			ops[0].elapsed < ops[0].session_wait ||
+			ops[0].sessions_in_use < 1 ||
+			ops[0].key_id_len != keys[0].id_len ||
+			memcmp(ops[0].key_id, keys[0].id, keys[0].id_len)) {
+		fprintf(stderr, "Unexpected slow operation\n");
+		goto notoken;
+	}
+
+	/* The log is drained */
+	if (PKCS11_get_slow_ops(ctx, NULL, &count) || count != 0) {
+		fprintf(stderr, "The slow operation log was not drained\n");
+		goto notoken;
+	}
+
+	printf("Slow operations are recorded as expected\n");
+	ret = 0;
+
+notoken:
+	EVP_MD_CTX_destroy(mctx);
+	EVP_PKEY_free(pkey);
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,276 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Measures the latency from a cold start to the first signature.
+ *
+ * The "engine" mode times ENGINE_by_id(), ENGINE_init(),
+ * ENGINE_load_private_key() and the first signature, and attributes the
+ * login and object searches made while loading the key using the slow
+ * operation log of the engine.  The "libp11" mode times the same path
+ * through the libp11 API, which separates loading the module and
+ * C_Initialize(), slot enumeration, login, key enumeration, fetching the
+ * public key and the first C_Sign().  Each mode should be run in a fresh
+ * process. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* this code extensively uses deprecated features, so warnings are useless */
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <libp11.h>
+#include <openssl/engine.h>
+
+#define MAX_SLOW_OPS 64
+
+static const char *phase_name;
+static unsigned long long phase_start;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static unsigned long long time_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void phase_begin(const char *name)
+{
+	phase_name = name;
+	phase_start = time_usec();
+}
+
+static unsigned long long phase_end(void)
+{
+	unsigned long long elapsed = time_usec() - phase_start;
+
+	printf("%-28s %10llu us\n", phase_name, elapsed);
+	return elapsed;
+}
+
+static int sign(EVP_PKEY *pkey)
+{
+	EVP_MD_CTX *mctx;
+	unsigned char data[] = "libp11 startup benchmark";
+	unsigned char sig[1024];
+	size_t siglen = sizeof(sig);
+	int ok;
+
+	mctx = EVP_MD_CTX_create();
+	ok = mctx &&
+		EVP_DigestSignInit(mctx, NULL, EVP_sha256(), NULL, pkey) > 0 &&
+		EVP_DigestSignUpdate(mctx, data, sizeof(data)) > 0 &&
+		EVP_DigestSignFinal(mctx, sig, &siglen) > 0;
+	EVP_MD_CTX_destroy(mctx);
+	return ok ? 0 : -1;
+}
+
+/* Print the time spent in the logged operations of each kind */
+static void print_slow_ops(ENGINE *e)
+{
+	static const char *names[] = {
+		NULL, "sign", "decrypt", "derive", "random", "find", "login"
+	};
+	struct {
+		PKCS11_SLOW_OP *ops;
+		unsigned int count;
+	} parms;
+	PKCS11_SLOW_OP ops[MAX_SLOW_OPS];
+	unsigned long long total;
+	unsigned int i, n;
+	int op;
+
+	parms.ops = ops;
+	parms.count = MAX_SLOW_OPS;
+	if (!ENGINE_ctrl_cmd(e, "GET_SLOW_OPS", 0, &parms, NULL, 0)) {
+		error_queue("GET_SLOW_OPS");
+		return;
+	}
+	for (op = PKCS11_OP_SIGN; op <= PKCS11_OP_LOGIN; op++) {
+		total = 0;
+		n = 0;
+		for (i = 0; i < parms.count; i++) {
+			if (ops[i].operation != op)
+				continue;
+			total += ops[i].elapsed;
+			n++;
+		}
+		if (n)
+			printf("  %-8s x%-4u            %10llu us\n",
+				names[op], n, total);
+	}
+}
+
+static int bench_engine(const char *engine_path, const char *module,
+		const char *key_uri, const char *pin)
+{
+	ENGINE *e;
+	EVP_PKEY *pkey = NULL;
+	unsigned long long total = 0;
+	int ret = 1;
+
+	ENGINE_load_dynamic();
+	phase_begin("ENGINE_by_id");
+	e = ENGINE_by_id("dynamic");
+	if (!e ||
+			!ENGINE_ctrl_cmd_string(e, "SO_PATH", engine_path, 0) ||
+			!ENGINE_ctrl_cmd_string(e, "ID", "pkcs11", 0) ||
+			!ENGINE_ctrl_cmd_string(e, "LOAD", NULL, 0)) {
+		error_queue("ENGINE_by_id");
+		ENGINE_free(e);
+		return 1;
+	}
+	total += phase_end();
+
+	/* Every operation takes at least a microsecond */
+	if (!ENGINE_ctrl_cmd_string(e, "MODULE_PATH", module, 0) ||
+			!ENGINE_ctrl_cmd_string(e, "PIN", pin, 0) ||
+			!ENGINE_ctrl_cmd_string(e, "SLOW_OP_THRESHOLD", "1", 0)) {
+		error_queue("ENGINE_ctrl_cmd_string");
+		goto free;
+	}
+
+	phase_begin("ENGINE_init");
+	if (!ENGINE_init(e)) {
+		error_queue("ENGINE_init");
+		goto free;
+	}
+	total += phase_end();
+
+	phase_begin("ENGINE_load_private_key");
+	pkey = ENGINE_load_private_key(e, key_uri, NULL, NULL);
+	if (!pkey) {
+		error_queue("ENGINE_load_private_key");
+		goto finish;
+	}
+	total += phase_end();
+	print_slow_ops(e);
+
+	phase_begin("first signature");
+	if (sign(pkey)) {
+		error_queue("EVP_DigestSign");
+		goto finish;
+	}
+	total += phase_end();
+	print_slow_ops(e);
+
+	printf("%-28s %10llu us\n", "total", total);
+	ret = 0;
+
+finish:
+	EVP_PKEY_free(pkey);
+	ENGINE_finish(e);
+free:
+	ENGINE_free(e);
+	return ret;
+}
+
+static int bench_libp11(const char *module, const char *pin)
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys;
+	EVP_PKEY *pubkey = NULL, *pkey = NULL;
+	unsigned long long total = 0;
+	unsigned int nslots, nkeys;
+	int ret = 1;
+
+	ctx = PKCS11_CTX_new();
+	phase_begin("module load + C_Initialize");
+	if (PKCS11_CTX_load(ctx, module)) {
+		error_queue("PKCS11_CTX_load");
+		goto nolib;
+	}
+	total += phase_end();
+
+	phase_begin("slot enumeration");
+	if (PKCS11_enumerate_slots(ctx, &slots, &nslots) < 0) {
+		error_queue("PKCS11_enumerate_slots");
+		goto noslots;
+	}
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+	total += phase_end();
+
+	phase_begin("login");
+	if (PKCS11_login(slot, 0, pin)) {
+		error_queue("PKCS11_login");
+		goto notoken;
+	}
+	total += phase_end();
+
+	phase_begin("key enumeration");
+	if (PKCS11_enumerate_keys(slot->token, &keys, &nkeys) || nkeys == 0) {
+		error_queue("PKCS11_enumerate_keys");
+		goto notoken;
+	}
+	total += phase_end();
+	printf("  %u private keys\n", nkeys);
+
+	phase_begin("public key fetch");
+	pubkey = PKCS11_get_public_key(&keys[0]);
+	if (!pubkey) {
+		error_queue("PKCS11_get_public_key");
+		goto notoken;
+	}
+	total += phase_end();
+
+	phase_begin("first C_Sign");
+	pkey = PKCS11_get_private_key(&keys[0]);
+	if (!pkey || sign(pkey)) {
+		error_queue("EVP_DigestSign");
+		goto notoken;
+	}
+	total += phase_end();
+
+	printf("%-28s %10llu us\n", "total", total);
+	ret = 0;
+
+notoken:
+	EVP_PKEY_free(pkey);
+	EVP_PKEY_free(pubkey);
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 4 && !strcmp(argv[1], "libp11"))
+		return bench_libp11(argv[2], argv[3]);
+	if (argc == 6 && !strcmp(argv[1], "engine"))
+		return bench_engine(argv[2], argv[3], argv[4], argv[5]);
+
+	fprintf(stderr, "usage: %s libp11 /usr/lib/opensc-pkcs11.so PIN\n",
+		argv[0]);
+	fprintf(stderr, "       %s engine pkcs11.so /usr/lib/opensc-pkcs11.so KEY-URI PIN\n",
+		argv[0]);
+	return 1;
+}
+
+/* vim: set noexpandtab: */
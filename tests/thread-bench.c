@@ -0,0 +1,164 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Measures the signing throughput of a single key shared by an increasing
+ * number of threads.  With a module that signs quickly, the time per
+ * signature is dominated by the libp11 state shared between the threads,
+ * so that its growth with the number of threads shows the cost of cache
+ * lines moving between cores. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <libp11.h>
+
+#include "../src/pkcs11.h"
+
+#define MAX_THREADS 256
+
+static PKCS11_KEY *key;
+static PKCS11_MECHANISM mech;
+static unsigned int ops_per_thread;
+static int failed;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static unsigned long long time_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *worker(void *arg)
+{
+	unsigned char tbs[32], sig[1024];
+	size_t siglen;
+	unsigned int i;
+
+	(void)arg;
+	memset(tbs, 0x5a, sizeof(tbs));
+	for (i = 0; i < ops_per_thread; i++) {
+		siglen = sizeof(sig);
+		if (PKCS11_sign_mech(key, &mech, tbs, sizeof(tbs), sig, &siglen)) {
+			failed = 1;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Returns the elapsed time, or 0 on error */
+static unsigned long long run(unsigned int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	unsigned long long start;
+	unsigned int i, n;
+
+	start = time_usec();
+	for (n = 0; n < nthreads; n++)
+		if (pthread_create(&threads[n], NULL, worker, NULL))
+			break;
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	if (n < nthreads || failed)
+		return 0;
+	return time_usec() - start + 1;
+}
+
+int main(int argc, char *argv[])
+{
+	PKCS11_CTX *ctx;
+	PKCS11_SLOT *slots, *slot;
+	PKCS11_KEY *keys;
+	unsigned int nslots, nkeys, max_threads, nthreads;
+	unsigned long long elapsed, ops;
+	int rc, ret = 1;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s /usr/lib/opensc-pkcs11.so PIN [THREADS] [SIGNATURES]\n",
+			argv[0]);
+		return 1;
+	}
+	max_threads = argc > 3 ? (unsigned int)atoi(argv[3]) : 16;
+	ops_per_thread = argc > 4 ? (unsigned int)atoi(argv[4]) : 10000;
+	if (max_threads < 1 || max_threads > MAX_THREADS || ops_per_thread < 1) {
+		fprintf(stderr, "Invalid number of threads or signatures\n");
+		return 1;
+	}
+
+	ctx = PKCS11_CTX_new();
+	rc = PKCS11_CTX_load(ctx, argv[1]);
+	error_queue("PKCS11_CTX_load");
+	if (rc)
+		goto nolib;
+
+	rc = PKCS11_enumerate_slots(ctx, &slots, &nslots);
+	error_queue("PKCS11_enumerate_slots");
+	if (rc < 0)
+		goto noslots;
+	slot = PKCS11_find_token(ctx, slots, nslots);
+	if (!slot || !slot->token)
+		goto notoken;
+
+	rc = PKCS11_login(slot, 0, argv[2]);
+	error_queue("PKCS11_login");
+	if (rc)
+		goto notoken;
+	rc = PKCS11_enumerate_keys(slot->token, &keys, &nkeys);
+	error_queue("PKCS11_enumerate_keys");
+	if (rc || nkeys == 0)
+		goto notoken;
+	key = &keys[0];
+	memset(&mech, 0, sizeof(mech));
+	mech.mechanism = PKCS11_get_key_type(key) == EVP_PKEY_EC ?
+		CKM_ECDSA : CKM_RSA_PKCS;
+
+	printf("%8s %14s %12s\n", "threads", "signatures/s", "us/signature");
+	for (nthreads = 1; ; nthreads *= 2) {
+		if (nthreads > max_threads)
+			nthreads = max_threads;
+		elapsed = run(nthreads);
+		if (!elapsed) {
+			error_queue("PKCS11_sign_mech");
+			goto notoken;
+		}
+		ops = (unsigned long long)nthreads * ops_per_thread;
+		printf("%8u %14llu %12.3f\n", nthreads, ops * 1000000 / elapsed,
+			(double)elapsed * nthreads / ops);
+		if (nthreads == max_threads)
+			break;
+	}
+	ret = 0;
+
+notoken:
+	PKCS11_release_all_slots(ctx, slots, nslots);
+noslots:
+	PKCS11_CTX_unload(ctx);
+nolib:
+	PKCS11_CTX_free(ctx);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
@@ -0,0 +1,326 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Measures the throughput and latency of full TLS handshakes with the
+ * server key loaded through the engine.  The client and the server run in
+ * the same thread and exchange their records over a memory BIO pair, so
+ * that the results only depend on the handshake computations: the server
+ * signature made by the token, the key exchange and the session pool.
+ * Handshakes are run with an increasing number of threads for each
+ * protocol version and cipher suite. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* this code extensively uses deprecated features, so warnings are useless */
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <libp11.h>
+#include <openssl/engine.h>
+#include <openssl/ssl.h>
+
+#define MAX_THREADS 256
+
+typedef struct {
+	const char *name;
+	int version;
+	const char *ciphers; /* TLS 1.2 cipher list, or TLS 1.3 cipher suites */
+	int key_type;
+} SUITE;
+
+static const SUITE suites[] = {
+	{"TLSv1.2 ECDHE-RSA-AES128-GCM-SHA256", TLS1_2_VERSION,
+		"ECDHE-RSA-AES128-GCM-SHA256", EVP_PKEY_RSA},
+	{"TLSv1.2 ECDHE-ECDSA-AES128-GCM-SHA256", TLS1_2_VERSION,
+		"ECDHE-ECDSA-AES128-GCM-SHA256", EVP_PKEY_EC},
+#ifdef TLS1_3_VERSION
+	{"TLSv1.3 TLS_AES_128_GCM_SHA256", TLS1_3_VERSION,
+		"TLS_AES_128_GCM_SHA256", 0},
+	{"TLSv1.3 TLS_AES_256_GCM_SHA384", TLS1_3_VERSION,
+		"TLS_AES_256_GCM_SHA384", 0},
+#endif
+};
+
+typedef struct {
+	SSL_CTX *server, *client;
+	unsigned int handshakes;
+	unsigned long long *latencies;
+	int failed;
+} WORKER;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static unsigned long long time_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int compare_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Self-signed certificate for the server key, signed by the token */
+static X509 *make_cert(EVP_PKEY *pkey)
+{
+	X509 *cert;
+	X509_NAME *name;
+
+	cert = X509_new();
+	if (!cert)
+		return NULL;
+	name = X509_get_subject_name(cert);
+	if (!X509_set_version(cert, 2) ||
+			!ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) ||
+			!X509_gmtime_adj(X509_getm_notBefore(cert), 0) ||
+			!X509_gmtime_adj(X509_getm_notAfter(cert), 3600) ||
+			!X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+				(const unsigned char *)"tls-bench", -1, -1, 0) ||
+			!X509_set_issuer_name(cert, name) ||
+			!X509_set_pubkey(cert, pkey) ||
+			!X509_sign(cert, pkey, EVP_sha256())) {
+		X509_free(cert);
+		return NULL;
+	}
+	return cert;
+}
+
+static int set_suite(SSL_CTX *ctx, const SUITE *suite)
+{
+	if (!SSL_CTX_set_min_proto_version(ctx, suite->version) ||
+			!SSL_CTX_set_max_proto_version(ctx, suite->version))
+		return 0;
+#ifdef TLS1_3_VERSION
+	if (suite->version == TLS1_3_VERSION)
+		return SSL_CTX_set_ciphersuites(ctx, suite->ciphers);
+#endif
+	return SSL_CTX_set_cipher_list(ctx, suite->ciphers);
+}
+
+/* Run a full handshake over a memory BIO pair */
+static int handshake(SSL_CTX *server_ctx, SSL_CTX *client_ctx)
+{
+	SSL *server, *client;
+	BIO *server_bio, *client_bio;
+	int server_done = 0, client_done = 0, rounds, ret = -1;
+
+	server = SSL_new(server_ctx);
+	client = SSL_new(client_ctx);
+	if (!server || !client ||
+			!BIO_new_bio_pair(&server_bio, 0, &client_bio, 0))
+		goto end;
+	SSL_set_bio(server, server_bio, server_bio);
+	SSL_set_bio(client, client_bio, client_bio);
+	SSL_set_accept_state(server);
+	SSL_set_connect_state(client);
+
+	for (rounds = 0; rounds < 32 && !(server_done && client_done); rounds++) {
+		if (!client_done) {
+			if (SSL_do_handshake(client) == 1)
+				client_done = 1;
+			else if (SSL_get_error(client, -1) != SSL_ERROR_WANT_READ)
+				goto end;
+		}
+		if (!server_done) {
+			if (SSL_do_handshake(server) == 1)
+				server_done = 1;
+			else if (SSL_get_error(server, -1) != SSL_ERROR_WANT_READ)
+				goto end;
+		}
+	}
+	if (server_done && client_done)
+		ret = 0;
+end:
+	SSL_free(server);
+	SSL_free(client);
+	return ret;
+}
+
+static void *worker(void *arg)
+{
+	WORKER *w = arg;
+	unsigned long long start;
+	unsigned int i;
+
+	for (i = 0; i < w->handshakes; i++) {
+		start = time_usec();
+		if (handshake(w->server, w->client)) {
+			w->failed = 1;
+			break;
+		}
+		w->latencies[i] = time_usec() - start;
+	}
+	return NULL;
+}
+
+static int run(SSL_CTX *server, SSL_CTX *client, const SUITE *suite,
+		unsigned int nthreads, unsigned int handshakes)
+{
+	pthread_t threads[MAX_THREADS];
+	WORKER workers[MAX_THREADS];
+	unsigned long long *latencies, start, elapsed;
+	unsigned int i, n, total = nthreads * handshakes;
+	int ret = -1;
+
+	latencies = malloc(total * sizeof(unsigned long long));
+	if (!latencies)
+		return -1;
+	start = time_usec();
+	for (n = 0; n < nthreads; n++) {
+		workers[n].server = server;
+		workers[n].client = client;
+		workers[n].handshakes = handshakes;
+		workers[n].latencies = latencies + n * handshakes;
+		workers[n].failed = 0;
+		if (pthread_create(&threads[n], NULL, worker, &workers[n]))
+			break;
+	}
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = time_usec() - start + 1;
+	if (n < nthreads)
+		goto end;
+	for (i = 0; i < n; i++)
+		if (workers[i].failed)
+			goto end;
+
+	qsort(latencies, total, sizeof(unsigned long long), compare_ull);
+	printf("%-40s %7u %12llu %9llu %9llu %9llu\n", suite->name, nthreads,
+		(unsigned long long)total * 1000000 / elapsed,
+		latencies[total / 2], latencies[total * 9 / 10],
+		latencies[total * 99 / 100]);
+	ret = 0;
+end:
+	free(latencies);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	ENGINE *e;
+	EVP_PKEY *pkey = NULL;
+	X509 *cert = NULL;
+	SSL_CTX *server = NULL, *client = NULL;
+	unsigned int max_threads, handshakes, nthreads, i;
+	int key_type, ret = 1;
+
+	if (argc < 5) {
+		fprintf(stderr, "usage: %s pkcs11.so /usr/lib/opensc-pkcs11.so KEY-URI PIN [THREADS] [HANDSHAKES]\n",
+			argv[0]);
+		return 1;
+	}
+	max_threads = argc > 5 ? (unsigned int)atoi(argv[5]) : 8;
+	handshakes = argc > 6 ? (unsigned int)atoi(argv[6]) : 200;
+	if (max_threads < 1 || max_threads > MAX_THREADS || handshakes < 1) {
+		fprintf(stderr, "Invalid number of threads or handshakes\n");
+		return 1;
+	}
+
+	ENGINE_load_dynamic();
+	e = ENGINE_by_id("dynamic");
+	if (!e ||
+			!ENGINE_ctrl_cmd_string(e, "SO_PATH", argv[1], 0) ||
+			!ENGINE_ctrl_cmd_string(e, "ID", "pkcs11", 0) ||
+			!ENGINE_ctrl_cmd_string(e, "LOAD", NULL, 0)) {
+		error_queue("ENGINE_by_id");
+		ENGINE_free(e);
+		return 1;
+	}
+	if (!ENGINE_ctrl_cmd_string(e, "MODULE_PATH", argv[2], 0) ||
+			!ENGINE_ctrl_cmd_string(e, "PIN", argv[4], 0)) {
+		error_queue("ENGINE_ctrl_cmd_string");
+		goto free;
+	}
+	if (!ENGINE_init(e)) {
+		error_queue("ENGINE_init");
+		goto free;
+	}
+	pkey = ENGINE_load_private_key(e, argv[3], NULL, NULL);
+	if (!pkey) {
+		error_queue("ENGINE_load_private_key");
+		goto finish;
+	}
+	key_type = EVP_PKEY_base_id(pkey);
+	cert = make_cert(pkey);
+	if (!cert) {
+		error_queue("X509_sign");
+		goto finish;
+	}
+
+	printf("%-40s %7s %12s %9s %9s %9s\n", "suite", "threads",
+		"handshakes/s", "p50 us", "p90 us", "p99 us");
+	for (i = 0; i < sizeof(suites) / sizeof(suites[0]); i++) {
+		if (suites[i].key_type && suites[i].key_type != key_type)
+			continue;
+		server = SSL_CTX_new(TLS_server_method());
+		client = SSL_CTX_new(TLS_client_method());
+		if (!server || !client ||
+				!set_suite(server, &suites[i]) ||
+				!set_suite(client, &suites[i]) ||
+				!SSL_CTX_use_certificate(server, cert) ||
+				!SSL_CTX_use_PrivateKey(server, pkey)) {
+			error_queue("SSL_CTX_new");
+			goto finish;
+		}
+		/* Every handshake is a full handshake */
+		SSL_CTX_set_session_cache_mode(server, SSL_SESS_CACHE_OFF);
+		SSL_CTX_set_session_cache_mode(client, SSL_SESS_CACHE_OFF);
+		SSL_CTX_set_options(server, SSL_OP_NO_TICKET);
+		SSL_CTX_set_verify(client, SSL_VERIFY_NONE, NULL);
+
+		for (nthreads = 1; ; nthreads *= 2) {
+			if (nthreads > max_threads)
+				nthreads = max_threads;
+			if (run(server, client, &suites[i], nthreads, handshakes)) {
+				error_queue("SSL_do_handshake");
+				fprintf(stderr, "Handshakes failed with %s\n", suites[i].name);
+				goto finish;
+			}
+			if (nthreads == max_threads)
+				break;
+		}
+		SSL_CTX_free(server);
+		SSL_CTX_free(client);
+		server = client = NULL;
+	}
+	ret = 0;
+
+finish:
+	SSL_CTX_free(server);
+	SSL_CTX_free(client);
+	X509_free(cert);
+	EVP_PKEY_free(pkey);
+	ENGINE_finish(e);
+free:
+	ENGINE_free(e);
+	return ret;
+}
+
+/* vim: set noexpandtab: */
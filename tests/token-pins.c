@@ -0,0 +1,147 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Checks that the TOKEN_PIN engine ctrl command sets the PIN of each token,
+ * so that keys of tokens with different PINs are loaded and used
+ * concurrently, regardless of the PIN set for all tokens. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/* this code extensively uses deprecated features, so warnings are useless */
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <libp11.h>
+#include <openssl/engine.h>
+
+#define THREADS 8
+#define LOADS 10
+
+static ENGINE *e;
+static const char *key_uri[2];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int failures;
+
+static void error_queue(const char *name)
+{
+	if (ERR_peek_last_error()) {
+		fprintf(stderr, "%s generated errors:\n", name);
+		ERR_print_errors_fp(stderr);
+	}
+}
+
+static int sign(EVP_PKEY *pkey)
+{
+	EVP_MD_CTX *mctx;
+	unsigned char data[] = "libp11 engine token PINs";
+	unsigned char sig[1024];
+	size_t siglen = sizeof(sig);
+	int ok;
+
+	mctx = EVP_MD_CTX_create();
+	ok = mctx &&
+		EVP_DigestSignInit(mctx, NULL, EVP_sha256(), NULL, pkey) > 0 &&
+		EVP_DigestSignUpdate(mctx, data, sizeof(data)) > 0 &&
+		EVP_DigestSignFinal(mctx, sig, &siglen) > 0;
+	EVP_MD_CTX_destroy(mctx);
+	return ok ? 0 : -1;
+}
+
+/* Load and use the keys of both tokens in turn */
+static void *worker(void *arg)
+{
+	EVP_PKEY *pkey;
+	unsigned int i, n = (unsigned int)(size_t)arg, failed = 0;
+
+	for (i = 0; i < LOADS; i++) {
+		pkey = ENGINE_load_private_key(e, key_uri[(n + i) % 2], NULL, NULL);
+		if (!pkey || sign(pkey))
+			failed++;
+		EVP_PKEY_free(pkey);
+	}
+	if (failed)
+		error_queue("worker");
+	pthread_mutex_lock(&lock);
+	failures += failed;
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[THREADS];
+	unsigned int i, n;
+	int ret = 1;
+
+	if (argc < 7) {
+		fprintf(stderr, "usage: %s pkcs11.so /usr/lib/opensc-pkcs11.so "
+			"TOKEN-PIN-URI-1 KEY-URI-1 TOKEN-PIN-URI-2 KEY-URI-2\n",
+			argv[0]);
+		return 1;
+	}
+	key_uri[0] = argv[4];
+	key_uri[1] = argv[6];
+
+	ENGINE_load_dynamic();
+	e = ENGINE_by_id("dynamic");
+	if (!e ||
+			!ENGINE_ctrl_cmd_string(e, "SO_PATH", argv[1], 0) ||
+			!ENGINE_ctrl_cmd_string(e, "ID", "pkcs11", 0) ||
+			!ENGINE_ctrl_cmd_string(e, "LOAD", NULL, 0)) {
+		error_queue("ENGINE_by_id");
+		ENGINE_free(e);
+		return 1;
+	}
+
+	/* A URI without token attributes or without a PIN is rejected */
+	if (ENGINE_ctrl_cmd_string(e, "TOKEN_PIN", "pkcs11:?pin-value=1234", 0) ||
+			ENGINE_ctrl_cmd_string(e, "TOKEN_PIN", "pkcs11:token=foo", 0)) {
+		fprintf(stderr, "An invalid token PIN was accepted\n");
+		goto free;
+	}
+	ERR_clear_error();
+
+	/* The token PINs take precedence over the PIN of all tokens */
+	if (!ENGINE_ctrl_cmd_string(e, "MODULE_PATH", argv[2], 0) ||
+			!ENGINE_ctrl_cmd_string(e, "PIN", "0000", 0) ||
+			!ENGINE_ctrl_cmd_string(e, "TOKEN_PIN", argv[3], 0) ||
+			!ENGINE_ctrl_cmd_string(e, "TOKEN_PIN", argv[5], 0) ||
+			!ENGINE_init(e)) {
+		error_queue("ENGINE_ctrl_cmd_string");
+		goto free;
+	}
+
+	for (n = 0; n < THREADS; n++)
+		if (pthread_create(&threads[n], NULL, worker, (void *)(size_t)n))
+			break;
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	if (n < THREADS || failures) {
+		fprintf(stderr, "%u of %u keys were not loaded or used\n",
+			failures, THREADS * LOADS);
+		goto finish;
+	}
+	printf("The keys of both tokens were loaded with their PINs\n");
+	ret = 0;
+
+finish:
+	ENGINE_finish(e);
+free:
+	ENGINE_free(e);
+	return ret;
+}
+
+/* vim: set noexpandtab: */